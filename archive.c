@@ -0,0 +1,670 @@
+//
+// Created by dbrent on 3/28/21.
+//
+
+#include "archive.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ARCHIVE_IDLE_SLEEP_NS 1000000
+#define ARCHIVE_MAGIC_BYTES 8
+
+_Static_assert(sizeof(archive_chunk_header_t) == 64, "chunk header layout");
+_Static_assert(sizeof(archive_line_header_t) == 32, "line header layout");
+_Static_assert(sizeof(archive_index_entry_t) == 24, "index entry layout");
+
+static const char *format_names[] = {"u8", "u16"};
+static const uint32_t format_bytes[] = {1, 2};
+static const float format_offsets[] = {-127.5f, -200.0f};
+static const float format_steps[] = {0.5f, 1.0f / 256.0f};
+
+const char *archive_format_name(archive_format_t format) {
+    return format_names[format];
+}
+
+static int64_t wall_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + (int64_t)ts.tv_nsec;
+}
+
+// False, with nothing usable in path, if dir is too long to fit the name.
+static bool chunk_path(char *path, const char *dir, uint32_t chunk) {
+    int n = snprintf(path, ARCHIVE_PATH_MAX, "%s/chunk-%08u.spg", dir,
+                     chunk);
+    if (n < 0 || n >= ARCHIVE_PATH_MAX) {
+        fprintf(stderr, "Archive path too long: %s\n", dir);
+        return false;
+    }
+    return true;
+}
+
+static bool index_path(char *path, const char *dir) {
+    int n = snprintf(path, ARCHIVE_PATH_MAX, "%s/index", dir);
+    if (n < 0 || n >= ARCHIVE_PATH_MAX) {
+        fprintf(stderr, "Archive path too long: %s\n", dir);
+        return false;
+    }
+    return true;
+}
+
+static bool pwrite_all(int fd, const void *data, size_t size, off_t at) {
+    const unsigned char *p = data;
+    while (size > 0) {
+        ssize_t n = pwrite(fd, p, size, at);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        p += n;
+        at += n;
+        size -= (size_t)n;
+    }
+    return true;
+}
+
+static bool pread_all(int fd, void *data, size_t size, off_t at) {
+    unsigned char *p = data;
+    while (size > 0) {
+        ssize_t n = pread(fd, p, size, at);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        p += n;
+        at += n;
+        size -= (size_t)n;
+    }
+    return true;
+}
+
+static size_t entries_in(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < ARCHIVE_MAGIC_BYTES) {
+        return 0;
+    }
+    return ((size_t)st.st_size - ARCHIVE_MAGIC_BYTES) /
+           sizeof(archive_index_entry_t);
+}
+
+static off_t entry_offset(size_t i) {
+    return (off_t)(ARCHIVE_MAGIC_BYTES + i * sizeof(archive_index_entry_t));
+}
+
+static off_t record_offset(const archive_chunk_header_t *header,
+                           uint64_t line) {
+    return (off_t)(sizeof(archive_chunk_header_t) +
+                   line * header->record_size);
+}
+
+// The slot is the archive time, then the line as it came in.
+static spectrum_line_t *slot_line(void *slot) {
+    return (spectrum_line_t *)((char *)slot + sizeof(int64_t));
+}
+
+// Shrink a chunk to the lines it holds, it was created at full size.
+static void finish_chunk(archive_t *archive) {
+    if (archive->chunk_fd < 0) {
+        return;
+    }
+    uint64_t lines = atomic_load(&archive->header.lines);
+    if (ftruncate(archive->chunk_fd,
+                  record_offset(&archive->header, lines)) != 0) {
+        atomic_fetch_add(&archive->write_errors, 1);
+    }
+    close(archive->chunk_fd);
+    archive->chunk_fd = -1;
+}
+
+// Created at full size, sparse, so a reader maps it once whatever gets
+// written later.
+static bool start_chunk(archive_t *archive, uint32_t n_bins,
+                        int64_t time_ns) {
+    finish_chunk(archive);
+    archive_chunk_header_t *h = &archive->header;
+    memset(h, 0, sizeof(*h));
+    memcpy(h->magic, ARCHIVE_CHUNK_MAGIC, ARCHIVE_MAGIC_BYTES);
+    h->version = ARCHIVE_VERSION;
+    h->n_bins = n_bins;
+    h->bytes_per_bin = format_bytes[archive->format];
+    h->record_size = (uint32_t)((sizeof(archive_line_header_t) +
+                                 n_bins * h->bytes_per_bin + 7) &
+                                ~(size_t)7);
+    h->db_offset = format_offsets[archive->format];
+    h->db_step = format_steps[archive->format];
+    h->capacity = ARCHIVE_CHUNK_LINES;
+    h->first_line = archive->next_line;
+    atomic_init(&h->lines, 0);
+
+    uint8_t *record = realloc(archive->record, h->record_size);
+    if (record == NULL) {
+        return false;
+    }
+    memset(record, 0, h->record_size);
+    archive->record = record;
+
+    char path[ARCHIVE_PATH_MAX];
+    uint32_t chunk = archive->chunk;
+    if (!chunk_path(path, archive->dir, chunk)) {
+        return false;
+    }
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror(path);
+        return false;
+    }
+    archive_index_entry_t entry = {h->first_line, time_ns, chunk, n_bins};
+    off_t at = entry_offset(entries_in(archive->index_fd));
+    if (!pwrite_all(fd, h, sizeof(*h), 0) ||
+        ftruncate(fd, record_offset(h, h->capacity)) != 0 ||
+        !pwrite_all(archive->index_fd, &entry, sizeof(entry), at)) {
+        fprintf(stderr, "Could not start %s\n", path);
+        close(fd);
+        return false;
+    }
+    archive->chunk_fd = fd;
+    archive->chunk = chunk + 1;
+    atomic_fetch_add(&archive->chunks, 1);
+    return true;
+}
+
+void archive_quantize(const float *db, uint32_t n, uint32_t bytes_per_bin,
+                      float db_offset, float db_step, void *bins) {
+    const float scale = 1.0f / db_step;
+    if (bytes_per_bin == 1) {
+        uint8_t *q = bins;
+#pragma omp simd
+        for (uint32_t i = 0; i < n; i++) {
+            float v = (db[i] - db_offset) * scale + 0.5f;
+            v = v < 0.0f ? 0.0f : v > 255.0f ? 255.0f : v;
+            q[i] = (uint8_t)v;
+        }
+    } else {
+        uint16_t *q = bins;
+#pragma omp simd
+        for (uint32_t i = 0; i < n; i++) {
+            float v = (db[i] - db_offset) * scale + 0.5f;
+            v = v < 0.0f ? 0.0f : v > 65535.0f ? 65535.0f : v;
+            q[i] = (uint16_t)v;
+        }
+    }
+}
+
+void archive_dequantize(const void *bins, uint32_t n, uint32_t bytes_per_bin,
+                        float db_offset, float db_step, float *db) {
+    if (bytes_per_bin == 1) {
+        const uint8_t *q = bins;
+#pragma omp simd
+        for (uint32_t i = 0; i < n; i++) {
+            db[i] = db_offset + (float)q[i] * db_step;
+        }
+    } else {
+        const uint16_t *q = bins;
+#pragma omp simd
+        for (uint32_t i = 0; i < n; i++) {
+            db[i] = db_offset + (float)q[i] * db_step;
+        }
+    }
+}
+
+bool archive_append(archive_t *archive, const spectrum_line_t *line,
+                    int64_t time_ns) {
+    archive_chunk_header_t *h = &archive->header;
+    uint64_t lines = atomic_load(&h->lines);
+    if (archive->chunk_fd < 0 || line->n_bins != h->n_bins ||
+        lines == h->capacity) {
+        if (!start_chunk(archive, line->n_bins, time_ns)) {
+            atomic_fetch_add(&archive->write_errors, 1);
+            return false;
+        }
+        lines = 0;
+    }
+
+    archive_line_header_t *lh = (archive_line_header_t *)archive->record;
+    lh->time_ns = time_ns;
+    lh->frequency = line->tag.frequency;
+    lh->span = line->span;
+    lh->rbw = line->rbw;
+    lh->generation = line->tag.generation;
+    archive_quantize(line->bins, h->n_bins, h->bytes_per_bin, h->db_offset,
+                     h->db_step, archive->record + sizeof(*lh));
+
+    // the record first, readers go by the count
+    if (!pwrite_all(archive->chunk_fd, archive->record, h->record_size,
+                    record_offset(h, lines))) {
+        atomic_fetch_add(&archive->write_errors, 1);
+        return false;
+    }
+    atomic_store(&h->lines, lines + 1);
+    uint64_t count = lines + 1;
+    if (!pwrite_all(archive->chunk_fd, &count, sizeof(count),
+                    offsetof(archive_chunk_header_t, lines))) {
+        atomic_fetch_add(&archive->write_errors, 1);
+    }
+    // its rows are the max of the unquantized bins, which quantize to the
+    // max of the codes
+    if (!pyramid_append(archive->pyramid, line->bins, line->n_bins, time_ns,
+                        line->tag.frequency)) {
+        atomic_fetch_add(&archive->write_errors, 1);
+    }
+    archive->next_line++;
+    atomic_fetch_add(&archive->lines_written, 1);
+    atomic_fetch_add(&archive->bytes_written, h->record_size);
+    return true;
+}
+
+static void *writer_thread(void *arg) {
+    archive_t *archive = arg;
+    const struct timespec idle = {0, ARCHIVE_IDLE_SLEEP_NS};
+
+    for (;;) {
+        void *slot = queue_peek(&archive->lines);
+        if (slot == NULL) {
+            // only stop once everything committed has been written
+            if (!atomic_load(&archive->running)) {
+                break;
+            }
+            nanosleep(&idle, NULL);
+            continue;
+        }
+        archive_append(archive, slot_line(slot), *(int64_t *)slot);
+        queue_release(&archive->lines);
+    }
+
+    return NULL;
+}
+
+// Carry on after the last chunk of an earlier run, trimming it in case
+// that run never got to.
+static bool resume(archive_t *archive) {
+    size_t n = entries_in(archive->index_fd);
+    if (n == 0) {
+        return true;
+    }
+    archive_index_entry_t last;
+    archive_chunk_header_t h;
+    char path[ARCHIVE_PATH_MAX];
+    if (!pread_all(archive->index_fd, &last, sizeof(last),
+                   entry_offset(n - 1))) {
+        return false;
+    }
+    if (!chunk_path(path, archive->dir, last.chunk)) {
+        return false;
+    }
+    int fd = open(path, O_RDWR);
+    if (fd < 0 || !pread_all(fd, &h, sizeof(h), 0)) {
+        perror(path);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return false;
+    }
+    uint64_t lines = atomic_load(&h.lines);
+    if (ftruncate(fd, record_offset(&h, lines)) != 0) {
+        perror(path);
+    }
+    close(fd);
+    archive->chunk = last.chunk + 1;
+    archive->next_line = last.first_line + lines;
+    return true;
+}
+
+// Folds in the lines the pyramid hasn't seen, all of them for an archive
+// from before it had one.
+static bool catch_up(archive_t *archive) {
+    uint64_t from = pyramid_lines(archive->pyramid);
+    if (from >= archive->next_line) {
+        return true;
+    }
+    if (archive->next_line - from > ARCHIVE_CHUNK_LINES) {
+        fprintf(stderr, "Building the pyramid from line %lu to %lu\n",
+                (unsigned long)from, (unsigned long)archive->next_line);
+    }
+    archive_reader_t *reader = archive_reader_open(archive->dir);
+    float *db = NULL;
+    uint32_t size = 0;
+    bool ok = reader != NULL;
+    for (uint64_t i = from; ok && i < archive->next_line; i++) {
+        archive_line_t line;
+        if (!archive_read_line(reader, i, &line)) {
+            ok = false;
+            break;
+        }
+        if (line.n_bins > size) {
+            float *bigger = realloc(db, line.n_bins * sizeof(float));
+            if (bigger == NULL) {
+                ok = false;
+                break;
+            }
+            db = bigger;
+            size = line.n_bins;
+        }
+        archive_line_db(&line, db);
+        ok = pyramid_append(archive->pyramid, db, line.n_bins,
+                            line.header->time_ns, line.header->frequency);
+    }
+    free(db);
+    archive_reader_close(reader);
+    return ok;
+}
+
+archive_t *archive_open(const char *dir, archive_format_t format,
+                        int max_bins) {
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        perror(dir);
+        return NULL;
+    }
+    archive_t *archive = calloc(1, sizeof(archive_t));
+    if (archive == NULL) {
+        return NULL;
+    }
+    snprintf(archive->dir, sizeof(archive->dir), "%s", dir);
+    archive->format = format;
+    archive->max_bins = max_bins;
+    archive->chunk_fd = -1;
+
+    char path[ARCHIVE_PATH_MAX];
+    char magic[ARCHIVE_MAGIC_BYTES];
+    // a dir too long for the index is too long for the chunks too
+    archive->index_fd = index_path(path, dir)
+                                ? open(path, O_RDWR | O_CREAT, 0644)
+                                : -1;
+    struct stat st;
+    bool ok = archive->index_fd >= 0 && fstat(archive->index_fd, &st) == 0;
+    if (ok && st.st_size == 0) {
+        ok = pwrite_all(archive->index_fd, ARCHIVE_INDEX_MAGIC,
+                        ARCHIVE_MAGIC_BYTES, 0);
+    } else if (ok) {
+        ok = pread_all(archive->index_fd, magic, sizeof(magic), 0) &&
+             memcmp(magic, ARCHIVE_INDEX_MAGIC, sizeof(magic)) == 0 &&
+             resume(archive);
+    }
+    ok = ok && queue_init(&archive->lines,
+                          sizeof(int64_t) + DSP_LINE_BYTES(max_bins),
+                          ARCHIVE_QUEUE_SIZE, QUEUE_SPSC);
+    ok = ok &&
+         (archive->pyramid = pyramid_open(dir, (uint32_t)max_bins,
+                                          format_bytes[format],
+                                          format_offsets[format],
+                                          format_steps[format],
+                                          archive->next_line)) != NULL &&
+         catch_up(archive);
+    if (!ok) {
+        fprintf(stderr, "Could not open archive %s\n", dir);
+        if (archive->index_fd >= 0) {
+            close(archive->index_fd);
+        }
+        pyramid_close(archive->pyramid);
+        queue_destroy(&archive->lines);
+        free(archive);
+        return NULL;
+    }
+
+    atomic_store(&archive->running, true);
+    if (pthread_create(&archive->thread, NULL, writer_thread, archive) != 0) {
+        fprintf(stderr, "Could not create archive thread\n");
+        archive_close(archive);
+        return NULL;
+    }
+    archive->started = true;
+    fprintf(stderr, "Archiving %s lines to %s from line %lu\n",
+            format_names[format], dir, (unsigned long)archive->next_line);
+    return archive;
+}
+
+void archive_stop(archive_t *archive) {
+    atomic_store(&archive->running, false);
+    if (archive->started) {
+        pthread_join(archive->thread, NULL);
+        archive->started = false;
+    }
+}
+
+void archive_close(archive_t *archive) {
+    if (archive == NULL) {
+        return;
+    }
+    archive_stop(archive);
+    finish_chunk(archive);
+    close(archive->index_fd);
+    pyramid_close(archive->pyramid);
+    queue_destroy(&archive->lines);
+    free(archive->record);
+    free(archive);
+}
+
+void archive_write(archive_t *archive, const spectrum_line_t *line) {
+    void *slot = line->n_bins <= (uint32_t)archive->max_bins
+                         ? queue_reserve(&archive->lines)
+                         : NULL;
+    if (slot == NULL) {
+        atomic_fetch_add_explicit(&archive->lines_dropped, 1,
+                                  memory_order_relaxed);
+        return;
+    }
+    *(int64_t *)slot = wall_ns();
+    memcpy(slot_line(slot), line, DSP_LINE_BYTES(line->n_bins));
+    queue_commit(&archive->lines, slot);
+}
+
+void archive_get_stats(archive_t *archive, archive_stats_t *stats) {
+    stats->lines_written = atomic_load(&archive->lines_written);
+    stats->lines_dropped = atomic_load(&archive->lines_dropped);
+    stats->bytes_written = atomic_load(&archive->bytes_written);
+    stats->write_errors = atomic_load(&archive->write_errors);
+    stats->chunks = atomic_load(&archive->chunks);
+    stats->pyramid_levels = archive->pyramid->n_levels;
+    // next_line belongs to the writer thread, close enough for stats
+    stats->lines = archive->next_line;
+    queue_get_stats(&archive->lines, &stats->queue);
+}
+
+archive_reader_t *archive_reader_open(const char *dir) {
+    archive_reader_t *reader = calloc(1, sizeof(archive_reader_t));
+    if (reader == NULL) {
+        return NULL;
+    }
+    snprintf(reader->dir, sizeof(reader->dir), "%s", dir);
+    char path[ARCHIVE_PATH_MAX];
+    char magic[ARCHIVE_MAGIC_BYTES];
+    reader->index_fd = index_path(path, dir) ? open(path, O_RDONLY) : -1;
+    if (reader->index_fd < 0 ||
+        !pread_all(reader->index_fd, magic, sizeof(magic), 0) ||
+        memcmp(magic, ARCHIVE_INDEX_MAGIC, sizeof(magic)) != 0 ||
+        !archive_reader_refresh(reader)) {
+        fprintf(stderr, "Could not read archive %s\n", dir);
+        archive_reader_close(reader);
+        return NULL;
+    }
+    return reader;
+}
+
+void archive_reader_close(archive_reader_t *reader) {
+    if (reader == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < reader->n_chunks; i++) {
+        if (reader->chunks[i].header != NULL) {
+            munmap((void *)reader->chunks[i].header, reader->chunks[i].size);
+        }
+    }
+    if (reader->index_fd >= 0) {
+        close(reader->index_fd);
+    }
+    free(reader->chunks);
+    free(reader);
+}
+
+bool archive_reader_refresh(archive_reader_t *reader) {
+    size_t n = entries_in(reader->index_fd);
+    if (n > reader->max_chunks) {
+        size_t max = reader->max_chunks ? reader->max_chunks : 16;
+        while (max < n) {
+            max *= 2;
+        }
+        archive_chunk_map_t *chunks =
+                realloc(reader->chunks, max * sizeof(archive_chunk_map_t));
+        if (chunks == NULL) {
+            return false;
+        }
+        reader->chunks = chunks;
+        reader->max_chunks = max;
+    }
+    for (size_t i = reader->n_chunks; i < n; i++) {
+        archive_chunk_map_t *c = &reader->chunks[i];
+        if (!pread_all(reader->index_fd, &c->entry, sizeof(c->entry),
+                       entry_offset(i))) {
+            return false;
+        }
+        c->header = NULL;
+        c->size = 0;
+        reader->n_chunks = i + 1;
+    }
+    return true;
+}
+
+static const archive_chunk_header_t *map_chunk(archive_reader_t *reader,
+                                               size_t i) {
+    archive_chunk_map_t *c = &reader->chunks[i];
+    if (c->header != NULL) {
+        return c->header;
+    }
+    char path[ARCHIVE_PATH_MAX];
+    if (!chunk_path(path, reader->dir, c->entry.chunk)) {
+        return NULL;
+    }
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 ||
+        (size_t)st.st_size < sizeof(archive_chunk_header_t)) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+    void *p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        return NULL;
+    }
+    const archive_chunk_header_t *h = p;
+    if (memcmp(h->magic, ARCHIVE_CHUNK_MAGIC, ARCHIVE_MAGIC_BYTES) != 0 ||
+        h->version != ARCHIVE_VERSION) {
+        munmap(p, (size_t)st.st_size);
+        return NULL;
+    }
+    c->header = h;
+    c->size = (size_t)st.st_size;
+    return h;
+}
+
+// Lines of chunk i: up to where the next one starts, or as many as the
+// last one has so far.
+static uint64_t chunk_lines(archive_reader_t *reader, size_t i) {
+    if (i + 1 < reader->n_chunks) {
+        return reader->chunks[i + 1].entry.first_line -
+               reader->chunks[i].entry.first_line;
+    }
+    const archive_chunk_header_t *h = map_chunk(reader, i);
+    if (h == NULL) {
+        return 0;
+    }
+    uint64_t lines = atomic_load(&((archive_chunk_header_t *)h)->lines);
+    // never past what was mapped
+    uint64_t mapped = (reader->chunks[i].size - sizeof(*h)) / h->record_size;
+    return lines < mapped ? lines : mapped;
+}
+
+uint64_t archive_reader_lines(archive_reader_t *reader) {
+    if (reader->n_chunks == 0) {
+        return 0;
+    }
+    size_t last = reader->n_chunks - 1;
+    return reader->chunks[last].entry.first_line +
+           chunk_lines(reader, last);
+}
+
+// Last chunk starting at or before line.
+static size_t chunk_of(archive_reader_t *reader, uint64_t line) {
+    size_t lo = 0, hi = reader->n_chunks;
+    while (hi - lo > 1) {
+        size_t mid = (lo + hi) / 2;
+        if (reader->chunks[mid].entry.first_line <= line) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+bool archive_read_line(archive_reader_t *reader, uint64_t index,
+                       archive_line_t *line) {
+    if (reader->n_chunks == 0) {
+        return false;
+    }
+    size_t i = chunk_of(reader, index);
+    uint64_t k = index - reader->chunks[i].entry.first_line;
+    const archive_chunk_header_t *h = map_chunk(reader, i);
+    if (h == NULL || index < reader->chunks[i].entry.first_line ||
+        k >= chunk_lines(reader, i)) {
+        return false;
+    }
+    const uint8_t *record = (const uint8_t *)h + record_offset(h, k);
+    line->header = (const archive_line_header_t *)record;
+    line->bins = record + sizeof(archive_line_header_t);
+    line->n_bins = h->n_bins;
+    line->bytes_per_bin = h->bytes_per_bin;
+    line->db_offset = h->db_offset;
+    line->db_step = h->db_step;
+    return true;
+}
+
+uint64_t archive_find_time(archive_reader_t *reader, int64_t time_ns) {
+    if (reader->n_chunks == 0) {
+        return 0;
+    }
+    // the chunk by its first time, then the line inside it
+    size_t lo = 0, hi = reader->n_chunks;
+    while (hi - lo > 1) {
+        size_t mid = (lo + hi) / 2;
+        if (reader->chunks[mid].entry.first_time_ns <= time_ns) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    const archive_chunk_header_t *h = map_chunk(reader, lo);
+    uint64_t first = reader->chunks[lo].entry.first_line;
+    uint64_t a = 0, b = h != NULL ? chunk_lines(reader, lo) : 0;
+    while (a < b) {
+        uint64_t mid = (a + b) / 2;
+        const archive_line_header_t *lh =
+                (const archive_line_header_t *)((const uint8_t *)h +
+                                                record_offset(h, mid));
+        if (lh->time_ns < time_ns) {
+            a = mid + 1;
+        } else {
+            b = mid;
+        }
+    }
+    return first + a;
+}
+
+void archive_line_db(const archive_line_t *line, float *db) {
+    archive_dequantize(line->bins, line->n_bins, line->bytes_per_bin,
+                       line->db_offset, line->db_step, db);
+}
@@ -0,0 +1,192 @@
+//
+// Created by dbrent on 3/28/21.
+//
+
+#ifndef DBSDR_ARCHIVE_H
+#define DBSDR_ARCHIVE_H
+
+#include "dsp.h"
+#include "pyramid.h"
+#include "queue.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define ARCHIVE_CHUNK_MAGIC "DBSDRSPG"
+#define ARCHIVE_INDEX_MAGIC "DBSDRIDX"
+#define ARCHIVE_VERSION 1
+#define ARCHIVE_CHUNK_LINES 8192 // per file, 64 MB of 8K uint8 lines
+#define ARCHIVE_QUEUE_SIZE 256   // lines waiting for the writer thread
+#define ARCHIVE_PATH_MAX 4096
+
+// Spectrum lines on disk, for scrolling back further than the waterfall
+// texture holds. A directory of chunk files, each a header then fixed size
+// records (a line header and the quantized bins) so line i is one multiply
+// away, plus an index with where each chunk starts in lines and in time.
+// Bins are stored as offset + q * step dB: 0.5 dB steps from -127.5 to 0
+// dB in a byte, or 1/256 dB steps from -200 dB in two. The lowest code
+// also stands for anything below. Reopening a directory carries on after
+// the lines already in it. A pyramid of max reduced rows is kept up to
+// date alongside, for drawing long stretches.
+typedef enum archive_format {
+    ARCHIVE_U8,
+    ARCHIVE_U16,
+    ARCHIVE_FORMAT_COUNT,
+} archive_format_t;
+
+// 64 bytes, then capacity records of record_size bytes. lines is bumped
+// after each record is written, readers only look at that many.
+typedef struct archive_chunk_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t n_bins;
+    uint32_t bytes_per_bin;
+    uint32_t record_size;
+    float db_offset;
+    float db_step;
+    uint64_t capacity;
+    uint64_t first_line; // of the whole archive
+    _Atomic uint64_t lines;
+    uint8_t reserved[8];
+} archive_chunk_header_t;
+
+typedef struct archive_line_header {
+    int64_t time_ns;    // CLOCK_REALTIME the line was archived at
+    uint64_t frequency; // Hz, centre
+    float span;         // Hz across all the bins
+    float rbw;          // Hz
+    uint32_t generation;
+    uint32_t reserved;
+} archive_line_header_t;
+
+// The index file is the magic, then one entry per chunk, appended as the
+// chunk is started.
+typedef struct archive_index_entry {
+    uint64_t first_line;
+    int64_t first_time_ns;
+    uint32_t chunk; // chunk-NNNNNNNN.spg
+    uint32_t n_bins;
+} archive_index_entry_t;
+
+typedef struct archive_stats {
+    uint64_t lines; // in the archive, including earlier runs
+    uint64_t lines_written;
+    uint64_t lines_dropped; // queue full, the disk fell behind
+    uint64_t bytes_written;
+    uint64_t write_errors;
+    uint32_t chunks;
+    int pyramid_levels;
+    queue_stats_t queue;
+} archive_stats_t;
+
+typedef struct archive {
+    char dir[ARCHIVE_PATH_MAX];
+    archive_format_t format;
+    queue_t lines; // any one thread -> writer thread, spectrum_line_t
+    int max_bins;
+    pthread_t thread;
+    bool started;
+    atomic_bool running;
+
+    // writer thread side
+    int index_fd;
+    int chunk_fd;
+    uint32_t chunk; // number of the open chunk
+    archive_chunk_header_t header;
+    uint8_t *record;
+    uint64_t next_line;
+    pyramid_t *pyramid; // next to the chunks, see pyramid.h
+
+    atomic_uint_fast64_t lines_written;
+    atomic_uint_fast64_t lines_dropped;
+    atomic_uint_fast64_t bytes_written;
+    atomic_uint_fast64_t write_errors;
+    atomic_uint chunks;
+} archive_t;
+
+const char *archive_format_name(archive_format_t format);
+
+// n dB values to codes of bytes_per_bin, offset + code * step, and back.
+void archive_quantize(const float *db, uint32_t n, uint32_t bytes_per_bin,
+                      float db_offset, float db_step, void *bins);
+void archive_dequantize(const void *bins, uint32_t n, uint32_t bytes_per_bin,
+                        float db_offset, float db_step, float *db);
+
+// Creates dir if needed and picks up after what is already there. Lines up
+// to max_bins wide.
+archive_t *archive_open(const char *dir, archive_format_t format,
+                        int max_bins);
+
+// Writes out everything queued, trims the last chunk and frees the archive.
+void archive_close(archive_t *archive);
+
+// Producer thread: queue a line, stamped with the time now. Dropped if the
+// writer is behind.
+void archive_write(archive_t *archive, const spectrum_line_t *line);
+
+// Quantizes and writes a line right away, what the writer thread does with
+// queued ones. Only for when there is no writer thread, tools and
+// benchmarks: archive_open() with it stopped, see archive_stop().
+bool archive_append(archive_t *archive, const spectrum_line_t *line,
+                    int64_t time_ns);
+
+// Stops the writer thread after what is queued, so archive_append() can
+// be called directly.
+void archive_stop(archive_t *archive);
+
+void archive_get_stats(archive_t *archive, archive_stats_t *stats);
+
+// Read side, memory mapped so any line is available without reading the
+// rest. Chunks are mapped on first use and stay mapped until close, only
+// the pages touched are ever read. Works on an archive that is still
+// being written, see archive_reader_refresh().
+typedef struct archive_chunk_map {
+    archive_index_entry_t entry;
+    const archive_chunk_header_t *header; // NULL until mapped
+    size_t size;
+} archive_chunk_map_t;
+
+typedef struct archive_reader {
+    char dir[ARCHIVE_PATH_MAX];
+    int index_fd;
+    archive_chunk_map_t *chunks;
+    size_t n_chunks;
+    size_t max_chunks;
+} archive_reader_t;
+
+// One line as stored, pointing into the mapping.
+typedef struct archive_line {
+    const archive_line_header_t *header;
+    const void *bins;
+    uint32_t n_bins;
+    uint32_t bytes_per_bin;
+    float db_offset;
+    float db_step;
+} archive_line_t;
+
+archive_reader_t *archive_reader_open(const char *dir);
+
+void archive_reader_close(archive_reader_t *reader);
+
+// Picks up chunks started since the last call. Lines added to chunks
+// already known show up without it.
+bool archive_reader_refresh(archive_reader_t *reader);
+
+// Lines in the archive so far.
+uint64_t archive_reader_lines(archive_reader_t *reader);
+
+// Line number index, false past the end or if its chunk can't be mapped.
+bool archive_read_line(archive_reader_t *reader, uint64_t index,
+                       archive_line_t *line);
+
+// First line archived at or after time_ns, archive_reader_lines() if none.
+// Times are wall clock, so a clock stepped back makes this approximate.
+uint64_t archive_find_time(archive_reader_t *reader, int64_t time_ns);
+
+// Stored bins back to dB, n_bins of them.
+void archive_line_db(const archive_line_t *line, float *db);
+
+#endif //DBSDR_ARCHIVE_H
@@ -1,11 +1,58 @@
 #version 330 core
 
+// reducers as in binning.h
+#define REDUCER_MAX 0
+#define REDUCER_MEAN 1
+#define REDUCER_MIN 2
+// texels read per pixel at most, wider spans are sampled evenly
+#define MAX_TAPS 64
+#define DB_PER_LOG2 3.01029996
+
 in vec2 f_TexCoords;
 
 uniform sampler2D tex;
+uniform sampler1D palette;
+uniform float row_offset;
+uniform float min_db;
+uniform float max_db;
+uniform float view_start;
+uniform float view_end;
+uniform int reducer;
 
 out vec4 color;
 
 void main() {
-    color = texture(tex, f_TexCoords);
+    // the texture is a ring of rows, row_offset is where the newest one is
+    ivec2 size = textureSize(tex, 0);
+    int y = int(fract(f_TexCoords.y + row_offset) * float(size.y));
+
+    // texels under this pixel of the zoomed range
+    float span = view_end - view_start;
+    float u = view_start + f_TexCoords.x * span;
+    float half_pixel = 0.5 * fwidth(f_TexCoords.x) * span;
+    int first = clamp(int(floor((u - half_pixel) * float(size.x))), 0,
+                      size.x - 1);
+    int last = clamp(int(ceil((u + half_pixel) * float(size.x))), first + 1,
+                     size.x);
+
+    float db;
+    if (last - first == 1) {
+        db = texelFetch(tex, ivec2(first, y), 0).r;
+    } else {
+        int step = (last - first + MAX_TAPS - 1) / MAX_TAPS;
+        float acc = reducer == REDUCER_MIN ? 1e30 : -1e30;
+        float power = 0.0;
+        int n = 0;
+        for (int x = first; x < last; x += step) {
+            float v = texelFetch(tex, ivec2(x, y), 0).r;
+            acc = reducer == REDUCER_MIN ? min(acc, v) : max(acc, v);
+            power += exp2(v / DB_PER_LOG2);
+            n++;
+        }
+        db = reducer == REDUCER_MEAN ? log2(power / float(n)) * DB_PER_LOG2
+                                     : acc;
+    }
+
+    float level = clamp((db - min_db) / (max_db - min_db), 0.0, 1.0);
+    color = texture(palette, level);
 }
@@ -0,0 +1,265 @@
+//
+// Created by dbrent on 3/26/21.
+//
+
+#include "audio.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef DBSDR_HAVE_PULSE
+#include <pulse/error.h>
+#include <pulse/simple.h>
+#endif
+#ifdef DBSDR_HAVE_ALSA
+#include <alsa/asoundlib.h>
+#include <errno.h>
+#endif
+
+#define WAV_HEADER_BYTES 44
+
+static const char *type_names[] = {"pulse", "alsa", "wav", "raw"};
+
+const char *audio_type_name(audio_type_t type) { return type_names[type]; }
+
+static void put_le(unsigned char *at, uint32_t value, int bytes) {
+    for (int i = 0; i < bytes; i++) {
+        at[i] = (unsigned char)(value >> (8 * i));
+    }
+}
+
+// 16 bit mono PCM, data_bytes 0 until the sizes are known
+static bool write_wav_header(FILE *file, uint32_t rate, uint32_t data_bytes) {
+    unsigned char h[WAV_HEADER_BYTES];
+    memcpy(h, "RIFF", 4);
+    put_le(h + 4, 36 + data_bytes, 4);
+    memcpy(h + 8, "WAVEfmt ", 8);
+    put_le(h + 16, 16, 4);
+    put_le(h + 20, 1, 2); // PCM
+    put_le(h + 22, 1, 2); // channels
+    put_le(h + 24, rate, 4);
+    put_le(h + 28, rate * 2, 4);
+    put_le(h + 32, 2, 2);
+    put_le(h + 34, 16, 2);
+    memcpy(h + 36, "data", 4);
+    put_le(h + 40, data_bytes, 4);
+    return fwrite(h, 1, sizeof(h), file) == sizeof(h);
+}
+
+static bool ends_with(const char *s, const char *suffix) {
+    size_t n = strlen(s), m = strlen(suffix);
+    return n >= m && strcmp(s + n - m, suffix) == 0;
+}
+
+#ifdef DBSDR_HAVE_PULSE
+static bool pulse_open(audio_sink_t *sink) {
+    pa_sample_spec spec = {PA_SAMPLE_S16LE, sink->rate, 1};
+    // a short target buffer, the server's defaults are around 2 s
+    pa_buffer_attr attr = {
+            .maxlength = (uint32_t)-1,
+            .tlength = (uint32_t)pa_usec_to_bytes(
+                    (pa_usec_t)(AUDIO_DEVICE_LATENCY * 1e6), &spec),
+            .prebuf = (uint32_t)-1,
+            .minreq = (uint32_t)-1,
+            .fragsize = (uint32_t)-1,
+    };
+    int error;
+    sink->device = pa_simple_new(NULL, "dbsdr", PA_STREAM_PLAYBACK, NULL,
+                                 "demodulated audio", &spec, NULL, &attr,
+                                 &error);
+    if (sink->device == NULL) {
+        fprintf(stderr, "Could not open PulseAudio: %s\n",
+                pa_strerror(error));
+        return false;
+    }
+    return true;
+}
+#endif
+
+#ifdef DBSDR_HAVE_ALSA
+static bool alsa_open(audio_sink_t *sink, const char *device) {
+    snd_pcm_t *pcm;
+    int err = snd_pcm_open(&pcm, device, SND_PCM_STREAM_PLAYBACK, 0);
+    if (err >= 0) {
+        err = snd_pcm_set_params(pcm, SND_PCM_FORMAT_S16_LE,
+                                 SND_PCM_ACCESS_RW_INTERLEAVED, 1, sink->rate,
+                                 1,
+                                 (unsigned)(AUDIO_DEVICE_LATENCY * 1e6));
+        if (err < 0) {
+            snd_pcm_close(pcm);
+        }
+    }
+    if (err < 0) {
+        fprintf(stderr, "Could not open ALSA device %s: %s\n", device,
+                snd_strerror(err));
+        return false;
+    }
+    sink->device = pcm;
+    return true;
+}
+#endif
+
+audio_sink_t *audio_open(const char *output, uint32_t rate) {
+    audio_sink_t *sink = calloc(1, sizeof(audio_sink_t));
+    if (sink == NULL) {
+        return NULL;
+    }
+    sink->rate = rate;
+
+    if (output == NULL) {
+#if defined(DBSDR_HAVE_PULSE)
+        output = "pulse";
+#elif defined(DBSDR_HAVE_ALSA)
+        output = "alsa";
+#else
+        fprintf(stderr, "Built without a sound device, pick an audio "
+                        "file, FIFO or - for stdout\n");
+        free(sink);
+        return NULL;
+#endif
+    }
+
+    bool ok = false;
+    if (strcmp(output, "pulse") == 0) {
+        sink->type = AUDIO_PULSE;
+#ifdef DBSDR_HAVE_PULSE
+        ok = pulse_open(sink);
+#else
+        fprintf(stderr, "Built without PulseAudio\n");
+#endif
+    } else if (strcmp(output, "alsa") == 0 ||
+               strncmp(output, "alsa:", 5) == 0) {
+        sink->type = AUDIO_ALSA;
+#ifdef DBSDR_HAVE_ALSA
+        ok = alsa_open(sink, output[4] == ':' ? output + 5 : "default");
+#else
+        fprintf(stderr, "Built without ALSA\n");
+#endif
+    } else if (strcmp(output, "-") == 0) {
+        sink->type = AUDIO_RAW;
+        sink->file = stdout;
+        ok = true;
+    } else {
+        sink->type = ends_with(output, ".wav") ? AUDIO_WAV : AUDIO_RAW;
+        sink->file = fopen(output, "wb");
+        if (sink->file == NULL) {
+            perror(output);
+        } else {
+            ok = sink->type == AUDIO_RAW ||
+                 write_wav_header(sink->file, rate, 0);
+        }
+    }
+    if (!ok) {
+        if (sink->file != NULL && sink->file != stdout) {
+            fclose(sink->file);
+        }
+        free(sink);
+        return NULL;
+    }
+    return sink;
+}
+
+void audio_close(audio_sink_t *sink) {
+    if (sink == NULL) {
+        return;
+    }
+    switch (sink->type) {
+    case AUDIO_PULSE:
+#ifdef DBSDR_HAVE_PULSE
+        pa_simple_drain(sink->device, NULL);
+        pa_simple_free(sink->device);
+#endif
+        break;
+    case AUDIO_ALSA:
+#ifdef DBSDR_HAVE_ALSA
+        snd_pcm_drain(sink->device);
+        snd_pcm_close(sink->device);
+#endif
+        break;
+    case AUDIO_WAV:
+        // a WAV tops out at 4 GiB, the sizes just saturate past that
+        if (fseek(sink->file, 0, SEEK_SET) == 0) {
+            uint64_t bytes = sink->samples * 2;
+            write_wav_header(sink->file, sink->rate,
+                             bytes < UINT32_MAX - 36 ? (uint32_t)bytes
+                                                     : UINT32_MAX - 36);
+        }
+        fclose(sink->file);
+        break;
+    case AUDIO_RAW:
+        if (sink->file != stdout) {
+            fclose(sink->file);
+        } else {
+            fflush(stdout);
+        }
+        break;
+    }
+    free(sink);
+}
+
+bool audio_write(audio_sink_t *sink, const int16_t *samples, size_t n) {
+    sink->samples += n;
+    switch (sink->type) {
+    case AUDIO_PULSE:
+#ifdef DBSDR_HAVE_PULSE
+        return pa_simple_write(sink->device, samples, n * sizeof(int16_t),
+                               NULL) == 0;
+#else
+        return false;
+#endif
+    case AUDIO_ALSA:
+#ifdef DBSDR_HAVE_ALSA
+        while (n > 0) {
+            snd_pcm_sframes_t written = snd_pcm_writei(sink->device, samples,
+                                                       n);
+            if (written < 0) {
+                // an underrun (EPIPE) or a suspend, pick up where it was
+                if (written == -EPIPE) {
+                    atomic_fetch_add_explicit(&sink->underruns, 1,
+                                              memory_order_relaxed);
+                }
+                if (snd_pcm_recover(sink->device, (int)written, 1) < 0) {
+                    return false;
+                }
+                continue;
+            }
+            samples += written;
+            n -= (size_t)written;
+        }
+        return true;
+#else
+        return false;
+#endif
+    case AUDIO_WAV:
+    case AUDIO_RAW:
+    default:
+        // s16le, native on the x86 and ARM targets
+        return fwrite(samples, sizeof(int16_t), n, sink->file) == n;
+    }
+}
+
+double audio_delay(audio_sink_t *sink) {
+    switch (sink->type) {
+    case AUDIO_PULSE: {
+#ifdef DBSDR_HAVE_PULSE
+        pa_usec_t usec = pa_simple_get_latency(sink->device, NULL);
+        return usec == (pa_usec_t)-1 ? 0.0 : (double)usec * 1e-6;
+#else
+        return 0.0;
+#endif
+    }
+    case AUDIO_ALSA: {
+#ifdef DBSDR_HAVE_ALSA
+        snd_pcm_sframes_t frames;
+        if (snd_pcm_delay(sink->device, &frames) < 0 || frames < 0) {
+            return 0.0;
+        }
+        return (double)frames / sink->rate;
+#else
+        return 0.0;
+#endif
+    }
+    default:
+        return 0.0;
+    }
+}
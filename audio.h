@@ -0,0 +1,53 @@
+//
+// Created by dbrent on 3/26/21.
+//
+
+#ifndef DBSDR_AUDIO_H
+#define DBSDR_AUDIO_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define AUDIO_DEVICE_LATENCY 0.02 // s the sound device is asked to buffer
+
+// Mono int16 audio out. output picks the sink:
+//   pulse            PulseAudio (built with libpulse-simple)
+//   alsa[:DEVICE]    ALSA, "default" unless DEVICE is given (built with
+//                    libasound)
+//   -                raw s16le to stdout
+//   NAME.wav         a WAV file, sizes filled in on close
+//   anything else    raw s16le to that file or FIFO
+// NULL picks the first sound device built in.
+typedef enum audio_type {
+    AUDIO_PULSE,
+    AUDIO_ALSA,
+    AUDIO_WAV,
+    AUDIO_RAW,
+} audio_type_t;
+
+typedef struct audio_sink {
+    audio_type_t type;
+    uint32_t rate;
+    void *device; // pa_simple or snd_pcm_t
+    FILE *file;
+    uint64_t samples;
+    atomic_uint_fast64_t underruns;
+} audio_sink_t;
+
+audio_sink_t *audio_open(const char *output, uint32_t rate);
+
+// Finishes playing or writing and frees the sink.
+void audio_close(audio_sink_t *sink);
+
+// Blocks while a sound device's buffer is full.
+bool audio_write(audio_sink_t *sink, const int16_t *samples, size_t n);
+
+// Seconds of audio written but not played yet, 0 for files.
+double audio_delay(audio_sink_t *sink);
+
+const char *audio_type_name(audio_type_t type);
+
+#endif //DBSDR_AUDIO_H
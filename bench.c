@@ -0,0 +1,1347 @@
+//
+// Created by dbrent on 3/17/21.
+//
+
+// dbsdr_bench: times the DSP and render-prep hot paths in isolation and
+// prints one record per benchmark as JSON or CSV, so runs on the same box
+// can be compared across commits.
+
+#include "archive.h"
+#include "binning.h"
+#include "config.h"
+#include "ddc.h"
+#include "demod.h"
+#include "dsp.h"
+#include "fft.h"
+#include "kernels.h"
+#include "pfb.h"
+#include "queue.h"
+#include "source.h"
+
+#include <dirent.h>
+#include <getopt.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef DBSDR_REVISION
+#define DBSDR_REVISION "unknown"
+#endif
+#ifndef DBSDR_BUILD_TYPE
+#define DBSDR_BUILD_TYPE "unknown"
+#endif
+
+#define BENCH_MAX_RESULTS 256
+#define BENCH_MAX_PRODUCERS 64
+#define BENCH_LINE_SIZE DEFAULT_FFT_SIZE
+#define BENCH_QUEUE_SIZE 256
+#define BENCH_KERNEL_SIZE 65536
+#define BENCH_DDC_RATE 20e6 // the default hackrf rate
+#define BENCH_DDC_SAMPLES 262144
+#define BENCH_DDC_CHECK_SAMPLES 2000000
+#define BENCH_PFB_CHANNELS 800 // 25 kHz apart, the narrowband raster
+#define BENCH_DEMOD_BLOCKS 60  // 0.8 s of transfers at 20 MSPS
+#define BENCH_DEMOD_TONE 1000.0
+#define BENCH_DEMOD_MAX_HARMONIC -65.0 // dB, AM's envelope sits near -68
+#define BENCH_ARCHIVE_BINS 8192
+#define BENCH_ARCHIVE_LINE_RATE 100.0 // what it has to keep up with
+#define BENCH_ARCHIVE_LINES 16384 // 2 3/4 minutes at 100 lines/s
+#define BENCH_SCREEN_WIDTH 1280
+#define BENCH_SCREEN_HEIGHT 640
+
+typedef void (*bench_fn)(void *arg, uint64_t iterations);
+
+typedef struct bench_result {
+    char name[64];
+    const char *group;
+    size_t size;
+    int threads;
+    int repetitions;
+    uint64_t iterations; // per repetition
+    double ns_min;       // per iteration
+    double ns_median;
+    double ns_mean;
+    double ns_stddev;
+    double items;        // work items per iteration
+    const char *unit;
+} bench_result_t;
+
+static struct {
+    const char *format;
+    const char *output;
+    const char *filter;
+    int repetitions;
+    double min_time_ns;
+    size_t max_fft;
+    int max_workers;
+} options = {"json", NULL, NULL, 15, 20e6, 1 << 20, 0};
+
+static bench_result_t results[BENCH_MAX_RESULTS];
+static int n_results = 0;
+static uint64_t rng = 0x9e3779b97f4a7c15ULL;
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static uint64_t xorshift(void) {
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+static void fill_random(int8_t *buf, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        buf[i] = (int8_t)(xorshift() >> 56);
+    }
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static bool selected(const char *name) {
+    return options.filter == NULL || strstr(name, options.filter) != NULL;
+}
+
+// Grow the iteration count until one repetition takes min_time (this doubles
+// as the warm up), then time the repetitions. setup runs untimed before
+// every repetition.
+static void run(const char *name, const char *group, size_t size, int threads,
+                double items, const char *unit, bench_fn fn,
+                void (*setup)(void *), void *arg) {
+    if (!selected(name) || n_results == BENCH_MAX_RESULTS) {
+        return;
+    }
+    fprintf(stderr, "%-32s", name);
+
+    uint64_t iterations = 1;
+    for (;;) {
+        if (setup != NULL) {
+            setup(arg);
+        }
+        double start = now_ns();
+        fn(arg, iterations);
+        double elapsed = now_ns() - start;
+        if (elapsed >= options.min_time_ns) {
+            break;
+        }
+        double grow = elapsed <= 0 ? 100 : options.min_time_ns * 1.2 / elapsed;
+        if (grow > 100) {
+            grow = 100;
+        }
+        iterations = (uint64_t)(iterations * grow) + 1;
+    }
+
+    double per_iteration[options.repetitions];
+    for (int r = 0; r < options.repetitions; r++) {
+        if (setup != NULL) {
+            setup(arg);
+        }
+        double start = now_ns();
+        fn(arg, iterations);
+        per_iteration[r] = (now_ns() - start) / (double)iterations;
+    }
+    qsort(per_iteration, options.repetitions, sizeof(double), compare_double);
+
+    bench_result_t *res = &results[n_results++];
+    snprintf(res->name, sizeof(res->name), "%s", name);
+    res->group = group;
+    res->size = size;
+    res->threads = threads;
+    res->repetitions = options.repetitions;
+    res->iterations = iterations;
+    res->ns_min = per_iteration[0];
+    res->ns_median = per_iteration[options.repetitions / 2];
+    double sum = 0;
+    for (int r = 0; r < options.repetitions; r++) {
+        sum += per_iteration[r];
+    }
+    res->ns_mean = sum / options.repetitions;
+    double var = 0;
+    for (int r = 0; r < options.repetitions; r++) {
+        double d = per_iteration[r] - res->ns_mean;
+        var += d * d;
+    }
+    res->ns_stddev = sqrt(var / options.repetitions);
+    res->items = items;
+    res->unit = unit;
+
+    fprintf(stderr, "%14.1f ns %12.3f M%s/s (+-%.1f%%)\n", res->ns_median,
+            items * 1e3 / res->ns_median, unit,
+            100.0 * res->ns_stddev / res->ns_mean);
+}
+
+// fft, window, log_power, fft_execute
+
+typedef struct fft_bench {
+    fft_context_t *ctx;
+    int8_t *samples;
+    float *line;
+} fft_bench_t;
+
+static void fft_bench_reset(void *arg) {
+    fft_bench_t *b = arg;
+    fft_load(b->ctx, b->samples);
+}
+
+// Each pass transforms whatever the last one left behind (the plan may
+// destroy its input). FFTW's cost doesn't depend on the data, and repeated
+// transforms only grow towards inf, which costs nothing extra on SSE/NEON.
+static void fft_bench_transform(void *arg, uint64_t iterations) {
+    fft_bench_t *b = arg;
+    for (uint64_t i = 0; i < iterations; i++) {
+        fft_transform(b->ctx);
+    }
+}
+
+static void fft_bench_load(void *arg, uint64_t iterations) {
+    fft_bench_t *b = arg;
+    for (uint64_t i = 0; i < iterations; i++) {
+        fft_load(b->ctx, b->samples);
+    }
+}
+
+static void fft_bench_log_power(void *arg, uint64_t iterations) {
+    fft_bench_t *b = arg;
+    for (uint64_t i = 0; i < iterations; i++) {
+        fft_log_power(b->ctx, b->line);
+    }
+}
+
+static void fft_bench_execute(void *arg, uint64_t iterations) {
+    fft_bench_t *b = arg;
+    for (uint64_t i = 0; i < iterations; i++) {
+        fft_execute(b->ctx, b->samples, b->line);
+    }
+}
+
+static void bench_fft(void) {
+    char name[64];
+    for (size_t size = 1024; size <= options.max_fft; size *= 4) {
+        const char *groups[] = {"fft", "window", "log_power", "fft_execute"};
+        bool any = false;
+        for (int g = 0; g < 4; g++) {
+            snprintf(name, sizeof(name), "%s/%zu", groups[g], size);
+            any |= selected(name);
+        }
+        if (!any) {
+            continue;
+        }
+
+        fprintf(stderr, "planning %zu point fft\n", size);
+        fft_bench_t b;
+        b.ctx = fft_context_create(size);
+        b.samples = malloc(size * 2);
+        b.line = malloc(size * sizeof(float));
+        if (b.ctx == NULL || b.samples == NULL || b.line == NULL ||
+            !fft_context_set(b.ctx, fft_setup_wait(size, FFT_WINDOW_HANN))) {
+            fprintf(stderr, "Could not set up %zu point fft\n", size);
+            exit(-1);
+        }
+        fill_random(b.samples, size * 2);
+        fft_load(b.ctx, b.samples);
+        fft_transform(b.ctx);
+
+        snprintf(name, sizeof(name), "fft/%zu", size);
+        run(name, "fft", size, 1, (double)size, "points", fft_bench_transform,
+            fft_bench_reset, &b);
+        snprintf(name, sizeof(name), "window/%zu", size);
+        run(name, "window", size, 1, (double)size, "samples", fft_bench_load,
+            NULL, &b);
+        snprintf(name, sizeof(name), "log_power/%zu", size);
+        run(name, "log_power", size, 1, (double)size, "bins",
+            fft_bench_log_power, fft_bench_reset, &b);
+        snprintf(name, sizeof(name), "fft_execute/%zu", size);
+        run(name, "fft_execute", size, 1, (double)size, "samples",
+            fft_bench_execute, NULL, &b);
+
+        fft_context_destroy(b.ctx);
+        free(b.samples);
+        free(b.line);
+    }
+}
+
+// kernels: each instruction set's FFT path loops, checked against the
+// scalar reference before they are timed
+
+typedef struct kernels_bench {
+    const kernels_t *k;
+    int8_t *samples;
+    float *window;
+    float *complex; // size complex points
+    float *line;
+    size_t size;
+} kernels_bench_t;
+
+static void kernels_bench_load(void *arg, uint64_t iterations) {
+    kernels_bench_t *b = arg;
+    for (uint64_t i = 0; i < iterations; i++) {
+        b->k->load(b->samples, b->window, b->complex, b->size);
+    }
+}
+
+static void kernels_bench_log_power(void *arg, uint64_t iterations) {
+    kernels_bench_t *b = arg;
+    for (uint64_t i = 0; i < iterations; i++) {
+        b->k->log_power(b->complex, 1.0f / (float)b->size, b->line, b->size);
+    }
+}
+
+static void kernels_bench_accumulate(void *arg, uint64_t iterations) {
+    kernels_bench_t *b = arg;
+    for (uint64_t i = 0; i < iterations; i++) {
+        b->k->accumulate_power(b->complex, b->line, b->size);
+    }
+}
+
+static void kernels_bench_line_reset(void *arg) {
+    kernels_bench_t *b = arg;
+    for (size_t i = 0; i < b->size; i++) {
+        b->line[i] = 1.0f + (float)i;
+    }
+}
+
+static void kernels_bench_power_to_db(void *arg, uint64_t iterations) {
+    kernels_bench_t *b = arg;
+    for (uint64_t i = 0; i < iterations; i++) {
+        b->k->power_to_db(b->line, 1.0f, b->complex, b->size);
+    }
+}
+
+// FFT output spans a huge range, cover every exponent a line can hit
+static void fill_spectrum(float *complex, size_t size) {
+    for (size_t i = 0; i < 2 * size; i++) {
+        float r = (float)(xorshift() >> 40) * 0x1p-24f - 0.5f;
+        complex[i] = ldexpf(r, (int)(xorshift() >> 58) - 20);
+    }
+}
+
+static void bench_kernels(void) {
+    const char *groups[] = {"load", "log_power", "accumulate_power",
+                            "power_to_db"};
+    const bench_fn fns[] = {kernels_bench_load, kernels_bench_log_power,
+                            kernels_bench_accumulate,
+                            kernels_bench_power_to_db};
+    void (*setups[])(void *) = {NULL, NULL, kernels_bench_line_reset,
+                                kernels_bench_line_reset};
+    const char *unit[] = {"samples", "bins", "bins", "bins"};
+    char name[64];
+
+    for (int isa = 0; isa < KERNELS_ISA_COUNT; isa++) {
+        const kernels_t *k = kernels_for(isa);
+        bool any = false;
+        for (int g = 0; g < 4; g++) {
+            snprintf(name, sizeof(name), "kernels/%s/%s/%d",
+                     kernels_isa_name(isa), groups[g], BENCH_KERNEL_SIZE);
+            any |= selected(name);
+        }
+        if (k == NULL || !any) {
+            continue;
+        }
+        kernels_bench_t b = {k,
+                             malloc(BENCH_KERNEL_SIZE * 2),
+                             malloc(BENCH_KERNEL_SIZE * sizeof(float)),
+                             malloc(BENCH_KERNEL_SIZE * 2 * sizeof(float)),
+                             malloc(BENCH_KERNEL_SIZE * sizeof(float)),
+                             BENCH_KERNEL_SIZE};
+        if (b.samples == NULL || b.window == NULL || b.complex == NULL ||
+            b.line == NULL) {
+            fprintf(stderr, "Could not set up %s kernels\n",
+                    kernels_isa_name(isa));
+            exit(-1);
+        }
+        fill_random(b.samples, BENCH_KERNEL_SIZE * 2);
+        for (size_t i = 0; i < BENCH_KERNEL_SIZE; i++) {
+            b.window[i] = 0.5f;
+        }
+        fill_spectrum(b.complex, BENCH_KERNEL_SIZE);
+
+        for (int g = 0; g < 4; g++) {
+            snprintf(name, sizeof(name), "kernels/%s/%s/%d",
+                     kernels_isa_name(isa), groups[g], BENCH_KERNEL_SIZE);
+            run(name, "kernels", BENCH_KERNEL_SIZE, 1, BENCH_KERNEL_SIZE,
+                unit[g], fns[g], setups[g], &b);
+        }
+
+        free(b.samples);
+        free(b.window);
+        free(b.complex);
+        free(b.line);
+    }
+}
+
+// queue: items through one ring, n producers against one consumer
+
+typedef struct queue_bench {
+    queue_t *q;
+    int producers;
+    unsigned char *item;
+} queue_bench_t;
+
+typedef struct queue_producer {
+    queue_bench_t *b;
+    uint64_t count;
+} queue_producer_t;
+
+static void *queue_producer_thread(void *arg) {
+    queue_producer_t *p = arg;
+    for (uint64_t i = 0; i < p->count; i++) {
+        while (!queue_push(p->b->q, p->b->item)) {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+static void queue_bench_run(void *arg, uint64_t iterations) {
+    queue_bench_t *b = arg;
+    pthread_t threads[BENCH_MAX_PRODUCERS];
+    queue_producer_t producers[BENCH_MAX_PRODUCERS];
+
+    for (int i = 0; i < b->producers; i++) {
+        producers[i].b = b;
+        producers[i].count = iterations / b->producers;
+        if (i == 0) {
+            producers[i].count += iterations % b->producers;
+        }
+        pthread_create(&threads[i], NULL, queue_producer_thread,
+                       &producers[i]);
+    }
+
+    for (uint64_t popped = 0; popped < iterations;) {
+        if (queue_peek(b->q) == NULL) {
+            sched_yield();
+            continue;
+        }
+        queue_release(b->q);
+        popped++;
+    }
+
+    for (int i = 0; i < b->producers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+static void bench_queue(int cores) {
+    const size_t slot_sizes[] = {64, BENCH_LINE_SIZE * sizeof(float)};
+    int counts[] = {1, 2, 4, cores};
+    char name[64];
+
+    for (int s = 0; s < 2; s++) {
+        queue_t *q = aligned_alloc(QUEUE_CACHE_LINE, sizeof(queue_t));
+        unsigned char *item = calloc(1, slot_sizes[s]);
+        for (int c = 0; c < 4; c++) {
+            int producers = counts[c];
+            if (producers > BENCH_MAX_PRODUCERS ||
+                (c == 3 && producers <= 4)) {
+                continue;
+            }
+            queue_mode_t mode = producers == 1 ? QUEUE_SPSC : QUEUE_MPSC;
+            snprintf(name, sizeof(name), "queue/%s%d/%zu",
+                     mode == QUEUE_SPSC ? "spsc" : "mpsc", producers,
+                     slot_sizes[s]);
+            if (!selected(name)) {
+                continue;
+            }
+            if (q == NULL || item == NULL ||
+                !queue_init(q, slot_sizes[s], BENCH_QUEUE_SIZE, mode)) {
+                fprintf(stderr, "Could not set up %s\n", name);
+                exit(-1);
+            }
+            queue_bench_t b = {q, producers, item};
+            run(name, "queue", slot_sizes[s], producers + 1, 1.0, "items",
+                queue_bench_run, NULL, &b);
+            queue_destroy(q);
+        }
+        free(q);
+        free(item);
+    }
+}
+
+// binning: one FFT line down to one waterfall row, then to half floats
+
+typedef struct binning_bench {
+    float *line;
+    size_t n_bins;
+    binning_reducer_t reducer;
+    float *row;
+    uint16_t *pixels;
+    int width;
+} binning_bench_t;
+
+static void binning_bench_run(void *arg, uint64_t iterations) {
+    binning_bench_t *b = arg;
+    for (uint64_t i = 0; i < iterations; i++) {
+        binning_reduce(b->line, b->n_bins, b->n_bins / 2, 0.0,
+                       (double)b->n_bins, b->reducer, b->row, b->width);
+    }
+}
+
+static void binning_bench_half(void *arg, uint64_t iterations) {
+    binning_bench_t *b = arg;
+    for (uint64_t i = 0; i < iterations; i++) {
+        binning_mean_half(b->row, b->width, b->pixels, b->width);
+    }
+}
+
+static void bench_binning(void) {
+    const size_t bins[] = {8192, 65536, 1048576};
+    const int widths[] = {1280, 1920, 3840};
+    char name[64];
+
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            bool any = false;
+            for (int r = 0; r <= BINNING_REDUCER_COUNT; r++) {
+                snprintf(name, sizeof(name), "binning/%s/%zu/%d",
+                         r < BINNING_REDUCER_COUNT ? binning_reducer_name(r)
+                                                   : "half",
+                         bins[i], widths[j]);
+                any |= selected(name);
+            }
+            if (!any) {
+                continue;
+            }
+            binning_bench_t b = {malloc(bins[i] * sizeof(float)),
+                                 bins[i],
+                                 BINNING_MAX,
+                                 calloc(widths[j], sizeof(float)),
+                                 malloc(widths[j] * sizeof(uint16_t)),
+                                 widths[j]};
+            if (b.line == NULL || b.row == NULL || b.pixels == NULL) {
+                fprintf(stderr, "Could not set up %s\n", name);
+                exit(-1);
+            }
+            for (size_t k = 0; k < bins[i]; k++) {
+                float r = (float)(xorshift() >> 40) * 0x1p-24f;
+                b.line[k] = -120.0f + 100.0f * r;
+            }
+            for (int r = 0; r < BINNING_REDUCER_COUNT; r++) {
+                b.reducer = r;
+                snprintf(name, sizeof(name), "binning/%s/%zu/%d",
+                         binning_reducer_name(r), bins[i], widths[j]);
+                run(name, "binning", bins[i], 1, (double)bins[i], "bins",
+                    binning_bench_run, NULL, &b);
+            }
+            snprintf(name, sizeof(name), "binning/half/%zu/%d", bins[i],
+                     widths[j]);
+            run(name, "binning", (size_t)widths[j], 1, (double)widths[j],
+                "pixels", binning_bench_half, NULL, &b);
+            free(b.line);
+            free(b.row);
+            free(b.pixels);
+        }
+    }
+}
+
+// workers: the whole dsp pipeline, transfers in and ordered lines out
+
+typedef struct workers_bench {
+    int8_t *transfer;
+    queue_t *lines;
+    uint64_t blocks;
+} workers_bench_t;
+
+static void workers_bench_run(void *arg, uint64_t iterations) {
+    workers_bench_t *b = arg;
+    uint64_t frames = SAMPLES_PER_TRANSFER / BENCH_LINE_SIZE;
+    uint64_t target = (b->blocks + iterations) * frames;
+    dsp_stats_t stats;
+
+    for (uint64_t i = 0; i < iterations; i++) {
+        for (;;) {
+            while (queue_peek(b->lines) != NULL) {
+                queue_release(b->lines);
+            }
+            dsp_get_stats(&stats);
+            if (stats.iq_queue.occupancy + 1 < stats.iq_queue.capacity) {
+                break;
+            }
+            sched_yield();
+        }
+        dsp_receive(b->transfer, SAMPLES_PER_TRANSFER, BYTES_PER_SAMPLE);
+    }
+    b->blocks += iterations;
+
+    for (;;) {
+        while (queue_peek(b->lines) != NULL) {
+            queue_release(b->lines);
+        }
+        dsp_get_stats(&stats);
+        if (stats.lines_emitted + stats.lines_dropped >= target) {
+            break;
+        }
+        sched_yield();
+    }
+}
+
+static void bench_workers(int cores) {
+    int max = options.max_workers > 0 ? options.max_workers : cores;
+    if (max > DSP_MAX_WORKERS) {
+        max = DSP_MAX_WORKERS;
+    }
+    char name[64];
+
+    // 1, 2, 4 ... and always max itself
+    for (int n = 1; n <= max; n = n < max && n * 2 > max ? max : n * 2) {
+        snprintf(name, sizeof(name), "workers/%d", n);
+        if (!selected(name)) {
+            continue;
+        }
+        queue_t *lines = aligned_alloc(QUEUE_CACHE_LINE, sizeof(queue_t));
+        workers_bench_t b = {malloc(SAMPLES_PER_TRANSFER * BYTES_PER_SAMPLE),
+                             lines, 0};
+        dsp_config_t config = {
+                .fft_size = BENCH_LINE_SIZE,
+                .window = FFT_WINDOW_HANN,
+                .max_block_samples = SAMPLES_PER_TRANSFER,
+                .workers = n,
+        };
+        if (b.transfer == NULL || lines == NULL ||
+            !queue_init(lines, DSP_LINE_BYTES(BENCH_LINE_SIZE),
+                        BENCH_QUEUE_SIZE, QUEUE_SPSC) ||
+            !dsp_init(&config, lines) || !dsp_start()) {
+            fprintf(stderr, "Could not set up %s\n", name);
+            exit(-1);
+        }
+        fill_random(b.transfer, SAMPLES_PER_TRANSFER * BYTES_PER_SAMPLE);
+
+        run(name, "workers", SAMPLES_PER_TRANSFER, n, SAMPLES_PER_TRANSFER,
+            "samples", workers_bench_run, NULL, &b);
+
+        dsp_stats_t stats;
+        dsp_get_stats(&stats);
+        if (stats.lines_dropped > 0 || stats.blocks_dropped > 0) {
+            fprintf(stderr, "%s dropped %lu blocks and %lu lines\n", name,
+                    (unsigned long)stats.blocks_dropped,
+                    (unsigned long)stats.lines_dropped);
+        }
+        dsp_stop();
+        dsp_destroy();
+        queue_destroy(lines);
+        free(lines);
+        free(b.transfer);
+    }
+}
+
+// ddc: int8 samples in at the input rate, decimated complex float out
+
+typedef struct ddc_bench {
+    ddc_t *ddc;
+    int8_t *samples;
+    float *out;
+} ddc_bench_t;
+
+static void ddc_bench_run(void *arg, uint64_t iterations) {
+    ddc_bench_t *b = arg;
+    for (uint64_t i = 0; i < iterations; i++) {
+        ddc_process(b->ddc, b->samples, BENCH_DDC_SAMPLES, b->out);
+    }
+}
+
+// A complex tone at f cycles per sample, 100 / 128 of full scale, dithered.
+static void fill_tone(int8_t *samples, size_t n, double f) {
+    for (size_t i = 0; i < n; i++) {
+        double dither = (double)(xorshift() >> 40) * 0x1p-24 - 0.5;
+        samples[2 * i] = (int8_t)lrint(100.0 * cos(2.0 * M_PI * f * i) +
+                                       dither);
+        samples[2 * i + 1] = (int8_t)lrint(100.0 * sin(2.0 * M_PI * f * i) +
+                                           dither);
+    }
+}
+
+// Level in dB of a complex tone at frequency f (cycles per sample) in a
+// Hann windowed stretch of channel output.
+static double tone_db(const float *out, size_t n, double f) {
+    double re = 0.0, im = 0.0, gain = 0.0;
+    for (size_t i = 0; i < n; i++) {
+        double w = 0.5 - 0.5 * cos(2.0 * M_PI * (double)i / (double)n);
+        double c = cos(2.0 * M_PI * f * (double)i);
+        double s = sin(2.0 * M_PI * f * (double)i);
+        re += w * (out[2 * i] * c + out[2 * i + 1] * s);
+        im += w * (out[2 * i + 1] * c - out[2 * i] * s);
+        gain += w;
+    }
+    return 10.0 * log10((re * re + im * im) / (gain * gain) + 1e-30);
+}
+
+// A tone inside the channel must come through at its own level, and one
+// just past the output rate, which folds back into the channel, must not.
+static bool check_ddc(uint32_t decimation) {
+    const double rate = BENCH_DDC_RATE, offset = -0.165 * rate;
+    const double in_band = 0.1, folds = 0.9;
+    const size_t n = BENCH_DDC_CHECK_SAMPLES;
+    ddc_config_t config = {rate, offset, decimation, 0.0};
+    int8_t *samples = malloc(n * 2);
+    float *out = malloc(n / decimation * 2 * sizeof(float) + 64);
+    if (samples == NULL || out == NULL) {
+        fprintf(stderr, "Could not set up ddc check\n");
+        exit(-1);
+    }
+    double level[2];
+    for (int t = 0; t < 2; t++) {
+        ddc_t *ddc = ddc_create(&config);
+        if (ddc == NULL) {
+            exit(-1);
+        }
+        double f = (offset + (t == 0 ? in_band : folds) * ddc->output_rate)
+                   / rate;
+        fill_tone(samples, n, f);
+        size_t n_out = ddc_process(ddc, samples, n, out);
+        // skip the filters filling up
+        size_t skip = n_out / 10;
+        level[t] = tone_db(out + 2 * skip, n_out - skip,
+                           t == 0 ? in_band : folds - 1.0);
+        ddc_destroy(ddc);
+    }
+    double expect = 20.0 * log10(100.0 / 128.0);
+    char name[64];
+    snprintf(name, sizeof(name), "check/ddc/%u", decimation);
+    fprintf(stderr, "%-32s gain %+.3f dB, alias rejection %.1f dB\n", name,
+            level[0] - expect, level[0] - level[1]);
+    free(samples);
+    free(out);
+    return fabs(level[0] - expect) < 0.1 &&
+           level[0] - level[1] >= DDC_ATTENUATION;
+}
+
+static void bench_ddc(void) {
+    const uint32_t decimations[] = {10, 100, 1000};
+    char name[64];
+
+    for (int i = 0; i < 3; i++) {
+        snprintf(name, sizeof(name), "ddc/%u", decimations[i]);
+        if (!selected(name)) {
+            continue;
+        }
+        if (!check_ddc(decimations[i])) {
+            fprintf(stderr, "%s does not meet its response\n", name);
+            exit(-1);
+        }
+        ddc_config_t config = {BENCH_DDC_RATE, 0.123 * BENCH_DDC_RATE,
+                               decimations[i], 0.0};
+        ddc_bench_t b = {ddc_create(&config), malloc(BENCH_DDC_SAMPLES * 2),
+                         NULL};
+        if (b.ddc == NULL || b.samples == NULL ||
+            (b.out = malloc(ddc_max_output(b.ddc, BENCH_DDC_SAMPLES) * 2 *
+                            sizeof(float))) == NULL) {
+            fprintf(stderr, "Could not set up %s\n", name);
+            exit(-1);
+        }
+        fill_random(b.samples, BENCH_DDC_SAMPLES * 2);
+        fprintf(stderr, "%-32s %.1f multiply-adds per sample\n", name,
+                ddc_cost(b.ddc));
+        run(name, "ddc", BENCH_DDC_SAMPLES, 1, BENCH_DDC_SAMPLES, "samples",
+            ddc_bench_run, NULL, &b);
+        ddc_destroy(b.ddc);
+        free(b.samples);
+        free(b.out);
+    }
+}
+
+// channels: N channels of one width out of the band, from one PFB or from
+// N DDCs
+
+typedef struct channels_bench {
+    pfb_t *pfb;
+    ddc_t *ddcs[PFB_MAX_ROUTES];
+    int n;
+    int8_t *samples;
+    float *out;
+    size_t n_out;
+} channels_bench_t;
+
+static void channels_keep(void *ctx, int channel, const float *samples,
+                          size_t n_samples) {
+    channels_bench_t *b = ctx;
+    memcpy(b->out + 2 * b->n_out, samples, n_samples * 2 * sizeof(float));
+    b->n_out += n_samples;
+}
+
+static void channels_drop(void *ctx, int channel, const float *samples,
+                          size_t n_samples) {}
+
+static void channels_bench_pfb(void *arg, uint64_t iterations) {
+    channels_bench_t *b = arg;
+    for (uint64_t i = 0; i < iterations; i++) {
+        pfb_process(b->pfb, b->samples, BENCH_DDC_SAMPLES);
+    }
+}
+
+static void channels_bench_ddcs(void *arg, uint64_t iterations) {
+    channels_bench_t *b = arg;
+    for (uint64_t i = 0; i < iterations; i++) {
+        for (int c = 0; c < b->n; c++) {
+            ddc_process(b->ddcs[c], b->samples, BENCH_DDC_SAMPLES, b->out);
+        }
+    }
+}
+
+// Same as check_ddc(), for one PFB channel: unity gain inside it and the
+// next channel's centre stopped.
+static bool check_pfb(const pfb_config_t *config) {
+    const int channel = -37;
+    const double in_band = 0.1;
+    const size_t n = BENCH_DDC_CHECK_SAMPLES;
+    channels_bench_t b = {.samples = malloc(n * 2)};
+    double level[2];
+    for (int t = 0; t < 2; t++) {
+        b.pfb = pfb_create(config);
+        if (b.pfb == NULL || b.samples == NULL ||
+            (b.out = malloc((n / b.pfb->decimation + 1) * 2 *
+                            sizeof(float))) == NULL) {
+            fprintf(stderr, "Could not set up pfb check\n");
+            exit(-1);
+        }
+        b.n_out = 0;
+        pfb_route(b.pfb, channel, channels_keep, &b);
+        double at = t == 0 ? in_band * b.pfb->spacing : b.pfb->spacing;
+        fill_tone(b.samples, n,
+                  (pfb_channel_offset(b.pfb, channel) + at) /
+                          b.pfb->sample_rate);
+        pfb_process(b.pfb, b.samples, n);
+        size_t skip = b.n_out / 10;
+        level[t] = tone_db(b.out + 2 * skip, b.n_out - skip,
+                           at / b.pfb->channel_rate);
+        pfb_destroy(b.pfb);
+        free(b.out);
+    }
+    double expect = 20.0 * log10(100.0 / 128.0);
+    char name[64];
+    snprintf(name, sizeof(name), "check/pfb/%u", config->channels);
+    fprintf(stderr, "%-32s gain %+.3f dB, next channel %.1f dB down\n",
+            name, level[0] - expect, level[0] - level[1]);
+    free(b.samples);
+    return fabs(level[0] - expect) < 0.1 &&
+           level[0] - level[1] >= DDC_ATTENUATION;
+}
+
+static void bench_channels(void) {
+    const int counts[] = {1, 8, 64};
+    pfb_config_t config = {BENCH_DDC_RATE, BENCH_PFB_CHANNELS, 1, 0.0};
+    char name[64];
+
+    for (int i = 0; i < 3; i++) {
+        int n = counts[i];
+        char pfb_name[64];
+        snprintf(pfb_name, sizeof(pfb_name), "channels/pfb/%u/%d",
+                 config.channels, n);
+        snprintf(name, sizeof(name), "channels/ddc/%u/%d", config.channels,
+                 n);
+        if (!selected(pfb_name) && !selected(name)) {
+            continue;
+        }
+        if (i == 0 && !check_pfb(&config)) {
+            fprintf(stderr, "%s does not meet its response\n", pfb_name);
+            exit(-1);
+        }
+
+        channels_bench_t b = {pfb_create(&config), {NULL}, n,
+                              malloc(BENCH_DDC_SAMPLES * 2), NULL, 0};
+        if (b.pfb == NULL || b.samples == NULL ||
+            (b.out = malloc((BENCH_DDC_SAMPLES / b.pfb->decimation + 1) * 2 *
+                            sizeof(float))) == NULL) {
+            fprintf(stderr, "Could not set up %s\n", pfb_name);
+            exit(-1);
+        }
+        fill_random(b.samples, BENCH_DDC_SAMPLES * 2);
+        // the same channels both ways, spread across the band
+        for (int c = 0; c < n; c++) {
+            int channel = (c - n / 2) * (int)(config.channels / 128);
+            ddc_config_t ddc = {BENCH_DDC_RATE,
+                                pfb_channel_offset(b.pfb, channel),
+                                b.pfb->decimation, b.pfb->bandwidth};
+            pfb_route(b.pfb, channel, channels_drop, NULL);
+            if ((b.ddcs[c] = ddc_create(&ddc)) == NULL) {
+                exit(-1);
+            }
+        }
+        fprintf(stderr, "%-32s %.1f multiply-adds per sample\n", pfb_name,
+                pfb_cost(b.pfb));
+        fprintf(stderr, "%-32s %.1f multiply-adds per sample\n", name,
+                n * ddc_cost(b.ddcs[0]));
+        run(pfb_name, "channels", BENCH_DDC_SAMPLES, 1, BENCH_DDC_SAMPLES,
+            "samples", channels_bench_pfb, NULL, &b);
+        run(name, "channels", BENCH_DDC_SAMPLES, 1, BENCH_DDC_SAMPLES,
+            "samples", channels_bench_ddcs, NULL, &b);
+        pfb_destroy(b.pfb);
+        for (int c = 0; c < n; c++) {
+            ddc_destroy(b.ddcs[c]);
+        }
+        free(b.samples);
+        free(b.out);
+    }
+}
+
+// demod: every mode on a synthetic 1 kHz tone, fed at the sample rate
+
+// Level of a real tone at f Hz in a stretch of DEMOD_AUDIO_RATE audio.
+static double audio_tone(const int16_t *pcm, size_t n, double f) {
+    double re = 0.0, im = 0.0;
+    for (size_t i = 0; i < n; i++) {
+        double x = pcm[i] / 32768.0;
+        re += x * cos(2.0 * M_PI * f * (double)i / DEMOD_AUDIO_RATE);
+        im += x * sin(2.0 * M_PI * f * (double)i / DEMOD_AUDIO_RATE);
+    }
+    return 2.0 * hypot(re, im) / (double)n;
+}
+
+// A channel 1 MHz off the tuning carrying the tone: FM at half the peak
+// deviation, AM half modulated, SSB as a carrier the tone away. It must come
+// out at the level the mode is scaled to, with the harmonics well down, and
+// the demod thread must keep up in real time inside DEMOD_MAX_LATENCY.
+static bool check_demod(demod_mode_t mode) {
+    const double rate = BENCH_DDC_RATE, offset = 1e6;
+    const double tone = BENCH_DEMOD_TONE;
+    const uint64_t tuned = 100000000;
+    const size_t n = BENCH_DDC_SAMPLES;
+    char path[] = "/tmp/dbsdr_bench.XXXXXX";
+    int fd = mkstemp(path);
+    demod_config_t config = {mode, tuned + (uint64_t)offset, rate, n, 0.0,
+                             path};
+    demod_t *demod = NULL;
+    iq_block_t *block = malloc(sizeof(iq_block_t) + 2 * n);
+    if (fd < 0 || block == NULL || (demod = demod_open(&config)) == NULL) {
+        fprintf(stderr, "Could not set up demod check\n");
+        exit(-1);
+    }
+    close(fd);
+
+    double deviation = mode == DEMOD_WFM ? 37.5e3 : 2.5e3;
+    // SSB is levelled by the AGC, the others come out in proportion to the
+    // deviation or modulation depth
+    double expect = DEMOD_AUDIO_LEVEL;
+    if (mode == DEMOD_WFM || mode == DEMOD_NFM || mode == DEMOD_AM) {
+        expect *= 0.5;
+    }
+    if (mode == DEMOD_WFM) {
+        double wt = 2.0 * M_PI * tone * DEMOD_DEEMPHASIS;
+        expect /= sqrt(1.0 + wt * wt);
+    }
+    double ssb = mode == DEMOD_USB ? tone : -tone;
+    double phase = 0.0, start = now_ns();
+    block->tag = (dsp_tag_t){.generation = 0, .frequency = tuned};
+    block->bytes_per_sample = 2;
+    block->n_samples = n;
+    for (int k = 0; k < BENCH_DEMOD_BLOCKS; k++) {
+        for (size_t i = 0; i < n; i++) {
+            double t = (double)(k * n + i) / rate, a = 60.0, f = offset;
+            if (mode == DEMOD_WFM || mode == DEMOD_NFM) {
+                f += deviation * sin(2.0 * M_PI * tone * t);
+            } else if (mode == DEMOD_AM) {
+                a = 50.0 * (1.0 + 0.5 * sin(2.0 * M_PI * tone * t));
+            } else {
+                f += ssb;
+            }
+            phase += 2.0 * M_PI * f / rate;
+            double dither = (double)(xorshift() >> 40) * 0x1p-24 - 0.5;
+            block->samples[2 * i] = (int8_t)lrint(a * cos(phase) + dither);
+            block->samples[2 * i + 1] = (int8_t)lrint(a * sin(phase) +
+                                                      dither);
+        }
+        phase = fmod(phase, 2.0 * M_PI);
+        // handed over when the radio would have
+        double due = start + (k + 1) * n / rate * 1e9, wait = due - now_ns();
+        if (wait > 0) {
+            struct timespec ts = {(time_t)(wait / 1e9),
+                                  (long)fmod(wait, 1e9)};
+            nanosleep(&ts, NULL);
+        }
+        block->sequence = (uint64_t)k;
+        block->tag.first_sample = (uint64_t)k * n;
+        block->received_ns = (uint64_t)now_ns();
+        demod_write(demod, block);
+    }
+    // the last block through
+    struct timespec ts = {0, 200000000};
+    nanosleep(&ts, NULL);
+    demod_stats_t stats;
+    demod_get_stats(demod, &stats);
+    demod_close(demod);
+    free(block);
+
+    // the last half second, well clear of the filters and AGC settling
+    FILE *in = fopen(path, "rb");
+    size_t want = DEMOD_AUDIO_RATE / 2, got = 0;
+    int16_t *pcm = malloc(want * sizeof(int16_t));
+    if (in != NULL && pcm != NULL && fseek(in, 0, SEEK_END) == 0) {
+        long size = ftell(in);
+        if (size >= (long)(want * sizeof(int16_t)) &&
+            fseek(in, size - (long)(want * sizeof(int16_t)), SEEK_SET) ==
+                    0) {
+            got = fread(pcm, sizeof(int16_t), want, in);
+        }
+    }
+    if (in != NULL) {
+        fclose(in);
+    }
+    unlink(path);
+    if (got != want) {
+        fprintf(stderr, "check/demod/%s: not enough audio\n",
+                demod_mode_name(mode));
+        free(pcm);
+        return false;
+    }
+    double level = audio_tone(pcm, want, tone);
+    double harmonic = -INFINITY;
+    for (int h = 2; h <= 5; h++) {
+        double db = 20.0 * log10(audio_tone(pcm, want, h * tone) / level +
+                                 1e-30);
+        harmonic = db > harmonic ? db : harmonic;
+    }
+    free(pcm);
+    double gain = 20.0 * log10(level / expect);
+
+    char name[64];
+    snprintf(name, sizeof(name), "check/demod/%s", demod_mode_name(mode));
+    fprintf(stderr,
+            "%-32s level %+.3f dB, harmonics %.1f dB, latency %.1f ms max, "
+            "%lu blocks dropped\n",
+            name, gain, harmonic, stats.latency_max * 1e3,
+            (unsigned long)stats.blocks_dropped);
+    return fabs(gain) < 0.1 && harmonic < BENCH_DEMOD_MAX_HARMONIC &&
+           stats.latency_max < DEMOD_MAX_LATENCY &&
+           stats.blocks_dropped == 0;
+}
+
+static void bench_demod(void) {
+    char name[64];
+
+    for (int mode = 0; mode < DEMOD_MODE_COUNT; mode++) {
+        snprintf(name, sizeof(name), "demod/%s", demod_mode_name(mode));
+        if (selected(name) && !check_demod(mode)) {
+            fprintf(stderr, "%s does not meet its response\n", name);
+            exit(-1);
+        }
+    }
+}
+
+// output
+
+static void json_string(FILE *out, const char *s) {
+    fputc('"', out);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') {
+            fputc('\\', out);
+        }
+        if ((unsigned char)*s >= 0x20) {
+            fputc(*s, out);
+        }
+    }
+    fputc('"', out);
+}
+
+static void write_json(FILE *out, const char *date, const char *host,
+                       int cores) {
+    fprintf(out, "{\n  \"context\": {\n    \"date\": ");
+    json_string(out, date);
+    fprintf(out, ",\n    \"host\": ");
+    json_string(out, host);
+    fprintf(out, ",\n    \"cpus\": %d,\n    \"revision\": ", cores);
+    json_string(out, DBSDR_REVISION);
+    fprintf(out, ",\n    \"build_type\": ");
+    json_string(out, DBSDR_BUILD_TYPE);
+    fprintf(out, ",\n    \"precision\": \"%s\",\n    \"repetitions\": %d,\n"
+                 "    \"min_time_ns\": %.0f\n  },\n  \"benchmarks\": [",
+            sizeof(fft_real) == sizeof(float) ? "float" : "double",
+            options.repetitions, options.min_time_ns);
+    for (int i = 0; i < n_results; i++) {
+        bench_result_t *r = &results[i];
+        fprintf(out,
+                "%s\n    {\"name\": \"%s\", \"group\": \"%s\", "
+                "\"size\": %zu, \"threads\": %d, \"repetitions\": %d, "
+                "\"iterations\": %lu, \"ns_min\": %.3f, "
+                "\"ns_median\": %.3f, \"ns_mean\": %.3f, "
+                "\"ns_stddev\": %.3f, \"unit\": \"%s\", "
+                "\"items_per_second\": %.1f}",
+                i == 0 ? "" : ",", r->name, r->group, r->size, r->threads,
+                r->repetitions, (unsigned long)r->iterations, r->ns_min,
+                r->ns_median, r->ns_mean, r->ns_stddev, r->unit,
+                r->items * 1e9 / r->ns_median);
+    }
+    fprintf(out, "\n  ]\n}\n");
+}
+
+static void write_csv(FILE *out) {
+    fprintf(out, "name,group,size,threads,repetitions,iterations,ns_min,"
+                 "ns_median,ns_mean,ns_stddev,unit,items_per_second,"
+                 "revision\n");
+    for (int i = 0; i < n_results; i++) {
+        bench_result_t *r = &results[i];
+        fprintf(out, "%s,%s,%zu,%d,%d,%lu,%.3f,%.3f,%.3f,%.3f,%s,%.1f,%s\n",
+                r->name, r->group, r->size, r->threads, r->repetitions,
+                (unsigned long)r->iterations, r->ns_min, r->ns_median,
+                r->ns_mean, r->ns_stddev, r->unit,
+                r->items * 1e9 / r->ns_median, DBSDR_REVISION);
+    }
+}
+
+// archive: 8K bin lines quantized and written to a chunk, then a screen of
+// them read back through the mapping, and all of them drawn on one screen
+// from the archive alone or from its pyramid
+
+typedef struct archive_bench {
+    archive_t *archive;
+    archive_reader_t *reader;
+    pyramid_reader_t *pyramid;
+    int level;
+    spectrum_line_t *line;
+    float *db;
+    int64_t time_ns;
+} archive_bench_t;
+
+static void archive_bench_write(void *arg, uint64_t iterations) {
+    archive_bench_t *b = arg;
+    for (uint64_t i = 0; i < iterations; i++) {
+        archive_append(b->archive, b->line, b->time_ns++);
+    }
+}
+
+static void archive_bench_read(void *arg, uint64_t iterations) {
+    archive_bench_t *b = arg;
+    uint64_t lines = archive_reader_lines(b->reader);
+    for (uint64_t i = 0; i < iterations; i++) {
+        archive_line_t line;
+        if (archive_read_line(b->reader, xorshift() % lines, &line)) {
+            archive_line_db(&line, b->db);
+        }
+    }
+}
+
+static void archive_bench_screen(void *arg, uint64_t iterations) {
+    archive_bench_t *b = arg;
+    uint64_t per_row = BENCH_ARCHIVE_LINES / BENCH_SCREEN_HEIGHT + 1;
+    for (uint64_t i = 0; i < iterations; i++) {
+        for (uint64_t row = 0; row < BENCH_SCREEN_HEIGHT; row++) {
+            pyramid_render_row(b->pyramid, b->reader, b->level, row * per_row,
+                               per_row, 0.0, 1.0, b->db, BENCH_SCREEN_WIDTH);
+        }
+    }
+}
+
+static void remove_dir(const char *path) {
+    DIR *dir = opendir(path);
+    struct dirent *entry;
+    char file[ARCHIVE_PATH_MAX + 256];
+    while (dir != NULL && (entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] != '.') {
+            snprintf(file, sizeof(file), "%s/%s", path, entry->d_name);
+            unlink(file);
+        }
+    }
+    if (dir != NULL) {
+        closedir(dir);
+    }
+    rmdir(path);
+}
+
+static void bench_archive(void) {
+    char name[64], read_name[64], screen_name[64];
+
+    for (int f = 0; f < ARCHIVE_FORMAT_COUNT; f++) {
+        snprintf(name, sizeof(name), "archive/%s/%d",
+                 archive_format_name(f), BENCH_ARCHIVE_BINS);
+        snprintf(read_name, sizeof(read_name), "archive/read/%s/%d",
+                 archive_format_name(f), BENCH_ARCHIVE_BINS);
+        snprintf(screen_name, sizeof(screen_name), "archive/screen/%s/",
+                 archive_format_name(f));
+        if (!selected(name) && !selected(read_name) &&
+            !selected(screen_name)) {
+            continue;
+        }
+        char dir[] = "/tmp/dbsdr_bench.XXXXXX";
+        archive_bench_t b = {NULL, NULL, NULL, 0,
+                             malloc(DSP_LINE_BYTES(BENCH_ARCHIVE_BINS)),
+                             malloc(BENCH_ARCHIVE_BINS * sizeof(float)), 0};
+        if (mkdtemp(dir) == NULL || b.line == NULL || b.db == NULL ||
+            (b.archive = archive_open(dir, f, BENCH_ARCHIVE_BINS)) == NULL) {
+            fprintf(stderr, "Could not set up %s\n", name);
+            exit(-1);
+        }
+        // written here rather than by the writer thread
+        archive_stop(b.archive);
+        b.line->tag = (dsp_tag_t){0, 100000000, 0};
+        b.line->span = 20e6f;
+        b.line->rbw = 20e6f / BENCH_ARCHIVE_BINS;
+        b.line->n_bins = BENCH_ARCHIVE_BINS;
+        for (int i = 0; i < BENCH_ARCHIVE_BINS; i++) {
+            b.line->bins[i] = -120.0f + (float)(xorshift() >> 40) * 0x1p-18f;
+        }
+        // the same history to draw whatever else is selected
+        archive_bench_write(&b, BENCH_ARCHIVE_LINES);
+        b.reader = archive_reader_open(dir);
+        b.pyramid = pyramid_reader_open(dir);
+        if (b.reader == NULL || b.pyramid == NULL) {
+            exit(-1);
+        }
+        for (int p = 0; p < 2; p++) {
+            snprintf(screen_name, sizeof(screen_name),
+                     "archive/screen/%s/%s", archive_format_name(f),
+                     p ? "pyramid" : "archive");
+            b.level = p ? pyramid_pick_level(
+                                  b.pyramid,
+                                  BENCH_ARCHIVE_LINES / BENCH_SCREEN_HEIGHT,
+                                  1.0, BENCH_SCREEN_WIDTH)
+                        : 0;
+            run(screen_name, "archive", BENCH_ARCHIVE_LINES, 1,
+                BENCH_SCREEN_HEIGHT, "rows", archive_bench_screen, NULL, &b);
+        }
+        run(name, "archive", BENCH_ARCHIVE_BINS, 1, 1.0, "lines",
+            archive_bench_write, NULL, &b);
+        if (selected(name)) {
+            fprintf(stderr, "%-32s %.0fx the %.0f lines/s needed\n", name,
+                    1e9 / results[n_results - 1].ns_median /
+                            BENCH_ARCHIVE_LINE_RATE,
+                    BENCH_ARCHIVE_LINE_RATE);
+        }
+        archive_reader_refresh(b.reader);
+        run(read_name, "archive", BENCH_ARCHIVE_BINS, 1, 1.0, "lines",
+            archive_bench_read, NULL, &b);
+        archive_reader_close(b.reader);
+        pyramid_reader_close(b.pyramid);
+        archive_close(b.archive);
+        remove_dir(dir);
+        free(b.line);
+        free(b.db);
+    }
+}
+
+static void usage(const char *name) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -f, --format FMT      json or csv (default: json)\n"
+            "  -o, --output FILE     write results to FILE (default: "
+            "stdout)\n"
+            "  -F, --filter TEXT     only run benchmarks whose name contains "
+            "TEXT\n"
+            "  -r, --repetitions N   timed repetitions per benchmark "
+            "(default: 15)\n"
+            "  -t, --min-time MS     minimum time per repetition (default: "
+            "20)\n"
+            "      --max-fft N       largest fft size (default: 1048576)\n"
+            "  -w, --workers N       largest dsp worker count (default: "
+            "cores)\n"
+            "  -h, --help            show this help\n"
+            "Benchmarks: fft/N window/N log_power/N fft_execute/N\n"
+            "            kernels/ISA/{load,log_power,accumulate_power,"
+            "power_to_db}/N\n"
+            "            queue/{spsc,mpscP}/SLOT workers/N\n"
+            "            binning/{max,mean,min,half}/BINS/WIDTH\n"
+            "            ddc/{10,100,1000} channels/{pfb,ddc}/512/N\n"
+            "            archive/{,read/}{u8,u16}/8192 "
+            "archive/screen/{u8,u16}/{archive,pyramid}\n",
+            name);
+}
+
+static bool parse_options(int argc, char **argv) {
+    enum { OPT_MAX_FFT = 256 };
+    static const struct option long_options[] = {
+            {"format", required_argument, NULL, 'f'},
+            {"output", required_argument, NULL, 'o'},
+            {"filter", required_argument, NULL, 'F'},
+            {"repetitions", required_argument, NULL, 'r'},
+            {"min-time", required_argument, NULL, 't'},
+            {"max-fft", required_argument, NULL, OPT_MAX_FFT},
+            {"workers", required_argument, NULL, 'w'},
+            {"help", no_argument, NULL, 'h'},
+            {NULL, 0, NULL, 0},
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "f:o:F:r:t:w:h", long_options,
+                              NULL)) != -1) {
+        switch (opt) {
+        case 'f':
+            options.format = optarg;
+            if (strcmp(optarg, "json") != 0 && strcmp(optarg, "csv") != 0) {
+                fprintf(stderr, "Unknown format: %s\n", optarg);
+                return false;
+            }
+            break;
+        case 'o':
+            options.output = optarg;
+            break;
+        case 'F':
+            options.filter = optarg;
+            break;
+        case 'r':
+            options.repetitions = atoi(optarg);
+            if (options.repetitions < 1) {
+                fprintf(stderr, "Invalid repetitions: %s\n", optarg);
+                return false;
+            }
+            break;
+        case 't':
+            options.min_time_ns = atof(optarg) * 1e6;
+            break;
+        case OPT_MAX_FFT:
+            options.max_fft = strtoul(optarg, NULL, 0);
+            break;
+        case 'w':
+            options.max_workers = atoi(optarg);
+            break;
+        case 'h':
+            usage(argv[0]);
+            exit(0);
+        default:
+            usage(argv[0]);
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    if (!parse_options(argc, argv)) {
+        return -1;
+    }
+
+    FILE *out = stdout;
+    if (options.output != NULL && (out = fopen(options.output, "w")) == NULL) {
+        perror(options.output);
+        return -1;
+    }
+
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cores < 1) {
+        cores = 1;
+    }
+    char host[256] = "unknown";
+    gethostname(host, sizeof(host) - 1);
+    char date[32];
+    time_t t = time(NULL);
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", gmtime(&t));
+
+    bench_fft();
+    bench_kernels();
+    bench_binning();
+    bench_ddc();
+    bench_channels();
+    bench_demod();
+    bench_archive();
+    bench_queue((int)cores);
+    bench_workers((int)cores);
+    fft_cleanup();
+
+    if (strcmp(options.format, "csv") == 0) {
+        write_csv(out);
+    } else {
+        write_json(out, date, host, (int)cores);
+    }
+    if (out != stdout) {
+        fclose(out);
+    }
+
+    return 0;
+}
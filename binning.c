@@ -0,0 +1,122 @@
+//
+// Created by dbrent on 3/17/21.
+//
+
+#include "binning.h"
+#include "kernels.h"
+
+#include <math.h>
+#include <string.h>
+
+#define DB_PER_LOG2 3.01029996f // 10 * log10(2)
+
+static const char *reducer_names[BINNING_REDUCER_COUNT] = {
+        "max",
+        "mean",
+        "min",
+};
+
+const char *binning_reducer_name(binning_reducer_t reducer) {
+    return (unsigned)reducer < BINNING_REDUCER_COUNT ? reducer_names[reducer]
+                                                     : "unknown";
+}
+
+uint16_t float_to_half(float f) {
+    uint32_t x;
+    memcpy(&x, &f, sizeof(x));
+    uint16_t sign = (x >> 16) & 0x8000;
+    int32_t exp = (int32_t)((x >> 23) & 0xff) - 127 + 15;
+    uint32_t mantissa = x & 0x7fffff;
+    if (exp <= 0) {
+        return sign;
+    }
+    if (exp >= 31) {
+        return sign | 0x7c00;
+    }
+    return sign | (uint16_t)(exp << 10) | (uint16_t)(mantissa >> 13);
+}
+
+void binning_mean_half(const float *line, size_t n_bins, uint16_t *pixels,
+                       int width) {
+    unsigned int points_per_pixel = n_bins / width;
+    if (points_per_pixel == 0) {
+        // fewer bins than pixels, stretch
+        for (int j = 0; j < width; j++) {
+            pixels[j] = float_to_half(line[(size_t)j * n_bins / width]);
+        }
+        return;
+    }
+    // one line/row of pixels
+    for (int j = 0; j < width; j++) {
+        float sum = 0;
+        for (unsigned int k = 0; k < points_per_pixel; k++) {
+            sum += line[j * points_per_pixel + k];
+        }
+        sum /= (float)points_per_pixel;
+        pixels[j] = float_to_half(sum);
+    }
+}
+
+// max, min, or the power sum for the mean
+static float reduce(const kernels_t *k, const float *bins, size_t n,
+                    binning_reducer_t reducer) {
+    switch (reducer) {
+    case BINNING_MEAN:
+        return k->db_power_sum(bins, n);
+    case BINNING_MIN:
+        return k->min(bins, n);
+    default:
+        return k->max(bins, n);
+    }
+}
+
+void binning_reduce(const float *line, size_t n_bins, size_t rotate,
+                    double start, double end, binning_reducer_t reducer,
+                    float *row, int width) {
+    const kernels_t *k = kernels_get();
+    const double step = (end - start) / width;
+    rotate %= n_bins;
+
+    for (int j = 0; j < width; j++) {
+        double lo = start + j * step;
+        size_t first = (size_t)(step < 1.0 ? lo + 0.5 * step : lo);
+        if (first >= n_bins) {
+            first = n_bins - 1;
+        }
+        size_t count = 1;
+        if (step >= 1.0) {
+            // rounded up, less a hair so rounding can't drag in the next
+            // bin
+            double hi = lo + step - 1e-9;
+            size_t last = (size_t)hi;
+            last += (double)last < hi;
+            if (last > n_bins) {
+                last = n_bins;
+            }
+            count = last > first ? last - first : 1;
+        }
+
+        // the span can wrap around the end of the line
+        size_t pos = first + rotate;
+        pos -= pos >= n_bins ? n_bins : 0;
+        size_t run = count < n_bins - pos ? count : n_bins - pos;
+        float v = reduce(k, line + pos, run, reducer);
+        if (run < count) {
+            float rest = reduce(k, line, count - run, reducer);
+            switch (reducer) {
+            case BINNING_MEAN:
+                v += rest;
+                break;
+            case BINNING_MIN:
+                v = fminf(v, rest);
+                break;
+            default:
+                v = fmaxf(v, rest);
+                break;
+            }
+        }
+        row[j] = reducer == BINNING_MEAN
+                         ? kernels_fast_log2(v / (float)count) * DB_PER_LOG2
+                         : v;
+    }
+}
@@ -0,0 +1,40 @@
+//
+// Created by dbrent on 3/17/21.
+//
+
+#ifndef DBSDR_BINNING_H
+#define DBSDR_BINNING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum binning_reducer {
+    BINNING_MAX, // narrow carriers survive any zoom level
+    BINNING_MEAN, // of the power, not of the dB values
+    BINNING_MIN,
+    BINNING_REDUCER_COUNT,
+} binning_reducer_t;
+
+const char *binning_reducer_name(binning_reducer_t reducer);
+
+// Truncating float -> IEEE half. dB values never need half denormals, and
+// -inf (log of an empty bin) stays -inf.
+uint16_t float_to_half(float f);
+
+// Average n_bins dB values down to width half float pixels, n_bins / width
+// bins per pixel, or stretched when there are fewer bins than pixels. No GL
+// in here, the output is usually mapped PBO memory.
+void binning_mean_half(const float *line, size_t n_bins, uint16_t *pixels,
+                       int width);
+
+// Reduce the bins between start and end (0 <= start < end <= n_bins, not
+// necessarily whole) of a dB line to width values. Each pixel takes every
+// bin it overlaps, so the ratio needn't be an integer and a bin on a pixel
+// boundary counts towards both, or the nearest bin when pixels are narrower
+// than bins. Bin i is read from line[(i + rotate) % n_bins], rotate n_bins / 2
+// puts dc of an FFT line in the middle.
+void binning_reduce(const float *line, size_t n_bins, size_t rotate,
+                    double start, double end, binning_reducer_t reducer,
+                    float *row, int width);
+
+#endif //DBSDR_BINNING_H
@@ -0,0 +1,342 @@
+//
+// Created by dbrent on 3/7/21.
+//
+
+#include "config.h"
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+enum long_only_options {
+    OPT_FAST = 256,
+    OPT_LOOP,
+    OPT_SEED,
+    OPT_MAX_FFT_SIZE,
+    OPT_WISDOM,
+    OPT_LINE_RATE,
+    OPT_REDUCER,
+    OPT_SWEEP,
+    OPT_DEMOD,
+    OPT_LISTEN,
+    OPT_AUDIO,
+    OPT_DEEMPHASIS,
+    OPT_ZOOM,
+    OPT_ZOOM_FFT_SIZE,
+    OPT_ARCHIVE,
+    OPT_ARCHIVE_FORMAT,
+};
+
+static void usage(const char *name) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -w, --workers N   FFT worker threads (default: cores - 1)\n"
+            "  -f, --fft-size N  FFT points, a power of two from %d to %d "
+            "(default: %d)\n"
+            "      --max-fft-size N\n"
+            "                    largest FFT size to switch to while running "
+            "(default: %d)\n"
+            "  -W, --window NAME hann, blackman-harris, flat-top or kaiser "
+            "(default: hann)\n"
+            "  -o, --overlap PCT overlap between FFTs, 0 to 90 (default: "
+            "0)\n"
+            "      --line-rate N average FFTs down to about N lines per "
+            "second,\n"
+            "                    0 for a line per FFT (default: %.0f)\n"
+            "      --reducer NAME\n"
+            "                    bins to a pixel by max, mean (of the power) "
+            "or min\n"
+            "                    (default: max)\n"
+            "      --wisdom FILE FFTW wisdom to load and update (default: "
+            "per host,\n"
+            "                    under ~/.cache/dbsdr)\n"
+            "  -s, --source NAME hackrf, file or synthetic (default: hackrf)\n"
+            "  -i, --input FILE  int8 IQ file for the file source\n"
+            "  -d, --device N    HackRF index when several are attached\n"
+            "      --fast        don't pace file/synthetic sources in real "
+            "time\n"
+            "      --loop        restart the input file when it ends\n"
+            "      --seed N      synthetic source noise seed\n"
+            "  -r, --record BASE record raw IQ to BASE.sigmf-data/-meta\n"
+            "      --sweep START:END\n"
+            "                    sweep START to END MHz into one panorama "
+            "line per\n"
+            "                    sweep, FFT size up to %d\n"
+            "      --demod MODE  listen with wfm, nfm, am, usb or lsb\n"
+            "      --listen HZ   frequency to demodulate (default: the "
+            "tuning)\n"
+            "      --audio SINK  pulse, alsa[:DEVICE], - for stdout, "
+            "FILE.wav, or a\n"
+            "                    file or FIFO for raw s16le (default: the "
+            "sound\n"
+            "                    device), %d Hz mono\n"
+            "      --deemphasis US\n"
+            "                    WFM de-emphasis time constant (default: "
+            "%.0f)\n"
+            "      --zoom HZ     zoom FFT of HZ around the middle of the view, "
+            "in its\n"
+            "                    own waterfall\n"
+            "      --zoom-fft-size N\n"
+            "                    zoom FFT points, a power of two up to %d "
+            "(default: %d)\n"
+            "      --archive DIR keep every spectrum line in DIR, for "
+            "scrolling back\n"
+            "      --archive-format u8|u16\n"
+            "                    0.5 dB or 1/256 dB steps per bin (default: "
+            "u8)\n"
+            "  -h, --help        show this help\n",
+            name, FFT_MIN_SIZE, FFT_MAX_SIZE, DEFAULT_FFT_SIZE,
+            DEFAULT_MAX_FFT_SIZE, DEFAULT_LINE_RATE, SWEEP_MAX_FFT_SIZE,
+            DEMOD_AUDIO_RATE, DEMOD_DEEMPHASIS * 1e6, ZOOM_MAX_FFT_SIZE,
+            ZOOM_DEFAULT_FFT_SIZE);
+}
+
+static bool valid_fft_size(size_t size) {
+    return size >= FFT_MIN_SIZE && size <= FFT_MAX_SIZE &&
+           (size & (size - 1)) == 0;
+}
+
+void config_defaults(config_t *config) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    config->workers = cores > 1 ? (int)cores - 1 : 1;
+    config->fft_size = DEFAULT_FFT_SIZE;
+    config->max_fft_size = DEFAULT_MAX_FFT_SIZE;
+    config->window = FFT_WINDOW_HANN;
+    config->overlap = 0.0f;
+    config->line_rate = DEFAULT_LINE_RATE;
+    config->reducer = BINNING_MAX;
+    config->wisdom = NULL;
+    config->record = NULL;
+    config->sweep_start = 0;
+    config->sweep_end = 0;
+    config->demod = DEMOD_MODE_COUNT;
+    config->listen = 0;
+    config->audio = NULL;
+    config->deemphasis = 0.0;
+    config->zoom_span = 0.0;
+    config->zoom_fft_size = ZOOM_DEFAULT_FFT_SIZE;
+    config->archive = NULL;
+    config->archive_format = ARCHIVE_U8;
+    config->source.type = "hackrf";
+    config->source.path = NULL;
+    config->source.device_index = 0;
+    config->source.throttle = true;
+    config->source.loop = false;
+    config->source.seed = 1;
+}
+
+bool config_parse(config_t *config, int argc, char **argv) {
+    static const struct option options[] = {
+            {"workers", required_argument, NULL, 'w'},
+            {"fft-size", required_argument, NULL, 'f'},
+            {"max-fft-size", required_argument, NULL, OPT_MAX_FFT_SIZE},
+            {"window", required_argument, NULL, 'W'},
+            {"overlap", required_argument, NULL, 'o'},
+            {"line-rate", required_argument, NULL, OPT_LINE_RATE},
+            {"reducer", required_argument, NULL, OPT_REDUCER},
+            {"wisdom", required_argument, NULL, OPT_WISDOM},
+            {"source", required_argument, NULL, 's'},
+            {"input", required_argument, NULL, 'i'},
+            {"device", required_argument, NULL, 'd'},
+            {"fast", no_argument, NULL, OPT_FAST},
+            {"loop", no_argument, NULL, OPT_LOOP},
+            {"seed", required_argument, NULL, OPT_SEED},
+            {"record", required_argument, NULL, 'r'},
+            {"sweep", required_argument, NULL, OPT_SWEEP},
+            {"demod", required_argument, NULL, OPT_DEMOD},
+            {"listen", required_argument, NULL, OPT_LISTEN},
+            {"audio", required_argument, NULL, OPT_AUDIO},
+            {"deemphasis", required_argument, NULL, OPT_DEEMPHASIS},
+            {"zoom", required_argument, NULL, OPT_ZOOM},
+            {"zoom-fft-size", required_argument, NULL, OPT_ZOOM_FFT_SIZE},
+            {"archive", required_argument, NULL, OPT_ARCHIVE},
+            {"archive-format", required_argument, NULL, OPT_ARCHIVE_FORMAT},
+            {"help", no_argument, NULL, 'h'},
+            {NULL, 0, NULL, 0},
+    };
+
+    const char *short_options = "w:f:W:o:s:i:d:r:h";
+    int opt;
+    while ((opt = getopt_long(argc, argv, short_options, options, NULL)) !=
+           -1) {
+        switch (opt) {
+        case 'w':
+            config->workers = atoi(optarg);
+            if (config->workers < 1) {
+                fprintf(stderr, "Invalid worker count: %s\n", optarg);
+                return false;
+            }
+            break;
+        case 'f':
+            config->fft_size = strtoul(optarg, NULL, 0);
+            if (!valid_fft_size(config->fft_size)) {
+                fprintf(stderr, "Invalid FFT size: %s\n", optarg);
+                return false;
+            }
+            break;
+        case OPT_MAX_FFT_SIZE:
+            config->max_fft_size = strtoul(optarg, NULL, 0);
+            if (!valid_fft_size(config->max_fft_size)) {
+                fprintf(stderr, "Invalid FFT size: %s\n", optarg);
+                return false;
+            }
+            break;
+        case 'W':
+            config->window = FFT_WINDOW_COUNT;
+            for (int w = 0; w < FFT_WINDOW_COUNT; w++) {
+                if (strcmp(optarg, fft_window_name(w)) == 0) {
+                    config->window = w;
+                }
+            }
+            if (config->window == FFT_WINDOW_COUNT) {
+                fprintf(stderr, "Unknown window: %s\n", optarg);
+                return false;
+            }
+            break;
+        case 'o':
+            config->overlap = strtof(optarg, NULL) / 100.0f;
+            if (config->overlap < 0.0f || config->overlap > 0.9f) {
+                fprintf(stderr, "Invalid overlap: %s\n", optarg);
+                return false;
+            }
+            break;
+        case OPT_LINE_RATE:
+            config->line_rate = strtod(optarg, NULL);
+            if (config->line_rate < 0.0) {
+                fprintf(stderr, "Invalid line rate: %s\n", optarg);
+                return false;
+            }
+            break;
+        case OPT_REDUCER:
+            config->reducer = BINNING_REDUCER_COUNT;
+            for (int r = 0; r < BINNING_REDUCER_COUNT; r++) {
+                if (strcmp(optarg, binning_reducer_name(r)) == 0) {
+                    config->reducer = r;
+                }
+            }
+            if (config->reducer == BINNING_REDUCER_COUNT) {
+                fprintf(stderr, "Unknown reducer: %s\n", optarg);
+                return false;
+            }
+            break;
+        case OPT_WISDOM:
+            config->wisdom = optarg;
+            break;
+        case 's':
+            config->source.type = optarg;
+            break;
+        case 'i':
+            config->source.path = optarg;
+            if (strcmp(config->source.type, "hackrf") == 0) {
+                config->source.type = "file";
+            }
+            break;
+        case 'd':
+            config->source.device_index = atoi(optarg);
+            break;
+        case OPT_FAST:
+            config->source.throttle = false;
+            break;
+        case OPT_LOOP:
+            config->source.loop = true;
+            break;
+        case OPT_SEED:
+            config->source.seed = strtoull(optarg, NULL, 0);
+            break;
+        case 'r':
+            config->record = optarg;
+            break;
+        case OPT_SWEEP:
+            if (sscanf(optarg, "%u:%u", &config->sweep_start,
+                       &config->sweep_end) != 2 ||
+                config->sweep_start >= config->sweep_end ||
+                config->sweep_end > SWEEP_MAX_MHZ) {
+                fprintf(stderr, "Invalid sweep range: %s\n", optarg);
+                return false;
+            }
+            break;
+        case OPT_DEMOD:
+            config->demod = DEMOD_MODE_COUNT;
+            for (int m = 0; m < DEMOD_MODE_COUNT; m++) {
+                if (strcmp(optarg, demod_mode_name(m)) == 0) {
+                    config->demod = m;
+                }
+            }
+            if (config->demod == DEMOD_MODE_COUNT) {
+                fprintf(stderr, "Unknown demodulator: %s\n", optarg);
+                return false;
+            }
+            break;
+        case OPT_LISTEN:
+            config->listen = (uint64_t)strtod(optarg, NULL);
+            if (config->listen == 0) {
+                fprintf(stderr, "Invalid frequency: %s\n", optarg);
+                return false;
+            }
+            break;
+        case OPT_AUDIO:
+            config->audio = optarg;
+            break;
+        case OPT_DEEMPHASIS:
+            config->deemphasis = strtod(optarg, NULL) * 1e-6;
+            if (config->deemphasis <= 0.0) {
+                fprintf(stderr, "Invalid de-emphasis: %s\n", optarg);
+                return false;
+            }
+            break;
+        case OPT_ZOOM:
+            config->zoom_span = strtod(optarg, NULL);
+            if (config->zoom_span <= 0.0) {
+                fprintf(stderr, "Invalid zoom span: %s\n", optarg);
+                return false;
+            }
+            break;
+        case OPT_ZOOM_FFT_SIZE:
+            config->zoom_fft_size = strtoul(optarg, NULL, 0);
+            if (!valid_fft_size(config->zoom_fft_size) ||
+                config->zoom_fft_size > ZOOM_MAX_FFT_SIZE) {
+                fprintf(stderr, "Invalid FFT size: %s\n", optarg);
+                return false;
+            }
+            break;
+        case OPT_ARCHIVE:
+            config->archive = optarg;
+            break;
+        case OPT_ARCHIVE_FORMAT:
+            config->archive_format = ARCHIVE_FORMAT_COUNT;
+            for (int f = 0; f < ARCHIVE_FORMAT_COUNT; f++) {
+                if (strcmp(optarg, archive_format_name(f)) == 0) {
+                    config->archive_format = f;
+                }
+            }
+            if (config->archive_format == ARCHIVE_FORMAT_COUNT) {
+                fprintf(stderr, "Unknown archive format: %s\n", optarg);
+                return false;
+            }
+            break;
+        case 'h':
+        default:
+            usage(argv[0]);
+            return false;
+        }
+    }
+    if (config->max_fft_size < config->fft_size) {
+        config->max_fft_size = config->fft_size;
+    }
+    if (config->sweep_end != 0 && config->record != NULL) {
+        fprintf(stderr, "Can't record while sweeping\n");
+        return false;
+    }
+    if (config->sweep_end != 0 && config->demod != DEMOD_MODE_COUNT) {
+        fprintf(stderr, "Can't demodulate while sweeping\n");
+        return false;
+    }
+    if (config->sweep_end != 0 && config->zoom_span > 0.0) {
+        fprintf(stderr, "Can't zoom while sweeping\n");
+        return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,50 @@
+//
+// Created by dbrent on 3/7/21.
+//
+
+#ifndef DBSDR_CONFIG_H
+#define DBSDR_CONFIG_H
+
+#include "archive.h"
+#include "binning.h"
+#include "demod.h"
+#include "fft.h"
+#include "source.h"
+#include "sweep.h"
+#include "zoom.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define DEFAULT_FFT_SIZE 8192
+#define DEFAULT_MAX_FFT_SIZE 65536
+#define DEFAULT_LINE_RATE 60.0
+
+typedef struct config {
+    int workers;
+    size_t fft_size;     // power of two
+    size_t max_fft_size; // largest size it can be switched to at runtime
+    fft_window_t window;
+    float overlap; // fraction of each FFT shared with the next
+    double line_rate;   // waterfall lines per second, 0 for every FFT
+    binning_reducer_t reducer; // bins -> pixels
+    const char *wisdom; // FFTW wisdom file, NULL for the per host default
+    const char *record; // SigMF base name, NULL when not recording
+    uint32_t sweep_start; // MHz, sweep_end 0 to watch one tuning
+    uint32_t sweep_end;
+    demod_mode_t demod; // DEMOD_MODE_COUNT when not listening
+    uint64_t listen;    // Hz, 0 for the tuned frequency
+    const char *audio;  // audio_open() output, NULL for the sound device
+    double deemphasis;  // s, 0 for DEMOD_DEEMPHASIS
+    double zoom_span;   // Hz, 0 for no zoom FFT
+    size_t zoom_fft_size;
+    const char *archive; // directory, NULL when not archiving
+    archive_format_t archive_format;
+    source_config_t source;
+} config_t;
+
+void config_defaults(config_t *config);
+
+bool config_parse(config_t *config, int argc, char **argv);
+
+#endif //DBSDR_CONFIG_H
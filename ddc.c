@@ -0,0 +1,382 @@
+//
+// Created by dbrent on 3/24/21.
+//
+
+#include "ddc.h"
+#include "fft.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PI 3.14159265358979
+
+// Kaiser design rules for DDC_ATTENUATION dB
+static double kaiser_beta(void) { return 0.1102 * (DDC_ATTENUATION - 8.7); }
+
+size_t ddc_lowpass_length(double transition) {
+    return (size_t)ceil((DDC_ATTENUATION - 7.95) / (14.36 * transition)) + 1;
+}
+
+void ddc_lowpass(float *taps, size_t n_taps, double cutoff, double gain) {
+    double beta = kaiser_beta();
+    double centre = (double)(n_taps - 1) / 2.0;
+    double sum = 0.0;
+    for (size_t k = 0; k < n_taps; k++) {
+        double x = (double)k - centre;
+        double h = x == 0.0 ? 2.0 * cutoff
+                            : sin(2.0 * PI * cutoff * x) / (PI * x);
+        h *= fft_kaiser(beta, x / centre);
+        taps[k] = (float)h;
+        sum += h;
+    }
+    for (size_t k = 0; k < n_taps; k++) {
+        taps[k] = (float)(taps[k] * gain / sum);
+    }
+}
+
+static float *alloc_floats(size_t n) { return calloc(n, sizeof(float)); }
+
+// Half-band for an input at rate, passing [-pass, pass] with its alias
+// (around rate / 2) stopped.
+static bool halfband_init(ddc_halfband_t *hb, double rate, double pass) {
+    double transition = 0.5 - 2.0 * pass / rate;
+    size_t n = ddc_lowpass_length(transition);
+    hb->m = (uint32_t)((n + 4) / 4); // 4m - 1 >= n
+    size_t history = 2 * hb->m + 1;
+    size_t len = history + DDC_CHUNK / 2 + 1;
+    hb->taps = alloc_floats(hb->m);
+    hb->even_re = alloc_floats(len);
+    hb->even_im = alloc_floats(len);
+    hb->odd_re = alloc_floats(len);
+    hb->odd_im = alloc_floats(len);
+    hb->pending = false;
+    if (hb->taps == NULL || hb->even_re == NULL || hb->even_im == NULL ||
+        hb->odd_re == NULL || hb->odd_im == NULL) {
+        return false;
+    }
+
+    // odd distances d from the centre, out to 2m - 1 at the window's
+    // edges, scaled so the taps sum to 1 with the 0.5 centre
+    double beta = kaiser_beta();
+    double half = 2.0 * hb->m - 1.0;
+    double sum = 0.0;
+    for (uint32_t t = 0; t < hb->m; t++) {
+        double d = 2.0 * t + 1.0;
+        double h = sin(PI * d / 2.0) / (PI * d) * fft_kaiser(beta, d / half);
+        hb->taps[t] = (float)h;
+        sum += 2.0 * h;
+    }
+    for (uint32_t t = 0; t < hb->m; t++) {
+        hb->taps[t] = (float)(hb->taps[t] * 0.5 / sum);
+    }
+    return true;
+}
+
+static void halfband_destroy(ddc_halfband_t *hb) {
+    free(hb->taps);
+    free(hb->even_re);
+    free(hb->even_im);
+    free(hb->odd_re);
+    free(hb->odd_im);
+}
+
+// n samples in, about n / 2 out. out may not alias in.
+static size_t halfband_process(ddc_halfband_t *hb, const float *in_re,
+                               const float *in_im, size_t n, float *out_re,
+                               float *out_im) {
+    const size_t m = hb->m;
+    const size_t history = 2 * m + 1;
+    float *even_re = hb->even_re;
+    float *even_im = hb->even_im;
+    float *odd_re = hb->odd_re;
+    float *odd_im = hb->odd_im;
+
+    // split into phases behind the history
+    size_t w = 0;
+    size_t i = 0;
+    if (hb->pending && n > 0) {
+        even_re[history] = hb->pending_re;
+        even_im[history] = hb->pending_im;
+        odd_re[history] = in_re[0];
+        odd_im[history] = in_im[0];
+        w = 1;
+        i = 1;
+    }
+    for (; i + 1 < n; i += 2, w++) {
+        even_re[history + w] = in_re[i];
+        even_im[history + w] = in_im[i];
+        odd_re[history + w] = in_re[i + 1];
+        odd_im[history + w] = in_im[i + 1];
+    }
+    hb->pending = i < n;
+    if (hb->pending) {
+        hb->pending_re = in_re[i];
+        hb->pending_im = in_im[i];
+    }
+
+    // y[j] = x[2j + 2m + 1] / 2 + sum g_t (x[2j + 2m - 2t] + x[2j + 2m + 2 +
+    // 2t]), every term unit stride in j
+#pragma omp simd
+    for (size_t j = 0; j < w; j++) {
+        out_re[j] = 0.5f * odd_re[j + m];
+        out_im[j] = 0.5f * odd_im[j + m];
+    }
+    for (size_t t = 0; t < m; t++) {
+        const float g = hb->taps[t];
+        const float *lo_re = even_re + m - t;
+        const float *lo_im = even_im + m - t;
+        const float *hi_re = even_re + m + 1 + t;
+        const float *hi_im = even_im + m + 1 + t;
+#pragma omp simd
+        for (size_t j = 0; j < w; j++) {
+            out_re[j] += g * (lo_re[j] + hi_re[j]);
+            out_im[j] += g * (lo_im[j] + hi_im[j]);
+        }
+    }
+
+    memmove(even_re, even_re + w, history * sizeof(float));
+    memmove(even_im, even_im + w, history * sizeof(float));
+    memmove(odd_re, odd_re + w, history * sizeof(float));
+    memmove(odd_im, odd_im + w, history * sizeof(float));
+    return w;
+}
+
+// Final stage for an input at rate, decimating by r and passing [-pass,
+// pass] with everything that would alias onto it stopped.
+static bool fir_init(ddc_fir_t *fir, double rate, uint32_t r, double pass) {
+    fir->decimation = r;
+    double out_rate = rate / r;
+    double stop = out_rate - pass;
+    fir->n_taps = r > 1 ? ddc_lowpass_length((stop - pass) / rate) | 1 : 1;
+    fir->capacity = fir->n_taps + DDC_CHUNK;
+    fir->taps = alloc_floats(fir->n_taps);
+    fir->re = alloc_floats(fir->capacity);
+    fir->im = alloc_floats(fir->capacity);
+    fir->fill = fir->n_taps - 1; // starts on zeros
+    fir->next = 0;
+    if (fir->taps == NULL || fir->re == NULL || fir->im == NULL) {
+        return false;
+    }
+    if (fir->n_taps == 1) {
+        fir->taps[0] = 1.0f;
+        return true;
+    }
+    ddc_lowpass(fir->taps, fir->n_taps, (pass + stop) / 2.0 / rate, 1.0);
+    return true;
+}
+
+static void fir_destroy(ddc_fir_t *fir) {
+    free(fir->taps);
+    free(fir->re);
+    free(fir->im);
+}
+
+// n <= DDC_CHUNK samples in, interleaved complex out.
+static size_t fir_process(ddc_fir_t *fir, const float *in_re,
+                          const float *in_im, size_t n, float *out) {
+    if (fir->fill + n > fir->capacity) {
+        size_t drop = fir->next < fir->fill ? fir->next : fir->fill;
+        memmove(fir->re, fir->re + drop, (fir->fill - drop) * sizeof(float));
+        memmove(fir->im, fir->im + drop, (fir->fill - drop) * sizeof(float));
+        fir->fill -= drop;
+        fir->next -= drop;
+    }
+    memcpy(fir->re + fir->fill, in_re, n * sizeof(float));
+    memcpy(fir->im + fir->fill, in_im, n * sizeof(float));
+    fir->fill += n;
+
+    const size_t n_taps = fir->n_taps;
+    const float *taps = fir->taps;
+    size_t produced = 0;
+    for (; fir->next + n_taps <= fir->fill; fir->next += fir->decimation) {
+        const float *re = fir->re + fir->next;
+        const float *im = fir->im + fir->next;
+        float acc_re = 0.0f;
+        float acc_im = 0.0f;
+#pragma omp simd reduction(+ : acc_re, acc_im)
+        for (size_t k = 0; k < n_taps; k++) {
+            acc_re += taps[k] * re[k];
+            acc_im += taps[k] * im[k];
+        }
+        out[2 * produced] = acc_re;
+        out[2 * produced + 1] = acc_im;
+        produced++;
+    }
+    return produced;
+}
+
+ddc_t *ddc_create(const ddc_config_t *config) {
+    if (config->decimation < 1 || config->decimation > DDC_MAX_DECIMATION ||
+        config->sample_rate <= 0.0 ||
+        fabs(config->offset) > config->sample_rate / 2) {
+        fprintf(stderr, "Invalid DDC: offset %.0f Hz, decimation %u\n",
+                config->offset, config->decimation);
+        return NULL;
+    }
+    ddc_t *ddc = calloc(1, sizeof(ddc_t));
+    if (ddc == NULL) {
+        return NULL;
+    }
+    ddc->sample_rate = config->sample_rate;
+    ddc->decimation = config->decimation;
+    ddc->output_rate = config->sample_rate / config->decimation;
+    ddc->bandwidth = config->bandwidth;
+    if (ddc->bandwidth <= 0.0) {
+        ddc->bandwidth = DDC_DEFAULT_BANDWIDTH * ddc->output_rate;
+    }
+    if (ddc->bandwidth > DDC_MAX_BANDWIDTH * ddc->output_rate) {
+        ddc->bandwidth = DDC_MAX_BANDWIDTH * ddc->output_rate;
+    }
+    double pass = ddc->bandwidth / 2.0;
+
+    // every factor of two as a half-band, the rest in the final FIR
+    uint32_t r = config->decimation;
+    double rate = config->sample_rate;
+    bool ok = true;
+    while (r % 2 == 0) {
+        ok &= halfband_init(&ddc->halfbands[ddc->n_halfbands++], rate, pass);
+        rate /= 2.0;
+        r /= 2;
+    }
+    ok &= fir_init(&ddc->fir, rate, r, pass);
+    for (int i = 0; i < 2; i++) {
+        ddc->re[i] = alloc_floats(DDC_CHUNK);
+        ddc->im[i] = alloc_floats(DDC_CHUNK);
+        ok &= ddc->re[i] != NULL && ddc->im[i] != NULL;
+    }
+    if (!ok) {
+        fprintf(stderr, "Could not create DDC\n");
+        ddc_destroy(ddc);
+        return NULL;
+    }
+
+    ddc->nco_re[0] = 1.0f;
+    ddc_set_offset(ddc, config->offset);
+    return ddc;
+}
+
+void ddc_destroy(ddc_t *ddc) {
+    if (ddc == NULL) {
+        return;
+    }
+    for (int i = 0; i < ddc->n_halfbands; i++) {
+        halfband_destroy(&ddc->halfbands[i]);
+    }
+    fir_destroy(&ddc->fir);
+    for (int i = 0; i < 2; i++) {
+        free(ddc->re[i]);
+        free(ddc->im[i]);
+    }
+    free(ddc);
+}
+
+void ddc_set_offset(ddc_t *ddc, double offset) {
+    ddc->offset = offset;
+    double w = -2.0 * PI * offset / ddc->sample_rate;
+    // carry on from the phase of the next sample
+    double phase = atan2(ddc->nco_im[0], ddc->nco_re[0]);
+    for (int l = 0; l < DDC_NCO_LANES; l++) {
+        ddc->nco_re[l] = (float)cos(phase + w * l);
+        ddc->nco_im[l] = (float)sin(phase + w * l);
+    }
+    ddc->rot_re = (float)cos(w * DDC_NCO_LANES);
+    ddc->rot_im = (float)sin(w * DDC_NCO_LANES);
+}
+
+size_t ddc_max_output(const ddc_t *ddc, size_t n_samples) {
+    return n_samples / ddc->decimation + 1;
+}
+
+// int8 IQ times the NCO, DDC_NCO_LANES independent phasors per step so the
+// recursion vectorizes.
+static void mix(ddc_t *ddc, const int8_t *samples, size_t n, float *out_re,
+                float *out_im) {
+    float re[DDC_NCO_LANES], im[DDC_NCO_LANES];
+    const float rot_re = ddc->rot_re;
+    const float rot_im = ddc->rot_im;
+    const float scale = 1.0f / 128.0f;
+    memcpy(re, ddc->nco_re, sizeof(re));
+    memcpy(im, ddc->nco_im, sizeof(im));
+
+    size_t i = 0;
+    for (; i + DDC_NCO_LANES <= n; i += DDC_NCO_LANES) {
+        for (int l = 0; l < DDC_NCO_LANES; l++) {
+            float x = samples[2 * (i + l)] * scale;
+            float y = samples[2 * (i + l) + 1] * scale;
+            out_re[i + l] = x * re[l] - y * im[l];
+            out_im[i + l] = x * im[l] + y * re[l];
+            float next_re = re[l] * rot_re - im[l] * rot_im;
+            im[l] = re[l] * rot_im + im[l] * rot_re;
+            re[l] = next_re;
+        }
+    }
+
+    // a short tail uses the first lanes, the rest move down to stay the
+    // next samples
+    size_t tail = n - i;
+    if (tail > 0) {
+        float next_re[DDC_NCO_LANES], next_im[DDC_NCO_LANES];
+        for (size_t l = 0; l < DDC_NCO_LANES; l++) {
+            if (l < tail) {
+                float x = samples[2 * (i + l)] * scale;
+                float y = samples[2 * (i + l) + 1] * scale;
+                out_re[i + l] = x * re[l] - y * im[l];
+                out_im[i + l] = x * im[l] + y * re[l];
+            }
+            size_t from = l + tail;
+            if (from < DDC_NCO_LANES) {
+                next_re[l] = re[from];
+                next_im[l] = im[from];
+            } else {
+                from -= DDC_NCO_LANES;
+                next_re[l] = re[from] * rot_re - im[from] * rot_im;
+                next_im[l] = re[from] * rot_im + im[from] * rot_re;
+            }
+        }
+        memcpy(re, next_re, sizeof(re));
+        memcpy(im, next_im, sizeof(im));
+    }
+
+    // keep the recursive phasors on the unit circle
+    for (int l = 0; l < DDC_NCO_LANES; l++) {
+        float mag = sqrtf(re[l] * re[l] + im[l] * im[l]);
+        ddc->nco_re[l] = re[l] / mag;
+        ddc->nco_im[l] = im[l] / mag;
+    }
+}
+
+size_t ddc_process(ddc_t *ddc, const int8_t *samples, size_t n_samples,
+                   float *out) {
+    size_t produced = 0;
+    for (size_t offset = 0; offset < n_samples; offset += DDC_CHUNK) {
+        size_t n = n_samples - offset;
+        if (n > DDC_CHUNK) {
+            n = DDC_CHUNK;
+        }
+        int cur = 0;
+        mix(ddc, samples + 2 * offset, n, ddc->re[cur], ddc->im[cur]);
+        for (int s = 0; s < ddc->n_halfbands; s++) {
+            n = halfband_process(&ddc->halfbands[s], ddc->re[cur],
+                                 ddc->im[cur], n, ddc->re[!cur],
+                                 ddc->im[!cur]);
+            cur = !cur;
+        }
+        produced += fir_process(&ddc->fir, ddc->re[cur], ddc->im[cur], n,
+                                out + 2 * produced);
+    }
+    return produced;
+}
+
+double ddc_cost(const ddc_t *ddc) {
+    // complex in, so two real multiply-adds per tap
+    double cost = 2.0; // the mix
+    double rate = 1.0;
+    for (int s = 0; s < ddc->n_halfbands; s++) {
+        rate /= 2.0;
+        cost += 2.0 * (ddc->halfbands[s].m + 1) * rate;
+    }
+    cost += 2.0 * ddc->fir.n_taps * rate / ddc->fir.decimation;
+    return cost;
+}
@@ -0,0 +1,110 @@
+//
+// Created by dbrent on 3/24/21.
+//
+
+#ifndef DBSDR_DDC_H
+#define DBSDR_DDC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define DDC_MAX_DECIMATION 1000
+#define DDC_MAX_HALFBANDS 10  // 2^10 > DDC_MAX_DECIMATION
+#define DDC_CHUNK 8192        // input samples per pass, keeps it in cache
+#define DDC_NCO_LANES 8       // consecutive samples mixed together
+#define DDC_ATTENUATION 80.0  // dB, stopband of every stage
+#define DDC_DEFAULT_BANDWIDTH 0.8 // of the output rate
+#define DDC_MAX_BANDWIDTH 0.9
+
+// Digital down-converter: a recursive complex NCO shifts offset Hz (within
+// +-sample_rate / 2) to dc, then decimation = 2^k * R comes from k half-band
+// stages and one polyphase FIR decimating by R. Every stage keeps aliases
+// out of [-bandwidth / 2, bandwidth / 2] at the output, and the last one
+// sets the channel edges. Filters are Kaiser windowed sinc, sized per stage
+// from the transition it needs, so early stages are short.
+typedef struct ddc_config {
+    double sample_rate;
+    double offset;
+    uint32_t decimation; // 1 - DDC_MAX_DECIMATION
+    double bandwidth;    // Hz, 0 for DDC_DEFAULT_BANDWIDTH of the output
+} ddc_config_t;
+
+// Decimate by 2 with 4m - 1 taps, every other one zero. Samples are split
+// into even and odd phases so each tap is one unit stride pass over the
+// outputs. Each phase keeps 2m + 1 samples of history in front.
+typedef struct ddc_halfband {
+    uint32_t m;
+    float *taps; // m taps either side of the 0.5 centre, nearest first
+    float *even_re;
+    float *even_im;
+    float *odd_re;
+    float *odd_im;
+    bool pending; // odd sample count so far, one waits for its pair
+    float pending_re;
+    float pending_im;
+} ddc_halfband_t;
+
+// Decimate by R, only computing the outputs that are kept. Input
+// accumulates in re / im and is shifted down only when it fills up.
+typedef struct ddc_fir {
+    uint32_t decimation;
+    size_t n_taps;
+    float *taps;
+    float *re;
+    float *im;
+    size_t capacity;
+    size_t fill;
+    size_t next; // start of the next output's window
+} ddc_fir_t;
+
+typedef struct ddc {
+    double sample_rate;
+    double output_rate;
+    double offset;
+    double bandwidth;
+    uint32_t decimation;
+
+    // NCO phasors of the next DDC_NCO_LANES samples, and the rotation by
+    // DDC_NCO_LANES samples
+    float nco_re[DDC_NCO_LANES];
+    float nco_im[DDC_NCO_LANES];
+    float rot_re;
+    float rot_im;
+
+    int n_halfbands;
+    ddc_halfband_t halfbands[DDC_MAX_HALFBANDS];
+    ddc_fir_t fir;
+
+    // ping-pong between stages, DDC_CHUNK each
+    float *re[2];
+    float *im[2];
+} ddc_t;
+
+ddc_t *ddc_create(const ddc_config_t *config);
+
+void ddc_destroy(ddc_t *ddc);
+
+// Move the channel, phase continuous, without flushing the filters.
+void ddc_set_offset(ddc_t *ddc, double offset);
+
+// Largest number of outputs n_samples of input can produce.
+size_t ddc_max_output(const ddc_t *ddc, size_t n_samples);
+
+// Interleaved int8 IQ in, interleaved complex float out (full scale 1.0).
+// Returns the number of complex outputs written.
+size_t ddc_process(ddc_t *ddc, const int8_t *samples, size_t n_samples,
+                   float *out);
+
+// Multiply-adds per input sample over all stages, for comparing setups.
+double ddc_cost(const ddc_t *ddc);
+
+// Taps a Kaiser windowed sinc needs for DDC_ATTENUATION dB with the given
+// transition width (cycles per sample).
+size_t ddc_lowpass_length(double transition);
+
+// Kaiser windowed sinc low-pass, cutoff in cycles per sample, scaled so the
+// taps sum to gain.
+void ddc_lowpass(float *taps, size_t n_taps, double cutoff, double gain);
+
+#endif //DBSDR_DDC_H
@@ -0,0 +1,412 @@
+//
+// Created by dbrent on 3/26/21.
+//
+
+#include "demod.h"
+#include "source.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define PI 3.14159265358979
+#define DEMOD_IDLE_SLEEP_NS 500000
+#define DEMOD_SSB_TRANSITION 300.0 // Hz
+#define DEMOD_AM_CARRIER 0.1       // s the carrier level is averaged over
+
+// Channel rate to aim for (at least), channel filter, and the audio passband
+// and stopband the resampler cuts to. WFM stops short of the 19 kHz pilot.
+typedef struct mode_info {
+    const char *name;
+    double rate;
+    double bandwidth;
+    double audio_pass;
+    double audio_stop;
+    double deviation; // FM peak
+} mode_info_t;
+
+static const mode_info_t modes[DEMOD_MODE_COUNT] = {
+        {"wfm", 250e3, 200e3, 15e3, 18e3, 75e3},
+        {"nfm", 25e3, 16e3, 3.5e3, 5e3, 5e3},
+        {"am", 25e3, 10e3, 5e3, 6e3, 0.0},
+        {"usb", 25e3, 6e3, 3e3, 4e3, 0.0},
+        {"lsb", 25e3, 6e3, 3e3, 4e3, 0.0},
+};
+
+static const struct timespec idle = {0, DEMOD_IDLE_SLEEP_NS};
+
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+const char *demod_mode_name(demod_mode_t mode) { return modes[mode].name; }
+
+// Largest decimation leaving at least rate that divides the sample rate
+// and leaves a channel rate the resampler can take to the audio rate.
+static uint32_t pick_decimation(double sample_rate, double rate) {
+    uint64_t in = (uint64_t)llround(sample_rate);
+    uint32_t up, down;
+    for (uint64_t d = (uint64_t)(sample_rate / rate); d >= 1; d--) {
+        if (d <= DDC_MAX_DECIMATION && in % d == 0 &&
+            resampler_ratio((double)(in / d), DEMOD_AUDIO_RATE, &up, &down)) {
+            return (uint32_t)d;
+        }
+    }
+    return 0;
+}
+
+// One sideband from audio low to high Hz: a low-pass as wide as the band,
+// shifted up (USB) or down (LSB) onto it. Only the real part of the output
+// is needed, re * re - im * im, so the taps are stored as (re, -im) pairs
+// against the interleaved history.
+static bool ssb_init(demod_t *demod, double high, bool upper,
+                     size_t max_channel) {
+    double rate = demod->channel_rate;
+    double half = (high - DEMOD_SSB_LOW) / 2.0;
+    double centre = (upper ? 1.0 : -1.0) * (DEMOD_SSB_LOW + half);
+    size_t n = ddc_lowpass_length(DEMOD_SSB_TRANSITION / rate);
+    float *h = malloc(n * sizeof(float));
+    demod->ssb_taps = n;
+    demod->ssb = malloc(2 * n * sizeof(float));
+    demod->history = calloc(2 * (n - 1 + max_channel), sizeof(float));
+    if (h == NULL || demod->ssb == NULL || demod->history == NULL) {
+        free(h);
+        return false;
+    }
+    ddc_lowpass(h, n, half / rate, 1.0);
+    double mid = (double)(n - 1) / 2.0;
+    for (size_t k = 0; k < n; k++) {
+        double w = 2.0 * PI * centre * ((double)k - mid) / rate;
+        size_t i = n - 1 - k;
+        demod->ssb[2 * i] = (float)(h[k] * cos(w));
+        demod->ssb[2 * i + 1] = (float)(-h[k] * sin(w));
+    }
+    free(h);
+    return true;
+}
+
+static void *demod_thread(void *arg);
+
+demod_t *demod_open(const demod_config_t *config) {
+    const mode_info_t *info = &modes[config->mode];
+    uint32_t decimation = pick_decimation(config->sample_rate, info->rate);
+    if (decimation == 0) {
+        fprintf(stderr, "No channel rate for %s at %.0f Hz\n", info->name,
+                config->sample_rate);
+        return NULL;
+    }
+    demod_t *demod = calloc(1, sizeof(demod_t));
+    if (demod == NULL) {
+        return NULL;
+    }
+    demod->mode = config->mode;
+    demod->sample_rate = config->sample_rate;
+    demod->channel_rate = config->sample_rate / decimation;
+    demod->bandwidth = info->bandwidth;
+    atomic_init(&demod->frequency, config->frequency);
+    demod->generation = UINT32_MAX;
+
+    ddc_config_t ddc_config = {config->sample_rate, 0.0, decimation,
+                               info->bandwidth};
+    size_t max_channel = config->max_block_samples / decimation + 1;
+    size_t max_audio = (size_t)((double)max_channel * DEMOD_AUDIO_RATE /
+                                demod->channel_rate) + 2;
+    bool ok = queue_init(&demod->blocks,
+                         sizeof(iq_block_t) +
+                                 config->max_block_samples * BYTES_PER_SAMPLE,
+                         DEMOD_BLOCK_QUEUE_SIZE, QUEUE_SPSC);
+    ok = ok && (demod->ddc = ddc_create(&ddc_config)) != NULL;
+    ok = ok && (demod->resampler = resampler_create(
+                        demod->channel_rate, DEMOD_AUDIO_RATE,
+                        info->audio_pass, info->audio_stop)) != NULL;
+    ok = ok && (demod->iq = malloc(2 * max_channel * sizeof(float))) != NULL;
+    ok = ok && (demod->audio = malloc(max_channel * sizeof(float))) != NULL;
+    ok = ok && (demod->out = malloc(max_audio * sizeof(float))) != NULL;
+    ok = ok && (demod->pcm = malloc(max_audio * sizeof(int16_t))) != NULL;
+    if (ok && (config->mode == DEMOD_USB || config->mode == DEMOD_LSB)) {
+        ok = ssb_init(demod, info->audio_pass, config->mode == DEMOD_USB,
+                      max_channel);
+    }
+    ok = ok && (demod->sink = audio_open(config->output,
+                                         DEMOD_AUDIO_RATE)) != NULL;
+    if (!ok) {
+        fprintf(stderr, "Could not set up %s demodulator\n", info->name);
+        demod_close(demod);
+        return NULL;
+    }
+
+    // FM comes out of the discriminator in radians per sample
+    double rate = demod->channel_rate;
+    if (info->deviation > 0.0) {
+        demod->fm_scale = (float)(rate / (2.0 * PI * info->deviation));
+    }
+    if (config->mode == DEMOD_WFM) {
+        double tau = config->deemphasis > 0.0 ? config->deemphasis
+                                              : DEMOD_DEEMPHASIS;
+        demod->deemphasis_alpha = (float)(1.0 - exp(-1.0 / (tau * rate)));
+    }
+    demod->carrier_alpha =
+            (float)(1.0 - exp(-1.0 / (DEMOD_AM_CARRIER * rate)));
+    demod->agc_decay = (float)exp(-1.0 / (DEMOD_AGC_DECAY * DEMOD_AUDIO_RATE));
+
+    atomic_store(&demod->running, true);
+    if (pthread_create(&demod->thread, NULL, demod_thread, demod) != 0) {
+        fprintf(stderr, "Could not create demod thread\n");
+        demod_close(demod);
+        return NULL;
+    }
+    demod->started = true;
+    fprintf(stderr,
+            "Demodulating %s at %lu Hz: %.0f Hz channel, %u:%u to %d Hz "
+            "audio on %s\n",
+            info->name, (unsigned long)config->frequency, demod->channel_rate,
+            demod->resampler->up, demod->resampler->down, DEMOD_AUDIO_RATE,
+            audio_type_name(demod->sink->type));
+    return demod;
+}
+
+void demod_close(demod_t *demod) {
+    if (demod == NULL) {
+        return;
+    }
+    atomic_store(&demod->running, false);
+    if (demod->started) {
+        pthread_join(demod->thread, NULL);
+    }
+    audio_close(demod->sink);
+    ddc_destroy(demod->ddc);
+    resampler_destroy(demod->resampler);
+    queue_destroy(&demod->blocks);
+    free(demod->iq);
+    free(demod->audio);
+    free(demod->out);
+    free(demod->pcm);
+    free(demod->ssb);
+    free(demod->history);
+    free(demod);
+}
+
+void demod_write(demod_t *demod, const iq_block_t *block) {
+    iq_block_t *slot = queue_reserve(&demod->blocks);
+    if (slot == NULL) {
+        atomic_fetch_add_explicit(&demod->blocks_dropped, 1,
+                                  memory_order_relaxed);
+        return;
+    }
+    memcpy(slot, block,
+           sizeof(iq_block_t) + block->n_samples * block->bytes_per_sample);
+    queue_commit(&demod->blocks, slot);
+}
+
+void demod_tap(void *ctx, const iq_block_t *block, uint64_t missing,
+               bool retuned) {
+    (void)missing;
+    (void)retuned;
+    demod_write(ctx, block);
+}
+
+void demod_set_frequency(demod_t *demod, uint64_t frequency) {
+    atomic_store(&demod->frequency, frequency);
+}
+
+static void fm(demod_t *demod, size_t n) {
+    const float *iq = demod->iq;
+    float *audio = demod->audio;
+    float re = demod->prev_re;
+    float im = demod->prev_im;
+    // phase step of x[i] * conj(x[i - 1])
+    for (size_t i = 0; i < n; i++) {
+        float x = iq[2 * i];
+        float y = iq[2 * i + 1];
+        audio[i] = atan2f(y * re - x * im, x * re + y * im) * demod->fm_scale;
+        re = x;
+        im = y;
+    }
+    demod->prev_re = re;
+    demod->prev_im = im;
+
+    if (demod->deemphasis_alpha > 0.0f) {
+        float alpha = demod->deemphasis_alpha;
+        float level = demod->deemphasis;
+        for (size_t i = 0; i < n; i++) {
+            level += alpha * (audio[i] - level);
+            audio[i] = level;
+        }
+        demod->deemphasis = level;
+    }
+}
+
+// Modulation depth: the envelope over its own average, which is the
+// carrier, so no AGC is needed. Full scale is 100% modulation.
+static void am(demod_t *demod, size_t n) {
+    const float *iq = demod->iq;
+    float *audio = demod->audio;
+    float alpha = demod->carrier_alpha;
+    float carrier = demod->carrier;
+    for (size_t i = 0; i < n; i++) {
+        audio[i] = sqrtf(iq[2 * i] * iq[2 * i] +
+                         iq[2 * i + 1] * iq[2 * i + 1]);
+    }
+    if (carrier == 0.0f && n > 0) {
+        // start from the first block's average rather than from silence
+        for (size_t i = 0; i < n; i++) {
+            carrier += audio[i];
+        }
+        carrier /= (float)n;
+    }
+    for (size_t i = 0; i < n; i++) {
+        float envelope = audio[i];
+        carrier += alpha * (envelope - carrier);
+        audio[i] = carrier > 1e-6f ? (envelope - carrier) / carrier : 0.0f;
+    }
+    demod->carrier = carrier;
+}
+
+static void ssb(demod_t *demod, size_t n) {
+    const size_t keep = 2 * (demod->ssb_taps - 1);
+    const size_t width = 2 * demod->ssb_taps;
+    const float *taps = demod->ssb;
+    memcpy(demod->history + keep, demod->iq, 2 * n * sizeof(float));
+    for (size_t j = 0; j < n; j++) {
+        const float *x = demod->history + 2 * j;
+        float acc = 0.0f;
+#pragma omp simd reduction(+ : acc)
+        for (size_t u = 0; u < width; u++) {
+            acc += taps[u] * x[u];
+        }
+        demod->audio[j] = acc;
+    }
+    memmove(demod->history, demod->history + 2 * n, keep * sizeof(float));
+}
+
+// Fast attack, slow decay, to DEMOD_AUDIO_LEVEL.
+static void agc(demod_t *demod, float *audio, size_t n) {
+    float level = demod->agc_level;
+    for (size_t i = 0; i < n; i++) {
+        float a = fabsf(audio[i]);
+        level = a > level ? a : level * demod->agc_decay;
+        audio[i] *= DEMOD_AUDIO_LEVEL / (level > 1e-5f ? level : 1e-5f);
+    }
+    demod->agc_level = level;
+}
+
+// Keeps what waits in the sound device under DEMOD_MAX_QUEUED, dropping the
+// oldest audio of this block if it would go over, then measures how long
+// after its transfer arrived the last of the block will be heard.
+static void play(demod_t *demod, const iq_block_t *block, size_t n) {
+    const int16_t *pcm = demod->pcm;
+    double room = DEMOD_MAX_QUEUED - audio_delay(demod->sink);
+    size_t fits = room > 0.0 ? (size_t)(room * DEMOD_AUDIO_RATE) : 0;
+    bool device = demod->sink->type == AUDIO_PULSE ||
+                  demod->sink->type == AUDIO_ALSA;
+    if (device && n > fits) {
+        atomic_fetch_add_explicit(&demod->samples_skipped, n - fits,
+                                  memory_order_relaxed);
+        pcm += n - fits;
+        n = fits;
+    }
+    if (n > 0 && !audio_write(demod->sink, pcm, n)) {
+        fprintf(stderr, "Audio output failed, stopping\n");
+        atomic_store(&demod->running, false);
+        return;
+    }
+    atomic_fetch_add_explicit(&demod->samples, n, memory_order_relaxed);
+
+    uint64_t latency = monotonic_ns() - block->received_ns +
+                       (uint64_t)(audio_delay(demod->sink) * 1e9);
+    atomic_store_explicit(&demod->latency_ns, latency, memory_order_relaxed);
+    if (latency > atomic_load(&demod->latency_max_ns)) {
+        atomic_store(&demod->latency_max_ns, latency);
+    }
+    if (latency > (uint64_t)(DEMOD_MAX_LATENCY * 1e9)) {
+        atomic_fetch_add_explicit(&demod->late, 1, memory_order_relaxed);
+    }
+}
+
+static void demod_block(demod_t *demod, const iq_block_t *block) {
+    // the channel sits at a fixed frequency, moving the DDC whenever the
+    // radio or the channel moves
+    uint64_t listening = atomic_load(&demod->frequency);
+    if (block->tag.generation != demod->generation ||
+        block->tag.frequency != demod->tuned ||
+        listening != demod->listening) {
+        demod->generation = block->tag.generation;
+        demod->tuned = block->tag.frequency;
+        demod->listening = listening;
+        double offset = (double)listening - (double)demod->tuned;
+        demod->muted = fabs(offset) + demod->bandwidth / 2.0 >
+                       demod->sample_rate / 2.0;
+        if (!demod->muted) {
+            ddc_set_offset(demod->ddc, offset);
+        }
+    }
+
+    size_t n = ddc_process(demod->ddc, block->samples, block->n_samples,
+                           demod->iq);
+    switch (demod->mode) {
+    case DEMOD_WFM:
+    case DEMOD_NFM:
+        fm(demod, n);
+        break;
+    case DEMOD_AM:
+        am(demod, n);
+        break;
+    default:
+        ssb(demod, n);
+        break;
+    }
+    if (demod->muted) {
+        memset(demod->audio, 0, n * sizeof(float));
+        atomic_fetch_add_explicit(&demod->blocks_muted, 1,
+                                  memory_order_relaxed);
+    }
+
+    size_t m = resampler_process(demod->resampler, demod->audio, n,
+                                 demod->out);
+    if (demod->mode == DEMOD_USB || demod->mode == DEMOD_LSB) {
+        agc(demod, demod->out, m);
+    } else {
+        for (size_t i = 0; i < m; i++) {
+            demod->out[i] *= DEMOD_AUDIO_LEVEL;
+        }
+    }
+    for (size_t i = 0; i < m; i++) {
+        float v = demod->out[i] * 32767.0f;
+        v = v > 32767.0f ? 32767.0f : v < -32767.0f ? -32767.0f : v;
+        demod->pcm[i] = (int16_t)lrintf(v);
+    }
+    play(demod, block, m);
+    atomic_fetch_add_explicit(&demod->blocks_done, 1, memory_order_relaxed);
+}
+
+static void *demod_thread(void *arg) {
+    demod_t *demod = arg;
+    while (atomic_load_explicit(&demod->running, memory_order_relaxed)) {
+        iq_block_t *block = queue_peek(&demod->blocks);
+        if (block == NULL) {
+            nanosleep(&idle, NULL);
+            continue;
+        }
+        demod_block(demod, block);
+        queue_release(&demod->blocks);
+    }
+    return NULL;
+}
+
+void demod_get_stats(demod_t *demod, demod_stats_t *stats) {
+    stats->blocks = atomic_load(&demod->blocks_done);
+    stats->blocks_dropped = atomic_load(&demod->blocks_dropped);
+    stats->blocks_muted = atomic_load(&demod->blocks_muted);
+    stats->samples = atomic_load(&demod->samples);
+    stats->samples_skipped = atomic_load(&demod->samples_skipped);
+    stats->underruns = atomic_load(&demod->sink->underruns);
+    stats->late = atomic_load(&demod->late);
+    stats->latency = atomic_load(&demod->latency_ns) * 1e-9;
+    stats->latency_max = atomic_load(&demod->latency_max_ns) * 1e-9;
+    stats->channel_rate = demod->channel_rate;
+    queue_get_stats(&demod->blocks, &stats->queue);
+}
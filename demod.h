@@ -0,0 +1,142 @@
+//
+// Created by dbrent on 3/26/21.
+//
+
+#ifndef DBSDR_DEMOD_H
+#define DBSDR_DEMOD_H
+
+#include "audio.h"
+#include "ddc.h"
+#include "dsp.h"
+#include "queue.h"
+#include "resampler.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define DEMOD_AUDIO_RATE 48000
+#define DEMOD_BLOCK_QUEUE_SIZE 4 // 26 ms of 20 MSPS transfers
+#define DEMOD_MAX_LATENCY 0.05   // s, transfer callback to the speaker
+#define DEMOD_MAX_QUEUED 0.03    // s ahead in the sound device at most
+#define DEMOD_DEEMPHASIS 50e-6   // s, 75e-6 in the Americas
+#define DEMOD_SSB_LOW 300.0      // Hz, bottom of the SSB audio band
+#define DEMOD_AGC_DECAY 0.5      // s for the SSB level to fall by 1 / e
+#define DEMOD_AUDIO_LEVEL 0.5f   // of full scale, for AGC and FM
+
+typedef enum demod_mode {
+    DEMOD_WFM,
+    DEMOD_NFM,
+    DEMOD_AM,
+    DEMOD_USB,
+    DEMOD_LSB,
+    DEMOD_MODE_COUNT,
+} demod_mode_t;
+
+// Listens to one channel of the raw stream: a DDC brings it down to a rate
+// that suits the mode and that resamples to DEMOD_AUDIO_RATE in whole
+// ratios, then FM (discriminator, de-emphasis for WFM), AM (envelope over
+// the carrier) or SSB (a complex band-pass that keeps one side, its real
+// part is the audio, then AGC), then the resampler, whose low-pass also
+// sets the audio bandwidth. Blocks are handed over on the DSP thread and
+// demodulated on the demod thread, which writes to the sink as it goes.
+typedef struct demod_config {
+    demod_mode_t mode;
+    uint64_t frequency; // Hz listened to, stays put across retunes
+    double sample_rate;
+    size_t max_block_samples;
+    double deemphasis;  // FM time constant in s, 0 for DEMOD_DEEMPHASIS
+    const char *output; // for audio_open()
+} demod_config_t;
+
+typedef struct demod_stats {
+    uint64_t blocks;
+    uint64_t blocks_dropped; // queue full, demodulating fell behind
+    uint64_t blocks_muted;   // listened to frequency out of the tuning
+    uint64_t samples;        // audio out
+    uint64_t samples_skipped; // dropped to bring the latency back down
+    uint64_t underruns;
+    uint64_t late; // blocks heard more than DEMOD_MAX_LATENCY after arriving
+    double latency; // s, the last block
+    double latency_max;
+    double channel_rate;
+    queue_stats_t queue;
+} demod_stats_t;
+
+typedef struct demod {
+    demod_mode_t mode;
+    double sample_rate;
+    double channel_rate;
+    double bandwidth;
+    atomic_uint_fast64_t frequency;
+
+    queue_t blocks; // dsp thread -> demod thread, iq_block_t slots
+    pthread_t thread;
+    bool started;
+    atomic_bool running; // cleared by the thread too if the audio fails
+
+    // demod thread side
+    ddc_t *ddc;
+    resampler_t *resampler;
+    audio_sink_t *sink;
+    float *iq;    // channel, interleaved complex
+    float *audio; // at the channel rate
+    float *out;   // at DEMOD_AUDIO_RATE
+    int16_t *pcm;
+    uint32_t generation;
+    uint64_t tuned;
+    uint64_t listening;
+    bool muted;
+
+    // FM
+    float fm_scale;
+    float prev_re;
+    float prev_im;
+    float deemphasis_alpha; // 0 for none
+    float deemphasis;
+
+    // AM
+    float carrier_alpha;
+    float carrier;
+
+    // SSB: real part of a complex filter, time reversed, over interleaved
+    // history
+    size_t ssb_taps;
+    float *ssb;
+    float *history;
+    float agc_decay;
+    float agc_level;
+
+    atomic_uint_fast64_t blocks_done;
+    atomic_uint_fast64_t blocks_dropped;
+    atomic_uint_fast64_t blocks_muted;
+    atomic_uint_fast64_t samples;
+    atomic_uint_fast64_t samples_skipped;
+    atomic_uint_fast64_t late;
+    atomic_uint_fast64_t latency_ns;
+    atomic_uint_fast64_t latency_max_ns;
+} demod_t;
+
+const char *demod_mode_name(demod_mode_t mode);
+
+// Opens the audio output and starts the demod thread.
+demod_t *demod_open(const demod_config_t *config);
+
+// Stops the thread, drains the audio and frees the demodulator.
+void demod_close(demod_t *demod);
+
+// DSP thread: queue a block, dropped if the demod thread is behind.
+void demod_write(demod_t *demod, const iq_block_t *block);
+
+// The same as a dsp_tap.
+void demod_tap(void *demod, const iq_block_t *block, uint64_t missing,
+               bool retuned);
+
+// Any thread: listen somewhere else from the next block on.
+void demod_set_frequency(demod_t *demod, uint64_t frequency);
+
+void demod_get_stats(demod_t *demod, demod_stats_t *stats);
+
+#endif //DBSDR_DEMOD_H
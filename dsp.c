@@ -0,0 +1,758 @@
+//
+// Created by dbrent on 3/6/21.
+//
+
+#include "dsp.h"
+#include "archive.h"
+#include "fft.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define DSP_IDLE_SLEEP_NS 100000
+#define DSP_LINE_RING_BYTES (4 * 1024 * 1024)
+#define DSP_MIN_LINE_RING 4
+
+// A run of contiguous samples handed to one worker, enough for frames FFTs
+// spaced hop samples apart. Jobs are numbered densely in dispatch order, job
+// n always goes to worker n % workers. Each job names its own FFT setup, so
+// size and window can change from one job to the next.
+//
+// Frames are numbered over the whole stream and averaged in groups of
+// average, counted from group_base. A group is named by its first frame,
+// so it can span several jobs and workers.
+typedef struct dsp_job {
+    uint64_t sequence;
+    dsp_tag_t tag; // of the first sample
+    const fft_setup_t *setup;
+    size_t hop;
+    size_t n_samples;
+    uint32_t frames;
+    uint32_t average;
+    uint64_t first_frame;
+    uint64_t group_base;
+    int8_t samples[];
+} dsp_job_t;
+
+// What a worker hands back for the frames of one job that fall in one
+// averaging group: either the whole group already in dB, or a linear power
+// sum over count frames for the dispatcher to merge with the rest of it.
+typedef struct dsp_line {
+    uint64_t job;
+    dsp_tag_t tag; // of the first frame
+    uint64_t group;
+    uint32_t count;
+    uint32_t average;
+    uint32_t n_bins;
+    bool complete;
+    bool last; // last line of its job
+    float bins[];
+} dsp_line_t;
+
+// Dispatcher side of the stream. Jobs are filled in place straight from the
+// IQ ring, whatever the block size. The overlapping tail of each finished
+// job is kept in carry and starts the next one.
+typedef struct dsp_accumulator {
+    uint64_t expected;      // next IQ block sequence
+    uint64_t next_sample;   // first sample of the next block, if contiguous
+    uint32_t generation;    // tune generation of the blocks being cut
+    uint64_t next_job;      // next job number to hand out
+    uint64_t next_line_job; // oldest job still owing lines
+    bool block_started;     // start_block() has seen the oldest block
+    size_t block_offset;    // samples of the oldest block already consumed
+    dsp_job_t *job;         // reserved job being filled, or NULL
+    size_t job_fill;        // samples in job so far
+    int8_t *carry;
+    size_t carry_len; // samples
+
+    // geometry of the jobs being cut, changes with the FFT setup
+    uint64_t applied;         // packed request the setup was made for
+    const fft_setup_t *setup; // NULL until the first one is ready
+    size_t hop;               // samples between the starts of two FFTs
+    uint32_t frames;          // FFTs per job
+    size_t job_samples;       // samples per job
+    uint32_t average;         // FFTs per output line
+    uint64_t frame;           // stream frame number of the next job
+    uint64_t group_base;      // where the current averaging run started
+
+    // a group spread over several jobs, merged in job order
+    float *sum;
+    dsp_tag_t group_tag;
+    uint64_t group;
+    uint32_t count;
+    uint32_t n_bins;
+} dsp_accumulator_t;
+
+typedef struct dsp_worker {
+    queue_t jobs;  // dispatcher -> worker
+    queue_t lines; // worker -> dispatcher
+    fft_context_t *fft;
+    pthread_t thread;
+    atomic_uint_fast64_t jobs_done;
+} dsp_worker_t;
+
+static void *dispatch_thread(void *arg);
+
+static void *worker_thread(void *arg);
+
+static const struct timespec idle = {0, DSP_IDLE_SLEEP_NS};
+
+static queue_t iq_block_queue;
+static queue_t *mag_line_queue = NULL;
+static struct {
+    dsp_tap tap;
+    void *ctx;
+} taps[DSP_MAX_TAPS];
+static int n_taps = 0;
+static archive_t *archive = NULL;
+static dsp_worker_t *workers = NULL;
+static int n_workers = 0;
+static size_t max_fft_size;
+static size_t max_block_samples;
+static float overlap;
+static double sample_rate;
+static double line_rate;
+static int display_width;
+
+// part of the band shown, packed as start << 32 | end in DSP_VIEW_ONE
+// units, and how bins are reduced to pixels
+static atomic_uint_fast64_t view = 0;
+static atomic_int reducer = BINNING_MAX;
+
+// FFT size and window asked for, packed as size << 8 | window, and the
+// ones actually running
+static atomic_uint_fast64_t requested_fft = 0;
+static atomic_size_t current_fft_size = 0;
+static atomic_int current_fft_window = 0;
+static atomic_uint current_average = 0;
+
+static pthread_t thread;
+static bool thread_started = false;
+static int workers_started = 0;
+static atomic_bool running = false;
+
+// retunes, from dsp_retune_begin() and dsp_retune() to the receive thread,
+// generation last
+static atomic_uint tune_generation = 0;
+static atomic_uint_fast64_t tune_frequency = 0;
+static atomic_size_t tune_settle = 0;
+
+// written by the receive thread only
+static uint64_t next_sequence = 0;
+static uint64_t next_sample = 0;
+static dsp_tag_t receive_tag;
+static uint64_t settle_until = 0;
+static atomic_uint_fast64_t blocks_received = 0;
+static atomic_uint_fast64_t blocks_dropped = 0;
+static atomic_uint_fast64_t blocks_settling = 0;
+
+// written by the dispatch thread only
+static atomic_uint_fast64_t blocks_processed = 0;
+static atomic_uint_fast64_t sequence_gaps = 0;
+static atomic_uint_fast64_t lines_emitted = 0;
+static atomic_uint_fast64_t lines_dropped = 0;
+
+static uint64_t pack_fft(size_t size, fft_window_t window) {
+    return (uint64_t)size << 8 | (uint64_t)window;
+}
+
+static uint64_t pack_view(double start, double end) {
+    return (uint64_t)(start * DSP_VIEW_ONE) << 32 |
+           (uint64_t)(end * DSP_VIEW_ONE);
+}
+
+bool dsp_init(const dsp_config_t *config, queue_t *line_queue) {
+    max_fft_size = config->max_fft_size;
+    if (max_fft_size < config->fft_size) {
+        max_fft_size = config->fft_size;
+    }
+    max_block_samples = config->max_block_samples;
+    mag_line_queue = line_queue;
+    n_workers = config->workers;
+    if (n_workers < 1) {
+        n_workers = 1;
+    }
+    if (n_workers > DSP_MAX_WORKERS) {
+        n_workers = DSP_MAX_WORKERS;
+    }
+    sample_rate = config->sample_rate;
+    line_rate = config->line_rate;
+    display_width = config->display_width;
+    atomic_store(&view, pack_view(0.0, 1.0));
+    atomic_store(&reducer, config->reducer);
+    overlap = config->overlap;
+    if (overlap < 0.0f) {
+        overlap = 0.0f;
+    }
+    if (overlap > DSP_MAX_OVERLAP) {
+        overlap = DSP_MAX_OVERLAP;
+    }
+
+    // the pipeline can be torn down and built again, start counting afresh
+    next_sequence = 0;
+    next_sample = 0;
+    settle_until = 0;
+    receive_tag = (dsp_tag_t){0, config->frequency, 0};
+    atomic_store(&tune_generation, 0);
+    atomic_store(&tune_frequency, config->frequency);
+    atomic_store(&tune_settle, 0);
+    atomic_store(&blocks_received, 0);
+    atomic_store(&blocks_dropped, 0);
+    atomic_store(&blocks_settling, 0);
+    atomic_store(&blocks_processed, 0);
+    atomic_store(&sequence_gaps, 0);
+    atomic_store(&lines_emitted, 0);
+    atomic_store(&lines_dropped, 0);
+
+    if (display_width > 0 &&
+        line_queue->slot_size < DSP_LINE_BYTES(display_width)) {
+        fprintf(stderr, "Line queue slots too small for %d pixel rows\n",
+                display_width);
+        return false;
+    }
+    if (display_width <= 0 &&
+        line_queue->slot_size < DSP_LINE_BYTES(max_fft_size)) {
+        fprintf(stderr, "Line queue slots too small for %zu point FFTs\n",
+                max_fft_size);
+        return false;
+    }
+
+    // plan the first setup up front, later ones are planned in the
+    // background while the current one keeps running
+    if (fft_setup_wait(config->fft_size, config->window) == NULL) {
+        return false;
+    }
+    atomic_store(&requested_fft, pack_fft(config->fft_size, config->window));
+
+    // interleaved int8 I and Q. A job holds about one transfer, or one FFT
+    // when that is bigger.
+    size_t block_bytes = max_block_samples * 2 * sizeof(int8_t);
+    size_t job_samples = max_block_samples > max_fft_size ? max_block_samples
+                                                          : max_fft_size;
+    size_t job_bytes = job_samples * 2 * sizeof(int8_t);
+    if (!queue_init(&iq_block_queue, sizeof(iq_block_t) + block_bytes,
+                    IQ_BLOCK_QUEUE_SIZE, QUEUE_SPSC)) {
+        return false;
+    }
+
+    workers = aligned_alloc(QUEUE_CACHE_LINE, sizeof(dsp_worker_t) * n_workers);
+    if (workers == NULL) {
+        fprintf(stderr, "Could not create dsp workers\n");
+        return false;
+    }
+    memset(workers, 0, sizeof(dsp_worker_t) * n_workers);
+
+    // lines go back to the dispatcher in job order, so a short ring per
+    // worker never deadlocks, it only paces the worker
+    size_t line_bytes = sizeof(dsp_line_t) + max_fft_size * sizeof(float);
+    size_t line_ring = DSP_LINE_RING_BYTES / line_bytes;
+    if (line_ring < DSP_MIN_LINE_RING) {
+        line_ring = DSP_MIN_LINE_RING;
+    }
+    for (int i = 0; i < n_workers; i++) {
+        dsp_worker_t *w = &workers[i];
+        atomic_init(&w->jobs_done, 0);
+        w->fft = fft_context_create(max_fft_size);
+        if (w->fft == NULL ||
+            !queue_init(&w->jobs, sizeof(dsp_job_t) + job_bytes,
+                        DSP_JOB_QUEUE_SIZE, QUEUE_SPSC) ||
+            !queue_init(&w->lines, line_bytes, line_ring, QUEUE_SPSC)) {
+            fprintf(stderr, "Could not create dsp worker %d\n", i);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool dsp_set_fft(size_t fft_size, fft_window_t window) {
+    if (fft_size < FFT_MIN_SIZE || fft_size > max_fft_size ||
+        (fft_size & (fft_size - 1)) != 0) {
+        fprintf(stderr, "FFT size must be a power of two from %d to %zu\n",
+                FFT_MIN_SIZE, max_fft_size);
+        return false;
+    }
+    if (window < 0 || window >= FFT_WINDOW_COUNT) {
+        return false;
+    }
+    // start planning now, the dispatcher switches once it is ready
+    if (fft_setup_get(fft_size, window) == NULL) {
+        fprintf(stderr, "Planning %zu point FFT...\n", fft_size);
+    }
+    atomic_store(&requested_fft, pack_fft(fft_size, window));
+    return true;
+}
+
+bool dsp_set_view(double start, double end, binning_reducer_t r) {
+    if (start < 0.0 || end > 1.0 || start >= end || r < 0 ||
+        r >= BINNING_REDUCER_COUNT) {
+        return false;
+    }
+    atomic_store(&view, pack_view(start, end));
+    atomic_store(&reducer, r);
+    return true;
+}
+
+void dsp_retune_begin(void) {
+    atomic_store(&tune_settle, SIZE_MAX);
+    atomic_fetch_add(&tune_generation, 1);
+}
+
+uint32_t dsp_retune(uint64_t frequency, size_t settle_samples) {
+    atomic_store(&tune_frequency, frequency);
+    atomic_store(&tune_settle, settle_samples);
+    return atomic_fetch_add(&tune_generation, 1) + 1;
+}
+
+bool dsp_add_tap(dsp_tap tap, void *ctx) {
+    if (n_taps == DSP_MAX_TAPS) {
+        fprintf(stderr, "Too many raw stream taps\n");
+        return false;
+    }
+    taps[n_taps].tap = tap;
+    taps[n_taps].ctx = ctx;
+    n_taps++;
+    return true;
+}
+
+void dsp_set_archive(archive_t *a) { archive = a; }
+
+void dsp_destroy(void) {
+    queue_destroy(&iq_block_queue);
+    if (workers != NULL) {
+        for (int i = 0; i < n_workers; i++) {
+            queue_destroy(&workers[i].jobs);
+            queue_destroy(&workers[i].lines);
+            fft_context_destroy(workers[i].fft);
+        }
+        free(workers);
+        workers = NULL;
+    }
+}
+
+bool dsp_start(void) {
+    atomic_store(&running, true);
+    for (workers_started = 0; workers_started < n_workers; workers_started++) {
+        if (pthread_create(&workers[workers_started].thread, NULL,
+                           worker_thread, &workers[workers_started]) != 0) {
+            fprintf(stderr, "Could not create dsp worker thread\n");
+            dsp_stop();
+            return false;
+        }
+    }
+    if (pthread_create(&thread, NULL, dispatch_thread, NULL) != 0) {
+        fprintf(stderr, "Could not create dsp thread\n");
+        dsp_stop();
+        return false;
+    }
+    thread_started = true;
+    return true;
+}
+
+void dsp_stop(void) {
+    atomic_store(&running, false);
+    for (int i = 0; i < workers_started; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    workers_started = 0;
+    if (thread_started) {
+        pthread_join(thread, NULL);
+        thread_started = false;
+    }
+}
+
+static uint64_t received_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+void dsp_receive(void *samples, size_t n_samples, size_t bytes_per_sample) {
+    uint64_t first_sample = next_sample;
+    next_sample += n_samples;
+    atomic_fetch_add_explicit(&blocks_received, 1, memory_order_relaxed);
+
+    // the settle window starts at the first block seen after a retune,
+    // everything still in flight then was taken before it
+    uint32_t generation = atomic_load(&tune_generation);
+    if (generation != receive_tag.generation) {
+        receive_tag.generation = generation;
+        receive_tag.frequency = atomic_load(&tune_frequency);
+        size_t settle = atomic_load(&tune_settle);
+        settle_until = settle == SIZE_MAX ? UINT64_MAX
+                                          : first_sample + settle;
+    }
+    if (first_sample < settle_until) {
+        atomic_fetch_add_explicit(&blocks_settling, 1, memory_order_relaxed);
+        return;
+    }
+
+    uint64_t sequence = next_sequence++;
+    iq_block_t *block = queue_reserve(&iq_block_queue);
+    if (block == NULL) {
+        atomic_fetch_add_explicit(&blocks_dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    if (n_samples > max_block_samples) {
+        n_samples = max_block_samples;
+    }
+    block->sequence = sequence;
+    block->tag = receive_tag;
+    block->tag.first_sample = first_sample;
+    block->received_ns = received_ns();
+    block->n_samples = n_samples;
+    block->bytes_per_sample = bytes_per_sample;
+    memcpy(block->samples, samples, n_samples * bytes_per_sample);
+
+    queue_commit(&iq_block_queue, block);
+}
+
+void dsp_get_stats(dsp_stats_t *stats) {
+    stats->blocks_received = atomic_load(&blocks_received);
+    stats->blocks_dropped = atomic_load(&blocks_dropped);
+    stats->blocks_processed = atomic_load(&blocks_processed);
+    stats->sequence_gaps = atomic_load(&sequence_gaps);
+    stats->blocks_settling = atomic_load(&blocks_settling);
+    stats->generation = atomic_load(&tune_generation);
+    stats->lines_emitted = atomic_load(&lines_emitted);
+    stats->lines_dropped = atomic_load(&lines_dropped);
+    stats->fft_size = atomic_load(&current_fft_size);
+    stats->fft_window = atomic_load(&current_fft_window);
+    stats->average = atomic_load(&current_average);
+    stats->workers = n_workers;
+    for (int i = 0; i < n_workers; i++) {
+        stats->worker_jobs[i] = atomic_load(&workers[i].jobs_done);
+    }
+    queue_get_stats(&iq_block_queue, &stats->iq_queue);
+}
+
+static void *worker_thread(void *arg) {
+    dsp_worker_t *w = arg;
+
+    while (atomic_load_explicit(&running, memory_order_relaxed)) {
+        dsp_job_t *job = queue_peek(&w->jobs);
+        if (job == NULL) {
+            nanosleep(&idle, NULL);
+            continue;
+        }
+
+        if (w->fft->setup != job->setup) {
+            fft_context_set(w->fft, job->setup);
+        }
+        size_t size = job->setup->size;
+
+        // one line per averaging group the job's frames touch
+        for (uint32_t f = 0; f < job->frames;) {
+            uint64_t frame = job->first_frame + f;
+            uint64_t group = job->group_base + (frame - job->group_base) /
+                                                       job->average *
+                                                       job->average;
+            uint32_t run = (uint32_t)(group + job->average - frame);
+            if (run > job->frames - f) {
+                run = job->frames - f;
+            }
+
+            dsp_line_t *line;
+            while ((line = queue_reserve(&w->lines)) == NULL) {
+                if (!atomic_load_explicit(&running, memory_order_relaxed)) {
+                    return NULL;
+                }
+                nanosleep(&idle, NULL);
+            }
+            line->job = job->sequence;
+            line->tag = job->tag;
+            line->tag.first_sample += f * job->hop;
+            line->group = group;
+            line->count = run;
+            line->average = job->average;
+            line->n_bins = (uint32_t)size;
+            line->complete = frame == group && run == job->average;
+            line->last = f + run == job->frames;
+
+            const int8_t *samples = job->samples + f * job->hop * 2;
+            if (line->complete && run == 1) {
+                fft_execute(w->fft, samples, line->bins);
+            } else {
+                memset(line->bins, 0, size * sizeof(float));
+                for (uint32_t k = 0; k < run; k++) {
+                    fft_load(w->fft, samples + k * job->hop * 2);
+                    fft_transform(w->fft);
+                    fft_accumulate_power(w->fft, line->bins);
+                }
+                if (line->complete) {
+                    fft_power_to_db(line->bins, size, run, line->bins);
+                }
+            }
+            queue_commit(&w->lines, line);
+            f += run;
+        }
+
+        queue_release(&w->jobs);
+        atomic_fetch_add_explicit(&w->jobs_done, 1, memory_order_relaxed);
+    }
+
+    return NULL;
+}
+
+// A finished line out, binned to a display row here so the render thread
+// only has to upload it.
+static void emit_line(const dsp_accumulator_t *acc, const float *bins,
+                      uint32_t n_bins, const dsp_tag_t *tag) {
+    spectrum_line_t *out = queue_reserve(mag_line_queue);
+    if (out == NULL) {
+        atomic_fetch_add_explicit(&lines_dropped, 1, memory_order_relaxed);
+        return;
+    }
+    out->tag = *tag;
+    // lines still in flight across a size switch are the only ones that
+    // don't match the setup
+    double enbw = acc->setup != NULL && acc->setup->size == n_bins
+                          ? acc->setup->enbw
+                          : 1.0;
+    out->rbw = (float)(sample_rate * enbw / n_bins);
+    out->span = (float)sample_rate;
+    if (display_width > 0) {
+        uint64_t v = atomic_load_explicit(&view, memory_order_relaxed);
+        double start = (double)(v >> 32) / DSP_VIEW_ONE * n_bins;
+        double end = (double)(v & 0xffffffff) / DSP_VIEW_ONE * n_bins;
+        out->span = (float)(sample_rate * (end - start) / n_bins);
+        // FFT order has dc first, show it in the middle
+        binning_reduce(bins, n_bins, n_bins / 2, start, end,
+                       atomic_load_explicit(&reducer, memory_order_relaxed),
+                       out->bins, display_width);
+        out->n_bins = (uint32_t)display_width;
+    } else {
+        out->n_bins = n_bins;
+        memcpy(out->bins, bins, n_bins * sizeof(float));
+    }
+    if (archive != NULL) {
+        archive_write(archive, out);
+    }
+    queue_commit(mag_line_queue, out);
+    atomic_fetch_add_explicit(&lines_emitted, 1, memory_order_relaxed);
+}
+
+// Emit the group being merged, short of frames if a switch or gap cut it.
+static void flush_group(dsp_accumulator_t *acc) {
+    if (acc->count == 0) {
+        return;
+    }
+    fft_power_to_db(acc->sum, acc->n_bins, acc->count, acc->sum);
+    emit_line(acc, acc->sum, acc->n_bins, &acc->group_tag);
+    acc->count = 0;
+}
+
+// Pull finished lines back out of the workers strictly in job order,
+// merging the averaging groups that were split between jobs.
+static bool collect_lines(dsp_accumulator_t *acc) {
+    bool busy = false;
+
+    while (acc->next_line_job < acc->next_job) {
+        dsp_worker_t *w = &workers[acc->next_line_job % n_workers];
+        dsp_line_t *line = queue_peek(&w->lines);
+        if (line == NULL) {
+            break;
+        }
+
+        if (acc->count > 0 && (line->complete || line->group != acc->group)) {
+            flush_group(acc);
+        }
+        if (line->complete) {
+            emit_line(acc, line->bins, line->n_bins, &line->tag);
+        } else if (acc->count == 0) {
+            memcpy(acc->sum, line->bins, line->n_bins * sizeof(float));
+            acc->group_tag = line->tag;
+            acc->group = line->group;
+            acc->n_bins = line->n_bins;
+            acc->count = line->count;
+        } else {
+            for (uint32_t i = 0; i < line->n_bins; i++) {
+                acc->sum[i] += line->bins[i];
+            }
+            acc->count += line->count;
+        }
+        if (acc->count >= line->average) {
+            flush_group(acc);
+        }
+
+        if (line->last) {
+            acc->next_line_job++;
+        }
+        queue_release(&w->lines);
+        busy = true;
+    }
+
+    return busy;
+}
+
+// Switch to the requested FFT setup once the planner has it ready. The
+// partly filled job and the carry are thrown away, they were cut for the
+// old geometry.
+static void apply_fft(dsp_accumulator_t *acc) {
+    uint64_t requested = atomic_load(&requested_fft);
+    if (requested == acc->applied) {
+        return;
+    }
+    size_t size = (size_t)(requested >> 8);
+    fft_window_t window = (fft_window_t)(requested & 0xff);
+    const fft_setup_t *setup = fft_setup_get(size, window);
+    if (setup == NULL) {
+        return;
+    }
+
+    acc->applied = requested;
+    acc->setup = setup;
+    acc->hop = (size_t)((double)size * (1.0 - overlap) + 0.5);
+    if (acc->hop < 1) {
+        acc->hop = 1;
+    }
+    acc->frames = 1;
+    if (max_block_samples > size) {
+        acc->frames = (uint32_t)((max_block_samples - size) / acc->hop + 1);
+    }
+    acc->job_samples = (acc->frames - 1) * acc->hop + size;
+    acc->job_fill = 0;
+    acc->carry_len = 0;
+
+    // Welch: average as many FFTs per line as it takes to come down to
+    // the target line rate
+    double frame_rate = sample_rate / (double)acc->hop;
+    acc->average = 1;
+    if (line_rate > 0 && frame_rate > line_rate) {
+        acc->average = (uint32_t)(frame_rate / line_rate + 0.5);
+    }
+    acc->group_base = acc->frame;
+
+    atomic_store(&current_fft_size, size);
+    atomic_store(&current_fft_window, window);
+    atomic_store(&current_average, acc->average);
+    fprintf(stderr,
+            "FFT: %zu points, %s window, hop %zu (%.0f%% overlap), "
+            "averaging %u (%.1f lines/s)\n",
+            size, fft_window_name(window), acc->hop,
+            100.0 * (1.0 - (double)acc->hop / (double)size), acc->average,
+            frame_rate / acc->average);
+}
+
+// Runs once per block, before any of it is consumed.
+static void start_block(dsp_accumulator_t *acc, const iq_block_t *block) {
+    uint64_t gap = block->sequence - acc->expected;
+    uint64_t missing = block->tag.first_sample - acc->next_sample;
+    bool retuned = block->tag.generation != acc->generation;
+    acc->expected = block->sequence + 1;
+    acc->next_sample = block->tag.first_sample + block->n_samples;
+    acc->generation = block->tag.generation;
+
+    if (gap != 0) {
+        atomic_fetch_add_explicit(&sequence_gaps, gap, memory_order_relaxed);
+    }
+    if (missing != 0 || retuned) {
+        // never let an FFT or an average straddle missing samples or a
+        // retune, start over
+        acc->carry_len = 0;
+        acc->job_fill = 0;
+        acc->group_base = acc->frame;
+    }
+
+    for (int i = 0; i < n_taps; i++) {
+        taps[i].tap(taps[i].ctx, block, missing, retuned);
+    }
+}
+
+// Move samples from the oldest raw block into jobs, handing each job to the
+// worker that owns its number as soon as it is full. A block can take
+// several calls when workers are behind, it stays in the ring until used up.
+static bool dispatch_block(dsp_accumulator_t *acc) {
+    iq_block_t *block = queue_peek(&iq_block_queue);
+    if (block == NULL || acc->setup == NULL) {
+        return false;
+    }
+    if (!acc->block_started) {
+        start_block(acc, block);
+        acc->block_started = true;
+    }
+
+    bool busy = false;
+    while (acc->block_offset < block->n_samples) {
+        if (acc->job == NULL) {
+            dsp_worker_t *w = &workers[acc->next_job % n_workers];
+            acc->job = queue_reserve(&w->jobs);
+            if (acc->job == NULL) {
+                // worker is behind, keep the rest of the block for later
+                return busy;
+            }
+            memcpy(acc->job->samples, acc->carry, acc->carry_len * 2);
+            acc->job_fill = acc->carry_len;
+        }
+
+        size_t n = acc->job_samples - acc->job_fill;
+        if (n > block->n_samples - acc->block_offset) {
+            n = block->n_samples - acc->block_offset;
+        }
+        memcpy(acc->job->samples + acc->job_fill * 2,
+               block->samples + acc->block_offset * 2, n * 2);
+        acc->job_fill += n;
+        acc->block_offset += n;
+        busy = true;
+
+        if (acc->job_fill == acc->job_samples) {
+            dsp_job_t *job = acc->job;
+            size_t next_start = acc->frames * acc->hop;
+            acc->carry_len = acc->job_samples - next_start;
+            memcpy(acc->carry, job->samples + next_start * 2,
+                   acc->carry_len * 2);
+
+            job->sequence = acc->next_job;
+            // a job never spans a restart, so it ends right here
+            job->tag = block->tag;
+            job->tag.first_sample = block->tag.first_sample +
+                                    acc->block_offset - acc->job_samples;
+            job->setup = acc->setup;
+            job->hop = acc->hop;
+            job->n_samples = acc->job_samples;
+            job->frames = acc->frames;
+            job->average = acc->average;
+            job->first_frame = acc->frame;
+            job->group_base = acc->group_base;
+            acc->frame += acc->frames;
+            queue_commit(&workers[acc->next_job % n_workers].jobs, job);
+            acc->next_job++;
+            acc->job = NULL;
+        }
+    }
+
+    acc->block_started = false;
+    acc->block_offset = 0;
+    queue_release(&iq_block_queue);
+    atomic_fetch_add_explicit(&blocks_processed, 1, memory_order_relaxed);
+
+    return true;
+}
+
+static void *dispatch_thread(void *arg) {
+    dsp_accumulator_t acc = {0};
+    acc.carry = malloc(max_fft_size * 2);
+    acc.sum = malloc(max_fft_size * sizeof(float));
+    if (acc.carry == NULL || acc.sum == NULL) {
+        fprintf(stderr, "Could not create dsp accumulator\n");
+        return NULL;
+    }
+
+    while (atomic_load_explicit(&running, memory_order_relaxed)) {
+        apply_fft(&acc);
+        bool busy = collect_lines(&acc);
+        busy |= dispatch_block(&acc);
+        if (!busy) {
+            nanosleep(&idle, NULL);
+        }
+    }
+
+    free(acc.carry);
+    free(acc.sum);
+    return NULL;
+}
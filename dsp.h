@@ -0,0 +1,146 @@
+//
+// Created by dbrent on 3/6/21.
+//
+
+#ifndef DBSDR_DSP_H
+#define DBSDR_DSP_H
+
+#include "binning.h"
+#include "fft.h"
+#include "queue.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define IQ_BLOCK_QUEUE_SIZE 32
+#define DSP_JOB_QUEUE_SIZE 4
+#define DSP_MAX_WORKERS 64
+#define DSP_MAX_OVERLAP 0.9f
+#define DSP_MAX_TAPS 4
+#define DSP_VIEW_ONE 2147483648.0 // 2^31, fixed point view bounds
+
+// Where samples came from: the tune generation, bumped by every
+// dsp_retune(), the frequency it stands for and the stream position of the
+// first sample, counted over everything the source delivered.
+typedef struct dsp_tag {
+    uint64_t first_sample;
+    uint64_t frequency;
+    uint32_t generation;
+} dsp_tag_t;
+
+// One USB transfer worth of raw interleaved int8 IQ. The sequence number is
+// assigned on the receive thread to every transfer past a retune's settle
+// window, including the ones dropped on a full queue, so gaps show up on
+// the DSP side. Settling ones get none, tag.first_sample still shows them.
+typedef struct iq_block {
+    uint64_t sequence;
+    dsp_tag_t tag;
+    uint64_t received_ns; // CLOCK_MONOTONIC when the source handed it over
+    size_t n_samples;
+    size_t bytes_per_sample;
+    int8_t samples[];
+} iq_block_t;
+
+// One spectrum on the line queue, in dB. Slots are sized for the largest
+// FFT, see DSP_LINE_BYTES, n_bins says how much of it is used. Lines never
+// mix tune generations, tag.first_sample is where the first FFT started.
+// span is the Hz the bins cover, centred on tag.frequency, and rbw the noise
+// bandwidth of the FFT bins behind them (bin width times the window's ENBW).
+typedef struct spectrum_line {
+    dsp_tag_t tag;
+    float span;
+    float rbw;
+    uint32_t n_bins;
+    float bins[];
+} spectrum_line_t;
+
+#define DSP_LINE_BYTES(max_bins)                                               \
+    (sizeof(spectrum_line_t) + (max_bins) * sizeof(float))
+
+// FFTs run over the continuous sample stream, not per block, so fft_size
+// may be smaller or much larger than a block. Consecutive FFTs share
+// overlap (0 - DSP_MAX_OVERLAP) of their samples.
+// fft_size and window can be changed later with dsp_set_fft(), up to
+// max_fft_size. With line_rate set, as many consecutive FFTs as it takes to
+// get down to about that many lines per second are averaged (Welch) into
+// each line, 0 for one line per FFT. With display_width set, lines come out
+// already binned to that many pixels, dc in the middle, see dsp_set_view().
+typedef struct dsp_config {
+    size_t fft_size;
+    size_t max_fft_size;
+    fft_window_t window;
+    float overlap;
+    double sample_rate;
+    double line_rate;
+    size_t max_block_samples;
+    int workers;
+    int display_width; // 0 for whole FFT lines
+    binning_reducer_t reducer;
+    uint64_t frequency; // tuned to at the start, for the tags
+} dsp_config_t;
+
+typedef struct dsp_stats {
+    uint64_t blocks_received;
+    uint64_t blocks_dropped;
+    uint64_t blocks_processed;
+    uint64_t sequence_gaps;
+    uint64_t blocks_settling; // dropped while a retune settled
+    uint32_t generation;
+    uint64_t lines_emitted;
+    uint64_t lines_dropped;
+    size_t fft_size; // 0 until the first setup runs
+    int fft_window;
+    uint32_t average; // FFTs per line
+    int workers;
+    uint64_t worker_jobs[DSP_MAX_WORKERS];
+    queue_stats_t iq_queue;
+} dsp_stats_t;
+
+bool dsp_init(const dsp_config_t *config, queue_t *line_queue);
+
+void dsp_destroy(void);
+
+// Part of the band binned into display rows, as fractions from the bottom
+// (-sample rate / 2) to the top, and the reducer to bin with. Takes effect
+// from the next line.
+bool dsp_set_view(double start, double end, binning_reducer_t reducer);
+
+// The source is about to be retuned. Blocks received until the
+// dsp_retune() that follows may come from either tuning and are dropped.
+void dsp_retune_begin(void);
+
+// The source was just retuned to frequency. Blocks from the next one on
+// carry a new tune generation, and the first settle_samples of them, still
+// from the old tuning or settling, are dropped. Returns the generation.
+uint32_t dsp_retune(uint64_t frequency, size_t settle_samples);
+
+// Sees every raw block on the DSP thread in stream order, before any of it
+// goes into an FFT. missing samples never arrived just before it, and
+// retuned is set on the first block of a tune generation.
+typedef void (*dsp_tap)(void *ctx, const iq_block_t *block, uint64_t missing,
+                        bool retuned);
+
+// Tap the ordered raw stream, e.g. recorder_tap(), demod_tap() or
+// zoom_tap(). Up to DSP_MAX_TAPS, added before dsp_start().
+bool dsp_add_tap(dsp_tap tap, void *ctx);
+
+// Archive every spectrum line as it is emitted, ahead of the render
+// thread, see archive.h. Set before dsp_start().
+struct archive;
+void dsp_set_archive(struct archive *archive);
+
+// Switch FFT size and/or window on the fly. The new setup is planned in the
+// background and the old one keeps running until it is ready, sizes and
+// windows used before switch immediately.
+bool dsp_set_fft(size_t fft_size, fft_window_t window);
+
+bool dsp_start(void);
+
+void dsp_stop(void);
+
+void dsp_receive(void *samples, size_t n_samples, size_t bytes_per_sample);
+
+void dsp_get_stats(dsp_stats_t *stats);
+
+#endif //DBSDR_DSP_H
@@ -4,68 +4,529 @@
 
 #include "fft.h"
 
-#include "fftw3.h"
-
+#include <errno.h>
 #include <math.h>
+#include <pthread.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
 #define PI 3.14159265358979
+#define LOG2_10 3.32192809f
+#define FFT_CACHE_SIZES (FFT_MAX_SIZE_LOG2 - FFT_MIN_SIZE_LOG2 + 1)
+
+#ifdef FFT_DOUBLE
+#define FFT_WISDOM_SUFFIX "fftw"
+#else
+#define FFT_WISDOM_SUFFIX "fftwf"
+#endif
+
+enum setup_state {
+    SETUP_EMPTY,
+    SETUP_QUEUED,   // waiting for the planner thread
+    SETUP_PLANNING, // claimed by the planner or a waiter
+    SETUP_READY,
+    SETUP_FAILED,
+};
+
+static const char *window_names[FFT_WINDOW_COUNT] = {
+        "hann",
+        "blackman-harris",
+        "flat-top",
+        "kaiser",
+};
+
+// the FFTW planner is not thread safe, only fftw_execute is
+static pthread_mutex_t planner_lock = PTHREAD_MUTEX_INITIALIZER;
+static fft_plan plans[FFT_CACHE_SIZES]; // under planner_lock
+static unsigned planner_rigor = FFTW_MEASURE;
+static double planner_time_limit = FFTW_NO_TIMELIMIT;
+static bool wisdom_dirty = false; // plans measured since the last save
+
+// cache state changes and the planner thread, under cache_lock
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cache_cond = PTHREAD_COND_INITIALIZER;
+static fft_setup_t cache[FFT_CACHE_SIZES][FFT_WINDOW_COUNT];
+static pthread_t planner;
+static bool planner_started = false;
+static bool planner_stop = false;
+
+static inline float logPower(const fft_complex c, float scale) {
+    float re = (float)c[0] * scale;
+    float im = (float)c[1] * scale;
+    float magsq = re * re + im * im;
+    return log2f(magsq) * (10.0f / LOG2_10);
+}
+
+static double bessel_i0(double x) {
+    double sum = 1.0;
+    double term = 1.0;
+    for (int k = 1; k < 64 && term > sum * 1e-12; k++) {
+        term *= (x / (2.0 * k)) * (x / (2.0 * k));
+        sum += term;
+    }
+    return sum;
+}
+
+double fft_kaiser(double beta, double r) {
+    return bessel_i0(beta * sqrt(1.0 - r * r)) / bessel_i0(beta);
+}
+
+static double window_value(fft_window_t window, size_t i, size_t size) {
+    double x = 2 * PI * i / (size - 1);
+    switch (window) {
+    case FFT_WINDOW_BLACKMAN_HARRIS:
+        return 0.35875 - 0.48829 * cos(x) + 0.14128 * cos(2 * x) -
+               0.01168 * cos(3 * x);
+    case FFT_WINDOW_FLAT_TOP:
+        return 0.21557895 - 0.41663158 * cos(x) + 0.277263158 * cos(2 * x) -
+               0.083578947 * cos(3 * x) + 0.006947368 * cos(4 * x);
+    case FFT_WINDOW_KAISER:
+        return fft_kaiser(FFT_KAISER_BETA, 2.0 * i / (size - 1) - 1.0);
+    case FFT_WINDOW_HANN:
+    default:
+        return 0.5 * (1.0 - cos(x));
+    }
+}
+
+static int size_index(size_t size) {
+    if (size < FFT_MIN_SIZE || size > FFT_MAX_SIZE ||
+        (size & (size - 1)) != 0) {
+        return -1;
+    }
+    int log2 = 0;
+    while (((size_t)1 << log2) < size) {
+        log2++;
+    }
+    return log2 - FFT_MIN_SIZE_LOG2;
+}
+
+// With planner_lock held. Only a plan wisdom didn't have adds anything
+// worth saving.
+static fft_plan plan_dft(size_t size, fft_complex *in, fft_complex *out) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    FFTW(set_timelimit)(planner_time_limit);
+    fft_plan plan = FFTW(plan_dft_1d)(
+            (int)size, in, out, FFTW_FORWARD,
+            planner_rigor | FFTW_DESTROY_INPUT | FFTW_WISDOM_ONLY);
+    if (plan == NULL) {
+        plan = FFTW(plan_dft_1d)((int)size, in, out, FFTW_FORWARD,
+                                 planner_rigor | FFTW_DESTROY_INPUT);
+        if (plan != NULL) {
+            wisdom_dirty = true;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double ms = (end.tv_sec - start.tv_sec) * 1e3 +
+                (end.tv_nsec - start.tv_nsec) / 1e6;
+    // wisdom makes this near instant, only mention the slow ones
+    if (ms >= 10.0) {
+        fprintf(stderr, "Planned %zu point FFT in %.0f ms\n", size, ms);
+    }
+    return plan;
+}
+
+// Fill in one cache entry, the plan is only made for the first window of a
+// size. Runs without cache_lock held.
+static void plan_setup(fft_setup_t *setup, int index) {
+    size_t size = setup->size;
+    fft_real *coefficients = FFTW(malloc)(sizeof(fft_real) * size);
+    if (coefficients == NULL) {
+        fprintf(stderr, "Could not allocate fft window of size %zu\n", size);
+        atomic_store_explicit(&setup->state, SETUP_FAILED,
+                              memory_order_release);
+        return;
+    }
+
+    // every window is scaled to Hann's coherent gain, so a tone reads the
+    // same level whichever one is picked, with the int8 -> [-1, 1) scale
+    // folded in
+    double sum = 0;
+    double sum_sq = 0;
+    for (size_t i = 0; i < size; i++) {
+        double w = window_value(setup->window, i, size);
+        sum += w;
+        sum_sq += w * w;
+    }
+    double scale = (double)(size - 1) / 2.0 / sum;
+    for (size_t i = 0; i < size; i++) {
+        double w = window_value(setup->window, i, size);
+        coefficients[i] = (fft_real)(w * scale / 128.0);
+    }
+    setup->enbw = (double)size * sum_sq / (sum * sum);
+
+    pthread_mutex_lock(&planner_lock);
+    if (plans[index] == NULL) {
+        // plans are run with fft_execute_dft on each context's own
+        // buffers, these only have to match their alignment
+        fft_complex *in = FFTW(malloc)(sizeof(fft_complex) * size);
+        fft_complex *out = FFTW(malloc)(sizeof(fft_complex) * size);
+        if (in != NULL && out != NULL) {
+            plans[index] = plan_dft(size, in, out);
+        }
+        FFTW(free)(in);
+        FFTW(free)(out);
+    }
+    setup->plan = plans[index];
+    pthread_mutex_unlock(&planner_lock);
+
+    if (setup->plan == NULL) {
+        fprintf(stderr, "Could not plan fft of size %zu\n", size);
+        FFTW(free)(coefficients);
+        atomic_store_explicit(&setup->state, SETUP_FAILED,
+                              memory_order_release);
+        return;
+    }
+    setup->coefficients = coefficients;
+    atomic_store_explicit(&setup->state, SETUP_READY, memory_order_release);
+}
+
+static void *planner_thread(void *arg) {
+    pthread_mutex_lock(&cache_lock);
+    while (!planner_stop) {
+        fft_setup_t *setup = NULL;
+        int index = 0;
+        for (int i = 0; i < FFT_CACHE_SIZES && setup == NULL; i++) {
+            for (int w = 0; w < FFT_WINDOW_COUNT; w++) {
+                if (atomic_load(&cache[i][w].state) == SETUP_QUEUED) {
+                    setup = &cache[i][w];
+                    index = i;
+                    break;
+                }
+            }
+        }
+        if (setup == NULL) {
+            pthread_cond_wait(&cache_cond, &cache_lock);
+            continue;
+        }
+
+        atomic_store(&setup->state, SETUP_PLANNING);
+        pthread_mutex_unlock(&cache_lock);
+        plan_setup(setup, index);
+        pthread_mutex_lock(&cache_lock);
+        pthread_cond_broadcast(&cache_cond);
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    return NULL;
+}
+
+static fft_setup_t *cache_entry(size_t size, fft_window_t window,
+                                int *index) {
+    *index = size_index(size);
+    if (*index < 0 || window < 0 || window >= FFT_WINDOW_COUNT) {
+        fprintf(stderr, "Unsupported fft: %zu points, window %d\n", size,
+                (int)window);
+        return NULL;
+    }
+    fft_setup_t *setup = &cache[*index][window];
+    if (atomic_load(&setup->state) == SETUP_EMPTY) {
+        setup->size = size;
+        setup->window = window;
+    }
+    return setup;
+}
+
+const char *fft_window_name(fft_window_t window) {
+    if (window < 0 || window >= FFT_WINDOW_COUNT) {
+        return "unknown";
+    }
+    return window_names[window];
+}
+
+const fft_setup_t *fft_setup_get(size_t size, fft_window_t window) {
+    int index;
+    pthread_mutex_lock(&cache_lock);
+    fft_setup_t *setup = cache_entry(size, window, &index);
+    if (setup == NULL) {
+        pthread_mutex_unlock(&cache_lock);
+        return NULL;
+    }
+    int state = atomic_load_explicit(&setup->state, memory_order_acquire);
+    if (state == SETUP_EMPTY) {
+        if (!planner_started) {
+            if (pthread_create(&planner, NULL, planner_thread, NULL) != 0) {
+                fprintf(stderr, "Could not create fft planner thread\n");
+                pthread_mutex_unlock(&cache_lock);
+                return NULL;
+            }
+            planner_started = true;
+        }
+        atomic_store(&setup->state, SETUP_QUEUED);
+        pthread_cond_broadcast(&cache_cond);
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    return state == SETUP_READY ? setup : NULL;
+}
+
+const fft_setup_t *fft_setup_wait(size_t size, fft_window_t window) {
+    int index;
+    pthread_mutex_lock(&cache_lock);
+    fft_setup_t *setup = cache_entry(size, window, &index);
+    if (setup == NULL) {
+        pthread_mutex_unlock(&cache_lock);
+        return NULL;
+    }
+    int state = atomic_load(&setup->state);
+    if (state == SETUP_EMPTY || state == SETUP_QUEUED) {
+        // nobody is on it yet, plan here rather than wait for the planner
+        atomic_store(&setup->state, SETUP_PLANNING);
+        pthread_mutex_unlock(&cache_lock);
+        plan_setup(setup, index);
+        pthread_mutex_lock(&cache_lock);
+        pthread_cond_broadcast(&cache_cond);
+    }
+    while ((state = atomic_load(&setup->state)) == SETUP_PLANNING) {
+        pthread_cond_wait(&cache_cond, &cache_lock);
+    }
+    pthread_mutex_unlock(&cache_lock);
 
-static float *fft_window;
-static fftw_plan fft_plan;
-static size_t fft_size;
+    return state == SETUP_READY ? setup : NULL;
+}
+
+void fft_set_rigor(unsigned rigor, double time_limit) {
+    pthread_mutex_lock(&planner_lock);
+    planner_rigor = rigor;
+    planner_time_limit = time_limit > 0 ? time_limit : FFTW_NO_TIMELIMIT;
+    pthread_mutex_unlock(&planner_lock);
+}
 
-static float logPower(const fftw_complex c, float scale) {
-  float re = (float) c[0] * scale;
-  float im = (float) c[1] * scale;
-  float magsq = re * re + im * im;
-  return (float) (log2f(magsq) * 10.0f / log2(10.0));
+static bool make_dir(const char *path) {
+    if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Could not create %s\n", path);
+        return false;
+    }
+    return true;
 }
 
-float *fft(const int8_t *samples) {
-  fftw_complex *fft_in = fftw_malloc(sizeof(fftw_complex) * fft_size);
-  fftw_complex *fft_out = fftw_malloc(sizeof(fftw_complex) * fft_size);
+const char *fft_wisdom_path(char *path, size_t len) {
+    char dir[4096];
+    const char *cache = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    if (cache != NULL && cache[0] != '\0') {
+        snprintf(dir, sizeof(dir), "%s", cache);
+    } else if (home != NULL && home[0] != '\0') {
+        snprintf(dir, sizeof(dir), "%s/.cache", home);
+        if (!make_dir(dir)) {
+            return NULL;
+        }
+    } else {
+        return NULL;
+    }
+    size_t n = strlen(dir);
+    snprintf(dir + n, sizeof(dir) - n, "/dbsdr");
+    if (!make_dir(dir)) {
+        return NULL;
+    }
+
+    // plans are only any good on the machine that measured them
+    char host[256] = "localhost";
+    gethostname(host, sizeof(host) - 1);
+    host[sizeof(host) - 1] = '\0';
+    if (snprintf(path, len, "%s/wisdom-%s." FFT_WISDOM_SUFFIX, dir, host) >=
+        (int)len) {
+        return NULL;
+    }
+    return path;
+}
+
+bool fft_wisdom_load(const char *path) {
+    pthread_mutex_lock(&planner_lock);
+    bool loaded = FFTW(import_wisdom_from_filename)(path) != 0;
+    pthread_mutex_unlock(&planner_lock);
+    if (loaded) {
+        fprintf(stderr, "Loaded FFT wisdom from %s\n", path);
+    } else if (access(path, F_OK) == 0) {
+        fprintf(stderr, "Could not read FFT wisdom from %s\n", path);
+    }
+    return loaded;
+}
+
+bool fft_wisdom_save(const char *path) {
+    pthread_mutex_lock(&planner_lock);
+    if (!wisdom_dirty) {
+        pthread_mutex_unlock(&planner_lock);
+        return true;
+    }
+    // write a temporary and rename it, a half written file would cost a
+    // full replan on the next start
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+    bool saved = FFTW(export_wisdom_to_filename)(tmp) != 0 &&
+                 rename(tmp, path) == 0;
+    if (saved) {
+        wisdom_dirty = false;
+    } else {
+        unlink(tmp);
+    }
+    pthread_mutex_unlock(&planner_lock);
+
+    if (!saved) {
+        fprintf(stderr, "Could not save FFT wisdom to %s\n", path);
+    }
+    return saved;
+}
+
+fft_context_t *fft_context_create(size_t capacity) {
+    fft_context_t *ctx = malloc(sizeof(fft_context_t));
+    if (ctx == NULL) {
+        fprintf(stderr, "Could not create fft context\n");
+        return NULL;
+    }
+    ctx->capacity = capacity;
+    ctx->size = 0;
+    ctx->setup = NULL;
+    ctx->kernels = kernels_get();
+    ctx->in = FFTW(malloc)(sizeof(fft_complex) * capacity);
+    ctx->out = FFTW(malloc)(sizeof(fft_complex) * capacity);
+    if (ctx->in == NULL || ctx->out == NULL) {
+        fprintf(stderr, "Could not allocate fft buffers of size %zu\n",
+                capacity);
+        fft_context_destroy(ctx);
+        return NULL;
+    }
+
+    return ctx;
+}
+
+void fft_context_destroy(fft_context_t *ctx) {
+    if (ctx == NULL) {
+        return;
+    }
+    FFTW(free)(ctx->out);
+    FFTW(free)(ctx->in);
+    free(ctx);
+}
+
+bool fft_context_set(fft_context_t *ctx, const fft_setup_t *setup) {
+    if (setup == NULL || setup->size > ctx->capacity) {
+        return false;
+    }
+    ctx->setup = setup;
+    ctx->size = setup->size;
+    return true;
+}
+
+void fft_execute(fft_context_t *ctx, const int8_t *samples, float *line) {
+    fft_load(ctx, samples);
+    fft_transform(ctx);
+    fft_log_power(ctx, line);
+}
+
+void fft_load(fft_context_t *ctx, const int8_t *samples) {
+#ifdef FFT_DOUBLE
+    const size_t size = ctx->size;
+    const fft_real *window = ctx->setup->coefficients;
+    fft_complex *in = ctx->in;
 
 #pragma omp simd
-  for (size_t i = 0; i < fft_size; i++) {
-    fft_in[i][0] = samples[2 * i] * fft_window[i] * (1.0f / 128.0f);
-    fft_in[i][1] = samples[2 * i + 1] * fft_window[i] * (1.0f / 128.0f);
-  }
+    for (size_t i = 0; i < size; i++) {
+        in[i][0] = samples[2 * i] * window[i];
+        in[i][1] = samples[2 * i + 1] * window[i];
+    }
+#else
+    ctx->kernels->load(samples, ctx->setup->coefficients, (float *)ctx->in,
+                       ctx->size);
+#endif
+}
+
+void fft_transform(fft_context_t *ctx) {
+    FFTW(execute_dft)(ctx->setup->plan, ctx->in, ctx->out);
+}
 
-  fftw_execute_dft(fft_plan, fft_in, fft_out);
+void fft_log_power(fft_context_t *ctx, float *line) {
+    const size_t size = ctx->size;
+    const float scale = 1.0f / (float)size;
+#ifdef FFT_DOUBLE
+    const fft_complex *out = ctx->out;
 
-  float *line = malloc(sizeof(float) * fft_size);
 #pragma omp simd
-  for (size_t i = 0; i < fft_size; i++) {
-    line[i] = logPower(fft_out[i], 1.0f / fft_size);
-  }
+    for (size_t i = 0; i < size; i++) {
+        line[i] = logPower(out[i], scale);
+    }
+#else
+    ctx->kernels->log_power((const float *)ctx->out, scale, line, size);
+#endif
 
-  line[0] = line[1]; // remove dc bias
+    line[0] = line[1]; // remove dc bias
+}
 
-  fftw_free(fft_out);
-  fftw_free(fft_in);
+void fft_accumulate_power(fft_context_t *ctx, float *sum) {
+#ifdef FFT_DOUBLE
+    const size_t size = ctx->size;
+    const fft_complex *out = ctx->out;
 
-  return line;
+#pragma omp simd
+    for (size_t i = 0; i < size; i++) {
+        float re = (float)out[i][0];
+        float im = (float)out[i][1];
+        sum[i] += re * re + im * im;
+    }
+#else
+    ctx->kernels->accumulate_power((const float *)ctx->out, sum, ctx->size);
+#endif
 }
 
-void fft_init(size_t size) {
-  fft_size = size;
+void fft_power_to_db(const float *sum, size_t size, uint32_t count,
+                     float *line) {
+    // same scale as logPower(), 1 / size on each component, then the mean
+    const float scale = 1.0f / ((float)size * (float)size * (float)count);
+    kernels_get()->power_to_db(sum, scale, line, size);
+
+    line[0] = line[1]; // remove dc bias
+}
 
-  fft_window = malloc(sizeof(float) * fft_size);
-  for (size_t i = 0; i < fft_size; i++) {
-    fft_window[i] = 0.5f * (1.0f - cos(2 * PI * i / (fft_size - 1)));
-  }
+fft_plan fft_plan_create(size_t size, fft_complex *in, fft_complex *out) {
+    pthread_mutex_lock(&planner_lock);
+    fft_plan plan = plan_dft(size, in, out);
+    pthread_mutex_unlock(&planner_lock);
+    if (plan == NULL) {
+        fprintf(stderr, "Could not plan fft of size %zu\n", size);
+    }
+    return plan;
+}
 
-  fftw_complex *fft_in = fftw_malloc(sizeof(fftw_complex) * fft_size);
-  fftw_complex *fft_out = fftw_malloc(sizeof(fftw_complex) * fft_size);
-  fft_plan = fftw_plan_dft_1d(fft_size, fft_in, fft_out, FFTW_FORWARD,
-                              FFTW_MEASURE | FFTW_DESTROY_INPUT);
-  fftw_free(fft_out);
-  fftw_free(fft_in);
+void fft_plan_destroy(fft_plan plan) {
+    if (plan == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&planner_lock);
+    FFTW(destroy_plan)(plan);
+    pthread_mutex_unlock(&planner_lock);
 }
 
-void fft_destroy() {
-  free(fft_window);
-  fftw_destroy_plan(fft_plan);
-  fftw_cleanup();
-}
\ No newline at end of file
+void fft_cleanup(void) {
+    pthread_mutex_lock(&cache_lock);
+    planner_stop = true;
+    pthread_cond_broadcast(&cache_cond);
+    pthread_mutex_unlock(&cache_lock);
+    if (planner_started) {
+        pthread_join(planner, NULL);
+        planner_started = false;
+    }
+    planner_stop = false;
+
+    for (int i = 0; i < FFT_CACHE_SIZES; i++) {
+        for (int w = 0; w < FFT_WINDOW_COUNT; w++) {
+            FFTW(free)(cache[i][w].coefficients);
+            cache[i][w].coefficients = NULL;
+            cache[i][w].plan = NULL;
+            atomic_store(&cache[i][w].state, SETUP_EMPTY);
+        }
+    }
+
+    pthread_mutex_lock(&planner_lock);
+    for (int i = 0; i < FFT_CACHE_SIZES; i++) {
+        if (plans[i] != NULL) {
+            FFTW(destroy_plan)(plans[i]);
+            plans[i] = NULL;
+        }
+    }
+    FFTW(cleanup)();
+    pthread_mutex_unlock(&planner_lock);
+}
@@ -5,13 +5,133 @@
 #ifndef DBSDR_FFT_H
 #define DBSDR_FFT_H
 
+#include "fftw3.h"
+#include "kernels.h"
+
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
-float *fft(const int8_t *samples);
+// Single precision unless built with FFT_DOUBLE.
+#ifdef FFT_DOUBLE
+#define FFTW(name) fftw_##name
+typedef double fft_real;
+#else
+#define FFTW(name) fftwf_##name
+typedef float fft_real;
+#endif
+
+typedef FFTW(complex) fft_complex;
+typedef FFTW(plan) fft_plan;
+
+// Power of two sizes only.
+#define FFT_MIN_SIZE_LOG2 8
+#define FFT_MAX_SIZE_LOG2 22
+#define FFT_MIN_SIZE (1 << FFT_MIN_SIZE_LOG2)
+#define FFT_MAX_SIZE (1 << FFT_MAX_SIZE_LOG2)
+#define FFT_KAISER_BETA 9.0
+
+typedef enum fft_window {
+    FFT_WINDOW_HANN,
+    FFT_WINDOW_BLACKMAN_HARRIS,
+    FFT_WINDOW_FLAT_TOP,
+    FFT_WINDOW_KAISER,
+    FFT_WINDOW_COUNT,
+} fft_window_t;
+
+// Plan and window table for one (size, window). Setups live in a cache
+// until fft_cleanup() and are read only once ready, so any number of
+// contexts can share one. Plans are shared between windows of one size.
+typedef struct fft_setup {
+    size_t size;
+    fft_window_t window;
+    fft_real *coefficients; // window pre-scaled for int8 input
+    double enbw;            // equivalent noise bandwidth, in bins
+    fft_plan plan;
+    atomic_int state;
+} fft_setup_t;
+
+// Per thread buffers for transforms up to capacity points. Nothing is
+// allocated after fft_context_create(), so one context per worker can run
+// lock free and switch setups between transforms. kernels start out as the
+// fastest this CPU has (unused with FFT_DOUBLE).
+typedef struct fft_context {
+    size_t capacity;
+    size_t size;
+    const fft_setup_t *setup;
+    const kernels_t *kernels;
+    fft_complex *in;
+    fft_complex *out;
+} fft_context_t;
+
+const char *fft_window_name(fft_window_t window);
+
+// Kaiser window at r (-1 to 1 across it), for filter design too.
+double fft_kaiser(double beta, double r);
+
+// Cached setup for (size, window), or NULL while it is still being planned
+// on the background planner thread (which this starts if needed) or when
+// planning failed. Never blocks on the planner.
+const fft_setup_t *fft_setup_get(size_t size, fft_window_t window);
+
+// Same, but waits for planning to finish. NULL only on failure.
+const fft_setup_t *fft_setup_wait(size_t size, fft_window_t window);
+
+// A plan of any size outside the setup cache, for transforms from in to
+// out or buffers aligned like them, which planning may overwrite. Made with
+// the current rigor and wisdom. NULL on failure. Destroy it before
+// fft_cleanup().
+fft_plan fft_plan_create(size_t size, fft_complex *in, fft_complex *out);
+
+void fft_plan_destroy(fft_plan plan);
+
+// FFTW planning rigor for plans made from now on: FFTW_MEASURE (the
+// default), FFTW_PATIENT or FFTW_EXHAUSTIVE. time_limit is in seconds, 0
+// for none.
+void fft_set_rigor(unsigned rigor, double time_limit);
+
+// Per host wisdom file under $XDG_CACHE_HOME/dbsdr (or ~/.cache/dbsdr),
+// creating the directory. NULL if there is nowhere to put it.
+const char *fft_wisdom_path(char *path, size_t len);
+
+// Plans made with loaded wisdom come back in milliseconds. Wisdom from a
+// more thorough rigor also serves the default one.
+bool fft_wisdom_load(const char *path);
+
+// Writes the file only when new plans were made since the last load/save.
+bool fft_wisdom_save(const char *path);
+
+fft_context_t *fft_context_create(size_t capacity);
+
+void fft_context_destroy(fft_context_t *ctx);
+
+// Point the context at a ready setup no larger than its capacity.
+bool fft_context_set(fft_context_t *ctx, const fft_setup_t *setup);
+
+// Windowed FFT of size interleaved int8 IQ samples, written to line as dB.
+// Same as fft_load(), fft_transform() then fft_log_power().
+void fft_execute(fft_context_t *ctx, const int8_t *samples, float *line);
+
+// The stages of fft_execute(), separately so they can be timed on their own.
+// int8 IQ -> windowed complex in ctx->in.
+void fft_load(fft_context_t *ctx, const int8_t *samples);
+
+// ctx->in -> ctx->out
+void fft_transform(fft_context_t *ctx);
+
+// ctx->out -> dB power, with the dc bin replaced by its neighbour.
+void fft_log_power(fft_context_t *ctx, float *line);
+
+// Welch averaging: add |ctx->out|^2 into sum (linear, unscaled), then turn
+// the mean of count such spectra into dB on the same scale as
+// fft_log_power().
+void fft_accumulate_power(fft_context_t *ctx, float *sum);
 
-void fft_destroy();
+void fft_power_to_db(const float *sum, size_t size, uint32_t count,
+                     float *line);
 
-void fft_init(size_t size);
+// Stops the planner and frees every cached setup.
+void fft_cleanup(void);
 
 #endif //DBSDR_FFT_H
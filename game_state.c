@@ -3,6 +3,7 @@
 //
 
 #include "game_state.h"
+#include "palette.h"
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -29,16 +30,34 @@ game_state_t *game_state_init() {
         exit(-1);
     }
 
+    gs->config = malloc(sizeof(config_t));
+    if (gs->config == NULL) {
+        fprintf(stderr, "Could not create game state - config\n");
+        exit(-1);
+    }
+    config_defaults(gs->config);
+
     //game_state->cursor = custom_cursor(window);
     gs->should_close = 0;
     gs->window_state->resizing = 0;
     gs->window_state->width = DEFAULT_WIDTH;
     gs->window_state->height = DEFAULT_HEIGHT;
+    gs->window_state->panel_width = 0;
+    gs->window_state->history_top = -1;
+    gs->window_state->history_scale = 1;
     gs->window_state->aspect =
             (float) DEFAULT_WIDTH / (float) DEFAULT_HEIGHT;
     gs->window_state->aspect = 1.0f;
     gs->window_state->zoom = 500.0f;
+    gs->window_state->min_db = DEFAULT_MIN_DB;
+    gs->window_state->max_db = DEFAULT_MAX_DB;
+    gs->window_state->palette = PALETTE_TURBO;
+    gs->window_state->update_palette = 0;
     gs->sdr_state->frequency = DEFAULT_FREQUENCY;
+    gs->sdr_state->view_start = 0.0;
+    gs->sdr_state->view_end = 1.0;
+    gs->sdr_state->sweeping = false;
+    gs->sdr_state->retune_pending = false;
 
     return gs;
 }
@@ -51,6 +70,48 @@ void game_state_destroy(game_state_t *gs) {
     gs->window_state = NULL;
     free(gs->sdr_state);
     gs->sdr_state = NULL;
+    free(gs->config);
+    gs->config = NULL;
     free(gs);
     gs = NULL;
-}
\ No newline at end of file
+}
+
+void sdr_state_set_view(sdr_state_t *sdr, double factor, double anchor,
+                        double offset) {
+    double span = sdr->view_end - sdr->view_start;
+    double point = sdr->view_start + span * anchor;
+    span *= factor;
+    if (span > 1.0) {
+        span = 1.0;
+    }
+    if (span < MIN_VIEW_SPAN) {
+        span = MIN_VIEW_SPAN;
+    }
+    double start = point - span * anchor + span * offset;
+    if (start < 0.0) {
+        start = 0.0;
+    }
+    if (start + span > 1.0) {
+        start = 1.0 - span;
+    }
+    sdr->view_start = start;
+    sdr->view_end = start + span;
+}
+
+void sdr_state_request_retune(sdr_state_t *sdr, int64_t offset, double now) {
+    sdr->frequency += offset;
+    if (!sdr->retune_pending) {
+        sdr->retune_first = now;
+    }
+    sdr->retune_last = now;
+    sdr->retune_pending = true;
+}
+
+bool sdr_state_retune_due(sdr_state_t *sdr, double now) {
+    if (!sdr->retune_pending || (now - sdr->retune_last < RETUNE_DEBOUNCE &&
+                                 now - sdr->retune_first < RETUNE_MAX_DELAY)) {
+        return false;
+    }
+    sdr->retune_pending = false;
+    return true;
+}
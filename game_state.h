@@ -11,4 +11,16 @@ game_state_t *game_state_init();
 
 void game_state_destroy(game_state_t *gs);
 
+// Zoom the view by factor keeping the point at anchor (0 - 1 across the
+// view) in place, then pan by offset (of the view), staying inside the band.
+void sdr_state_set_view(sdr_state_t *sdr, double factor, double anchor,
+                        double offset);
+
+// Move frequency by offset Hz, debounced: the radio follows once
+// sdr_state_retune_due() says so.
+void sdr_state_request_retune(sdr_state_t *sdr, int64_t offset, double now);
+
+// True (once) when a pending retune should go to the radio now.
+bool sdr_state_retune_due(sdr_state_t *sdr, double now);
+
 #endif //DBSDR_GAME_STATE_H
@@ -1,6 +1,8 @@
 #ifndef DBSDR_GLOBAL_H
 #define DBSDR_GLOBAL_H
 
+#include "config.h"
+#include "dsp.h"
 #include "linmath.h"
 #include "mouse.h"
 #include "queue.h"
@@ -11,13 +13,40 @@
 #define DEFAULT_FREQUENCY 106120000 // 860721500 //
 #define DEFAULT_LNA_GAIN 24
 #define DEFAULT_VGA_GAIN 24
-#define FFT_SIZE 8192 // max BYTES_PER_TRANSFER
-#define WATERFALL_WIDTH 1280
 #define WATERFALL_HEIGHT 640
+#define MAG_LINE_QUEUE_SIZE 256
+#define WATERFALL_LINES_PER_FRAME 4
+#define DEFAULT_MIN_DB -90.0f
+#define DEFAULT_MAX_DB -20.0f
+#define DB_STEP 5.0f
+#define MIN_VIEW_SPAN (1.0 / 1024) // of the band, deepest zoom
+#define ZOOM_STEP 2.0
+#define SCROLL_ZOOM_STEP 1.25
+#define PAN_STEP 0.25 // of the view
+#define TUNE_STEP 1000000
+// retunes wait for this long without tuning input, but no longer than
+// RETUNE_MAX_DELAY while it keeps coming (s)
+#define RETUNE_DEBOUNCE 0.05
+#define RETUNE_MAX_DELAY 0.25
+// full FFT resolution up to this many bins, bigger FFTs are binned down to
+// it on the DSP side
+#define WATERFALL_MAX_TEXTURE_WIDTH 16384
+// the zoom FFT's waterfall takes this many pixels on the right
+#define ZOOM_PANEL_WIDTH 320
+#define HISTORY_SEEK 600.0 // s back in the archive for Shift+Home
+#define HISTORY_MAX_SCALE ((uint64_t)1 << 24) // archive lines a row
 
 typedef struct sdr_state {
     int64_t frequency;
-    float *last_line;
+    size_t fft_size;
+    fft_window_t fft_window;
+    double view_start; // part of the band shown, 0 - 1, zoomed in the shader
+    double view_end;
+    binning_reducer_t reducer;
+    bool sweeping; // the band is a swept panorama, nothing to retune
+    bool retune_pending; // frequency changed, the radio not yet
+    double retune_first; // glfwGetTime() of the oldest pending request
+    double retune_last;
 } sdr_state_t;
 
 typedef struct mouse_state {
@@ -33,8 +62,15 @@ typedef struct window_state {
     float zoom;
     int width;
     int height;
+    int panel_width; // on the right, not showing the wideband waterfall
+    int64_t history_top; // newest archive line shown, -1 for live
+    uint64_t history_scale; // archive lines a row
     int update_aspect;
     int resizing;
+    float min_db;
+    float max_db;
+    int palette;
+    int update_palette;
     mat4x4 mvp;
 } window_state_t;
 
@@ -54,6 +90,7 @@ typedef struct game_state {
     window_state_t *window_state;
     mouse_state_t *mouse_state;
     sdr_state_t *sdr_state;
+    config_t *config;
 } game_state_t;
 
 extern game_state_t *game_state;
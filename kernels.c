@@ -0,0 +1,547 @@
+//
+// Created by dbrent on 3/21/21.
+//
+
+#include "kernels.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define KERNELS_HAVE_AVX2
+#include <immintrin.h>
+#endif
+#if defined(__ARM_NEON)
+#define KERNELS_HAVE_NEON
+#include <arm_neon.h>
+#endif
+
+#define DB_PER_LOG2 3.01029996f // 10 * log10(2)
+#define LOG2_PER_DB 0.33219281f // 1 / DB_PER_LOG2
+#define EXP2_MIN -126.0f        // smallest normal float
+#define EXP2_MAX 127.0f
+
+// log2(1 + t) ~ t * (C1 + t * (C2 + ...)) for t in [0, 1), fitted for the
+// smallest largest error (1.4e-5)
+#define LOG2_C1 1.44196503f
+#define LOG2_C2 -0.70965718f
+#define LOG2_C3 0.41757872f
+#define LOG2_C4 -0.19624924f
+#define LOG2_C5 0.04637695f
+
+// 2^f ~ 1 + f * (C1 + f * (C2 + ...)) for f in [0, 1), relative error 2.9e-6
+#define EXP2_C1 0.69304483f
+#define EXP2_C2 0.24128030f
+#define EXP2_C3 0.05224232f
+#define EXP2_C4 0.01342676f
+
+static const char *isa_names[KERNELS_ISA_COUNT] = {
+        "scalar",
+        "avx2",
+        "neon",
+};
+
+const char *kernels_isa_name(kernels_isa_t isa) {
+    return (unsigned)isa < KERNELS_ISA_COUNT ? isa_names[isa] : "unknown";
+}
+
+float kernels_fast_log2(float x) {
+    uint32_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    float e = (float)((int32_t)(bits >> 23) - 127);
+    bits = (bits & 0x7fffff) | 0x3f800000;
+    float m;
+    memcpy(&m, &bits, sizeof(m));
+    float t = m - 1.0f;
+    float p = LOG2_C5;
+    p = p * t + LOG2_C4;
+    p = p * t + LOG2_C3;
+    p = p * t + LOG2_C2;
+    p = p * t + LOG2_C1;
+    return e + p * t;
+}
+
+// scalar, the reference
+
+static void scalar_load(const int8_t *samples, const float *window,
+                        float *out, size_t size) {
+#pragma omp simd
+    for (size_t i = 0; i < size; i++) {
+        out[2 * i] = samples[2 * i] * window[i];
+        out[2 * i + 1] = samples[2 * i + 1] * window[i];
+    }
+}
+
+static void scalar_log_power(const float *in, float scale, float *line,
+                             size_t size) {
+#pragma omp simd
+    for (size_t i = 0; i < size; i++) {
+        float re = in[2 * i] * scale;
+        float im = in[2 * i + 1] * scale;
+        line[i] = log2f(re * re + im * im) * DB_PER_LOG2;
+    }
+}
+
+static void scalar_accumulate_power(const float *in, float *sum,
+                                    size_t size) {
+#pragma omp simd
+    for (size_t i = 0; i < size; i++) {
+        float re = in[2 * i];
+        float im = in[2 * i + 1];
+        sum[i] += re * re + im * im;
+    }
+}
+
+static void scalar_power_to_db(const float *sum, float scale, float *line,
+                               size_t size) {
+#pragma omp simd
+    for (size_t i = 0; i < size; i++) {
+        line[i] = log2f(sum[i] * scale) * DB_PER_LOG2;
+    }
+}
+
+static float scalar_max(const float *x, size_t n) {
+    float m = x[0];
+    for (size_t i = 1; i < n; i++) {
+        m = x[i] > m ? x[i] : m;
+    }
+    return m;
+}
+
+static float scalar_min(const float *x, size_t n) {
+    float m = x[0];
+    for (size_t i = 1; i < n; i++) {
+        m = x[i] < m ? x[i] : m;
+    }
+    return m;
+}
+
+static float scalar_db_power_sum(const float *db, size_t n) {
+    float sum = 0.0f;
+    for (size_t i = 0; i < n; i++) {
+        float y = db[i] * LOG2_PER_DB;
+        sum += exp2f(y > EXP2_MIN ? y : EXP2_MIN);
+    }
+    return sum;
+}
+
+static const kernels_t scalar_kernels = {
+        .isa = KERNELS_SCALAR,
+        .load = scalar_load,
+        .log_power = scalar_log_power,
+        .accumulate_power = scalar_accumulate_power,
+        .power_to_db = scalar_power_to_db,
+        .max = scalar_max,
+        .min = scalar_min,
+        .db_power_sum = scalar_db_power_sum,
+};
+
+// AVX2 + FMA, built for any x86 and only picked when the CPU has both
+
+#ifdef KERNELS_HAVE_AVX2
+#define AVX2 __attribute__((target("avx2,fma")))
+
+AVX2 static inline __m256 avx2_log2(__m256 x) {
+    __m256i bits = _mm256_castps_si256(x);
+    __m256 e = _mm256_cvtepi32_ps(_mm256_sub_epi32(
+            _mm256_srli_epi32(bits, 23), _mm256_set1_epi32(127)));
+    __m256 m = _mm256_castsi256_ps(
+            _mm256_or_si256(_mm256_and_si256(bits, _mm256_set1_epi32(0x7fffff)),
+                            _mm256_set1_epi32(0x3f800000)));
+    __m256 t = _mm256_sub_ps(m, _mm256_set1_ps(1.0f));
+    __m256 p = _mm256_set1_ps(LOG2_C5);
+    p = _mm256_fmadd_ps(p, t, _mm256_set1_ps(LOG2_C4));
+    p = _mm256_fmadd_ps(p, t, _mm256_set1_ps(LOG2_C3));
+    p = _mm256_fmadd_ps(p, t, _mm256_set1_ps(LOG2_C2));
+    p = _mm256_fmadd_ps(p, t, _mm256_set1_ps(LOG2_C1));
+    return _mm256_fmadd_ps(p, t, e);
+}
+
+AVX2 static inline __m256 avx2_exp2(__m256 y) {
+    y = _mm256_min_ps(_mm256_max_ps(y, _mm256_set1_ps(EXP2_MIN)),
+                      _mm256_set1_ps(EXP2_MAX));
+    __m256 i = _mm256_floor_ps(y);
+    __m256 f = _mm256_sub_ps(y, i);
+    __m256 p = _mm256_set1_ps(EXP2_C4);
+    p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(EXP2_C3));
+    p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(EXP2_C2));
+    p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(EXP2_C1));
+    p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(1.0f));
+    __m256i e = _mm256_slli_epi32(
+            _mm256_add_epi32(_mm256_cvtps_epi32(i), _mm256_set1_epi32(127)),
+            23);
+    return _mm256_mul_ps(p, _mm256_castsi256_ps(e));
+}
+
+AVX2 static inline float avx2_hmax(__m256 v) {
+    __m128 m = _mm_max_ps(_mm256_castps256_ps128(v),
+                          _mm256_extractf128_ps(v, 1));
+    m = _mm_max_ps(m, _mm_movehl_ps(m, m));
+    m = _mm_max_ss(m, _mm_shuffle_ps(m, m, 1));
+    return _mm_cvtss_f32(m);
+}
+
+AVX2 static inline float avx2_hmin(__m256 v) {
+    __m128 m = _mm_min_ps(_mm256_castps256_ps128(v),
+                          _mm256_extractf128_ps(v, 1));
+    m = _mm_min_ps(m, _mm_movehl_ps(m, m));
+    m = _mm_min_ss(m, _mm_shuffle_ps(m, m, 1));
+    return _mm_cvtss_f32(m);
+}
+
+// |z|^2 of 8 interleaved complex values, in order
+AVX2 static inline __m256 avx2_magsq(const float *in) {
+    __m256 a = _mm256_loadu_ps(in);
+    __m256 b = _mm256_loadu_ps(in + 8);
+    // hadd works per 128 bit lane: bins 0 1 4 5 2 3 6 7
+    __m256 h = _mm256_hadd_ps(_mm256_mul_ps(a, a), _mm256_mul_ps(b, b));
+    return _mm256_castpd_ps(
+            _mm256_permute4x64_pd(_mm256_castps_pd(h), 0xd8));
+}
+
+AVX2 static void avx2_load(const int8_t *samples, const float *window,
+                           float *out, size_t size) {
+    // w0 w0 w1 w1 w2 w2 w3 w3
+    const __m256i pairs = _mm256_setr_epi32(0, 0, 1, 1, 2, 2, 3, 3);
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        __m128i iq = _mm_loadu_si128((const __m128i *)(samples + 2 * i));
+        __m256 lo = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(iq));
+        __m256 hi = _mm256_cvtepi32_ps(
+                _mm256_cvtepi8_epi32(_mm_unpackhi_epi64(iq, iq)));
+        __m256 w_lo = _mm256_permutevar8x32_ps(
+                _mm256_castps128_ps256(_mm_loadu_ps(window + i)), pairs);
+        __m256 w_hi = _mm256_permutevar8x32_ps(
+                _mm256_castps128_ps256(_mm_loadu_ps(window + i + 4)), pairs);
+        _mm256_storeu_ps(out + 2 * i, _mm256_mul_ps(lo, w_lo));
+        _mm256_storeu_ps(out + 2 * i + 8, _mm256_mul_ps(hi, w_hi));
+    }
+    scalar_load(samples + 2 * i, window + i, out + 2 * i, size - i);
+}
+
+AVX2 static void avx2_log_power(const float *in, float scale, float *line,
+                                size_t size) {
+    const __m256 scale2 = _mm256_set1_ps(scale * scale);
+    const __m256 db = _mm256_set1_ps(DB_PER_LOG2);
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        __m256 p = _mm256_mul_ps(avx2_magsq(in + 2 * i), scale2);
+        _mm256_storeu_ps(line + i, _mm256_mul_ps(avx2_log2(p), db));
+    }
+    for (; i < size; i++) {
+        float re = in[2 * i] * scale;
+        float im = in[2 * i + 1] * scale;
+        line[i] = kernels_fast_log2(re * re + im * im) * DB_PER_LOG2;
+    }
+}
+
+AVX2 static void avx2_accumulate_power(const float *in, float *sum,
+                                       size_t size) {
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        _mm256_storeu_ps(sum + i, _mm256_add_ps(_mm256_loadu_ps(sum + i),
+                                                avx2_magsq(in + 2 * i)));
+    }
+    scalar_accumulate_power(in + 2 * i, sum + i, size - i);
+}
+
+AVX2 static void avx2_power_to_db(const float *sum, float scale, float *line,
+                                  size_t size) {
+    const __m256 s = _mm256_set1_ps(scale);
+    const __m256 db = _mm256_set1_ps(DB_PER_LOG2);
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        __m256 p = _mm256_mul_ps(_mm256_loadu_ps(sum + i), s);
+        _mm256_storeu_ps(line + i, _mm256_mul_ps(avx2_log2(p), db));
+    }
+    for (; i < size; i++) {
+        line[i] = kernels_fast_log2(sum[i] * scale) * DB_PER_LOG2;
+    }
+}
+
+// the last n < 8 values, the rest of the vector filled in
+AVX2 static inline __m256 avx2_load_tail(const float *x, size_t n,
+                                         float fill, __m256 *mask) {
+    const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    __m256i keep = _mm256_cmpgt_epi32(_mm256_set1_epi32((int)n), lanes);
+    *mask = _mm256_castsi256_ps(keep);
+    return _mm256_blendv_ps(_mm256_set1_ps(fill), _mm256_maskload_ps(x, keep),
+                            *mask);
+}
+
+AVX2 static float avx2_max(const float *x, size_t n) {
+    __m256 m = _mm256_set1_ps(-INFINITY);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        m = _mm256_max_ps(m, _mm256_loadu_ps(x + i));
+    }
+    if (i < n) {
+        __m256 mask;
+        m = _mm256_max_ps(m, avx2_load_tail(x + i, n - i, -INFINITY, &mask));
+    }
+    return avx2_hmax(m);
+}
+
+AVX2 static float avx2_min(const float *x, size_t n) {
+    __m256 m = _mm256_set1_ps(INFINITY);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        m = _mm256_min_ps(m, _mm256_loadu_ps(x + i));
+    }
+    if (i < n) {
+        __m256 mask;
+        m = _mm256_min_ps(m, avx2_load_tail(x + i, n - i, INFINITY, &mask));
+    }
+    return avx2_hmin(m);
+}
+
+AVX2 static float avx2_db_power_sum(const float *db, size_t n) {
+    const __m256 k = _mm256_set1_ps(LOG2_PER_DB);
+    __m256 sum = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        sum = _mm256_add_ps(
+                sum, avx2_exp2(_mm256_mul_ps(_mm256_loadu_ps(db + i), k)));
+    }
+    if (i < n) {
+        __m256 mask;
+        __m256 tail = avx2_load_tail(db + i, n - i, 0.0f, &mask);
+        sum = _mm256_add_ps(
+                sum, _mm256_and_ps(avx2_exp2(_mm256_mul_ps(tail, k)), mask));
+    }
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(sum),
+                          _mm256_extractf128_ps(sum, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+    return _mm_cvtss_f32(s);
+}
+
+static const kernels_t avx2_kernels = {
+        .isa = KERNELS_AVX2,
+        .load = avx2_load,
+        .log_power = avx2_log_power,
+        .accumulate_power = avx2_accumulate_power,
+        .power_to_db = avx2_power_to_db,
+        .max = avx2_max,
+        .min = avx2_min,
+        .db_power_sum = avx2_db_power_sum,
+};
+#endif
+
+// NEON, always there on aarch64. vld2/vst2 do the (de)interleaving.
+
+#ifdef KERNELS_HAVE_NEON
+static inline float32x4_t neon_log2(float32x4_t x) {
+    uint32x4_t bits = vreinterpretq_u32_f32(x);
+    float32x4_t e = vcvtq_f32_s32(vsubq_s32(
+            vreinterpretq_s32_u32(vshrq_n_u32(bits, 23)), vdupq_n_s32(127)));
+    float32x4_t m = vreinterpretq_f32_u32(vorrq_u32(
+            vandq_u32(bits, vdupq_n_u32(0x7fffff)), vdupq_n_u32(0x3f800000)));
+    float32x4_t t = vsubq_f32(m, vdupq_n_f32(1.0f));
+    float32x4_t p = vdupq_n_f32(LOG2_C5);
+    p = vmlaq_f32(vdupq_n_f32(LOG2_C4), p, t);
+    p = vmlaq_f32(vdupq_n_f32(LOG2_C3), p, t);
+    p = vmlaq_f32(vdupq_n_f32(LOG2_C2), p, t);
+    p = vmlaq_f32(vdupq_n_f32(LOG2_C1), p, t);
+    return vmlaq_f32(e, p, t);
+}
+
+static inline float32x4_t neon_exp2(float32x4_t y) {
+    y = vminq_f32(vmaxq_f32(y, vdupq_n_f32(EXP2_MIN)), vdupq_n_f32(EXP2_MAX));
+    // floor without ARMv8 rounding: truncate, then step down below zero
+    int32x4_t i = vcvtq_s32_f32(y);
+    uint32x4_t above = vcltq_f32(y, vcvtq_f32_s32(i));
+    i = vaddq_s32(i, vreinterpretq_s32_u32(above)); // true is -1
+    float32x4_t f = vsubq_f32(y, vcvtq_f32_s32(i));
+    float32x4_t p = vdupq_n_f32(EXP2_C4);
+    p = vmlaq_f32(vdupq_n_f32(EXP2_C3), p, f);
+    p = vmlaq_f32(vdupq_n_f32(EXP2_C2), p, f);
+    p = vmlaq_f32(vdupq_n_f32(EXP2_C1), p, f);
+    p = vmlaq_f32(vdupq_n_f32(1.0f), p, f);
+    int32x4_t e = vshlq_n_s32(vaddq_s32(i, vdupq_n_s32(127)), 23);
+    return vmulq_f32(p, vreinterpretq_f32_s32(e));
+}
+
+static inline float32x4_t neon_magsq(const float *in) {
+    float32x4x2_t z = vld2q_f32(in);
+    return vmlaq_f32(vmulq_f32(z.val[0], z.val[0]), z.val[1], z.val[1]);
+}
+
+static void neon_load(const int8_t *samples, const float *window, float *out,
+                      size_t size) {
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        int8x8x2_t iq = vld2_s8(samples + 2 * i);
+        int16x8_t re = vmovl_s8(iq.val[0]);
+        int16x8_t im = vmovl_s8(iq.val[1]);
+        float32x4_t w_lo = vld1q_f32(window + i);
+        float32x4_t w_hi = vld1q_f32(window + i + 4);
+        float32x4x2_t lo = {{
+                vmulq_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(re))), w_lo),
+                vmulq_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(im))), w_lo),
+        }};
+        float32x4x2_t hi = {{
+                vmulq_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(re))), w_hi),
+                vmulq_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(im))), w_hi),
+        }};
+        vst2q_f32(out + 2 * i, lo);
+        vst2q_f32(out + 2 * i + 8, hi);
+    }
+    scalar_load(samples + 2 * i, window + i, out + 2 * i, size - i);
+}
+
+static void neon_log_power(const float *in, float scale, float *line,
+                           size_t size) {
+    const float32x4_t scale2 = vdupq_n_f32(scale * scale);
+    size_t i = 0;
+    for (; i + 4 <= size; i += 4) {
+        float32x4_t p = vmulq_f32(neon_magsq(in + 2 * i), scale2);
+        vst1q_f32(line + i, vmulq_n_f32(neon_log2(p), DB_PER_LOG2));
+    }
+    for (; i < size; i++) {
+        float re = in[2 * i] * scale;
+        float im = in[2 * i + 1] * scale;
+        line[i] = kernels_fast_log2(re * re + im * im) * DB_PER_LOG2;
+    }
+}
+
+static void neon_accumulate_power(const float *in, float *sum, size_t size) {
+    size_t i = 0;
+    for (; i + 4 <= size; i += 4) {
+        vst1q_f32(sum + i,
+                  vaddq_f32(vld1q_f32(sum + i), neon_magsq(in + 2 * i)));
+    }
+    scalar_accumulate_power(in + 2 * i, sum + i, size - i);
+}
+
+static void neon_power_to_db(const float *sum, float scale, float *line,
+                             size_t size) {
+    size_t i = 0;
+    for (; i + 4 <= size; i += 4) {
+        float32x4_t p = vmulq_n_f32(vld1q_f32(sum + i), scale);
+        vst1q_f32(line + i, vmulq_n_f32(neon_log2(p), DB_PER_LOG2));
+    }
+    for (; i < size; i++) {
+        line[i] = kernels_fast_log2(sum[i] * scale) * DB_PER_LOG2;
+    }
+}
+
+static float neon_max(const float *x, size_t n) {
+    if (n < 4) {
+        return scalar_max(x, n);
+    }
+    float32x4_t m = vld1q_f32(x);
+    size_t i = 4;
+    for (; i + 4 <= n; i += 4) {
+        m = vmaxq_f32(m, vld1q_f32(x + i));
+    }
+    float32x2_t h = vpmax_f32(vget_low_f32(m), vget_high_f32(m));
+    float r = vget_lane_f32(vpmax_f32(h, h), 0);
+    return i < n ? fmaxf(r, scalar_max(x + i, n - i)) : r;
+}
+
+static float neon_min(const float *x, size_t n) {
+    if (n < 4) {
+        return scalar_min(x, n);
+    }
+    float32x4_t m = vld1q_f32(x);
+    size_t i = 4;
+    for (; i + 4 <= n; i += 4) {
+        m = vminq_f32(m, vld1q_f32(x + i));
+    }
+    float32x2_t h = vpmin_f32(vget_low_f32(m), vget_high_f32(m));
+    float r = vget_lane_f32(vpmin_f32(h, h), 0);
+    return i < n ? fminf(r, scalar_min(x + i, n - i)) : r;
+}
+
+// scalar version of neon_exp2(), for the tails
+static inline float fast_exp2(float y) {
+    y = y > EXP2_MIN ? (y < EXP2_MAX ? y : EXP2_MAX) : EXP2_MIN;
+    float i = (float)(int32_t)y; // floorf() is a libm call without SSE4.1
+    i -= i > y ? 1.0f : 0.0f;
+    float f = y - i;
+    float p = EXP2_C4;
+    p = p * f + EXP2_C3;
+    p = p * f + EXP2_C2;
+    p = p * f + EXP2_C1;
+    p = p * f + 1.0f;
+    uint32_t bits = (uint32_t)((int32_t)i + 127) << 23;
+    float e;
+    memcpy(&e, &bits, sizeof(e));
+    return p * e;
+}
+
+static float fast_db_power_sum(const float *db, size_t n) {
+    float sum = 0.0f;
+    for (size_t i = 0; i < n; i++) {
+        sum += fast_exp2(db[i] * LOG2_PER_DB);
+    }
+    return sum;
+}
+
+static float neon_db_power_sum(const float *db, size_t n) {
+    float32x4_t sum = vdupq_n_f32(0.0f);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        sum = vaddq_f32(sum, neon_exp2(vmulq_n_f32(vld1q_f32(db + i),
+                                                   LOG2_PER_DB)));
+    }
+    float lanes[4];
+    vst1q_f32(lanes, sum);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] +
+           fast_db_power_sum(db + i, n - i);
+}
+
+static const kernels_t neon_kernels = {
+        .isa = KERNELS_NEON,
+        .load = neon_load,
+        .log_power = neon_log_power,
+        .accumulate_power = neon_accumulate_power,
+        .power_to_db = neon_power_to_db,
+        .max = neon_max,
+        .min = neon_min,
+        .db_power_sum = neon_db_power_sum,
+};
+#endif
+
+// dispatch
+
+static pthread_once_t detect_once = PTHREAD_ONCE_INIT;
+static const kernels_t *best = &scalar_kernels;
+
+const kernels_t *kernels_for(kernels_isa_t isa) {
+    switch (isa) {
+    case KERNELS_SCALAR:
+        return &scalar_kernels;
+#ifdef KERNELS_HAVE_AVX2
+    case KERNELS_AVX2:
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+            return &avx2_kernels;
+        }
+        return NULL;
+#endif
+#ifdef KERNELS_HAVE_NEON
+    case KERNELS_NEON:
+        return &neon_kernels;
+#endif
+    default:
+        return NULL;
+    }
+}
+
+static void detect(void) {
+    for (int isa = KERNELS_ISA_COUNT - 1; isa > KERNELS_SCALAR; isa--) {
+        const kernels_t *k = kernels_for(isa);
+        if (k != NULL) {
+            best = k;
+            return;
+        }
+    }
+}
+
+const kernels_t *kernels_get(void) {
+    pthread_once(&detect_once, detect);
+    return best;
+}
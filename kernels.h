@@ -0,0 +1,62 @@
+//
+// Created by dbrent on 3/21/21.
+//
+
+#ifndef DBSDR_KERNELS_H
+#define DBSDR_KERNELS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Largest error of kernels_fast_log2() over all normal floats, in log2 units
+// (about 0.00005 dB after the 10 * log10(2) scale), and the relative error of
+// the vector 2^x behind db_power_sum.
+#define KERNELS_LOG2_MAX_ERROR 2e-5f
+#define KERNELS_EXP2_MAX_ERROR 3e-6f
+
+typedef enum kernels_isa {
+    KERNELS_SCALAR,
+    KERNELS_AVX2, // with FMA
+    KERNELS_NEON,
+    KERNELS_ISA_COUNT,
+} kernels_isa_t;
+
+// Single precision inner loops of the FFT path. Complex data is interleaved
+// re, im as FFTW lays it out, sizes are in complex points and any size
+// works, vector kernels finish the tail in scalar code.
+typedef struct kernels {
+    kernels_isa_t isa;
+    // out = int8 IQ * window, one window value per complex sample
+    void (*load)(const int8_t *samples, const float *window, float *out,
+                 size_t size);
+    // line = dB of |in * scale|^2
+    void (*log_power)(const float *in, float scale, float *line, size_t size);
+    // sum += |in|^2
+    void (*accumulate_power)(const float *in, float *sum, size_t size);
+    // line = dB of sum * scale
+    void (*power_to_db)(const float *sum, float scale, float *line,
+                        size_t size);
+    // largest / smallest of n > 0 values
+    float (*max)(const float *x, size_t n);
+    float (*min)(const float *x, size_t n);
+    // sum of the linear powers of n dB values, anything below about -379 dB
+    // counts as that
+    float (*db_power_sum)(const float *db, size_t n);
+} kernels_t;
+
+const char *kernels_isa_name(kernels_isa_t isa);
+
+// The fastest kernels this CPU runs, detected on first use.
+const kernels_t *kernels_get(void);
+
+// Kernels for one instruction set, NULL if this build or CPU lacks it. The
+// scalar ones are the reference the others are checked against: they use
+// libm log2f, the vector ones a polynomial within KERNELS_LOG2_MAX_ERROR.
+const kernels_t *kernels_for(kernels_isa_t isa);
+
+// Scalar version of the vector log2. Zero and denormals come out around
+// -127 instead of -inf.
+float kernels_fast_log2(float x);
+
+#endif //DBSDR_KERNELS_H
@@ -0,0 +1,193 @@
+//
+// Created by dbrent on 3/30/21.
+//
+
+// Every kernel this build and CPU run against the scalar reference, at
+// sizes that take the vector bodies and every scalar tail. Exits non-zero
+// on a mismatch, run by ctest.
+
+#include "kernels.h"
+
+#include <float.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TEST_KERNEL_SIZE 65536
+#define TEST_MAX_DB_ERROR 0.01f
+
+static uint64_t rng = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t xorshift(void) {
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+static float uniform(void) {
+    return (float)(xorshift() >> 40) * 0x1p-24f;
+}
+
+static void fill_random(int8_t *buf, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        buf[i] = (int8_t)(xorshift() >> 56);
+    }
+}
+
+// FFT output spans a huge range, cover every exponent a line can hit
+static void fill_spectrum(float *complex, size_t size) {
+    for (size_t i = 0; i < 2 * size; i++) {
+        complex[i] = ldexpf(uniform() - 0.5f, (int)(xorshift() >> 58) - 20);
+    }
+}
+
+static float db_error(const float *ref, const float *line, size_t size) {
+    float worst = 0.0f;
+    for (size_t i = 0; i < size; i++) {
+        // the vector log2 has no -inf, zeros just come out very low
+        float err = isinf(ref[i]) ? (line[i] < -300.0f ? 0.0f : INFINITY)
+                                  : fabsf(line[i] - ref[i]);
+        if (!(err <= worst)) {
+            worst = err;
+        }
+    }
+    return worst;
+}
+
+static bool report(const char *isa, const char *kernel, size_t size,
+                   bool ok, const char *what, double error) {
+    if (!ok) {
+        fprintf(stderr, "%s/%s/%zu: %s %.6g\n", isa, kernel, size, what,
+                error);
+    }
+    return ok;
+}
+
+static bool check_kernels(const kernels_t *k, size_t size) {
+    const kernels_t *ref = kernels_for(KERNELS_SCALAR);
+    const char *isa = kernels_isa_name(k->isa);
+    int8_t *samples = malloc(size * 2);
+    float *window = malloc(size * sizeof(float));
+    float *complex = malloc(size * 2 * sizeof(float));
+    float *expect = malloc(size * 2 * sizeof(float));
+    float *got = malloc(size * 2 * sizeof(float));
+    if (samples == NULL || window == NULL || complex == NULL ||
+        expect == NULL || got == NULL) {
+        fprintf(stderr, "Could not set up kernel check\n");
+        exit(-1);
+    }
+    bool ok = true;
+
+    fill_random(samples, size * 2);
+    samples[0] = samples[1] = -128;
+    for (size_t i = 0; i < size; i++) {
+        window[i] = uniform();
+    }
+    ref->load(samples, window, expect, size);
+    k->load(samples, window, got, size);
+    // one multiply per value, must match exactly
+    ok &= report(isa, "load", size,
+                 memcmp(expect, got, size * 2 * sizeof(float)) == 0,
+                 "mismatch", 0.0);
+
+    fill_spectrum(complex, size);
+    complex[2] = complex[3] = 0.0f;
+    ref->log_power(complex, 1.0f / (float)size, expect, size);
+    k->log_power(complex, 1.0f / (float)size, got, size);
+    float worst = db_error(expect, got, size);
+    ok &= report(isa, "log_power", size, worst < TEST_MAX_DB_ERROR,
+                 "max error dB", worst);
+
+    for (size_t i = 0; i < size; i++) {
+        expect[i] = got[i] = (float)i;
+    }
+    ref->accumulate_power(complex, expect, size);
+    k->accumulate_power(complex, got, size);
+    worst = 0.0f;
+    for (size_t i = 0; i < size; i++) {
+        float err = fabsf(got[i] - expect[i]) / fmaxf(expect[i], FLT_MIN);
+        if (!(err <= worst)) {
+            worst = err;
+        }
+    }
+    ok &= report(isa, "accumulate_power", size, worst < 1e-6f,
+                 "max relative error", worst);
+
+    ref->power_to_db(got, 1e-9f, expect, size);
+    k->power_to_db(got, 1e-9f, got, size);
+    worst = db_error(expect, got, size);
+    ok &= report(isa, "power_to_db", size, worst < TEST_MAX_DB_ERROR,
+                 "max error dB", worst);
+
+    // reducers over every span length a pixel is likely to cover
+    for (size_t i = 0; i < size; i++) {
+        got[i] = -150.0f + 140.0f * uniform();
+    }
+    if (size > 5) {
+        got[5] = -INFINITY;
+    }
+    bool extremes = true;
+    worst = 0.0f;
+    for (size_t n = 1; n <= 100 && n <= size; n++) {
+        for (size_t at = 0; at + n <= size; at += 4099) {
+            extremes &= k->max(got + at, n) == ref->max(got + at, n) &&
+                        k->min(got + at, n) == ref->min(got + at, n);
+            float want = ref->db_power_sum(got + at, n);
+            float err = fabsf(k->db_power_sum(got + at, n) - want) / want;
+            if (!(err <= worst)) {
+                worst = err;
+            }
+        }
+    }
+    ok &= report(isa, "max,min", size, extremes, "mismatch", 0.0);
+    ok &= report(isa, "db_power_sum", size, worst < 1e-5f,
+                 "max relative error", worst);
+
+    free(samples);
+    free(window);
+    free(complex);
+    free(expect);
+    free(got);
+    return ok;
+}
+
+// kernels_fast_log2() against libm over every normal exponent
+static bool check_fast_log2(void) {
+    float worst = 0.0f;
+    for (int e = -125; e < 129; e++) {
+        for (int i = 0; i < 4096; i++) {
+            float x = ldexpf(1.0f + uniform(), e - 1);
+            float err = fabsf(kernels_fast_log2(x) - log2f(x));
+            if (!(err <= worst)) {
+                worst = err;
+            }
+        }
+    }
+    return report("scalar", "fast_log2", 0, worst <= KERNELS_LOG2_MAX_ERROR,
+                  "max error", worst);
+}
+
+int main(void) {
+    // the vector bodies, and every tail length behind them
+    const size_t sizes[] = {1, 2, 3, 5, 7, 8, 9, 15, 16, 17, 31, 33,
+                            TEST_KERNEL_SIZE + 7};
+    bool ok = check_fast_log2();
+    for (int isa = 0; isa < KERNELS_ISA_COUNT; isa++) {
+        const kernels_t *k = kernels_for(isa);
+        if (k == NULL) {
+            fprintf(stderr, "%s: not on this build or CPU\n",
+                    kernels_isa_name(isa));
+            continue;
+        }
+        bool isa_ok = true;
+        for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+            isa_ok &= check_kernels(k, sizes[i]);
+        }
+        fprintf(stderr, "%s: %s\n", kernels_isa_name(isa),
+                isa_ok ? "ok" : "FAILED");
+        ok &= isa_ok;
+    }
+    return ok ? 0 : 1;
+}
@@ -3,22 +3,37 @@
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
 
-#include "device.h"
+#include "archive.h"
+#include "demod.h"
+#include "dsp.h"
 #include "fft.h"
 #include "game_state.h"
 #include "global.h"
 #include "linmath.h"
+#include "palette.h"
 #include "queue.h"
+#include "recorder.h"
 #include "shader.h"
+#include "source.h"
+#include "sweep.h"
+#include "waterfall.h"
+#include "zoom.h"
 
-#include <libhackrf/hackrf.h>
-#include <pthread.h>
+#include <math.h>
 #include <stb/stb_image.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 
 game_state_t *game_state;
 queue_t mag_line_queue;
+source_t *source;
+recorder_t *recorder = NULL;
+demod_t *demod = NULL;
+zoom_t *zoom = NULL;
+archive_t *archive = NULL;
+archive_reader_t *archive_reader = NULL;
+pyramid_reader_t *pyramid_reader = NULL;
 
 void error_callback(int error, const char *description) {
     fprintf(stderr, "Error: %s\n", description);
@@ -29,19 +44,6 @@ void window_close_callback(GLFWwindow *window) {
     game_state->should_close = 1;
 }
 
-void receive_callback(void *samples, size_t n_samples,
-                      size_t bytes_per_sample) {
-    int8_t *buff = (int8_t *)samples;
-    size_t ffts = n_samples / FFT_SIZE;
-
-    // TODO store in a buffer for fft size larger than n samples
-
-    for (size_t i = 0; i < ffts; i++) {
-        float *line = fft(buff + i * FFT_SIZE * bytes_per_sample);
-        queue_append(&mag_line_queue, line);
-    }
-}
-
 void set_aspect(int width, int height) {
     float aspect = (float)width / (float)height;
     glViewport(0, 0, width, height);
@@ -63,42 +65,199 @@ void resize_callback(GLFWwindow *window, int width, int height) {
     set_aspect(width, height);
 }
 
-void key_callback(GLFWwindow *window, int key, int scancode, int action,
-                  int mods) {
-    if (key == GLFW_KEY_ESCAPE && action == GLFW_PRESS) {
-        game_state->should_close = 1;
+// Scroll back through the archive so the newest line shown is top, or back
+// to live for -1 or anything past the newest line.
+static void history_show(int64_t top) {
+    window_state_t *ws = game_state->window_state;
+    int64_t lines = (int64_t)archive_reader_lines(archive_reader);
+    int64_t screen = WATERFALL_HEIGHT * (int64_t)ws->history_scale;
+    archive_line_t line;
+    if (top < 0 || top > lines - 1) {
+        ws->history_top = -1;
+        ws->history_scale = 1;
+        fprintf(stderr, "History: live\n");
+        return;
+    }
+    // a screen full unless there isn't one
+    if (top < screen - 1) {
+        top = screen - 1 < lines - 1 ? screen - 1 : top;
+    }
+    ws->history_top = top;
+    if (archive_read_line(archive_reader, (uint64_t)top, &line)) {
+        char when[32];
+        time_t t = (time_t)(line.header->time_ns / 1000000000);
+        struct tm tm;
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S",
+                 localtime_r(&t, &tm));
+        fprintf(stderr,
+                "History: line %ld of %ld, %s, %.3f MHz, %lu lines a "
+                "row\n",
+                (long)top, (long)lines, when,
+                (double)line.header->frequency / 1e6,
+                (unsigned long)ws->history_scale);
     }
 }
 
-float float_rand(float min, float max) {
-    float scale = rand() / (float)RAND_MAX; /* [0, 1.0] */
-    return min + scale * (max - min);       /* [min, max] */
+// Newest line shown, the newest archived when live.
+static int64_t history_top(void) {
+    int64_t top = game_state->window_state->history_top;
+    archive_reader_refresh(archive_reader);
+    pyramid_reader_refresh(pyramid_reader);
+    return top >= 0 ? top
+                    : (int64_t)archive_reader_lines(archive_reader) - 1;
 }
 
-void set_pixel(float *location, unsigned int offset, float sum) {
-    float value = DEFAULT_LNA_GAIN / fabsf(sum);
+// Screens back from what is shown, negative for forward.
+static void history_scroll(int screens) {
+    int64_t top = history_top();
+    int64_t back = (int64_t)screens * WATERFALL_HEIGHT *
+                   (int64_t)game_state->window_state->history_scale;
+    history_show(top - back > 0 ? top - back : 0);
+}
 
-    location[offset] = value;
-    location[offset + 1] = value;
-    location[offset + 2] = value;
-    location[offset + 3] = 1.0f;
+// Seconds back in time from what is shown.
+static void history_seek(double back) {
+    int64_t top = history_top();
+    archive_line_t line;
+    if (archive_read_line(archive_reader, (uint64_t)top, &line)) {
+        int64_t when = line.header->time_ns - (int64_t)(back * 1e9);
+        uint64_t at = archive_find_time(archive_reader, when);
+        history_show(at > 0 ? (int64_t)at - 1 : 0);
+    }
 }
 
-void *queue_processor() {
-    while (!game_state->should_close && device_is_alive()) {
-        float *line = queue_pop(&mag_line_queue);
-        if (line != NULL) {
-            game_state->sdr_state->last_line = line;
+// Twice or half as many lines a row, keeping the newest line shown.
+static void history_zoom(bool out) {
+    window_state_t *ws = game_state->window_state;
+    int64_t top = history_top();
+    if (out && ws->history_scale < HISTORY_MAX_SCALE) {
+        ws->history_scale *= 2;
+    } else if (!out && ws->history_scale > 1) {
+        ws->history_scale /= 2;
+    }
+    history_show(top);
+}
+
+void key_callback(GLFWwindow *window, int key, int scancode, int action,
+                  int mods) {
+    if (key == GLFW_KEY_ESCAPE && action == GLFW_PRESS) {
+        game_state->should_close = 1;
+    }
+    if (action != GLFW_PRESS && action != GLFW_REPEAT) {
+        return;
+    }
+
+    window_state_t *ws = game_state->window_state;
+    sdr_state_t *sdr = game_state->sdr_state;
+    if (sdr->sweeping &&
+        (key == GLFW_KEY_COMMA || key == GLFW_KEY_PERIOD ||
+         key == GLFW_KEY_W || key == GLFW_KEY_PAGE_UP ||
+         key == GLFW_KEY_PAGE_DOWN)) {
+        return; // the sweep has its own FFT and tunings
+    }
+    switch (key) {
+    case GLFW_KEY_COMMA:
+        if (sdr->fft_size > FFT_MIN_SIZE &&
+            dsp_set_fft(sdr->fft_size / 2, sdr->fft_window)) {
+            sdr->fft_size /= 2;
+        }
+        return;
+    case GLFW_KEY_PERIOD:
+        if (dsp_set_fft(sdr->fft_size * 2, sdr->fft_window)) {
+            sdr->fft_size *= 2;
+        }
+        return;
+    case GLFW_KEY_W:
+        sdr->fft_window = (sdr->fft_window + 1) % FFT_WINDOW_COUNT;
+        dsp_set_fft(sdr->fft_size, sdr->fft_window);
+        return;
+    case GLFW_KEY_UP:
+        sdr_state_set_view(sdr, 1.0 / ZOOM_STEP, 0.5, 0.0);
+        return;
+    case GLFW_KEY_DOWN:
+        sdr_state_set_view(sdr, ZOOM_STEP, 0.5, 0.0);
+        return;
+    case GLFW_KEY_LEFT:
+        sdr_state_set_view(sdr, 1.0, 0.5, -PAN_STEP);
+        return;
+    case GLFW_KEY_RIGHT:
+        sdr_state_set_view(sdr, 1.0, 0.5, PAN_STEP);
+        return;
+    case GLFW_KEY_PAGE_UP:
+    case GLFW_KEY_PAGE_DOWN:
+        // retunes on the render thread once the key stops repeating
+        sdr_state_request_retune(
+                sdr, key == GLFW_KEY_PAGE_UP ? TUNE_STEP : -TUNE_STEP,
+                glfwGetTime());
+        return;
+    case GLFW_KEY_R:
+        // only matters on the DSP side when the FFT is wider than the
+        // texture
+        sdr->reducer = (sdr->reducer + 1) % BINNING_REDUCER_COUNT;
+        if (sdr->sweeping) {
+            sweep_set_reducer(sdr->reducer);
+        } else {
+            dsp_set_view(0.0, 1.0, sdr->reducer);
+        }
+        fprintf(stderr, "Reducer: %s\n", binning_reducer_name(sdr->reducer));
+        return;
+    case GLFW_KEY_HOME:
+        if (archive_reader != NULL) {
+            if (mods & GLFW_MOD_SHIFT) {
+                history_seek(HISTORY_SEEK);
+            } else {
+                history_scroll(1);
+            }
+        }
+        return;
+    case GLFW_KEY_END:
+        if (archive_reader != NULL) {
+            if (mods & GLFW_MOD_SHIFT) {
+                history_show(-1);
+            } else {
+                history_scroll(-1);
+            }
+        }
+        return;
+    case GLFW_KEY_INSERT:
+    case GLFW_KEY_DELETE:
+        if (archive_reader != NULL) {
+            history_zoom(key == GLFW_KEY_DELETE);
+        }
+        return;
+    case GLFW_KEY_C:
+        ws->palette = (ws->palette + 1) % PALETTE_COUNT;
+        ws->update_palette = 1;
+        fprintf(stderr, "Palette: %s\n", palette_name(ws->palette));
+        return;
+    case GLFW_KEY_LEFT_BRACKET:
+        ws->min_db -= DB_STEP;
+        break;
+    case GLFW_KEY_RIGHT_BRACKET:
+        if (ws->min_db + DB_STEP < ws->max_db) {
+            ws->min_db += DB_STEP;
         }
-        free(line);
-        // this shouldn't happen but just in case
-        if (queue_size(&mag_line_queue) > 25000) {
-            queue_pop(&mag_line_queue);
+        break;
+    case GLFW_KEY_MINUS:
+        if (ws->max_db - DB_STEP > ws->min_db) {
+            ws->max_db -= DB_STEP;
         }
+        break;
+    case GLFW_KEY_EQUAL:
+        ws->max_db += DB_STEP;
+        break;
+    default:
+        return;
     }
+    fprintf(stderr, "Range: %.0f dB to %.0f dB\n", ws->min_db, ws->max_db);
 }
 
-int main() {
+float float_rand(float min, float max) {
+    float scale = rand() / (float)RAND_MAX; /* [0, 1.0] */
+    return min + scale * (max - min);       /* [min, max] */
+}
+
+int main(int argc, char **argv) {
     GLFWwindow *window;
     game_timer_t timer;
     timer.frame_count = 0;
@@ -107,23 +266,161 @@ int main() {
         return -1;
     }
 
-    queue_init(&mag_line_queue);
     game_state = game_state_init();
-    fft_init(FFT_SIZE);
+    if (!config_parse(game_state->config, argc, argv)) {
+        exit(-1);
+    }
+    config_t *config = game_state->config;
+    game_state->sdr_state->fft_size = config->fft_size;
+    game_state->sdr_state->fft_window = config->window;
+    game_state->sdr_state->reducer = config->reducer;
+    game_state->sdr_state->sweeping = config->sweep_end != 0;
+
+    // a sweep stitches small FFTs from many tunings into one panorama
+    sweep_config_t sweep_config = {
+            .start = (uint64_t)config->sweep_start * 1000000,
+            .end = (uint64_t)config->sweep_end * 1000000,
+            .sample_rate = DEFAULT_SAMPLE_RATE,
+            .fft_size = config->fft_size < SWEEP_MAX_FFT_SIZE
+                                ? config->fft_size
+                                : SWEEP_MAX_FFT_SIZE,
+            .window = config->window,
+            .reducer = config->reducer,
+    };
 
-    if (!device_init()) {
-        fprintf(stderr, "Could not open HackRF device\n");
+    // every bin goes to the texture, zoom happens in the shader. Only FFTs
+    // (or panoramas) wider than the texture are binned down beforehand.
+    size_t max_bins = game_state->sdr_state->sweeping
+                              ? sweep_panorama_bins(&sweep_config)
+                              : config->max_fft_size;
+    int texture_width = max_bins < WATERFALL_MAX_TEXTURE_WIDTH
+                                ? (int)max_bins
+                                : WATERFALL_MAX_TEXTURE_WIDTH;
+    sweep_config.display_width = texture_width;
+    if (!queue_init(&mag_line_queue, DSP_LINE_BYTES(texture_width),
+                    MAG_LINE_QUEUE_SIZE, QUEUE_SPSC)) {
         exit(-1);
     }
-    device_set_sample_rate(DEFAULT_SAMPLE_RATE);
-    device_set_frequency(game_state->sdr_state->frequency);
-    device_set_lna_gain(DEFAULT_LNA_GAIN);
-    device_set_vga_gain(DEFAULT_VGA_GAIN);
-    device_rx(receive_callback);
 
-    pthread_t queue_processing_thread;
-    int qpt_ret = pthread_create(&queue_processing_thread, NULL,
-                                 queue_processor, NULL);
+    // reuse plans measured on earlier runs, planning big sizes from scratch
+    // takes seconds
+    char wisdom_buf[4096];
+    const char *wisdom = config->wisdom != NULL
+                                 ? config->wisdom
+                                 : fft_wisdom_path(wisdom_buf,
+                                                   sizeof(wisdom_buf));
+    if (wisdom != NULL) {
+        fft_wisdom_load(wisdom);
+    }
+
+    dsp_config_t dsp_config = {
+            .fft_size = config->fft_size,
+            .max_fft_size = config->max_fft_size,
+            .window = config->window,
+            .overlap = config->overlap,
+            .sample_rate = DEFAULT_SAMPLE_RATE,
+            .line_rate = config->line_rate,
+            .max_block_samples = SAMPLES_PER_TRANSFER,
+            .workers = config->workers,
+            .display_width = texture_width,
+            .reducer = config->reducer,
+            .frequency = (uint64_t)game_state->sdr_state->frequency,
+    };
+    if (game_state->sdr_state->sweeping) {
+        if (!sweep_init(&sweep_config, &mag_line_queue)) {
+            exit(-1);
+        }
+    } else if (!dsp_init(&dsp_config, &mag_line_queue)) {
+        exit(-1);
+    }
+    if (wisdom != NULL) {
+        fft_wisdom_save(wisdom); // keep the startup plan even if we crash
+    }
+
+    source = source_open(&game_state->config->source);
+    if (source == NULL) {
+        exit(-1);
+    }
+    source_set_sample_rate(source, DEFAULT_SAMPLE_RATE);
+    source_set_frequency(source, game_state->sdr_state->frequency);
+    source_set_gain(source, SOURCE_GAIN_LNA, DEFAULT_LNA_GAIN);
+    source_set_gain(source, SOURCE_GAIN_VGA, DEFAULT_VGA_GAIN);
+    if (game_state->config->record != NULL) {
+        recorder = recorder_open(game_state->config->record,
+                                 DEFAULT_SAMPLE_RATE,
+                                 game_state->sdr_state->frequency,
+                                 DEFAULT_LNA_GAIN, DEFAULT_VGA_GAIN);
+        if (recorder == NULL) {
+            exit(-1);
+        }
+        dsp_add_tap(recorder_tap, recorder);
+    }
+    if (game_state->config->demod != DEMOD_MODE_COUNT) {
+        // listens to one spot, the waterfall still follows the tuning
+        uint64_t listen = game_state->config->listen;
+        demod_config_t demod_config = {
+                .mode = game_state->config->demod,
+                .frequency = listen != 0 ? listen
+                                         : (uint64_t)game_state->sdr_state
+                                                   ->frequency,
+                .sample_rate = DEFAULT_SAMPLE_RATE,
+                .max_block_samples = SAMPLES_PER_TRANSFER,
+                .deemphasis = game_state->config->deemphasis,
+                .output = game_state->config->audio,
+        };
+        demod = demod_open(&demod_config);
+        if (demod == NULL) {
+            exit(-1);
+        }
+        dsp_add_tap(demod_tap, demod);
+    }
+    if (game_state->config->zoom_span > 0.0) {
+        zoom_config_t zoom_config = {
+                .sample_rate = DEFAULT_SAMPLE_RATE,
+                .span = game_state->config->zoom_span,
+                .fft_size = game_state->config->zoom_fft_size,
+                .window = config->window,
+                .line_rate = config->line_rate,
+                .max_block_samples = SAMPLES_PER_TRANSFER,
+                .max_width = WATERFALL_MAX_TEXTURE_WIDTH,
+        };
+        zoom = zoom_open(&zoom_config);
+        if (zoom == NULL) {
+            exit(-1);
+        }
+        dsp_add_tap(zoom_tap, zoom);
+        game_state->window_state->panel_width = ZOOM_PANEL_WIDTH;
+    }
+    if (game_state->config->archive != NULL) {
+        // archived as emitted, so the render thread skipping lines
+        // doesn't leave holes
+        archive = archive_open(game_state->config->archive,
+                               game_state->config->archive_format,
+                               texture_width);
+        if (archive == NULL) {
+            exit(-1);
+        }
+        if (game_state->sdr_state->sweeping) {
+            sweep_set_archive(archive);
+        } else {
+            dsp_set_archive(archive);
+        }
+        archive_reader = archive_reader_open(game_state->config->archive);
+        pyramid_reader = pyramid_reader_open(game_state->config->archive);
+        if (archive_reader == NULL || pyramid_reader == NULL) {
+            exit(-1);
+        }
+    }
+    if (game_state->sdr_state->sweeping) {
+        if (!sweep_start(source)) {
+            exit(-1);
+        }
+    } else {
+        if (!dsp_start()) {
+            exit(-1);
+        }
+        source_start(source, dsp_receive);
+    }
 
     glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
     glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 2);
@@ -175,7 +472,7 @@ int main() {
     unsigned int position_size = 2;
     unsigned int uv_size = 2;
 
-    GLuint vbo, vao, tex, ebo;
+    GLuint vbo, vao, ebo;
 
     // voa
     glGenVertexArrays(1, &vao);
@@ -194,15 +491,39 @@ int main() {
                  GL_STATIC_DRAW);
 
     // texture
-    glGenTextures(1, &tex);
-    glBindTexture(GL_TEXTURE_2D, tex);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    float *pixels =
-            malloc(WATERFALL_WIDTH * WATERFALL_HEIGHT * 4 * sizeof(float));
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, WATERFALL_WIDTH, WATERFALL_HEIGHT,
-                 0, GL_RGBA, GL_FLOAT, pixels);
-    glBindTexture(GL_TEXTURE_2D, 0);
+    waterfall_t *waterfall =
+            waterfall_create(texture_width, WATERFALL_HEIGHT);
+    if (waterfall == NULL) {
+        exit(-1);
+    }
+    waterfall_t *zoom_waterfall = NULL;
+    if (zoom != NULL) {
+        zoom_waterfall = waterfall_create(zoom->width, WATERFALL_HEIGHT);
+        if (zoom_waterfall == NULL) {
+            exit(-1);
+        }
+    }
+    // scroll-back, a texel per pixel of the view, redrawn from the archive
+    // and its pyramid whenever it moves
+    waterfall_t *history_waterfall = NULL;
+    float *history_line = NULL;
+    int64_t drawn_top = -1;
+    uint64_t drawn_scale = 0;
+    double drawn_start = 0.0, drawn_end = 0.0;
+    if (archive != NULL) {
+        history_waterfall = waterfall_create(
+                game_state->window_state->width -
+                        game_state->window_state->panel_width,
+                WATERFALL_HEIGHT);
+        if (history_waterfall == NULL) {
+            exit(-1);
+        }
+        history_line = malloc(history_waterfall->width * sizeof(float));
+        if (history_line == NULL) {
+            exit(-1);
+        }
+    }
+    GLuint palette = palette_texture_create(game_state->window_state->palette);
 
     // position attribute pointer
     glVertexAttribPointer(0, position_size, GL_FLOAT, GL_FALSE,
@@ -222,14 +543,30 @@ int main() {
     shader_program_link(default_program);
     GLint mvp_uniform =
             shader_program_get_uniform_location(default_program, "mvp");
+    GLint row_offset_uniform =
+            shader_program_get_uniform_location(default_program, "row_offset");
+    GLint min_db_uniform =
+            shader_program_get_uniform_location(default_program, "min_db");
+    GLint max_db_uniform =
+            shader_program_get_uniform_location(default_program, "max_db");
+    GLint view_start_uniform =
+            shader_program_get_uniform_location(default_program, "view_start");
+    GLint view_end_uniform =
+            shader_program_get_uniform_location(default_program, "view_end");
+    GLint reducer_uniform =
+            shader_program_get_uniform_location(default_program, "reducer");
+    glUseProgram(default_program);
+    glUniform1i(shader_program_get_uniform_location(default_program, "tex"), 0);
+    glUniform1i(shader_program_get_uniform_location(default_program, "palette"),
+                1);
+    glUseProgram(0);
 
     // game loop
     set_aspect(game_state->window_state->width,
                game_state->window_state->height);
     timer.previous_time = glfwGetTime();
-    unsigned int one_line = (int)(WATERFALL_WIDTH * 4 * sizeof(float));
     while (!game_state->should_close && !glfwWindowShouldClose(window) &&
-           device_is_alive()) {
+           source_is_alive(source)) {
         timer.time = glfwGetTime();
         timer.start_time = timer.time;
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
@@ -243,31 +580,124 @@ int main() {
                                (const GLfloat *)game_state->window_state->mvp);
             set_aspect(game_state->window_state->width,
                        game_state->window_state->height);
-            device_set_frequency(game_state->sdr_state->frequency);
-            fprintf(stderr, "Frequency: %ld\n",
-                    game_state->sdr_state->frequency);
             game_state->window_state->update_aspect = 0;
-            one_line = (int)(WATERFALL_WIDTH * 4 * sizeof(float));
+        }
+        if (sdr_state_retune_due(game_state->sdr_state, timer.time) &&
+            !game_state->sdr_state->sweeping) {
+            // lines from before the PLL settled are dropped on the DSP
+            // side, and the recording is annotated in stream order there.
+            // Transfers completing while the tuner is set could be from
+            // either frequency, those go too.
+            uint64_t frequency = (uint64_t)game_state->sdr_state->frequency;
+            dsp_retune_begin();
+            source_set_frequency(source, frequency);
+            uint32_t generation =
+                    dsp_retune(frequency, source_settle_samples(source));
+            fprintf(stderr, "Frequency: %lu (generation %u)\n",
+                    (unsigned long)frequency, generation);
+        }
+        if (game_state->window_state->update_palette) {
+            palette_texture_set(palette, game_state->window_state->palette);
+            game_state->window_state->update_palette = 0;
         }
 
-        // update pixels
-        memmove(pixels + (one_line), pixels, (WATERFALL_HEIGHT - 1) * one_line);
-        float *line = game_state->sdr_state->last_line;
-        unsigned int points_per_pixel = FFT_SIZE / WATERFALL_WIDTH;
-        // one line/row of pixels
-        for (unsigned int j = 0; j < WATERFALL_WIDTH; j++) {
-            float sum = 0;
-            for (unsigned int k = 0; k < points_per_pixel; k++) {
-                sum += line[j * points_per_pixel + k];
+        // update pixels, a row per line so the waterfall scrolls at the
+        // line rate. If we fell behind, skip to the newest few.
+        while (queue_size(&mag_line_queue) > WATERFALL_LINES_PER_FRAME &&
+               queue_peek(&mag_line_queue) != NULL) {
+            queue_release(&mag_line_queue);
+        }
+        spectrum_line_t *line;
+        while ((line = queue_peek(&mag_line_queue)) != NULL) {
+            waterfall_push_line(waterfall, line->bins, line->n_bins);
+            queue_release(&mag_line_queue);
+        }
+        window_state_t *ws = game_state->window_state;
+        sdr_state_t *sdr = game_state->sdr_state;
+        bool history = ws->history_top >= 0;
+        if (history &&
+            (ws->history_top != drawn_top ||
+             ws->history_scale != drawn_scale ||
+             sdr->view_start != drawn_start || sdr->view_end != drawn_end)) {
+            // oldest row first, from the coarsest level that still has
+            // a line per row and a bin per pixel
+            int width = history_waterfall->width;
+            uint64_t scale = ws->history_scale;
+            int level = pyramid_pick_level(pyramid_reader, scale,
+                                           sdr->view_end - sdr->view_start,
+                                           width);
+            for (int64_t row = WATERFALL_HEIGHT - 1; row >= 0; row--) {
+                int64_t last = ws->history_top - row * (int64_t)scale;
+                int64_t first = last - (int64_t)scale + 1;
+                first = first > 0 ? first : 0;
+                if (last < 0 ||
+                    !pyramid_render_row(pyramid_reader, archive_reader,
+                                        level, (uint64_t)first,
+                                        (uint64_t)(last - first + 1),
+                                        sdr->view_start, sdr->view_end,
+                                        history_line, width)) {
+                    history_line[0] = -INFINITY; // before the archive
+                    waterfall_push_line(history_waterfall, history_line, 1);
+                } else {
+                    waterfall_push_line(history_waterfall, history_line,
+                                        width);
+                }
+            }
+            drawn_top = ws->history_top;
+            drawn_scale = scale;
+            drawn_start = sdr->view_start;
+            drawn_end = sdr->view_end;
+        } else if (!history) {
+            drawn_top = -1;
+        }
+        waterfall_t *shown = history ? history_waterfall : waterfall;
+        int wide_width = game_state->window_state->width -
+                         game_state->window_state->panel_width;
+        if (zoom != NULL) {
+            // the zoomed sub-band follows the middle of the view
+            double centre = (game_state->sdr_state->view_start +
+                             game_state->sdr_state->view_end) /
+                            2.0;
+            zoom_set_offset(zoom, (centre - 0.5) * DEFAULT_SAMPLE_RATE);
+            while (queue_size(&zoom->lines) > WATERFALL_LINES_PER_FRAME &&
+                   queue_peek(&zoom->lines) != NULL) {
+                queue_release(&zoom->lines);
+            }
+            while ((line = queue_peek(&zoom->lines)) != NULL) {
+                waterfall_push_line(zoom_waterfall, line->bins,
+                                    line->n_bins);
+                queue_release(&zoom->lines);
             }
-            sum /= (float)points_per_pixel;
-            set_pixel(pixels, j * 4, sum);
         }
+        glViewport(0, 0, wide_width, game_state->window_state->height);
+        glUniform1f(row_offset_uniform, waterfall_row_offset(shown));
+        glUniform1f(min_db_uniform, game_state->window_state->min_db);
+        glUniform1f(max_db_uniform, game_state->window_state->max_db);
+        // history is drawn already zoomed, a texel per pixel
+        glUniform1f(view_start_uniform,
+                    history ? 0.0f : (float)game_state->sdr_state->view_start);
+        glUniform1f(view_end_uniform,
+                    history ? 1.0f : (float)game_state->sdr_state->view_end);
+        glUniform1i(reducer_uniform, history ? BINNING_MAX
+                                             : game_state->sdr_state->reducer);
         glBindVertexArray(vao);
-        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, WATERFALL_WIDTH,
-                        WATERFALL_HEIGHT, GL_RGBA, GL_FLOAT, pixels);
-        glBindTexture(GL_TEXTURE_2D, tex);
+        glActiveTexture(GL_TEXTURE1);
+        glBindTexture(GL_TEXTURE_1D, palette);
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, shown->texture);
         glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+        if (zoom != NULL) {
+            // all of it, a texel per zoom FFT bin where they fit
+            glViewport(wide_width, 0, game_state->window_state->panel_width,
+                       game_state->window_state->height);
+            glUniform1f(row_offset_uniform,
+                        waterfall_row_offset(zoom_waterfall));
+            glUniform1f(view_start_uniform, 0.0f);
+            glUniform1f(view_end_uniform, 1.0f);
+            glUniform1i(reducer_uniform, BINNING_MAX);
+            glBindTexture(GL_TEXTURE_2D, zoom_waterfall->texture);
+            glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+        }
         glBindVertexArray(0);
         glUseProgram(0);
 
@@ -281,8 +711,110 @@ int main() {
         timer.delta = timer.end_time - timer.start_time;
         timer.frame_count++;
         if (timer.time - timer.previous_time >= 1.0) {
-            fprintf(stderr, "FPS: %i, Queue size: %zu\n", timer.fps,
-                    queue_size(&mag_line_queue));
+            queue_stats_t stats;
+            dsp_stats_t dsp_stats;
+            queue_get_stats(&mag_line_queue, &stats);
+            fprintf(stderr,
+                    "FPS: %i, Queue size: %zu/%zu (max %zu), overflows: "
+                    "%lu\n",
+                    timer.fps, stats.occupancy, stats.capacity,
+                    stats.high_water, (unsigned long)stats.overflows);
+            if (game_state->sdr_state->view_start > 0.0 ||
+                game_state->sdr_state->view_end < 1.0) {
+                fprintf(stderr, "View: %.4f - %.4f of the band\n",
+                        game_state->sdr_state->view_start,
+                        game_state->sdr_state->view_end);
+            }
+            if (game_state->sdr_state->sweeping) {
+                sweep_stats_t sweep_stats;
+                sweep_get_stats(&sweep_stats);
+                fprintf(stderr,
+                        "Sweep: %.2f GHz/s (%s), %lu sweeps of %u "
+                        "tunings, %lu missed, %lu blocks dropped, %lu "
+                        "ignored, %lu lines dropped\n",
+                        sweep_stats.rate / 1e9,
+                        sweep_stats.hardware ? "hardware" : "retuning",
+                        (unsigned long)sweep_stats.sweeps,
+                        sweep_stats.tunings,
+                        (unsigned long)sweep_stats.missing,
+                        (unsigned long)sweep_stats.blocks_dropped,
+                        (unsigned long)sweep_stats.blocks_ignored,
+                        (unsigned long)sweep_stats.lines_dropped);
+            } else {
+                dsp_get_stats(&dsp_stats);
+                fprintf(stderr,
+                        "IQ blocks: %lu received, %lu dropped, %lu gaps, "
+                        "%lu settling, %d workers, ring %zu/%zu (max %zu), "
+                        "%u FFTs per line\n",
+                        (unsigned long)dsp_stats.blocks_received,
+                        (unsigned long)dsp_stats.blocks_dropped,
+                        (unsigned long)dsp_stats.sequence_gaps,
+                        (unsigned long)dsp_stats.blocks_settling,
+                        dsp_stats.workers, dsp_stats.iq_queue.occupancy,
+                        dsp_stats.iq_queue.capacity,
+                        dsp_stats.iq_queue.high_water, dsp_stats.average);
+            }
+            uploader_stats_t upload_stats;
+            uploader_get_stats(waterfall->uploader, &upload_stats);
+            fprintf(stderr, "Uploads: %lu, %lu stalls, %.3f ms stalled\n",
+                    (unsigned long)upload_stats.uploads,
+                    (unsigned long)upload_stats.stalls,
+                    upload_stats.stall_time * 1000.0);
+            if (recorder != NULL) {
+                recorder_stats_t rec_stats;
+                recorder_get_stats(recorder, &rec_stats);
+                fprintf(stderr,
+                        "Recording: %lu MB, buffers %zu/%zu (max %zu), %lu "
+                        "stalls (%.1f ms), %lu samples dropped, %lu write "
+                        "errors\n",
+                        (unsigned long)(rec_stats.bytes_written >> 20),
+                        rec_stats.buffers.occupancy,
+                        rec_stats.buffers.capacity,
+                        rec_stats.buffers.high_water,
+                        (unsigned long)rec_stats.stalls,
+                        rec_stats.stall_time * 1000.0,
+                        (unsigned long)rec_stats.dropped_samples,
+                        (unsigned long)rec_stats.write_errors);
+            }
+            if (zoom != NULL) {
+                zoom_stats_t zoom_stats;
+                zoom_get_stats(zoom, &zoom_stats);
+                fprintf(stderr,
+                        "Zoom: %+.0f Hz, %.3f Hz RBW, %u FFTs per line, %lu "
+                        "lines (%lu dropped), %lu blocks dropped\n",
+                        zoom_stats.offset, zoom_stats.rbw,
+                        zoom_stats.average,
+                        (unsigned long)zoom_stats.lines_emitted,
+                        (unsigned long)zoom_stats.lines_dropped,
+                        (unsigned long)zoom_stats.blocks_dropped);
+            }
+            if (archive != NULL) {
+                archive_stats_t archive_stats;
+                archive_get_stats(archive, &archive_stats);
+                fprintf(stderr,
+                        "Archive: %lu lines in %u chunks, %lu MB, %lu "
+                        "dropped, %lu write errors\n",
+                        (unsigned long)archive_stats.lines,
+                        archive_stats.chunks,
+                        (unsigned long)(archive_stats.bytes_written >> 20),
+                        (unsigned long)archive_stats.lines_dropped,
+                        (unsigned long)archive_stats.write_errors);
+            }
+            if (demod != NULL) {
+                demod_stats_t demod_stats;
+                demod_get_stats(demod, &demod_stats);
+                fprintf(stderr,
+                        "Audio: latency %.1f ms (max %.1f), %lu late, %lu "
+                        "blocks dropped, %lu muted, %lu samples skipped, "
+                        "%lu underruns\n",
+                        demod_stats.latency * 1000.0,
+                        demod_stats.latency_max * 1000.0,
+                        (unsigned long)demod_stats.late,
+                        (unsigned long)demod_stats.blocks_dropped,
+                        (unsigned long)demod_stats.blocks_muted,
+                        (unsigned long)demod_stats.samples_skipped,
+                        (unsigned long)demod_stats.underruns);
+            }
             timer.fps = timer.frame_count;
             timer.frame_count = 0;
             timer.previous_time = timer.time;
@@ -290,16 +822,34 @@ int main() {
     }
 
     // cleanup
-    pthread_join(queue_processing_thread, NULL);
-    fprintf(stderr, "Queue processor thread exited with status %d\n", qpt_ret);
-    device_destroy();
+    source_stop(source);
+    source_close(source);
+    if (game_state->sdr_state->sweeping) {
+        sweep_stop();
+        archive_close(archive);
+        sweep_destroy();
+    } else {
+        dsp_stop();
+        recorder_close(recorder);
+        demod_close(demod);
+        zoom_close(zoom);
+        archive_close(archive);
+        dsp_destroy();
+    }
+    if (wisdom != NULL) {
+        fft_wisdom_save(wisdom);
+    }
+    fft_cleanup();
     queue_destroy(&mag_line_queue);
     glfwDestroyWindow(window);
+    waterfall_destroy(waterfall);
+    waterfall_destroy(zoom_waterfall);
+    waterfall_destroy(history_waterfall);
+    free(history_line);
+    archive_reader_close(archive_reader);
+    pyramid_reader_close(pyramid_reader);
+    glDeleteTextures(1, &palette);
     game_state_destroy(game_state);
-    if (pixels != NULL) {
-        free(pixels);
-        pixels = NULL;
-    }
 
     return 0;
 }
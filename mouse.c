@@ -3,7 +3,9 @@
 //
 
 #include "mouse.h"
+#include "game_state.h"
 #include "global.h"
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -43,8 +45,8 @@ void cursor_position_callback(GLFWwindow *window, double x_pos, double y_pos) {
     if (y_pos < 0) {
         y_pos = 0;
     }
-    if (x_pos > game_state->window_state->height) {
-        x_pos = game_state->window_state->height;
+    if (y_pos > game_state->window_state->height) {
+        y_pos = game_state->window_state->height;
     }
     game_state->mouse_state->x_pos = x_pos;
     game_state->mouse_state->y_pos = y_pos;
@@ -53,16 +55,13 @@ void cursor_position_callback(GLFWwindow *window, double x_pos, double y_pos) {
 void scroll_callback(GLFWwindow *window, double x_offset, double y_offset) {
     game_state->mouse_state->scroll_x_offset = x_offset;
     game_state->mouse_state->scroll_y_offset = y_offset;
-    if (y_offset == -1.0f) {
-        game_state->sdr_state->frequency -= 1000000;
-        //        if (game_state->window_state->zoom < 30.0f) {
-        //        game_state->window_state->zoom += 1.0f;
-        //        }
-    } else {
-        game_state->sdr_state->frequency += 1000000;
-        //        if (game_state->window_state->zoom > 1.0f) {
-        //        game_state->window_state->zoom -= 1.0f;
-        //        }
+    // zoom around the frequency under the cursor, no retune
+    window_state_t *ws = game_state->window_state;
+    double anchor = game_state->mouse_state->x_pos /
+                    (double)(ws->width - ws->panel_width);
+    if (anchor > 1.0) {
+        anchor = 1.0; // over the zoom panel
     }
-    game_state->window_state->update_aspect = 1;
+    sdr_state_set_view(game_state->sdr_state,
+                       pow(SCROLL_ZOOM_STEP, -y_offset), anchor, 0.0);
 }
\ No newline at end of file
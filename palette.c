@@ -0,0 +1,123 @@
+//
+// Created by dbrent on 3/9/21.
+//
+
+#include "palette.h"
+
+#include <math.h>
+#include <stddef.h>
+
+// Polynomial fits of the matplotlib viridis/inferno maps (Matt Zucker, CC0)
+// and Google's turbo map, evaluated once into a lookup texture.
+static const float viridis[7][3] = {
+        {0.2777273272234177f, 0.005407344544966578f, 0.3340998053353061f},
+        {0.1050930431085774f, 1.404613529898575f, 1.384590162594685f},
+        {-0.3308618287255563f, 0.214847559468213f, 0.09509516302823659f},
+        {-4.634230498983486f, -5.799100973351585f, -19.33244095627987f},
+        {6.228269936347081f, 14.17993336680509f, 56.69055260068105f},
+        {4.776384997670288f, -13.74514537774601f, -65.35303263337234f},
+        {-5.435455855934631f, 4.645852612178535f, 26.3124352495832f},
+};
+
+static const float inferno[7][3] = {
+        {0.0002189403691192265f, 0.001651004631001012f, -0.01948089843709184f},
+        {0.1065134194856116f, 0.5639564367884091f, 3.932712388889277f},
+        {11.60249308247187f, -3.972853965665698f, -15.9423941062914f},
+        {-41.70399613139459f, 17.43639888205313f, 44.35414519872813f},
+        {77.162935699427f, -33.40235894210092f, -81.80730925738993f},
+        {-71.31942824499214f, 32.62606426397723f, 73.20951985803202f},
+        {25.13112622477341f, -12.24266895238567f, -23.07032500287172f},
+};
+
+static const float turbo[6][3] = {
+        {0.13572138f, 0.09140261f, 0.10667330f},
+        {4.61539260f, 2.19418839f, 12.64194608f},
+        {-42.66032258f, 4.84296658f, -60.58204836f},
+        {132.13108234f, -14.18503333f, 110.36276771f},
+        {-152.94239396f, 4.27729857f, -89.90310912f},
+        {59.28637943f, 2.82956604f, 27.34824973f},
+};
+
+static uint8_t to_byte(float v) {
+    if (v < 0.0f) {
+        v = 0.0f;
+    }
+    if (v > 1.0f) {
+        v = 1.0f;
+    }
+    return (uint8_t)lroundf(v * 255.0f);
+}
+
+static void poly(const float (*c)[3], int terms, float t, uint8_t *rgba) {
+    for (int ch = 0; ch < 3; ch++) {
+        float v = c[terms - 1][ch];
+        for (int i = terms - 2; i >= 0; i--) {
+            v = v * t + c[i][ch];
+        }
+        rgba[ch] = to_byte(v);
+    }
+    rgba[3] = 255;
+}
+
+const char *palette_name(palette_id_t id) {
+    switch (id) {
+    case PALETTE_GRAYSCALE:
+        return "grayscale";
+    case PALETTE_VIRIDIS:
+        return "viridis";
+    case PALETTE_INFERNO:
+        return "inferno";
+    case PALETTE_TURBO:
+        return "turbo";
+    default:
+        return "unknown";
+    }
+}
+
+void palette_fill(palette_id_t id, uint8_t *rgba, int n) {
+    for (int i = 0; i < n; i++) {
+        float t = n > 1 ? (float)i / (float)(n - 1) : 0.0f;
+        uint8_t *entry = rgba + i * 4;
+        switch (id) {
+        case PALETTE_VIRIDIS:
+            poly(viridis, 7, t, entry);
+            break;
+        case PALETTE_INFERNO:
+            poly(inferno, 7, t, entry);
+            break;
+        case PALETTE_TURBO:
+            poly(turbo, 6, t, entry);
+            break;
+        case PALETTE_GRAYSCALE:
+        default:
+            entry[0] = entry[1] = entry[2] = to_byte(t);
+            entry[3] = 255;
+            break;
+        }
+    }
+}
+
+GLuint palette_texture_create(palette_id_t id) {
+    GLuint texture;
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_1D, texture);
+    glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexImage1D(GL_TEXTURE_1D, 0, GL_RGBA8, PALETTE_SIZE, 0, GL_RGBA,
+                 GL_UNSIGNED_BYTE, NULL);
+    glBindTexture(GL_TEXTURE_1D, 0);
+
+    palette_texture_set(texture, id);
+    return texture;
+}
+
+void palette_texture_set(GLuint texture, palette_id_t id) {
+    uint8_t rgba[PALETTE_SIZE * 4];
+    palette_fill(id, rgba, PALETTE_SIZE);
+
+    glBindTexture(GL_TEXTURE_1D, texture);
+    glTexSubImage1D(GL_TEXTURE_1D, 0, 0, PALETTE_SIZE, GL_RGBA,
+                    GL_UNSIGNED_BYTE, rgba);
+    glBindTexture(GL_TEXTURE_1D, 0);
+}
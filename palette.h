@@ -0,0 +1,31 @@
+//
+// Created by dbrent on 3/9/21.
+//
+
+#ifndef DBSDR_PALETTE_H
+#define DBSDR_PALETTE_H
+
+#include <GL/glew.h>
+
+#include <stdint.h>
+
+#define PALETTE_SIZE 256
+
+typedef enum palette_id {
+    PALETTE_GRAYSCALE,
+    PALETTE_VIRIDIS,
+    PALETTE_INFERNO,
+    PALETTE_TURBO,
+    PALETTE_COUNT,
+} palette_id_t;
+
+const char *palette_name(palette_id_t id);
+
+// n RGBA8 entries from the low to the high end of the map
+void palette_fill(palette_id_t id, uint8_t *rgba, int n);
+
+GLuint palette_texture_create(palette_id_t id);
+
+void palette_texture_set(GLuint texture, palette_id_t id);
+
+#endif //DBSDR_PALETTE_H
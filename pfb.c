@@ -0,0 +1,230 @@
+//
+// Created by dbrent on 3/25/21.
+//
+
+#include "pfb.h"
+#include "ddc.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PI 3.14159265358979
+
+pfb_t *pfb_create(const pfb_config_t *config) {
+    uint32_t m = config->channels;
+    uint32_t o = config->oversample;
+    if (m < 2 || m > FFT_MAX_SIZE || (o != 1 && o != 2 && o != 4) ||
+        m % o != 0 || config->sample_rate <= 0.0) {
+        fprintf(stderr, "Invalid PFB: %u channels, oversampled %u\n", m, o);
+        return NULL;
+    }
+    pfb_t *pfb = calloc(1, sizeof(pfb_t));
+    if (pfb == NULL) {
+        return NULL;
+    }
+    pfb->sample_rate = config->sample_rate;
+    pfb->channels = m;
+    pfb->decimation = m / o;
+    pfb->spacing = config->sample_rate / m;
+    pfb->channel_rate = config->sample_rate / pfb->decimation;
+    pfb->bandwidth = config->bandwidth;
+    if (pfb->bandwidth <= 0.0) {
+        pfb->bandwidth = DDC_DEFAULT_BANDWIDTH * pfb->spacing;
+    }
+    if (pfb->bandwidth > DDC_MAX_BANDWIDTH * pfb->spacing) {
+        pfb->bandwidth = DDC_MAX_BANDWIDTH * pfb->spacing;
+    }
+
+    // stopped from where the neighbouring channel's passband starts, which
+    // also keeps aliases out when critically sampled
+    double pass = pfb->bandwidth / 2.0;
+    double stop = pfb->spacing - pass;
+    size_t length = ddc_lowpass_length((stop - pass) / pfb->sample_rate);
+    pfb->taps_per_branch = (uint32_t)((length + m - 1) / m);
+    pfb->n_taps = (size_t)pfb->taps_per_branch * m;
+    pfb->capacity = pfb->n_taps + PFB_CHUNK;
+    pfb->chunk_outputs = PFB_CHUNK / pfb->decimation + 1;
+    pfb->taps = malloc(2 * pfb->n_taps * sizeof(float));
+    pfb->history = calloc(2 * pfb->capacity, sizeof(float));
+    pfb->in = FFTW(malloc)(sizeof(fft_complex) * m);
+    pfb->out = FFTW(malloc)(sizeof(fft_complex) * m);
+    pfb->root_re = malloc(m * sizeof(float));
+    pfb->root_im = malloc(m * sizeof(float));
+    // channel counts off the raster the setup cache covers, e.g. 800 for
+    // 25 kHz apart at 20 MSPS, get a plan of their own
+    pfb->plan = pfb->in != NULL && pfb->out != NULL
+                        ? fft_plan_create(m, pfb->in, pfb->out)
+                        : NULL;
+    if (pfb->taps == NULL || pfb->history == NULL || pfb->in == NULL ||
+        pfb->out == NULL || pfb->root_re == NULL || pfb->root_im == NULL ||
+        pfb->plan == NULL) {
+        fprintf(stderr, "Could not create PFB\n");
+        pfb_destroy(pfb);
+        return NULL;
+    }
+
+    // designed into the top half, then spread out from the bottom without
+    // overtaking what is left to read
+    float *h = pfb->taps + pfb->n_taps;
+    ddc_lowpass(h, pfb->n_taps, (pass + stop) / 2.0 / pfb->sample_rate,
+                1.0 / 128.0);
+    for (size_t k = 0; k < pfb->n_taps; k++) {
+        pfb->taps[2 * k] = pfb->taps[2 * k + 1] = h[k];
+    }
+    for (uint32_t k = 0; k < m; k++) {
+        pfb->root_re[k] = (float)cos(-2.0 * PI * k / m);
+        pfb->root_im[k] = (float)sin(-2.0 * PI * k / m);
+    }
+
+    // the first output comes after one decimation's worth of samples
+    pfb->fill = pfb->n_taps - pfb->decimation;
+    pfb->next = pfb->n_taps;
+    pfb->phase = pfb->decimation % m;
+    return pfb;
+}
+
+void pfb_destroy(pfb_t *pfb) {
+    if (pfb == NULL) {
+        return;
+    }
+    for (int i = 0; i < pfb->n_routes; i++) {
+        free(pfb->routes[i].out);
+    }
+    fft_plan_destroy(pfb->plan);
+    free(pfb->taps);
+    free(pfb->history);
+    FFTW(free)(pfb->in);
+    FFTW(free)(pfb->out);
+    free(pfb->root_re);
+    free(pfb->root_im);
+    free(pfb);
+}
+
+int pfb_channel_at(const pfb_t *pfb, double offset) {
+    int half = (int)(pfb->channels / 2);
+    long c = lround(offset / pfb->spacing);
+    return c < -half ? -half : c >= half ? half - 1 : (int)c;
+}
+
+double pfb_channel_offset(const pfb_t *pfb, int channel) {
+    return channel * pfb->spacing;
+}
+
+bool pfb_route(pfb_t *pfb, int channel, pfb_consumer consumer, void *ctx) {
+    int half = (int)(pfb->channels / 2);
+    if (channel < -half || channel >= half) {
+        fprintf(stderr, "No PFB channel %d\n", channel);
+        return false;
+    }
+    for (int i = 0; i < pfb->n_routes; i++) {
+        if (pfb->routes[i].channel == channel) {
+            pfb->routes[i].consumer = consumer;
+            pfb->routes[i].ctx = ctx;
+            return true;
+        }
+    }
+    if (pfb->n_routes == PFB_MAX_ROUTES) {
+        fprintf(stderr, "Too many PFB channels routed\n");
+        return false;
+    }
+    float *out = malloc(2 * pfb->chunk_outputs * sizeof(float));
+    if (out == NULL) {
+        return false;
+    }
+    int m = (int)pfb->channels;
+    pfb->routes[pfb->n_routes++] = (pfb_route_t){
+            channel, (uint32_t)((channel % m + m) % m), consumer, ctx, out};
+    return true;
+}
+
+void pfb_unroute(pfb_t *pfb, int channel) {
+    for (int i = 0; i < pfb->n_routes; i++) {
+        if (pfb->routes[i].channel == channel) {
+            free(pfb->routes[i].out);
+            pfb->routes[i] = pfb->routes[--pfb->n_routes];
+            return;
+        }
+    }
+}
+
+// Output produced of every channel from the window ending at pfb->next:
+// the window times the prototype, summed down to channels points (the
+// branches), then the FFT. Channel c lands in bin c mod channels and is
+// turned back to the phase of a mixer running since the first sample.
+static void pfb_output(pfb_t *pfb, size_t produced) {
+    const size_t width = 2 * (size_t)pfb->channels;
+    const float *x = pfb->history + 2 * (pfb->next - pfb->n_taps);
+    const float *taps = pfb->taps;
+    fft_real *acc = (fft_real *)pfb->in;
+
+#pragma omp simd
+    for (size_t j = 0; j < width; j++) {
+        acc[j] = taps[j] * x[j];
+    }
+    for (uint32_t k = 1; k < pfb->taps_per_branch; k++) {
+        const float *g = taps + k * width;
+        const float *xk = x + k * width;
+#pragma omp simd
+        for (size_t j = 0; j < width; j++) {
+            acc[j] += g[j] * xk[j];
+        }
+    }
+    FFTW(execute_dft)(pfb->plan, pfb->in, pfb->out);
+
+    for (int i = 0; i < pfb->n_routes; i++) {
+        pfb_route_t *route = &pfb->routes[i];
+        size_t k = (size_t)(((uint64_t)route->bin * pfb->phase) %
+                            pfb->channels);
+        float re = (float)pfb->out[route->bin][0];
+        float im = (float)pfb->out[route->bin][1];
+        float *out = route->out + 2 * produced;
+        out[0] = re * pfb->root_re[k] - im * pfb->root_im[k];
+        out[1] = re * pfb->root_im[k] + im * pfb->root_re[k];
+    }
+}
+
+size_t pfb_process(pfb_t *pfb, const int8_t *samples, size_t n_samples) {
+    size_t total = 0;
+    for (size_t offset = 0; offset < n_samples; offset += PFB_CHUNK) {
+        size_t n = n_samples - offset;
+        if (n > PFB_CHUNK) {
+            n = PFB_CHUNK;
+        }
+        if (pfb->fill + n > pfb->capacity) {
+            size_t drop = pfb->next - pfb->n_taps;
+            memmove(pfb->history, pfb->history + 2 * drop,
+                    2 * (pfb->fill - drop) * sizeof(float));
+            pfb->fill -= drop;
+            pfb->next -= drop;
+        }
+        const int8_t *in = samples + 2 * offset;
+        float *history = pfb->history + 2 * pfb->fill;
+#pragma omp simd
+        for (size_t i = 0; i < 2 * n; i++) {
+            history[i] = (float)in[i];
+        }
+        pfb->fill += n;
+
+        size_t produced = 0;
+        for (; pfb->next <= pfb->fill; pfb->next += pfb->decimation) {
+            pfb_output(pfb, produced++);
+            pfb->phase = (pfb->phase + pfb->decimation) % pfb->channels;
+        }
+        for (int i = 0; i < pfb->n_routes && produced > 0; i++) {
+            pfb_route_t *route = &pfb->routes[i];
+            route->consumer(route->ctx, route->channel, route->out, produced);
+        }
+        total += produced;
+    }
+    return total;
+}
+
+double pfb_cost(const pfb_t *pfb) {
+    // two real multiply-adds per tap for complex input, and about 2.5 n
+    // log2 n for the FFT
+    double m = pfb->channels;
+    return (2.0 * (double)pfb->n_taps + 2.5 * m * log2(m)) /
+           pfb->decimation;
+}
@@ -0,0 +1,101 @@
+//
+// Created by dbrent on 3/25/21.
+//
+
+#ifndef DBSDR_PFB_H
+#define DBSDR_PFB_H
+
+#include "fft.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define PFB_MAX_ROUTES 64
+#define PFB_MAX_OVERSAMPLE 4
+#define PFB_CHUNK 65536 // input samples between consumer calls
+
+// Channel samples at the channel rate, interleaved complex float (full
+// scale 1.0), in the order they came in.
+typedef void (*pfb_consumer)(void *ctx, int channel, const float *samples,
+                             size_t n_samples);
+
+// Polyphase filter bank: splits the band into channels equal channels
+// sample_rate / channels apart, channel c centred on c * spacing for c in
+// [-channels / 2, channels / 2). One prototype low-pass, channels *
+// taps_per_branch long, is folded into channels branches and one FFT turns
+// them into every channel at once, so the work per output sample is the
+// same however many channels are routed. Channels come out at oversample *
+// spacing: 1 is critically sampled, 2 or 4 leave room around the edges.
+typedef struct pfb_config {
+    double sample_rate;
+    uint32_t channels;   // 2 - FFT_MAX_SIZE, a multiple of oversample
+    uint32_t oversample; // 1, 2 or 4
+    double bandwidth;    // Hz, 0 for DDC_DEFAULT_BANDWIDTH of the spacing
+} pfb_config_t;
+
+typedef struct pfb_route {
+    int channel;
+    uint32_t bin;
+    pfb_consumer consumer;
+    void *ctx;
+    float *out; // one chunk's worth
+} pfb_route_t;
+
+typedef struct pfb {
+    double sample_rate;
+    double spacing;
+    double channel_rate;
+    double bandwidth;
+    uint32_t channels;
+    uint32_t decimation;
+    uint32_t taps_per_branch;
+
+    // prototype (symmetric, so it reads the same either way), each tap
+    // twice to line up with interleaved input, with the int8 scale folded in
+    size_t n_taps;
+    float *taps;
+
+    // interleaved input history, shifted down only when it fills up
+    float *history;
+    size_t capacity;
+    size_t fill;
+    size_t next; // end of the next output's window
+    uint32_t phase; // input samples at that end, mod channels
+
+    fft_plan plan;
+    fft_complex *in;
+    fft_complex *out;
+    float *root_re; // e^(-2 pi i k / channels)
+    float *root_im;
+    size_t chunk_outputs;
+
+    int n_routes;
+    pfb_route_t routes[PFB_MAX_ROUTES];
+} pfb_t;
+
+// Blocks while the FFT is planned.
+pfb_t *pfb_create(const pfb_config_t *config);
+
+void pfb_destroy(pfb_t *pfb);
+
+// Nearest channel to offset Hz from the centre.
+int pfb_channel_at(const pfb_t *pfb, double offset);
+
+double pfb_channel_offset(const pfb_t *pfb, int channel);
+
+// Send channel to consumer from the next output on. A channel goes to one
+// consumer, routing it again replaces it.
+bool pfb_route(pfb_t *pfb, int channel, pfb_consumer consumer, void *ctx);
+
+void pfb_unroute(pfb_t *pfb, int channel);
+
+// Interleaved int8 IQ in, routed channels out through their consumers.
+// Returns the number of samples each channel got.
+size_t pfb_process(pfb_t *pfb, const int8_t *samples, size_t n_samples);
+
+// Multiply-adds per input sample, FFT included, however many channels are
+// routed. Comparable with ddc_cost().
+double pfb_cost(const pfb_t *pfb);
+
+#endif //DBSDR_PFB_H
@@ -0,0 +1,136 @@
+//
+// Created by dbrent on 3/20/21.
+//
+
+// dbsdr-plan: measure FFTW plans for every FFT size dbsdr supports ahead of
+// time and store them as wisdom, so dbsdr starts (and switches size) with
+// optimal plans without measuring anything itself.
+
+#include "fft.h"
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static void usage(const char *name) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -r, --rigor NAME   measure, patient or exhaustive (default: "
+            "patient)\n"
+            "      --min N        smallest FFT size (default: %d)\n"
+            "      --max N        largest FFT size (default: %d)\n"
+            "  -t, --time-limit S give up on a size after S seconds and keep "
+            "the best\n"
+            "                     plan so far (default: none)\n"
+            "  -o, --wisdom FILE  wisdom file to update (default: the per "
+            "host file\n"
+            "                     dbsdr loads)\n"
+            "  -h, --help         show this help\n",
+            name, FFT_MIN_SIZE, FFT_MAX_SIZE);
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+    enum { OPT_MIN = 256, OPT_MAX };
+    static const struct option options[] = {
+            {"rigor", required_argument, NULL, 'r'},
+            {"min", required_argument, NULL, OPT_MIN},
+            {"max", required_argument, NULL, OPT_MAX},
+            {"time-limit", required_argument, NULL, 't'},
+            {"wisdom", required_argument, NULL, 'o'},
+            {"help", no_argument, NULL, 'h'},
+            {NULL, 0, NULL, 0},
+    };
+
+    unsigned rigor = FFTW_PATIENT;
+    const char *rigor_name = "patient";
+    size_t min_size = FFT_MIN_SIZE;
+    size_t max_size = FFT_MAX_SIZE;
+    double time_limit = 0;
+    const char *wisdom = NULL;
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "r:t:o:h", options, NULL)) != -1) {
+        switch (opt) {
+        case 'r':
+            rigor_name = optarg;
+            if (strcmp(optarg, "measure") == 0) {
+                rigor = FFTW_MEASURE;
+            } else if (strcmp(optarg, "patient") == 0) {
+                rigor = FFTW_PATIENT;
+            } else if (strcmp(optarg, "exhaustive") == 0) {
+                rigor = FFTW_EXHAUSTIVE;
+            } else {
+                fprintf(stderr, "Unknown rigor: %s\n", optarg);
+                return -1;
+            }
+            break;
+        case OPT_MIN:
+            min_size = strtoul(optarg, NULL, 0);
+            break;
+        case OPT_MAX:
+            max_size = strtoul(optarg, NULL, 0);
+            break;
+        case 't':
+            time_limit = atof(optarg);
+            break;
+        case 'o':
+            wisdom = optarg;
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+    if (min_size < FFT_MIN_SIZE) {
+        min_size = FFT_MIN_SIZE;
+    }
+    if (max_size > FFT_MAX_SIZE) {
+        max_size = FFT_MAX_SIZE;
+    }
+
+    char path[4096];
+    if (wisdom == NULL) {
+        wisdom = fft_wisdom_path(path, sizeof(path));
+    }
+    if (wisdom == NULL) {
+        fprintf(stderr, "No wisdom location, pass --wisdom FILE\n");
+        return -1;
+    }
+    // start from what is there, sizes already planned at this rigor or
+    // better come straight back out of it
+    fft_wisdom_load(wisdom);
+    fft_set_rigor(rigor, time_limit);
+
+    fprintf(stderr, "Planning %zu to %zu points, %s, into %s\n", min_size,
+            max_size, rigor_name, wisdom);
+    double total = now();
+    for (size_t size = FFT_MIN_SIZE; size <= max_size; size *= 2) {
+        if (size < min_size) {
+            continue;
+        }
+        double start = now();
+        if (fft_setup_wait(size, FFT_WINDOW_HANN) == NULL) {
+            return -1;
+        }
+        fprintf(stderr, "%8zu points %10.2f s\n", size, now() - start);
+        // save as we go, the big sizes at exhaustive can take hours
+        if (!fft_wisdom_save(wisdom)) {
+            return -1;
+        }
+    }
+    fprintf(stderr, "Done in %.1f s\n", now() - total);
+
+    fft_cleanup();
+    return 0;
+}
@@ -0,0 +1,512 @@
+//
+// Created by dbrent on 3/29/21.
+//
+
+#include "pyramid.h"
+#include "archive.h"
+#include "binning.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define PYRAMID_MAGIC_BYTES 8
+
+_Static_assert(sizeof(pyramid_header_t) == 64, "pyramid header layout");
+_Static_assert(sizeof(pyramid_row_header_t) == 16, "row header layout");
+
+// False, with nothing usable in path, if dir is too long to fit the name.
+static bool level_path(char *path, const char *dir, int level) {
+    int n = snprintf(path, PYRAMID_PATH_MAX, "%s/pyramid-%02d.spp", dir,
+                     level);
+    if (n < 0 || n >= PYRAMID_PATH_MAX) {
+        fprintf(stderr, "Pyramid path too long: %s\n", dir);
+        return false;
+    }
+    return true;
+}
+
+// Bins of the level above one of n bins.
+static uint32_t level_bins(uint32_t n) {
+    return n >= 2 * PYRAMID_MIN_BINS && n % 2 == 0 ? n / 2 : n;
+}
+
+static off_t row_offset(const pyramid_header_t *header, uint64_t row) {
+    return (off_t)(sizeof(pyramid_header_t) + row * header->record_size);
+}
+
+static bool pwrite_all(int fd, const void *data, size_t size, off_t at) {
+    const unsigned char *p = data;
+    while (size > 0) {
+        ssize_t n = pwrite(fd, p, size, at);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        p += n;
+        at += n;
+        size -= (size_t)n;
+    }
+    return true;
+}
+
+static bool pread_all(int fd, void *data, size_t size, off_t at) {
+    unsigned char *p = data;
+    while (size > 0) {
+        ssize_t n = pread(fd, p, size, at);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        p += n;
+        at += n;
+        size -= (size_t)n;
+    }
+    return true;
+}
+
+// Max of a row of in_bins, halved if it is twice as wide, into the level's
+// pending row.
+static void fold(pyramid_level_t *l, const float *in, uint32_t in_bins) {
+    float *p = l->pending;
+    const uint32_t n = l->header.n_bins;
+    const bool first = l->count == 0;
+    if (in_bins == n) {
+#pragma omp simd
+        for (uint32_t i = 0; i < n; i++) {
+            float v = in[i];
+            p[i] = first || v > p[i] ? v : p[i];
+        }
+    } else {
+#pragma omp simd
+        for (uint32_t i = 0; i < n; i++) {
+            float a = in[2 * i], b = in[2 * i + 1];
+            float v = a > b ? a : b;
+            p[i] = first || v > p[i] ? v : p[i];
+        }
+    }
+}
+
+static bool set_rows(pyramid_level_t *l, uint64_t rows) {
+    atomic_store(&l->header.rows, rows);
+    return ftruncate(l->fd, row_offset(&l->header, rows)) == 0 &&
+           pwrite_all(l->fd, &rows, sizeof(rows),
+                      offsetof(pyramid_header_t, rows));
+}
+
+static bool create_level(pyramid_t *pyramid, int k) {
+    pyramid_level_t *l = &pyramid->levels[k];
+    pyramid_header_t *h = &l->header;
+    uint32_t below = k == 1 ? pyramid->base_bins
+                            : pyramid->levels[k - 1].header.n_bins;
+    memset(h, 0, sizeof(*h));
+    memcpy(h->magic, PYRAMID_MAGIC, PYRAMID_MAGIC_BYTES);
+    h->version = PYRAMID_VERSION;
+    h->level = (uint32_t)k;
+    h->n_bins = level_bins(below);
+    h->base_bins = pyramid->base_bins;
+    h->bytes_per_bin = pyramid->bytes_per_bin;
+    h->record_size = (uint32_t)((sizeof(pyramid_row_header_t) +
+                                 h->n_bins * h->bytes_per_bin + 7) &
+                                ~(size_t)7);
+    h->db_offset = pyramid->db_offset;
+    h->db_step = pyramid->db_step;
+    h->lines_per_row = (uint64_t)1 << k;
+    atomic_init(&h->rows, 0);
+
+    char path[PYRAMID_PATH_MAX];
+    if (!level_path(path, pyramid->dir, k)) {
+        return false;
+    }
+    l->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    l->pending = malloc(h->n_bins * sizeof(float));
+    l->count = 0;
+    if (l->fd < 0 || l->pending == NULL ||
+        !pwrite_all(l->fd, h, sizeof(*h), 0)) {
+        perror(path);
+        return false;
+    }
+    pyramid->n_levels = k;
+    return true;
+}
+
+// Existing level k, if it follows on from the ones below.
+static bool load_level(pyramid_t *pyramid, int k) {
+    pyramid_level_t *l = &pyramid->levels[k];
+    pyramid_header_t *h = &l->header;
+    char path[PYRAMID_PATH_MAX];
+    if (!level_path(path, pyramid->dir, k)) {
+        return false;
+    }
+    l->fd = open(path, O_RDWR);
+    if (l->fd < 0) {
+        return false;
+    }
+    bool ok = pread_all(l->fd, h, sizeof(*h), 0) &&
+              memcmp(h->magic, PYRAMID_MAGIC, PYRAMID_MAGIC_BYTES) == 0 &&
+              h->version == PYRAMID_VERSION && h->level == (uint32_t)k;
+    if (ok && k == 1) {
+        pyramid->base_bins = h->base_bins;
+        pyramid->bytes_per_bin = h->bytes_per_bin;
+        pyramid->db_offset = h->db_offset;
+        pyramid->db_step = h->db_step;
+    }
+    ok = ok && h->base_bins == pyramid->base_bins &&
+         h->bytes_per_bin == pyramid->bytes_per_bin &&
+         h->n_bins == level_bins(k == 1 ? pyramid->base_bins
+                                        : pyramid->levels[k - 1]
+                                                  .header.n_bins) &&
+         (l->pending = malloc(h->n_bins * sizeof(float))) != NULL;
+    if (!ok) {
+        close(l->fd);
+        l->fd = -1;
+        return false;
+    }
+    l->count = 0;
+    pyramid->n_levels = k;
+    return true;
+}
+
+// Row r of level k back into the pending row above it, as it was before
+// the restart.
+static bool seed(pyramid_t *pyramid, int k, uint64_t r) {
+    pyramid_level_t *l = &pyramid->levels[k];
+    pyramid_level_t *above = &pyramid->levels[k + 1];
+    const pyramid_header_t *h = &l->header;
+    if (!pread_all(l->fd, pyramid->record, h->record_size,
+                   row_offset(h, r))) {
+        return false;
+    }
+    memcpy(&above->row, pyramid->record, sizeof(above->row));
+    archive_dequantize(pyramid->record + sizeof(pyramid_row_header_t),
+                       h->n_bins, h->bytes_per_bin, h->db_offset,
+                       h->db_step, pyramid->base);
+    fold(above, pyramid->base, h->n_bins);
+    above->count = 1;
+    return true;
+}
+
+pyramid_t *pyramid_open(const char *dir, uint32_t base_bins,
+                        uint32_t bytes_per_bin, float db_offset,
+                        float db_step, uint64_t lines) {
+    pyramid_t *pyramid = calloc(1, sizeof(pyramid_t));
+    if (pyramid == NULL) {
+        return NULL;
+    }
+    snprintf(pyramid->dir, sizeof(pyramid->dir), "%s", dir);
+    pyramid->base_bins = base_bins;
+    pyramid->bytes_per_bin = bytes_per_bin;
+    pyramid->db_offset = db_offset;
+    pyramid->db_step = db_step;
+    for (int k = 0; k <= PYRAMID_LEVELS; k++) {
+        pyramid->levels[k].fd = -1;
+    }
+    for (int k = 1; k <= PYRAMID_LEVELS && load_level(pyramid, k); k++) {
+    }
+
+    // rows still pending when it was closed are gone, carry on from the
+    // last line in a level 1 row, where every level is complete
+    uint64_t from = pyramid->n_levels > 0
+                            ? 2 * atomic_load(&pyramid->levels[1].header.rows)
+                            : 0;
+    if (from > lines) {
+        fprintf(stderr, "Pyramid is ahead of the archive, starting over\n");
+        from = 0;
+    }
+    bool ok = true;
+    for (int k = 1; k <= pyramid->n_levels; k++) {
+        pyramid_level_t *l = &pyramid->levels[k];
+        uint64_t rows = atomic_load(&l->header.rows);
+        ok = ok && set_rows(l, rows < (from >> k) ? rows : from >> k);
+    }
+    pyramid->base = malloc(pyramid->base_bins * sizeof(float));
+    pyramid->record = malloc(sizeof(pyramid_row_header_t) +
+                             pyramid->base_bins * sizeof(uint16_t) + 8);
+    ok = ok && pyramid->base != NULL && pyramid->record != NULL;
+    // a level with an odd number of rows has the last of them waiting for
+    // its pair in the level above
+    for (int k = 1; ok && k < PYRAMID_LEVELS && k <= pyramid->n_levels;
+         k++) {
+        if ((from >> k) & 1) {
+            ok = (k + 1 <= pyramid->n_levels ||
+                  create_level(pyramid, k + 1)) &&
+                 seed(pyramid, k, (from >> k) - 1);
+        }
+    }
+    if (!ok) {
+        fprintf(stderr, "Could not open the pyramid in %s\n", dir);
+        pyramid_close(pyramid);
+        return NULL;
+    }
+    pyramid->lines = from;
+    return pyramid;
+}
+
+void pyramid_close(pyramid_t *pyramid) {
+    if (pyramid == NULL) {
+        return;
+    }
+    for (int k = 1; k <= PYRAMID_LEVELS; k++) {
+        if (pyramid->levels[k].fd >= 0) {
+            close(pyramid->levels[k].fd);
+        }
+        free(pyramid->levels[k].pending);
+    }
+    free(pyramid->base);
+    free(pyramid->record);
+    free(pyramid);
+}
+
+uint64_t pyramid_lines(const pyramid_t *pyramid) { return pyramid->lines; }
+
+static bool write_row(pyramid_t *pyramid, pyramid_level_t *l) {
+    pyramid_header_t *h = &l->header;
+    uint64_t rows = atomic_load(&h->rows);
+    memcpy(pyramid->record, &l->row, sizeof(l->row));
+    archive_quantize(l->pending, h->n_bins, h->bytes_per_bin, h->db_offset,
+                     h->db_step, pyramid->record + sizeof(l->row));
+    // the record first, readers go by the count
+    if (!pwrite_all(l->fd, pyramid->record, h->record_size,
+                    row_offset(h, rows))) {
+        return false;
+    }
+    atomic_store(&h->rows, rows + 1);
+    rows++;
+    return pwrite_all(l->fd, &rows, sizeof(rows),
+                      offsetof(pyramid_header_t, rows));
+}
+
+bool pyramid_append(pyramid_t *pyramid, const float *db, uint32_t n_bins,
+                    int64_t time_ns, uint64_t frequency) {
+    if (n_bins != pyramid->base_bins) {
+        binning_reduce(db, n_bins, 0, 0.0, (double)n_bins, BINNING_MAX,
+                       pyramid->base, (int)pyramid->base_bins);
+        db = pyramid->base;
+    }
+    pyramid->lines++;
+
+    // up the levels for as long as rows are completed
+    const float *in = db;
+    uint32_t in_bins = pyramid->base_bins;
+    pyramid_row_header_t row = {time_ns, frequency};
+    for (int k = 1; k <= PYRAMID_LEVELS; k++) {
+        if (k > pyramid->n_levels && !create_level(pyramid, k)) {
+            return false;
+        }
+        pyramid_level_t *l = &pyramid->levels[k];
+        if (l->count == 0) {
+            l->row = row;
+        }
+        fold(l, in, in_bins);
+        if (++l->count < 2) {
+            return true;
+        }
+        l->count = 0;
+        if (!write_row(pyramid, l)) {
+            return false;
+        }
+        in = l->pending;
+        in_bins = l->header.n_bins;
+        row = l->row;
+    }
+    return true;
+}
+
+// Maps level k, again if it grew past the mapping.
+static bool map_level(pyramid_reader_t *reader, int k) {
+    pyramid_map_t *m = &reader->levels[k];
+    if (m->fd < 0) {
+        char path[PYRAMID_PATH_MAX];
+        if (!level_path(path, reader->dir, k)) {
+            return false;
+        }
+        m->fd = open(path, O_RDONLY);
+        if (m->fd < 0) {
+            return false;
+        }
+    }
+    struct stat st;
+    if (fstat(m->fd, &st) != 0 ||
+        (size_t)st.st_size < sizeof(pyramid_header_t)) {
+        return false;
+    }
+    if ((size_t)st.st_size <= m->size) {
+        return true;
+    }
+    void *p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, m->fd,
+                   0);
+    if (p == MAP_FAILED) {
+        return false;
+    }
+    const pyramid_header_t *h = p;
+    if (memcmp(h->magic, PYRAMID_MAGIC, PYRAMID_MAGIC_BYTES) != 0 ||
+        h->version != PYRAMID_VERSION || h->level != (uint32_t)k) {
+        munmap(p, (size_t)st.st_size);
+        return false;
+    }
+    if (m->header != NULL) {
+        munmap((void *)m->header, m->size);
+    }
+    m->header = h;
+    m->size = (size_t)st.st_size;
+    return true;
+}
+
+pyramid_reader_t *pyramid_reader_open(const char *dir) {
+    pyramid_reader_t *reader = calloc(1, sizeof(pyramid_reader_t));
+    if (reader == NULL) {
+        return NULL;
+    }
+    snprintf(reader->dir, sizeof(reader->dir), "%s", dir);
+    for (int k = 0; k <= PYRAMID_LEVELS; k++) {
+        reader->levels[k].fd = -1;
+    }
+    pyramid_reader_refresh(reader);
+    return reader;
+}
+
+void pyramid_reader_close(pyramid_reader_t *reader) {
+    if (reader == NULL) {
+        return;
+    }
+    for (int k = 1; k <= PYRAMID_LEVELS; k++) {
+        pyramid_map_t *m = &reader->levels[k];
+        if (m->header != NULL) {
+            munmap((void *)m->header, m->size);
+        }
+        if (m->fd >= 0) {
+            close(m->fd);
+        }
+    }
+    free(reader->scratch);
+    free(reader->reduced);
+    free(reader);
+}
+
+void pyramid_reader_refresh(pyramid_reader_t *reader) {
+    int k = 1;
+    while (k <= PYRAMID_LEVELS && map_level(reader, k)) {
+        k++;
+    }
+    reader->n_levels = k - 1;
+}
+
+// Rows of level k, never past what is mapped.
+static uint64_t level_rows(const pyramid_reader_t *reader, int k) {
+    const pyramid_map_t *m = &reader->levels[k];
+    uint64_t rows = atomic_load(&((pyramid_header_t *)m->header)->rows);
+    uint64_t mapped = (m->size - sizeof(pyramid_header_t)) /
+                      m->header->record_size;
+    return rows < mapped ? rows : mapped;
+}
+
+int pyramid_pick_level(const pyramid_reader_t *reader, uint64_t lines_per_row,
+                       double span, int columns) {
+    int level = 0;
+    uint32_t bins = reader->n_levels > 0
+                            ? reader->levels[1].header->base_bins
+                            : 0;
+    while (level < reader->n_levels) {
+        const pyramid_header_t *h = reader->levels[level + 1].header;
+        // coarser in time only while it keeps a bin per column
+        if (h->lines_per_row > lines_per_row ||
+            (h->n_bins < bins && h->n_bins * span < columns)) {
+            break;
+        }
+        bins = h->n_bins;
+        level++;
+    }
+    return level;
+}
+
+// Max of the bins of one row between start and end into out.
+static void add_row(pyramid_reader_t *reader, const void *bins,
+                    uint32_t n_bins, uint32_t bytes_per_bin, float db_offset,
+                    float db_step, double start, double end, float *out,
+                    int width) {
+    double s = start * n_bins, e = end * n_bins;
+    uint32_t lo = (uint32_t)s;
+    uint32_t hi = (uint32_t)ceil(e);
+    hi = hi > n_bins ? n_bins : hi <= lo ? lo + 1 : hi;
+    if (hi - lo > reader->scratch_size) {
+        float *scratch = realloc(reader->scratch, n_bins * sizeof(float));
+        if (scratch == NULL) {
+            return;
+        }
+        reader->scratch = scratch;
+        reader->scratch_size = n_bins;
+    }
+    // only the bins in view are ever touched
+    archive_dequantize((const uint8_t *)bins + lo * bytes_per_bin, hi - lo,
+                       bytes_per_bin, db_offset, db_step, reader->scratch);
+    binning_reduce(reader->scratch, hi - lo, 0, s - lo,
+                   e - lo < hi - lo ? e - lo : hi - lo, BINNING_MAX,
+                   reader->reduced, width);
+    const float *r = reader->reduced;
+#pragma omp simd
+    for (int i = 0; i < width; i++) {
+        out[i] = r[i] > out[i] ? r[i] : out[i];
+    }
+}
+
+bool pyramid_render_row(pyramid_reader_t *reader,
+                        struct archive_reader *archive, int level,
+                        uint64_t first, uint64_t n_lines, double start,
+                        double end, float *out, int width) {
+    if (width > reader->reduced_width) {
+        float *reduced = realloc(reader->reduced, width * sizeof(float));
+        if (reduced == NULL) {
+            return false;
+        }
+        reader->reduced = reduced;
+        reader->reduced_width = width;
+    }
+    for (int i = 0; i < width; i++) {
+        out[i] = -INFINITY;
+    }
+    if (level > reader->n_levels) {
+        level = reader->n_levels;
+    }
+
+    // whole rows of level that overlap, then whatever is newer than its
+    // last row from the levels below
+    bool any = false;
+    uint64_t at = first, stop = first + n_lines;
+    for (int k = level; k >= 1 && at < stop; k--) {
+        const pyramid_header_t *h = reader->levels[k].header;
+        uint64_t rows = level_rows(reader, k);
+        uint64_t r = at / h->lines_per_row;
+        uint64_t r_end = (stop + h->lines_per_row - 1) / h->lines_per_row;
+        for (; r < r_end && r < rows; r++) {
+            const uint8_t *record = (const uint8_t *)h + row_offset(h, r);
+            add_row(reader, record + sizeof(pyramid_row_header_t), h->n_bins,
+                    h->bytes_per_bin, h->db_offset, h->db_step, start, end,
+                    out, width);
+            any = true;
+        }
+        if (r * h->lines_per_row > at) {
+            at = r * h->lines_per_row;
+        }
+    }
+    for (; at < stop; at++) {
+        archive_line_t line;
+        if (!archive_read_line(archive, at, &line)) {
+            break;
+        }
+        add_row(reader, line.bins, line.n_bins, line.bytes_per_bin,
+                line.db_offset, line.db_step, start, end, out, width);
+        any = true;
+    }
+    return any;
+}
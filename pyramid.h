@@ -0,0 +1,127 @@
+//
+// Created by dbrent on 3/29/21.
+//
+
+#ifndef DBSDR_PYRAMID_H
+#define DBSDR_PYRAMID_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define PYRAMID_MAGIC "DBSDRPYR"
+#define PYRAMID_VERSION 1
+#define PYRAMID_LEVELS 24     // 2^24 lines a row, 46 hours at 100 lines/s
+#define PYRAMID_MIN_BINS 2048 // levels stop narrowing at about a screen
+#define PYRAMID_PATH_MAX 4096
+
+// Mipmaps of the archive for drawing long stretches of it. Level 0 is the
+// archive itself, each row of level k is the max of two rows of level k - 1
+// and half as many bins, until PYRAMID_MIN_BINS where only time is halved.
+// Lines of any width are first max reduced to the base width of level 0.
+// A row is written once both halves are in, so levels are always complete
+// up to 2^k times their rows, and showing any number of lines on a screen
+// of rows takes about as many cells as it has pixels. One file per level,
+// pyramid-KK.spp next to the archive chunks, a header and fixed size
+// records of a row header and bins quantized like the archive's.
+typedef struct pyramid_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t level;
+    uint32_t n_bins;
+    uint32_t base_bins; // lines are reduced to this before level 1
+    uint32_t bytes_per_bin;
+    uint32_t record_size;
+    float db_offset;
+    float db_step;
+    uint64_t lines_per_row;
+    _Atomic uint64_t rows; // bumped after each record is written
+    uint8_t reserved[8];
+} pyramid_header_t;
+
+typedef struct pyramid_row_header {
+    int64_t time_ns;    // of the first line
+    uint64_t frequency; // Hz, centre of the first line
+} pyramid_row_header_t;
+
+typedef struct pyramid_level {
+    int fd;
+    pyramid_header_t header;
+    float *pending; // max of the rows below so far, count of them
+    uint32_t count;
+    pyramid_row_header_t row;
+} pyramid_level_t;
+
+typedef struct pyramid {
+    char dir[PYRAMID_PATH_MAX];
+    uint32_t base_bins;
+    uint32_t bytes_per_bin;
+    float db_offset;
+    float db_step;
+    uint64_t lines; // archive lines folded in
+    int n_levels;   // levels with a file so far
+    pyramid_level_t levels[PYRAMID_LEVELS + 1]; // from 1
+    float *base;     // a line reduced to base_bins
+    uint8_t *record; // room for a level 1 record
+} pyramid_t;
+
+// Opens or starts the pyramid in dir. Bins are quantized as offset + q *
+// step in bytes_per_bin, and lines reduced to base_bins, unless there is a
+// pyramid already, which keeps its own. If it holds more lines than the
+// archive's lines it is started over.
+pyramid_t *pyramid_open(const char *dir, uint32_t base_bins,
+                        uint32_t bytes_per_bin, float db_offset,
+                        float db_step, uint64_t lines);
+
+void pyramid_close(pyramid_t *pyramid);
+
+// Archive lines folded in, the next line pyramid_append() expects.
+uint64_t pyramid_lines(const pyramid_t *pyramid);
+
+// Folds the next archive line in, writing out the rows it completes.
+bool pyramid_append(pyramid_t *pyramid, const float *db, uint32_t n_bins,
+                    int64_t time_ns, uint64_t frequency);
+
+// Read side, every level memory mapped and remapped as it grows.
+typedef struct pyramid_map {
+    int fd;
+    const pyramid_header_t *header;
+    size_t size;
+} pyramid_map_t;
+
+typedef struct pyramid_reader {
+    char dir[PYRAMID_PATH_MAX];
+    int n_levels;
+    pyramid_map_t levels[PYRAMID_LEVELS + 1]; // from 1
+    float *scratch; // a row's bins in dB
+    size_t scratch_size;
+    float *reduced; // one row reduced to the output
+    int reduced_width;
+} pyramid_reader_t;
+
+// A reader with no levels yet is fine, they show up on refresh.
+pyramid_reader_t *pyramid_reader_open(const char *dir);
+
+void pyramid_reader_close(pyramid_reader_t *reader);
+
+// Picks up rows and levels written since the last call.
+void pyramid_reader_refresh(pyramid_reader_t *reader);
+
+// Coarsest level to draw lines_per_row lines a row from, keeping at least
+// columns bins across a fraction span of the band.
+int pyramid_pick_level(const pyramid_reader_t *reader, uint64_t lines_per_row,
+                       double span, int columns);
+
+// Max of archive lines [first, first + n_lines) between start and end (0 -
+// 1 of the band) into width values, from rows of level or below. Rows of
+// level are taken whole where they overlap, as a mipmap would, and the
+// newest lines, not yet in a row, from the levels below, down to the
+// archive itself. False if none of the lines are there.
+struct archive_reader;
+bool pyramid_render_row(pyramid_reader_t *reader,
+                        struct archive_reader *archive, int level,
+                        uint64_t first, uint64_t n_lines, double start,
+                        double end, float *out, int width);
+
+#endif //DBSDR_PYRAMID_H
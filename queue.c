@@ -4,74 +4,168 @@
 
 #include "queue.h"
 
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
-void queue_init(queue_t *q) {
-    pthread_mutex_init(&q->lock, NULL);
-    q->first = NULL;
-    q->last = NULL;
-    q->size = 0;
+static size_t round_up_pow2(size_t n) {
+    size_t p = 1;
+    while (p < n) {
+        p <<= 1;
+    }
+    return p;
 }
 
-void queue_destroy(queue_t *q) {
-    pthread_mutex_lock(&q->lock);
-    queue_entry_t *current = q->first;
-    while (current) {
-        queue_entry_t *tmp = current->next;
-        free(current->val);
-        free(current);
-        current = tmp;
+static void update_high_water(queue_t *q, size_t occupancy) {
+    size_t current =
+            atomic_load_explicit(&q->high_water, memory_order_relaxed);
+    while (occupancy > current &&
+           !atomic_compare_exchange_weak_explicit(&q->high_water, &current,
+                                                  occupancy,
+                                                  memory_order_relaxed,
+                                                  memory_order_relaxed)) {
     }
-    pthread_mutex_destroy(&q->lock);
 }
 
-void queue_append(queue_t *q, void *val) {
-    queue_entry_t *entry = malloc(sizeof(queue_entry_t));
-    entry->val = val;
-
-    pthread_mutex_lock(&q->lock);
-
-    entry->next = NULL;
-    if (q->size == 0) {
-        q->first = entry;
-        q->last = entry;
-        entry->prev = NULL;
-    } else {
-        q->last->next = entry;
-        entry->prev = q->last;
-        q->last = entry;
+bool queue_init(queue_t *q, size_t slot_size, size_t capacity,
+                queue_mode_t mode) {
+    return queue_init_aligned(q, slot_size, capacity, mode, QUEUE_CACHE_LINE);
+}
+
+bool queue_init_aligned(queue_t *q, size_t slot_size, size_t capacity,
+                        queue_mode_t mode, size_t alignment) {
+    q->mode = mode;
+    q->capacity = round_up_pow2(capacity < 2 ? 2 : capacity);
+    q->mask = q->capacity - 1;
+    q->slot_size = slot_size;
+    q->stride = (slot_size + alignment - 1) & ~(alignment - 1);
+
+    q->slots = aligned_alloc(alignment, q->stride * q->capacity);
+    q->sequence = aligned_alloc(QUEUE_CACHE_LINE,
+                                sizeof(queue_sequence_t) * q->capacity);
+    if (q->slots == NULL || q->sequence == NULL) {
+        fprintf(stderr, "Could not allocate queue of %zu x %zu bytes\n",
+                q->capacity, slot_size);
+        free(q->slots);
+        free(q->sequence);
+        q->slots = NULL;
+        q->sequence = NULL;
+        return false;
     }
+    // touch every slot now so the first pass doesn't page fault
+    memset(q->slots, 0, q->stride * q->capacity);
 
-    q->size++;
+    for (size_t i = 0; i < q->capacity; i++) {
+        atomic_init(&q->sequence[i].value, i);
+    }
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+    atomic_init(&q->high_water, 0);
+    atomic_init(&q->pushed, 0);
+    atomic_init(&q->overflows, 0);
 
-    pthread_mutex_unlock(&q->lock);
+    return true;
 }
 
-void *queue_pop(queue_t *q) {
-    pthread_mutex_lock(&q->lock);
-
-    void *val = NULL;
-    if (q->size == 1) {
-        val = q->first->val;
-        free(q->first);
-        q->first = NULL;
-        q->last = NULL;
-        q->size--;
-    } else if (q->size > 1) {
-        val = q->first->val;
-        queue_entry_t *snd = q->first->next;
-        free(q->first);
-        snd->prev = NULL;
-        q->first = snd;
-        q->size--;
+void queue_destroy(queue_t *q) {
+    free(q->slots);
+    free(q->sequence);
+    q->slots = NULL;
+    q->sequence = NULL;
+}
+
+void *queue_reserve(queue_t *q) {
+    size_t pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+    for (;;) {
+        size_t seq =
+                atomic_load_explicit(&q->sequence[pos & q->mask].value,
+                                     memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+            if (q->mode == QUEUE_SPSC) {
+                atomic_store_explicit(&q->head, pos + 1, memory_order_relaxed);
+                break;
+            }
+            if (atomic_compare_exchange_weak_explicit(&q->head, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            atomic_fetch_add_explicit(&q->overflows, 1, memory_order_relaxed);
+            return NULL;
+        } else {
+            pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+        }
     }
 
-    pthread_mutex_unlock(&q->lock);
+    size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    update_high_water(q, pos + 1 - tail);
+
+    return q->slots + (pos & q->mask) * q->stride;
+}
 
-    return val;
+void queue_commit(queue_t *q, void *slot) {
+    size_t index = ((unsigned char *)slot - q->slots) / q->stride;
+    // a reserved slot's sequence still equals its position, nobody else
+    // can move it until we publish
+    atomic_size_t *sequence = &q->sequence[index].value;
+    size_t seq = atomic_load_explicit(sequence, memory_order_relaxed);
+    atomic_store_explicit(sequence, seq + 1, memory_order_release);
+    atomic_fetch_add_explicit(&q->pushed, 1, memory_order_relaxed);
+}
+
+void *queue_peek(queue_t *q) {
+    size_t pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    size_t seq = atomic_load_explicit(&q->sequence[pos & q->mask].value,
+                                      memory_order_acquire);
+    if (seq != pos + 1) {
+        return NULL;
+    }
+    return q->slots + (pos & q->mask) * q->stride;
+}
+
+void queue_release(queue_t *q) {
+    size_t pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    atomic_store_explicit(&q->sequence[pos & q->mask].value,
+                          pos + q->capacity, memory_order_release);
+    atomic_store_explicit(&q->tail, pos + 1, memory_order_release);
+}
+
+bool queue_push(queue_t *q, const void *val) {
+    void *slot = queue_reserve(q);
+    if (slot == NULL) {
+        return false;
+    }
+    memcpy(slot, val, q->slot_size);
+    queue_commit(q, slot);
+    return true;
+}
+
+bool queue_pop(queue_t *q, void *val) {
+    void *slot = queue_peek(q);
+    if (slot == NULL) {
+        return false;
+    }
+    memcpy(val, slot, q->slot_size);
+    queue_release(q);
+    return true;
 }
 
 size_t queue_size(queue_t *q) {
-    size_t size = q->size;
-    return size;
-}
\ No newline at end of file
+    size_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+    size_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+    // head can be reserved but not yet committed, never report past capacity
+    size_t size = head - tail;
+    return size > q->capacity ? q->capacity : size;
+}
+
+void queue_get_stats(queue_t *q, queue_stats_t *stats) {
+    stats->occupancy = queue_size(q);
+    stats->capacity = q->capacity;
+    stats->high_water =
+            atomic_load_explicit(&q->high_water, memory_order_relaxed);
+    stats->pushed = atomic_load_explicit(&q->pushed, memory_order_relaxed);
+    stats->overflows =
+            atomic_load_explicit(&q->overflows, memory_order_relaxed);
+}
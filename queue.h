@@ -5,32 +5,82 @@
 #ifndef DBSDR_QUEUE_H
 #define DBSDR_QUEUE_H
 
-#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
+#define QUEUE_CACHE_LINE 64
 
-typedef struct queue_entry {
-    struct queue_entry *next;
-    struct queue_entry *prev;
-    void *val;
-} queue_entry_t;
+// Bounded ring of fixed-size slots stored inline. Every slot carries a
+// sequence number on a cache line of its own, so producers and the consumer
+// never touch the same index cache line and nothing is allocated after
+// queue_init().
+typedef enum queue_mode {
+    QUEUE_SPSC, // one producer thread, one consumer thread
+    QUEUE_MPSC, // any number of producer threads, one consumer thread
+} queue_mode_t;
 
+typedef struct queue_stats {
+    size_t occupancy;
+    size_t capacity;
+    size_t high_water;
+    uint64_t pushed;
+    uint64_t overflows;
+} queue_stats_t;
 
-typedef struct {
-    queue_entry_t *first;
-    queue_entry_t *last;
-    pthread_mutex_t lock;
-    size_t size;
+typedef struct queue_sequence {
+    _Alignas(QUEUE_CACHE_LINE) atomic_size_t value;
+} queue_sequence_t;
+
+typedef struct queue {
+    // producer side
+    _Alignas(QUEUE_CACHE_LINE) atomic_size_t head;
+    atomic_size_t high_water;
+    atomic_uint_fast64_t pushed;
+    atomic_uint_fast64_t overflows;
+
+    // consumer side
+    _Alignas(QUEUE_CACHE_LINE) atomic_size_t tail;
+
+    // read-only after queue_init()
+    _Alignas(QUEUE_CACHE_LINE) queue_mode_t mode;
+    size_t capacity;
+    size_t mask;
+    size_t slot_size;
+    size_t stride;
+    unsigned char *slots;
+    queue_sequence_t *sequence;
 } queue_t;
 
+bool queue_init(queue_t *q, size_t slot_size, size_t capacity,
+                queue_mode_t mode);
 
-void queue_init(queue_t *q);
+// Same, with every slot starting on an alignment boundary (a power of two
+// and a multiple of QUEUE_CACHE_LINE), e.g. page aligned for O_DIRECT.
+bool queue_init_aligned(queue_t *q, size_t slot_size, size_t capacity,
+                        queue_mode_t mode, size_t alignment);
 
 void queue_destroy(queue_t *q);
 
-void queue_append(queue_t *q, void *val);
+// Producer: claim the next free slot, fill it in place, then commit it.
+// Returns NULL (and counts an overflow) when the ring is full.
+void *queue_reserve(queue_t *q);
+
+void queue_commit(queue_t *q, void *slot);
 
-void *queue_pop(queue_t *q);
+// Consumer: look at the oldest committed slot without removing it, then
+// release it once done. Returns NULL when the ring is empty.
+void *queue_peek(queue_t *q);
+
+void queue_release(queue_t *q);
+
+bool queue_push(queue_t *q, const void *val);
+
+bool queue_pop(queue_t *q, void *val);
 
 size_t queue_size(queue_t *q);
 
+void queue_get_stats(queue_t *q, queue_stats_t *stats);
+
 #endif //DBSDR_QUEUE_H
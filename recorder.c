@@ -0,0 +1,368 @@
+//
+// Created by dbrent on 3/16/21.
+//
+
+// O_DIRECT
+#define _GNU_SOURCE
+
+#include "recorder.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RECORDER_IDLE_SLEEP_NS 1000000
+#define RECORDER_STALL_SLEEP_NS 100000
+
+static double wall_time(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static char *path_with_suffix(const char *base, const char *suffix) {
+    size_t length = strlen(base) + strlen(suffix) + 1;
+    char *path = malloc(length);
+    if (path != NULL) {
+        snprintf(path, length, "%s%s", base, suffix);
+    }
+    return path;
+}
+
+static bool pwrite_all(int fd, const unsigned char *data, size_t size,
+                       off_t at) {
+    while (size > 0) {
+        ssize_t n = pwrite(fd, data, size, at);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += n;
+        at += n;
+        size -= (size_t)n;
+    }
+    return true;
+}
+
+static void *writer_thread(void *arg) {
+    recorder_t *rec = arg;
+    const struct timespec idle = {0, RECORDER_IDLE_SLEEP_NS};
+
+    for (;;) {
+        unsigned char *chunk = queue_peek(&rec->chunks);
+        if (chunk == NULL) {
+            // only stop once everything committed has been written
+            if (!atomic_load(&rec->running)) {
+                break;
+            }
+            nanosleep(&idle, NULL);
+            continue;
+        }
+
+        // every chunk keeps its place in the file, so a failed one doesn't
+        // shift the samples after it
+        if (pwrite_all(rec->fd, chunk, RECORDER_CHUNK, (off_t)rec->offset)) {
+            atomic_fetch_add(&rec->bytes_written, RECORDER_CHUNK);
+        } else {
+            atomic_fetch_add(&rec->write_errors, 1);
+        }
+        rec->offset += RECORDER_CHUNK;
+        queue_release(&rec->chunks);
+    }
+
+    return NULL;
+}
+
+static void add_event(recorder_t *rec, uint64_t frequency, uint64_t dropped) {
+    if (rec->n_events == rec->max_events) {
+        size_t max = rec->max_events ? rec->max_events * 2 : 16;
+        recorder_event_t *events =
+                realloc(rec->events, max * sizeof(recorder_event_t));
+        if (events == NULL) {
+            return;
+        }
+        rec->events = events;
+        rec->max_events = max;
+    }
+    recorder_event_t *e = &rec->events[rec->n_events++];
+    e->sample = rec->samples;
+    e->frequency = frequency;
+    e->dropped = dropped;
+    e->time = wall_time();
+}
+
+static void format_datetime(double time, char *buffer, size_t size) {
+    time_t seconds = (time_t)time;
+    struct tm tm;
+    gmtime_r(&seconds, &tm);
+    size_t n = strftime(buffer, size, "%Y-%m-%dT%H:%M:%S", &tm);
+    snprintf(buffer + n, size - n, ".%06dZ",
+             (int)((time - (double)seconds) * 1e6));
+}
+
+static bool write_meta(recorder_t *rec) {
+    FILE *f = fopen(rec->meta_path, "w");
+    if (f == NULL) {
+        fprintf(stderr, "Could not write %s\n", rec->meta_path);
+        return false;
+    }
+
+    char datetime[64];
+    fprintf(f, "{\n  \"global\": {\n");
+    fprintf(f, "    \"core:datatype\": \"ci8\",\n");
+    fprintf(f, "    \"core:sample_rate\": %lu,\n",
+            (unsigned long)rec->sample_rate);
+    fprintf(f, "    \"core:version\": \"1.0.0\",\n");
+    fprintf(f, "    \"core:recorder\": \"dbsdr\",\n");
+    fprintf(f, "    \"core:num_channels\": 1,\n");
+    fprintf(f, "    \"core:extensions\": [{\"name\": \"dbsdr\", "
+               "\"version\": \"1.0.0\", \"optional\": true}],\n");
+    fprintf(f, "    \"dbsdr:lna_gain\": %u,\n", rec->lna_gain);
+    fprintf(f, "    \"dbsdr:vga_gain\": %u,\n", rec->vga_gain);
+    fprintf(f, "    \"dbsdr:dropped_samples\": %lu\n",
+            (unsigned long)atomic_load(&rec->dropped_samples));
+    fprintf(f, "  },\n");
+
+    // a new capture segment starts at every retune
+    format_datetime(rec->start_time, datetime, sizeof(datetime));
+    fprintf(f, "  \"captures\": [\n");
+    fprintf(f, "    {\"core:sample_start\": 0, \"core:frequency\": %lu, "
+               "\"core:datetime\": \"%s\"}",
+            (unsigned long)rec->frequency, datetime);
+    for (size_t i = 0; i < rec->n_events; i++) {
+        recorder_event_t *e = &rec->events[i];
+        if (e->dropped != 0) {
+            continue;
+        }
+        format_datetime(e->time, datetime, sizeof(datetime));
+        fprintf(f,
+                ",\n    {\"core:sample_start\": %lu, \"core:frequency\": "
+                "%lu, \"core:datetime\": \"%s\"}",
+                (unsigned long)e->sample, (unsigned long)e->frequency,
+                datetime);
+    }
+    fprintf(f, "\n  ],\n");
+
+    fprintf(f, "  \"annotations\": [");
+    for (size_t i = 0; i < rec->n_events; i++) {
+        recorder_event_t *e = &rec->events[i];
+        fprintf(f, "%s\n    {\"core:sample_start\": %lu, ", i ? "," : "",
+                (unsigned long)e->sample);
+        if (e->dropped != 0) {
+            fprintf(f,
+                    "\"core:sample_count\": 0, \"core:comment\": "
+                    "\"%lu samples dropped before this point\"}",
+                    (unsigned long)e->dropped);
+        } else {
+            fprintf(f,
+                    "\"core:sample_count\": 0, \"core:comment\": "
+                    "\"retuned to %lu Hz\"}",
+                    (unsigned long)e->frequency);
+        }
+    }
+    fprintf(f, "%s]\n}\n", rec->n_events ? "\n  " : "");
+
+    fclose(f);
+    return true;
+}
+
+recorder_t *recorder_open(const char *base, uint64_t sample_rate,
+                          uint64_t frequency, uint32_t lna_gain,
+                          uint32_t vga_gain) {
+    recorder_t *rec = aligned_alloc(QUEUE_CACHE_LINE, sizeof(recorder_t));
+    if (rec == NULL) {
+        fprintf(stderr, "Could not create recorder\n");
+        return NULL;
+    }
+    memset(rec, 0, sizeof(recorder_t));
+    rec->sample_rate = sample_rate;
+    rec->frequency = frequency;
+    rec->lna_gain = lna_gain;
+    rec->vga_gain = vga_gain;
+    rec->start_time = wall_time();
+    atomic_init(&rec->pending_frequency, 0);
+    atomic_init(&rec->running, true);
+    rec->data_path = path_with_suffix(base, ".sigmf-data");
+    rec->meta_path = path_with_suffix(base, ".sigmf-meta");
+    if (rec->data_path == NULL || rec->meta_path == NULL ||
+        !queue_init_aligned(&rec->chunks, RECORDER_CHUNK, RECORDER_BUFFERS,
+                            QUEUE_SPSC, RECORDER_ALIGNMENT)) {
+        free(rec->data_path);
+        free(rec->meta_path);
+        free(rec);
+        return NULL;
+    }
+
+    // O_DIRECT skips the page cache for sustained rates, not every
+    // filesystem (tmpfs) takes it
+    rec->direct = true;
+    rec->fd = open(rec->data_path, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT,
+                   0644);
+    if (rec->fd < 0 && errno == EINVAL) {
+        rec->direct = false;
+        rec->fd = open(rec->data_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    }
+    if (rec->fd < 0) {
+        fprintf(stderr, "Could not create %s\n", rec->data_path);
+        queue_destroy(&rec->chunks);
+        free(rec->data_path);
+        free(rec->meta_path);
+        free(rec);
+        return NULL;
+    }
+
+    if (pthread_create(&rec->thread, NULL, writer_thread, rec) != 0) {
+        fprintf(stderr, "Could not create recorder thread\n");
+        close(rec->fd);
+        queue_destroy(&rec->chunks);
+        free(rec->data_path);
+        free(rec->meta_path);
+        free(rec);
+        return NULL;
+    }
+
+    fprintf(stderr, "Recording to %s%s\n", rec->data_path,
+            rec->direct ? " (O_DIRECT)" : "");
+    return rec;
+}
+
+void recorder_close(recorder_t *rec) {
+    if (rec == NULL) {
+        return;
+    }
+
+    atomic_store(&rec->running, false);
+    pthread_join(rec->thread, NULL);
+
+    // the partial last chunk isn't a multiple of the block size O_DIRECT
+    // wants, it goes through the page cache after the whole ones
+    if (rec->current != NULL && rec->fill > 0) {
+        int flags = fcntl(rec->fd, F_GETFL);
+        bool ok = !rec->direct ||
+                  (flags >= 0 &&
+                   fcntl(rec->fd, F_SETFL, flags & ~O_DIRECT) == 0);
+        if (ok && pwrite_all(rec->fd, rec->current, rec->fill,
+                             (off_t)rec->offset)) {
+            atomic_fetch_add(&rec->bytes_written, rec->fill);
+        } else {
+            atomic_fetch_add(&rec->write_errors, 1);
+        }
+    }
+    // failed chunks at the end are holes too, every sample keeps its place
+    off_t length = (off_t)(rec->offset + (rec->current ? rec->fill : 0));
+    if (ftruncate(rec->fd, length) != 0) {
+        fprintf(stderr, "Could not size %s\n", rec->data_path);
+    }
+    if (atomic_load(&rec->write_errors) != 0) {
+        fprintf(stderr, "%lu writes to %s failed\n",
+                (unsigned long)atomic_load(&rec->write_errors),
+                rec->data_path);
+    }
+    close(rec->fd);
+
+    write_meta(rec);
+    fprintf(stderr, "Recorded %lu samples to %s, %lu dropped, %lu stalls\n",
+            (unsigned long)rec->samples, rec->data_path,
+            (unsigned long)atomic_load(&rec->dropped_samples),
+            (unsigned long)atomic_load(&rec->stalls));
+
+    queue_destroy(&rec->chunks);
+    free(rec->events);
+    free(rec->data_path);
+    free(rec->meta_path);
+    free(rec);
+}
+
+static unsigned char *next_chunk(recorder_t *rec) {
+    unsigned char *chunk = queue_reserve(&rec->chunks);
+    if (chunk != NULL) {
+        return chunk;
+    }
+
+    // the disk is behind: wait here and let the raw IQ ring absorb it, any
+    // overflow upstream comes back as a recorded gap
+    const struct timespec pause = {0, RECORDER_STALL_SLEEP_NS};
+    uint64_t start = monotonic_ns();
+    while ((chunk = queue_reserve(&rec->chunks)) == NULL) {
+        nanosleep(&pause, NULL);
+    }
+    atomic_fetch_add(&rec->stalls, 1);
+    atomic_fetch_add(&rec->stall_ns, monotonic_ns() - start);
+    return chunk;
+}
+
+void recorder_write(recorder_t *rec, const int8_t *samples, size_t n_samples) {
+    uint64_t frequency = atomic_exchange(&rec->pending_frequency, 0);
+    if (frequency != 0) {
+        add_event(rec, frequency, 0);
+    }
+
+    const unsigned char *data = (const unsigned char *)samples;
+    size_t size = n_samples * 2;
+    while (size > 0) {
+        if (rec->current == NULL) {
+            rec->current = next_chunk(rec);
+            rec->fill = 0;
+        }
+        size_t n = RECORDER_CHUNK - rec->fill;
+        if (n > size) {
+            n = size;
+        }
+        memcpy(rec->current + rec->fill, data, n);
+        rec->fill += n;
+        data += n;
+        size -= n;
+
+        if (rec->fill == RECORDER_CHUNK) {
+            queue_commit(&rec->chunks, rec->current);
+            rec->current = NULL;
+        }
+    }
+
+    rec->samples += n_samples;
+    atomic_store(&rec->samples_total, rec->samples);
+}
+
+void recorder_gap(recorder_t *rec, uint64_t n_samples) {
+    add_event(rec, 0, n_samples);
+    atomic_fetch_add(&rec->dropped_samples, n_samples);
+}
+
+void recorder_retune(recorder_t *rec, uint64_t frequency) {
+    atomic_store(&rec->pending_frequency, frequency);
+}
+
+void recorder_tap(void *ctx, const iq_block_t *block, uint64_t missing,
+                  bool retuned) {
+    recorder_t *rec = ctx;
+    if (missing != 0) {
+        recorder_gap(rec, missing);
+    }
+    if (retuned) {
+        recorder_retune(rec, block->tag.frequency);
+    }
+    recorder_write(rec, block->samples, block->n_samples);
+}
+
+void recorder_get_stats(recorder_t *rec, recorder_stats_t *stats) {
+    stats->samples = atomic_load(&rec->samples_total);
+    stats->bytes_written = atomic_load(&rec->bytes_written);
+    stats->stalls = atomic_load(&rec->stalls);
+    stats->stall_time = (double)atomic_load(&rec->stall_ns) * 1e-9;
+    stats->dropped_samples = atomic_load(&rec->dropped_samples);
+    stats->write_errors = atomic_load(&rec->write_errors);
+    stats->direct = rec->direct;
+    queue_get_stats(&rec->chunks, &stats->buffers);
+}
@@ -0,0 +1,100 @@
+//
+// Created by dbrent on 3/16/21.
+//
+
+#ifndef DBSDR_RECORDER_H
+#define DBSDR_RECORDER_H
+
+#include "dsp.h"
+#include "queue.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define RECORDER_CHUNK (4 * 1024 * 1024)
+#define RECORDER_BUFFERS 8
+#define RECORDER_ALIGNMENT 4096
+
+// Raw IQ to <base>.sigmf-data with a <base>.sigmf-meta sidecar. Samples are
+// copied into page aligned chunks on the DSP thread and a writer thread
+// flushes whole chunks, with O_DIRECT when the filesystem allows it. The
+// partial last one is written on close without it.
+typedef struct recorder_event {
+    uint64_t sample;
+    uint64_t frequency;
+    uint64_t dropped; // 0 for a retune
+    double time;
+} recorder_event_t;
+
+typedef struct recorder_stats {
+    uint64_t samples;
+    uint64_t bytes_written;
+    uint64_t stalls;
+    double stall_time;
+    uint64_t dropped_samples;
+    uint64_t write_errors;
+    bool direct;
+    queue_stats_t buffers;
+} recorder_stats_t;
+
+typedef struct recorder {
+    queue_t chunks;
+    char *data_path;
+    char *meta_path;
+    int fd;
+    bool direct;
+    uint64_t sample_rate;
+    uint64_t frequency;
+    uint32_t lna_gain;
+    uint32_t vga_gain;
+    double start_time;
+
+    // dsp thread side
+    unsigned char *current;
+    size_t fill;
+    uint64_t samples;
+    recorder_event_t *events;
+    size_t n_events;
+    size_t max_events;
+    atomic_uint_fast64_t pending_frequency;
+
+    // writer thread side
+    pthread_t thread;
+    atomic_bool running;
+    uint64_t offset; // of the next chunk, failed ones are left as holes
+    atomic_uint_fast64_t bytes_written;
+    atomic_uint_fast64_t write_errors;
+
+    atomic_uint_fast64_t stalls;
+    atomic_uint_fast64_t stall_ns;
+    atomic_uint_fast64_t dropped_samples;
+    atomic_uint_fast64_t samples_total;
+} recorder_t;
+
+recorder_t *recorder_open(const char *base, uint64_t sample_rate,
+                          uint64_t frequency, uint32_t lna_gain,
+                          uint32_t vga_gain);
+
+// Flushes everything, writes the metadata and frees the recorder.
+void recorder_close(recorder_t *rec);
+
+// DSP thread: append n_samples interleaved int8 IQ.
+void recorder_write(recorder_t *rec, const int8_t *samples, size_t n_samples);
+
+// DSP thread: n_samples never arrived, annotate the discontinuity.
+void recorder_gap(recorder_t *rec, uint64_t n_samples);
+
+// Any thread: the radio was retuned, the next samples written carry it.
+void recorder_retune(recorder_t *rec, uint64_t frequency);
+
+// dsp_tap for the raw stream: annotates gaps and retunes, then writes the
+// block.
+void recorder_tap(void *rec, const iq_block_t *block, uint64_t missing,
+                  bool retuned);
+
+void recorder_get_stats(recorder_t *rec, recorder_stats_t *stats);
+
+#endif //DBSDR_RECORDER_H
@@ -0,0 +1,141 @@
+//
+// Created by dbrent on 3/26/21.
+//
+
+#include "resampler.h"
+#include "ddc.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static uint64_t gcd(uint64_t a, uint64_t b) {
+    while (b != 0) {
+        uint64_t t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+bool resampler_ratio(double in_rate, double out_rate, uint32_t *up,
+                     uint32_t *down) {
+    uint64_t in = (uint64_t)llround(in_rate);
+    uint64_t out = (uint64_t)llround(out_rate);
+    if (in == 0 || out == 0) {
+        return false;
+    }
+    uint64_t g = gcd(in, out);
+    if (out / g > RESAMPLER_MAX_UP || in / g > UINT32_MAX) {
+        return false;
+    }
+    *up = (uint32_t)(out / g);
+    *down = (uint32_t)(in / g);
+    return true;
+}
+
+resampler_t *resampler_create(double in_rate, double out_rate, double pass,
+                              double stop) {
+    uint32_t up, down;
+    double edge = (in_rate < out_rate ? in_rate : out_rate) - pass;
+    if (stop > edge) {
+        stop = edge;
+    }
+    if (!resampler_ratio(in_rate, out_rate, &up, &down) || pass <= 0.0 ||
+        stop <= pass) {
+        fprintf(stderr, "Can't resample %.0f Hz to %.0f Hz passing %.0f Hz\n",
+                in_rate, out_rate, pass);
+        return NULL;
+    }
+    resampler_t *rs = calloc(1, sizeof(resampler_t));
+    if (rs == NULL) {
+        return NULL;
+    }
+    rs->in_rate = in_rate;
+    rs->out_rate = out_rate;
+    rs->up = up;
+    rs->down = down;
+
+    // designed at the rate in between, up times the input
+    double rate = in_rate * up;
+    size_t length = ddc_lowpass_length((stop - pass) / rate);
+    rs->taps_per_phase = (length + up - 1) / up;
+    size_t n_taps = rs->taps_per_phase * up;
+    rs->capacity = rs->taps_per_phase + RESAMPLER_CHUNK;
+    rs->taps = malloc(n_taps * sizeof(float));
+    rs->history = calloc(rs->capacity, sizeof(float));
+    float *h = malloc(n_taps * sizeof(float));
+    if (rs->taps == NULL || rs->history == NULL || h == NULL) {
+        fprintf(stderr, "Could not create resampler\n");
+        free(h);
+        resampler_destroy(rs);
+        return NULL;
+    }
+    // up times the gain to make up for the zeros stuffed in between
+    ddc_lowpass(h, n_taps, (pass + stop) / 2.0 / rate, (double)up);
+    size_t k_max = rs->taps_per_phase - 1;
+    for (uint32_t p = 0; p < up; p++) {
+        for (size_t k = 0; k <= k_max; k++) {
+            rs->taps[p * rs->taps_per_phase + k_max - k] = h[p + k * up];
+        }
+    }
+    free(h);
+
+    // starts on zeros
+    rs->fill = k_max;
+    rs->next = k_max;
+    return rs;
+}
+
+void resampler_destroy(resampler_t *rs) {
+    if (rs == NULL) {
+        return;
+    }
+    free(rs->taps);
+    free(rs->history);
+    free(rs);
+}
+
+size_t resampler_max_output(const resampler_t *rs, size_t n_samples) {
+    return (size_t)((uint64_t)n_samples * rs->up / rs->down) + 1;
+}
+
+size_t resampler_process(resampler_t *rs, const float *in, size_t n_samples,
+                         float *out) {
+    const size_t k = rs->taps_per_phase;
+    size_t produced = 0;
+    for (size_t offset = 0; offset < n_samples; offset += RESAMPLER_CHUNK) {
+        size_t n = n_samples - offset;
+        if (n > RESAMPLER_CHUNK) {
+            n = RESAMPLER_CHUNK;
+        }
+        if (rs->fill + n > rs->capacity) {
+            size_t drop = rs->next + 1 - k;
+            if (drop > rs->fill) {
+                drop = rs->fill;
+            }
+            memmove(rs->history, rs->history + drop,
+                    (rs->fill - drop) * sizeof(float));
+            rs->fill -= drop;
+            rs->next -= drop;
+        }
+        memcpy(rs->history + rs->fill, in + offset, n * sizeof(float));
+        rs->fill += n;
+
+        for (; rs->next < rs->fill; produced++) {
+            const float *taps = rs->taps + rs->phase * k;
+            const float *x = rs->history + rs->next + 1 - k;
+            float acc = 0.0f;
+#pragma omp simd reduction(+ : acc)
+            for (size_t i = 0; i < k; i++) {
+                acc += taps[i] * x[i];
+            }
+            out[produced] = acc;
+            rs->phase += rs->down;
+            rs->next += rs->phase / rs->up;
+            rs->phase %= rs->up;
+        }
+    }
+    return produced;
+}
@@ -0,0 +1,53 @@
+//
+// Created by dbrent on 3/26/21.
+//
+
+#ifndef DBSDR_RESAMPLER_H
+#define DBSDR_RESAMPLER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define RESAMPLER_MAX_UP 256
+#define RESAMPLER_CHUNK 8192 // input samples per pass
+
+// Rational resampler for real samples: up by up, low-pass, down by down,
+// with in_rate * up == out_rate * down for whole Hz rates. Polyphase, so
+// only the outputs kept are computed and none of the zeros stuffed in. The
+// low-pass passes [0, pass] Hz and stops from stop Hz, pulled in when
+// needed so nothing aliases or images onto the passband.
+typedef struct resampler {
+    double in_rate;
+    double out_rate;
+    uint32_t up;
+    uint32_t down;
+    size_t taps_per_phase;
+    float *taps; // up phases of taps_per_phase each, time reversed
+
+    // input history, shifted down only when it fills up
+    float *history;
+    size_t capacity;
+    size_t fill;
+    size_t next;    // newest input under the next output
+    uint32_t phase; // of the next output, 0 - up - 1
+} resampler_t;
+
+resampler_t *resampler_create(double in_rate, double out_rate, double pass,
+                              double stop);
+
+void resampler_destroy(resampler_t *rs);
+
+// Largest number of outputs n_samples of input can produce.
+size_t resampler_max_output(const resampler_t *rs, size_t n_samples);
+
+// Returns the number of outputs written.
+size_t resampler_process(resampler_t *rs, const float *in, size_t n_samples,
+                         float *out);
+
+// Reduced up / down for whole Hz rates, false when up would be over
+// RESAMPLER_MAX_UP.
+bool resampler_ratio(double in_rate, double out_rate, uint32_t *up,
+                     uint32_t *down);
+
+#endif //DBSDR_RESAMPLER_H
@@ -22,7 +22,7 @@ char *file_to_buffer(char *file) {
     size = ftell(f);
     fseek(f, 0L, SEEK_SET);
 
-    buffer = calloc(size, sizeof(char));
+    buffer = calloc(size + 1, sizeof(char));
     if (buffer == NULL) {
         fprintf(stderr, "Could not create file buffer.\n");
         return NULL;
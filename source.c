@@ -0,0 +1,124 @@
+//
+// Created by dbrent on 3/14/21.
+//
+
+#include "source.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const source_ops_t *sources[] = {
+        &hackrf_source_ops,
+        &file_source_ops,
+        &synthetic_source_ops,
+};
+
+source_t *source_open(const source_config_t *config) {
+    const source_ops_t *ops = NULL;
+    for (size_t i = 0; i < sizeof(sources) / sizeof(sources[0]); i++) {
+        if (strcmp(sources[i]->name, config->type) == 0) {
+            ops = sources[i];
+        }
+    }
+    if (ops == NULL) {
+        fprintf(stderr, "Unknown source: %s\n", config->type);
+        return NULL;
+    }
+
+    source_t *src = calloc(1, sizeof(source_t));
+    if (src == NULL) {
+        fprintf(stderr, "Could not create source\n");
+        return NULL;
+    }
+    src->ops = ops;
+    if (!ops->open(src, config)) {
+        fprintf(stderr, "Could not open %s source\n", ops->name);
+        free(src);
+        return NULL;
+    }
+
+    return src;
+}
+
+void source_close(source_t *src) {
+    if (src == NULL) {
+        return;
+    }
+    src->ops->close(src);
+    free(src);
+}
+
+bool source_start(source_t *src, source_rx_callback callback) {
+    src->callback = callback;
+    return src->ops->start(src, callback);
+}
+
+bool source_start_sweep(source_t *src, const source_sweep_t *sweep,
+                        source_sweep_callback callback) {
+    if (!source_can_sweep(src)) {
+        return false;
+    }
+    src->sweep_callback = callback;
+    return src->ops->start_sweep(src, sweep, callback);
+}
+
+bool source_can_sweep(source_t *src) { return src->ops->start_sweep != NULL; }
+
+bool source_stop(source_t *src) { return src->ops->stop(src); }
+
+bool source_set_frequency(source_t *src, uint64_t frequency) {
+    if (!src->ops->set_frequency(src, frequency)) {
+        return false;
+    }
+    src->frequency = frequency;
+    return true;
+}
+
+bool source_set_sample_rate(source_t *src, uint64_t sample_rate) {
+    if (!src->ops->set_sample_rate(src, sample_rate)) {
+        return false;
+    }
+    src->sample_rate = sample_rate;
+    return true;
+}
+
+bool source_set_gain(source_t *src, source_gain_t stage, uint32_t gain) {
+    if (!src->ops->set_gain(src, stage, gain)) {
+        return false;
+    }
+    src->gain[stage] = gain;
+    return true;
+}
+
+bool source_is_alive(source_t *src) {
+    return src != NULL && src->ops->is_alive(src);
+}
+
+size_t source_settle_samples(source_t *src) {
+    return (size_t)src->ops->settle_transfers * SAMPLES_PER_TRANSFER;
+}
+
+void source_throttle(struct timespec *deadline, size_t n_samples,
+                     uint64_t sample_rate) {
+    if (sample_rate == 0) {
+        return;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (deadline->tv_sec == 0 || now.tv_sec - deadline->tv_sec > 1) {
+        // first block, or too far behind to ever catch up
+        *deadline = now;
+    }
+
+    uint64_t ns = (uint64_t)n_samples * 1000000000ULL / sample_rate;
+    deadline->tv_nsec += (long)(ns % 1000000000ULL);
+    deadline->tv_sec += (time_t)(ns / 1000000000ULL);
+    if (deadline->tv_nsec >= 1000000000L) {
+        deadline->tv_nsec -= 1000000000L;
+        deadline->tv_sec++;
+    }
+
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, deadline, NULL);
+}
@@ -0,0 +1,112 @@
+//
+// Created by dbrent on 2/20/21.
+//
+
+#ifndef DBSDR_SOURCE_H
+#define DBSDR_SOURCE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#define BLOCKS_PER_TRANSFER 16
+#define SAMPLES_PER_BLOCK 8192
+#define BYTES_PER_SAMPLE 2
+#define SAMPLES_PER_TRANSFER (SAMPLES_PER_BLOCK * BLOCKS_PER_TRANSFER)
+
+// Called from the source's own thread with interleaved int8 IQ.
+typedef void (*source_rx_callback)(void *, size_t, size_t);
+
+// Same for a hardware sweep, with the frequency the block was taken at, as
+// the low edge of the tuning (see source_sweep_t).
+typedef void (*source_sweep_callback)(uint64_t, void *, size_t, size_t);
+
+typedef enum source_gain {
+    SOURCE_GAIN_LNA, // GQRX IF
+    SOURCE_GAIN_VGA, // GQRX BB
+} source_gain_t;
+
+typedef struct source_config {
+    const char *type; // "hackrf", "file" or "synthetic"
+    const char *path; // input for the file source
+    int device_index; // which HackRF when several are attached
+    bool throttle;    // pace file/synthetic sources at the sample rate
+    bool loop;        // restart the file source at the end
+    uint64_t seed;    // synthetic source noise seed
+} source_config_t;
+
+// Hardware sweep over [start, end) Hz, the plan of sweep.h: tunings to
+// f + offset for f = start, start + step / 4, start + step, ... with
+// samples_per_tuning (at least) from each.
+typedef struct source_sweep {
+    uint64_t start;
+    uint64_t end;
+    uint64_t step;
+    uint64_t offset;
+    size_t samples_per_tuning;
+} source_sweep_t;
+
+typedef struct source source_t;
+
+typedef struct source_ops {
+    const char *name;
+    bool (*open)(source_t *src, const source_config_t *config);
+    void (*close)(source_t *src);
+    bool (*start)(source_t *src, source_rx_callback callback);
+    bool (*stop)(source_t *src);
+    bool (*set_frequency)(source_t *src, uint64_t frequency);
+    bool (*set_sample_rate)(source_t *src, uint64_t sample_rate);
+    bool (*set_gain)(source_t *src, source_gain_t stage, uint32_t gain);
+    bool (*is_alive)(source_t *src);
+    // NULL when the device can't sweep on its own
+    bool (*start_sweep)(source_t *src, const source_sweep_t *sweep,
+                        source_sweep_callback callback);
+    // transfers that can still carry the old tuning after set_frequency()
+    int settle_transfers;
+} source_ops_t;
+
+struct source {
+    const source_ops_t *ops;
+    void *priv;
+    source_rx_callback callback;
+    source_sweep_callback sweep_callback;
+    uint64_t frequency;
+    uint64_t sample_rate;
+    uint32_t gain[2];
+};
+
+extern const source_ops_t hackrf_source_ops;
+extern const source_ops_t file_source_ops;
+extern const source_ops_t synthetic_source_ops;
+
+source_t *source_open(const source_config_t *config);
+
+void source_close(source_t *src);
+
+bool source_start(source_t *src, source_rx_callback callback);
+
+bool source_start_sweep(source_t *src, const source_sweep_t *sweep,
+                        source_sweep_callback callback);
+
+bool source_can_sweep(source_t *src);
+
+bool source_stop(source_t *src);
+
+bool source_set_frequency(source_t *src, uint64_t frequency);
+
+bool source_set_sample_rate(source_t *src, uint64_t sample_rate);
+
+bool source_set_gain(source_t *src, source_gain_t stage, uint32_t gain);
+
+bool source_is_alive(source_t *src);
+
+// Samples after a set_frequency() that may still be from the old tuning.
+size_t source_settle_samples(source_t *src);
+
+// For software sources: sleep until n_samples more would have arrived at
+// sample_rate, counted from *deadline (CLOCK_MONOTONIC, advanced in place).
+void source_throttle(struct timespec *deadline, size_t n_samples,
+                     uint64_t sample_rate);
+
+#endif //DBSDR_SOURCE_H
@@ -0,0 +1,165 @@
+//
+// Created by dbrent on 3/14/21.
+//
+
+#include "source.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Raw interleaved int8 IQ (.cs8, hackrf_transfer -r output), read straight
+// out of the page cache through mmap.
+typedef struct file_source {
+    const int8_t *data;
+    size_t size;
+    size_t offset;
+    bool throttle;
+    bool loop;
+    pthread_t thread;
+    atomic_bool running;
+    atomic_bool alive;
+} file_source_t;
+
+static void *file_thread(void *arg) {
+    source_t *src = arg;
+    file_source_t *fs = src->priv;
+    const size_t chunk = SAMPLES_PER_TRANSFER * BYTES_PER_SAMPLE;
+    struct timespec deadline = {0, 0};
+
+    while (atomic_load_explicit(&fs->running, memory_order_relaxed)) {
+        if (fs->offset + BYTES_PER_SAMPLE > fs->size) {
+            if (!fs->loop) {
+                break;
+            }
+            fs->offset = 0;
+        }
+
+        size_t bytes = fs->size - fs->offset;
+        if (bytes > chunk) {
+            bytes = chunk;
+        }
+        size_t n_samples = bytes / BYTES_PER_SAMPLE;
+
+        src->callback((void *)(fs->data + fs->offset), n_samples,
+                      BYTES_PER_SAMPLE);
+        fs->offset += n_samples * BYTES_PER_SAMPLE;
+
+        if (fs->throttle) {
+            source_throttle(&deadline, n_samples, src->sample_rate);
+        }
+    }
+
+    atomic_store(&fs->alive, false);
+    return NULL;
+}
+
+static bool file_open(source_t *src, const source_config_t *config) {
+    if (config->path == NULL) {
+        fprintf(stderr, "File source needs an input file\n");
+        return false;
+    }
+
+    int fd = open(config->path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Could not open %s\n", config->path);
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < BYTES_PER_SAMPLE) {
+        fprintf(stderr, "%s is empty\n", config->path);
+        close(fd);
+        return false;
+    }
+
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "Could not map %s\n", config->path);
+        return false;
+    }
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+    file_source_t *fs = calloc(1, sizeof(file_source_t));
+    if (fs == NULL) {
+        munmap(data, st.st_size);
+        return false;
+    }
+    fs->data = data;
+    fs->size = st.st_size;
+    fs->throttle = config->throttle;
+    fs->loop = config->loop;
+    atomic_init(&fs->running, false);
+    atomic_init(&fs->alive, false);
+    src->priv = fs;
+
+    fprintf(stderr, "Reading %zu samples from %s\n",
+            fs->size / BYTES_PER_SAMPLE, config->path);
+    return true;
+}
+
+static bool file_stop(source_t *src) {
+    file_source_t *fs = src->priv;
+    if (atomic_exchange(&fs->running, false)) {
+        pthread_join(fs->thread, NULL);
+    }
+    return true;
+}
+
+static void file_close(source_t *src) {
+    file_source_t *fs = src->priv;
+    file_stop(src);
+    munmap((void *)fs->data, fs->size);
+    free(fs);
+    src->priv = NULL;
+}
+
+static bool file_start(source_t *src, source_rx_callback callback) {
+    file_source_t *fs = src->priv;
+    atomic_store(&fs->running, true);
+    atomic_store(&fs->alive, true);
+    if (pthread_create(&fs->thread, NULL, file_thread, src) != 0) {
+        fprintf(stderr, "Could not create file source thread\n");
+        atomic_store(&fs->running, false);
+        atomic_store(&fs->alive, false);
+        return false;
+    }
+    return true;
+}
+
+static bool file_set_frequency(source_t *src, uint64_t frequency) {
+    // a recording can't be retuned, only relabelled
+    return true;
+}
+
+static bool file_set_sample_rate(source_t *src, uint64_t sample_rate) {
+    return true;
+}
+
+static bool file_set_gain(source_t *src, source_gain_t stage, uint32_t gain) {
+    return true;
+}
+
+static bool file_is_alive(source_t *src) {
+    file_source_t *fs = src->priv;
+    return atomic_load(&fs->alive);
+}
+
+const source_ops_t file_source_ops = {
+        .name = "file",
+        .open = file_open,
+        .close = file_close,
+        .start = file_start,
+        .stop = file_stop,
+        .set_frequency = file_set_frequency,
+        .set_sample_rate = file_set_sample_rate,
+        .set_gain = file_set_gain,
+        .is_alive = file_is_alive,
+        .start_sweep = NULL,
+        .settle_transfers = 0,
+};
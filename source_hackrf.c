@@ -0,0 +1,207 @@
+//
+// Created by dbrent on 2/20/21.
+//
+
+#include "source.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "libhackrf/hackrf.h"
+
+// libhackrf keeps 4 transfers queued, plus the one being filled while the
+// PLL locks
+#define HRF_TRANSFERS_IN_FLIGHT 5
+// sweep blocks start with 0x7f 0x7f and the tuning as a little endian uint64
+#define HRF_SWEEP_HEADER 10
+
+#define HRF_ASSERT(x, m) if (x) { fprintf(stderr, (m), hackrf_error_name(err)); }
+
+typedef struct hackrf_source {
+    hackrf_device *device;
+    hackrf_device_list_t *devices;
+} hackrf_source_t;
+
+static int rx_callback(hackrf_transfer *transfer) {
+    source_t *src = transfer->rx_ctx;
+    src->callback(transfer->buffer, SAMPLES_PER_TRANSFER, BYTES_PER_SAMPLE);
+
+    return 0;
+}
+
+#ifdef DBSDR_HAVE_HACKRF_SWEEP
+static int sweep_rx_callback(hackrf_transfer *transfer) {
+    source_t *src = transfer->rx_ctx;
+    for (int i = 0; i + BYTES_PER_BLOCK <= transfer->valid_length;
+         i += BYTES_PER_BLOCK) {
+        uint8_t *block = transfer->buffer + i;
+        if (block[0] != 0x7f || block[1] != 0x7f) {
+            continue;
+        }
+        uint64_t frequency = 0;
+        for (int b = HRF_SWEEP_HEADER - 1; b >= 2; b--) {
+            frequency = frequency << 8 | block[b];
+        }
+        src->sweep_callback(frequency, block + HRF_SWEEP_HEADER,
+                            (BYTES_PER_BLOCK - HRF_SWEEP_HEADER) /
+                                    BYTES_PER_SAMPLE,
+                            BYTES_PER_SAMPLE);
+    }
+
+    return 0;
+}
+#endif
+
+static bool hrf_open(source_t *src, const source_config_t *config) {
+    int err;
+    err = hackrf_init();
+    HRF_ASSERT(err, "Failed to init: %s\n");
+    if (err) {
+        return false;
+    }
+
+    hackrf_source_t *hrf = calloc(1, sizeof(hackrf_source_t));
+    if (hrf == NULL) {
+        hackrf_exit();
+        return false;
+    }
+    src->priv = hrf;
+
+    hrf->devices = hackrf_device_list();
+    if (hrf->devices == NULL ||
+        config->device_index >= hrf->devices->devicecount) {
+        fprintf(stderr, "HackRF %d not found\n", config->device_index);
+        err = HACKRF_ERROR_OTHER;
+    } else {
+        err = hackrf_device_list_open(hrf->devices, config->device_index,
+                                      &hrf->device);
+        HRF_ASSERT(err, "Failed to open device: %s\n");
+    }
+
+    if (err) {
+        if (hrf->devices != NULL) {
+            hackrf_device_list_free(hrf->devices);
+        }
+        free(hrf);
+        src->priv = NULL;
+        hackrf_exit();
+    }
+
+    return !err;
+}
+
+static void hrf_close(source_t *src) {
+    hackrf_source_t *hrf = src->priv;
+    int err;
+
+    err = hackrf_close(hrf->device);
+    HRF_ASSERT(err, "Failed to cleanly close device: %s\n");
+
+    hackrf_device_list_free(hrf->devices);
+
+    err = hackrf_exit();
+    HRF_ASSERT(err, "Failed to exit cleanly: %s\n");
+
+    free(hrf);
+    src->priv = NULL;
+}
+
+static bool hrf_start(source_t *src, source_rx_callback callback) {
+    hackrf_source_t *hrf = src->priv;
+    int err;
+    err = hackrf_start_rx(hrf->device, rx_callback, src);
+    HRF_ASSERT(err, "Couldn't start receiving: %s\n");
+
+    return !err;
+}
+
+#ifdef DBSDR_HAVE_HACKRF_SWEEP
+static bool hrf_start_sweep(source_t *src, const source_sweep_t *sweep,
+                            source_sweep_callback callback) {
+    hackrf_source_t *hrf = src->priv;
+    int err;
+    // the firmware takes the range in MHz and whole blocks per tuning
+    uint16_t range[2] = {(uint16_t)(sweep->start / 1000000),
+                         (uint16_t)(sweep->end / 1000000)};
+    size_t bytes = sweep->samples_per_tuning * BYTES_PER_SAMPLE +
+                   HRF_SWEEP_HEADER;
+    uint32_t blocks = (uint32_t)((bytes + BYTES_PER_BLOCK - 1) /
+                                 BYTES_PER_BLOCK);
+    err = hackrf_init_sweep(hrf->device, range, 1, blocks * BYTES_PER_BLOCK,
+                            (uint32_t)sweep->step, (uint32_t)sweep->offset,
+                            INTERLEAVED);
+    HRF_ASSERT(err, "Couldn't set up sweep: %s\n");
+    if (err) {
+        return false;
+    }
+    err = hackrf_start_rx_sweep(hrf->device, sweep_rx_callback, src);
+    HRF_ASSERT(err, "Couldn't start sweeping: %s\n");
+
+    return !err;
+}
+#endif
+
+static bool hrf_stop(source_t *src) {
+    hackrf_source_t *hrf = src->priv;
+    int err;
+    err = hackrf_stop_rx(hrf->device);
+    HRF_ASSERT(err, "Failed to cleanly stop rx: %s\n");
+
+    return !err;
+}
+
+static bool hrf_set_frequency(source_t *src, uint64_t frequency) {
+    hackrf_source_t *hrf = src->priv;
+    int err;
+    err = hackrf_set_freq(hrf->device, frequency);
+    HRF_ASSERT(err, "Couldn't set frequency: %s\n");
+
+    return !err;
+}
+
+static bool hrf_set_sample_rate(source_t *src, uint64_t sample_rate) {
+    hackrf_source_t *hrf = src->priv;
+    int err;
+    err = hackrf_set_sample_rate(hrf->device, sample_rate);
+    HRF_ASSERT(err, "Couldn't set sample rate: %s\n");
+
+    return !err;
+}
+
+static bool hrf_set_gain(source_t *src, source_gain_t stage, uint32_t gain) {
+    hackrf_source_t *hrf = src->priv;
+    int err;
+    if (stage == SOURCE_GAIN_LNA) {
+        err = hackrf_set_lna_gain(hrf->device, gain);
+        HRF_ASSERT(err, "Couldn't set lna gain: %s\n");
+    } else {
+        err = hackrf_set_vga_gain(hrf->device, gain);
+        HRF_ASSERT(err, "Couldn't set vga gain: %s\n");
+    }
+
+    return !err;
+}
+
+static bool hrf_is_alive(source_t *src) {
+    hackrf_source_t *hrf = src->priv;
+    return hrf && hrf->device &&
+           (hackrf_is_streaming(hrf->device) == HACKRF_TRUE);
+}
+
+const source_ops_t hackrf_source_ops = {
+        .name = "hackrf",
+        .open = hrf_open,
+        .close = hrf_close,
+        .start = hrf_start,
+        .stop = hrf_stop,
+        .set_frequency = hrf_set_frequency,
+        .set_sample_rate = hrf_set_sample_rate,
+        .set_gain = hrf_set_gain,
+        .is_alive = hrf_is_alive,
+#ifdef DBSDR_HAVE_HACKRF_SWEEP
+        .start_sweep = hrf_start_sweep,
+#else
+        .start_sweep = NULL,
+#endif
+        .settle_transfers = HRF_TRANSFERS_IN_FLIGHT,
+};
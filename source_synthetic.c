@@ -0,0 +1,265 @@
+//
+// Created by dbrent on 3/14/21.
+//
+
+#include "source.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PI 3.14159265358979
+#define SYNTH_MAX_CARRIERS 64
+#define SYNTH_SPACING 2300000 // Hz between carriers, on an absolute grid
+#define SYNTH_NOISE 3.0f      // noise amplitude in LSB
+#define SYNTH_LANES 8         // consecutive samples advanced together
+#define SYNTH_NOISE_TABLE 65536
+
+// Deterministic test signal: a comb of carriers at fixed absolute
+// frequencies (so retuning moves them across the band like a real antenna
+// would) plus noise from a seeded generator. Output depends only on the
+// seed, the tuning history and the sample count.
+typedef struct carrier {
+    float amplitude;
+    float re[SYNTH_LANES], im[SYNTH_LANES]; // phasors of the next lanes
+    float rot_re, rot_im;                   // rotation by SYNTH_LANES samples
+} carrier_t;
+
+typedef struct synthetic_source {
+    int8_t *buffer;
+    float *noise; // SYNTH_NOISE_TABLE values, read from a random offset
+    float *acc_re;
+    float *acc_im;
+    uint64_t rng;
+    bool throttle;
+    carrier_t carriers[SYNTH_MAX_CARRIERS];
+    int n_carriers;
+    uint64_t tuned_frequency;
+    uint64_t tuned_rate;
+    atomic_uint_fast64_t frequency;
+    atomic_uint_fast64_t sample_rate;
+    pthread_t thread;
+    atomic_bool running;
+} synthetic_source_t;
+
+static inline uint64_t xorshift(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+static inline float noise(uint64_t *state) {
+    // sum of four uniforms, close enough to gaussian for a noise floor
+    uint64_t r = xorshift(state);
+    float sum = (float)(r & 0xffff) + (float)((r >> 16) & 0xffff) +
+                (float)((r >> 32) & 0xffff) + (float)(r >> 48);
+    return (sum / 65535.0f - 2.0f) * SYNTH_NOISE;
+}
+
+static void tune(synthetic_source_t *ss, uint64_t frequency,
+                 uint64_t sample_rate) {
+    int64_t low = (int64_t)frequency - (int64_t)sample_rate / 2;
+    int64_t high = (int64_t)frequency + (int64_t)sample_rate / 2;
+    int64_t first = low / SYNTH_SPACING + 1;
+
+    ss->n_carriers = 0;
+    for (int64_t k = first; k * SYNTH_SPACING < high; k++) {
+        if (ss->n_carriers == SYNTH_MAX_CARRIERS) {
+            break;
+        }
+        carrier_t *c = &ss->carriers[ss->n_carriers++];
+        // level pattern that repeats every 8 carriers, -20 to -48 dBFS
+        float dbfs = -20.0f - 4.0f * (float)((k * 5) % 8);
+        c->amplitude = 127.0f * powf(10.0f, dbfs / 20.0f);
+        double offset = (double)(k * SYNTH_SPACING - (int64_t)frequency);
+        double w = 2 * PI * offset / (double)sample_rate;
+        for (int l = 0; l < SYNTH_LANES; l++) {
+            c->re[l] = (float)cos(w * l);
+            c->im[l] = (float)sin(w * l);
+        }
+        c->rot_re = (float)cos(w * SYNTH_LANES);
+        c->rot_im = (float)sin(w * SYNTH_LANES);
+    }
+
+    ss->tuned_frequency = frequency;
+    ss->tuned_rate = sample_rate;
+}
+
+static void generate(synthetic_source_t *ss, size_t n_samples) {
+    float *acc_re = ss->acc_re;
+    float *acc_im = ss->acc_im;
+    const size_t mask = SYNTH_NOISE_TABLE - 1;
+    size_t offset_re = xorshift(&ss->rng);
+    size_t offset_im = xorshift(&ss->rng);
+    for (size_t i = 0; i < n_samples; i++) {
+        acc_re[i] = ss->noise[(offset_re + i) & mask];
+        acc_im[i] = ss->noise[(offset_im + i) & mask];
+    }
+
+    // carriers one at a time, SYNTH_LANES independent phasors per step so
+    // the recursion vectorizes
+    for (int c = 0; c < ss->n_carriers; c++) {
+        carrier_t *k = &ss->carriers[c];
+        // locals, so the phasors stay in registers
+        float re[SYNTH_LANES], im[SYNTH_LANES];
+        const float a = k->amplitude;
+        const float rot_re = k->rot_re;
+        const float rot_im = k->rot_im;
+        memcpy(re, k->re, sizeof(re));
+        memcpy(im, k->im, sizeof(im));
+
+        for (size_t i = 0; i + SYNTH_LANES <= n_samples; i += SYNTH_LANES) {
+            for (int l = 0; l < SYNTH_LANES; l++) {
+                acc_re[i + l] += a * re[l];
+                acc_im[i + l] += a * im[l];
+                float next_re = re[l] * rot_re - im[l] * rot_im;
+                im[l] = re[l] * rot_im + im[l] * rot_re;
+                re[l] = next_re;
+            }
+        }
+
+        // keep the recursive phasors on the unit circle
+        for (int l = 0; l < SYNTH_LANES; l++) {
+            float mag = sqrtf(re[l] * re[l] + im[l] * im[l]);
+            k->re[l] = re[l] / mag;
+            k->im[l] = im[l] / mag;
+        }
+    }
+
+    for (size_t i = 0; i < n_samples; i++) {
+        float re = fmaxf(-127.0f, fminf(127.0f, acc_re[i]));
+        float im = fmaxf(-127.0f, fminf(127.0f, acc_im[i]));
+        ss->buffer[2 * i] = (int8_t)(re + (re < 0.0f ? -0.5f : 0.5f));
+        ss->buffer[2 * i + 1] = (int8_t)(im + (im < 0.0f ? -0.5f : 0.5f));
+    }
+}
+
+static void *synthetic_thread(void *arg) {
+    source_t *src = arg;
+    synthetic_source_t *ss = src->priv;
+    struct timespec deadline = {0, 0};
+
+    while (atomic_load_explicit(&ss->running, memory_order_relaxed)) {
+        uint64_t frequency = atomic_load(&ss->frequency);
+        uint64_t sample_rate = atomic_load(&ss->sample_rate);
+        if (frequency != ss->tuned_frequency ||
+            sample_rate != ss->tuned_rate) {
+            tune(ss, frequency, sample_rate);
+        }
+
+        generate(ss, SAMPLES_PER_TRANSFER);
+        src->callback(ss->buffer, SAMPLES_PER_TRANSFER, BYTES_PER_SAMPLE);
+
+        if (ss->throttle) {
+            source_throttle(&deadline, SAMPLES_PER_TRANSFER, sample_rate);
+        }
+    }
+
+    return NULL;
+}
+
+static bool synthetic_open(source_t *src, const source_config_t *config) {
+    synthetic_source_t *ss = calloc(1, sizeof(synthetic_source_t));
+    if (ss == NULL) {
+        return false;
+    }
+    ss->buffer = malloc(SAMPLES_PER_TRANSFER * BYTES_PER_SAMPLE);
+    ss->acc_re = malloc(SAMPLES_PER_TRANSFER * sizeof(float));
+    ss->acc_im = malloc(SAMPLES_PER_TRANSFER * sizeof(float));
+    ss->noise = malloc(SYNTH_NOISE_TABLE * sizeof(float));
+    if (ss->buffer == NULL || ss->acc_re == NULL || ss->acc_im == NULL ||
+        ss->noise == NULL) {
+        free(ss->buffer);
+        free(ss->noise);
+        free(ss->acc_re);
+        free(ss->acc_im);
+        free(ss);
+        return false;
+    }
+    ss->rng = config->seed ? config->seed : 1;
+    for (size_t i = 0; i < SYNTH_NOISE_TABLE; i++) {
+        ss->noise[i] = noise(&ss->rng);
+    }
+    ss->throttle = config->throttle;
+    atomic_init(&ss->frequency, 100000000);
+    atomic_init(&ss->sample_rate, 20000000);
+    atomic_init(&ss->running, false);
+    src->priv = ss;
+
+    return true;
+}
+
+static bool synthetic_stop(source_t *src) {
+    synthetic_source_t *ss = src->priv;
+    if (atomic_exchange(&ss->running, false)) {
+        pthread_join(ss->thread, NULL);
+    }
+    return true;
+}
+
+static void synthetic_close(source_t *src) {
+    synthetic_source_t *ss = src->priv;
+    synthetic_stop(src);
+    free(ss->buffer);
+    free(ss->acc_re);
+    free(ss->acc_im);
+    free(ss->noise);
+    free(ss);
+    src->priv = NULL;
+}
+
+static bool synthetic_start(source_t *src, source_rx_callback callback) {
+    synthetic_source_t *ss = src->priv;
+    atomic_store(&ss->running, true);
+    if (pthread_create(&ss->thread, NULL, synthetic_thread, src) != 0) {
+        fprintf(stderr, "Could not create synthetic source thread\n");
+        atomic_store(&ss->running, false);
+        return false;
+    }
+    return true;
+}
+
+static bool synthetic_set_frequency(source_t *src, uint64_t frequency) {
+    synthetic_source_t *ss = src->priv;
+    atomic_store(&ss->frequency, frequency);
+    return true;
+}
+
+static bool synthetic_set_sample_rate(source_t *src, uint64_t sample_rate) {
+    synthetic_source_t *ss = src->priv;
+    if (sample_rate == 0) {
+        return false;
+    }
+    atomic_store(&ss->sample_rate, sample_rate);
+    return true;
+}
+
+static bool synthetic_set_gain(source_t *src, source_gain_t stage,
+                               uint32_t gain) {
+    return true;
+}
+
+static bool synthetic_is_alive(source_t *src) {
+    synthetic_source_t *ss = src->priv;
+    return atomic_load(&ss->running);
+}
+
+const source_ops_t synthetic_source_ops = {
+        .name = "synthetic",
+        .open = synthetic_open,
+        .close = synthetic_close,
+        .start = synthetic_start,
+        .stop = synthetic_stop,
+        .set_frequency = synthetic_set_frequency,
+        .set_sample_rate = synthetic_set_sample_rate,
+        .set_gain = synthetic_set_gain,
+        .is_alive = synthetic_is_alive,
+        .start_sweep = NULL,
+        .settle_transfers = 1, // the one being generated
+};
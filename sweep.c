@@ -0,0 +1,380 @@
+//
+// Created by dbrent on 3/22/21.
+//
+
+#include "sweep.h"
+#include "archive.h"
+#include "dsp.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define SWEEP_IDLE_SLEEP_NS 100000
+#define SWEEP_FLOOR_DB -200.0f // panorama before its first sweep
+
+// The samples of one tuning, the last SWEEP_TUNING_SAMPLES of a transfer
+// when retuning in software. sequence numbers transfers for the settle
+// window, frequency is the tuning's low edge as in the hardware sweep.
+typedef struct sweep_block {
+    uint64_t sequence;
+    uint64_t frequency;
+    size_t n_samples;
+    int8_t samples[];
+} sweep_block_t;
+
+static void *sweep_thread(void *arg);
+
+static const struct timespec idle = {0, SWEEP_IDLE_SLEEP_NS};
+
+static queue_t block_queue;
+static queue_t *mag_line_queue = NULL;
+static source_t *source = NULL;
+static archive_t *archive = NULL;
+static fft_context_t *fft = NULL;
+static float *sum = NULL;
+static float *line = NULL;
+static float *panorama = NULL;
+static uint64_t *refreshed = NULL; // sweep each tuning was last stitched in
+static size_t fft_size;
+static size_t n_bins;
+static uint32_t n_tunings;
+static uint64_t start;
+static uint64_t end;
+static uint64_t step;
+static int display_width;
+static atomic_int reducer = BINNING_MAX;
+
+static pthread_t thread;
+static atomic_bool running = false;
+static atomic_bool hardware = false;
+
+// software retuning: blocks before settle_until still carry the previous
+// tuning, the receive thread skips copying them
+static atomic_uint_fast64_t settle_until = 0;
+
+// written by the receive thread only, blocks_received numbers the blocks
+static atomic_uint_fast64_t blocks_received = 0;
+static atomic_uint_fast64_t blocks_dropped = 0;
+
+// written by the sweep thread only
+static atomic_uint_fast64_t blocks_ignored = 0;
+static atomic_uint_fast64_t sweeps = 0;
+static atomic_uint_fast64_t missing = 0;
+static atomic_uint_fast64_t lines_emitted = 0;
+static atomic_uint_fast64_t lines_dropped = 0;
+static atomic_uint_fast64_t rate = 0; // Hz per second
+
+// Low edge of tuning t, two per step.
+static uint64_t tuning_frequency(uint32_t t) {
+    return start + (t / 2) * step + (t % 2) * (step / 4);
+}
+
+static uint64_t sweep_steps(const sweep_config_t *config) {
+    uint64_t s = (uint64_t)config->sample_rate;
+    return (config->end - config->start + s - 1) / s;
+}
+
+size_t sweep_panorama_bins(const sweep_config_t *config) {
+    return sweep_steps(config) * config->fft_size;
+}
+
+bool sweep_init(const sweep_config_t *config, queue_t *line_queue) {
+    if (config->end <= config->start || config->sample_rate <= 0.0 ||
+        config->fft_size < FFT_MIN_SIZE ||
+        config->fft_size > SWEEP_MAX_FFT_SIZE) {
+        fprintf(stderr, "Invalid sweep\n");
+        return false;
+    }
+    mag_line_queue = line_queue;
+    fft_size = config->fft_size;
+    step = (uint64_t)config->sample_rate;
+    start = config->start;
+    end = start + sweep_steps(config) * step;
+    n_tunings = (uint32_t)(2 * sweep_steps(config));
+    n_bins = sweep_panorama_bins(config);
+    display_width = config->display_width;
+    atomic_store(&reducer, config->reducer);
+
+    atomic_store(&settle_until, 0);
+    atomic_store(&blocks_received, 0);
+    atomic_store(&blocks_dropped, 0);
+    atomic_store(&blocks_ignored, 0);
+    atomic_store(&sweeps, 0);
+    atomic_store(&missing, 0);
+    atomic_store(&lines_emitted, 0);
+    atomic_store(&lines_dropped, 0);
+    atomic_store(&rate, 0);
+
+    if (display_width <= 0 ||
+        line_queue->slot_size < DSP_LINE_BYTES(display_width)) {
+        fprintf(stderr, "Line queue slots too small for %d pixel rows\n",
+                display_width);
+        return false;
+    }
+
+    const fft_setup_t *setup = fft_setup_wait(fft_size, config->window);
+    if (setup == NULL) {
+        return false;
+    }
+    fft = fft_context_create(fft_size);
+    sum = malloc(fft_size * sizeof(float));
+    line = malloc(fft_size * sizeof(float));
+    panorama = malloc(n_bins * sizeof(float));
+    refreshed = calloc(n_tunings, sizeof(uint64_t));
+    if (fft == NULL || sum == NULL || line == NULL || panorama == NULL ||
+        refreshed == NULL || !fft_context_set(fft, setup)) {
+        fprintf(stderr, "Could not create sweep\n");
+        return false;
+    }
+    for (size_t i = 0; i < n_bins; i++) {
+        panorama[i] = SWEEP_FLOOR_DB;
+    }
+
+    size_t block_bytes = SWEEP_TUNING_SAMPLES * 2 * sizeof(int8_t);
+    if (!queue_init(&block_queue, sizeof(sweep_block_t) + block_bytes,
+                    SWEEP_BLOCK_QUEUE_SIZE, QUEUE_SPSC)) {
+        return false;
+    }
+
+    fprintf(stderr, "Sweep: %.0f - %.0f MHz, %u tunings, %zu bins\n",
+            start / 1e6, end / 1e6, n_tunings, n_bins);
+    return true;
+}
+
+void sweep_destroy(void) {
+    queue_destroy(&block_queue);
+    fft_context_destroy(fft);
+    fft = NULL;
+    free(sum);
+    free(line);
+    free(panorama);
+    free(refreshed);
+    sum = line = panorama = NULL;
+    refreshed = NULL;
+}
+
+// Software sweep: move to tuning t and skip whatever was already under way.
+static void retune(uint32_t t) {
+    source_set_frequency(source, tuning_frequency(t) + 3 * step / 8);
+    atomic_store(&settle_until,
+                 atomic_load(&blocks_received) +
+                         source->ops->settle_transfers);
+}
+
+bool sweep_start(source_t *src) {
+    source = src;
+    atomic_store(&hardware, source_can_sweep(src));
+    atomic_store(&running, true);
+    if (pthread_create(&thread, NULL, sweep_thread, NULL) != 0) {
+        fprintf(stderr, "Could not create sweep thread\n");
+        atomic_store(&running, false);
+        return false;
+    }
+
+    if (atomic_load(&hardware)) {
+        source_sweep_t plan = {
+                .start = start,
+                .end = end,
+                .step = step,
+                .offset = 3 * step / 8,
+                .samples_per_tuning = SWEEP_TUNING_SAMPLES,
+        };
+        if (source_start_sweep(src, &plan, sweep_receive_tuning)) {
+            return true;
+        }
+        fprintf(stderr, "Hardware sweep failed, retuning instead\n");
+        atomic_store(&hardware, false);
+    }
+    // the sweep thread retunes from here on
+    retune(0);
+    if (!source_start(src, sweep_receive)) {
+        sweep_stop();
+        return false;
+    }
+    return true;
+}
+
+void sweep_stop(void) {
+    if (atomic_exchange(&running, false)) {
+        pthread_join(thread, NULL);
+    }
+}
+
+void sweep_set_archive(archive_t *a) { archive = a; }
+
+bool sweep_set_reducer(binning_reducer_t r) {
+    if (r < 0 || r >= BINNING_REDUCER_COUNT) {
+        return false;
+    }
+    atomic_store(&reducer, r);
+    return true;
+}
+
+static void push_block(uint64_t sequence, uint64_t frequency,
+                       const int8_t *samples, size_t n_samples) {
+    sweep_block_t *block = queue_reserve(&block_queue);
+    if (block == NULL) {
+        atomic_fetch_add_explicit(&blocks_dropped, 1, memory_order_relaxed);
+        return;
+    }
+    if (n_samples > SWEEP_TUNING_SAMPLES) {
+        // the end of the dwell, furthest from the retune
+        samples += (n_samples - SWEEP_TUNING_SAMPLES) * 2;
+        n_samples = SWEEP_TUNING_SAMPLES;
+    }
+    block->sequence = sequence;
+    block->frequency = frequency;
+    block->n_samples = n_samples;
+    memcpy(block->samples, samples, n_samples * 2);
+    queue_commit(&block_queue, block);
+}
+
+void sweep_receive(void *samples, size_t n_samples, size_t bytes_per_sample) {
+    uint64_t sequence = atomic_fetch_add(&blocks_received, 1);
+    if (sequence < atomic_load(&settle_until)) {
+        return;
+    }
+    // the sweep thread knows which tuning this is
+    push_block(sequence, 0, samples, n_samples);
+}
+
+void sweep_receive_tuning(uint64_t frequency, void *samples, size_t n_samples,
+                          size_t bytes_per_sample) {
+    uint64_t sequence = atomic_fetch_add(&blocks_received, 1);
+    push_block(sequence, frequency, samples, n_samples);
+}
+
+void sweep_get_stats(sweep_stats_t *stats) {
+    stats->hardware = atomic_load(&hardware);
+    stats->tunings = n_tunings;
+    stats->sweeps = atomic_load(&sweeps);
+    stats->blocks_received = atomic_load(&blocks_received);
+    stats->blocks_dropped = atomic_load(&blocks_dropped);
+    stats->blocks_ignored = atomic_load(&blocks_ignored);
+    stats->missing = atomic_load(&missing);
+    stats->lines_emitted = atomic_load(&lines_emitted);
+    stats->lines_dropped = atomic_load(&lines_dropped);
+    stats->rate = (double)atomic_load(&rate);
+    stats->span = (double)(end - start);
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+// Welch average of the whole FFTs in a tuning, taken from the end, then the
+// two quarters either side of the tuned frequency into the panorama.
+static void stitch(uint32_t t, const int8_t *samples, size_t n_samples) {
+    uint32_t frames = (uint32_t)(n_samples / fft_size);
+    samples += (n_samples - frames * fft_size) * 2;
+    memset(sum, 0, fft_size * sizeof(float));
+    for (uint32_t f = 0; f < frames; f++) {
+        fft_load(fft, samples + f * fft_size * 2);
+        fft_transform(fft);
+        fft_accumulate_power(fft, sum);
+    }
+    fft_power_to_db(sum, fft_size, frames, line);
+
+    // FFT order: [f, f + step / 4) is 3/8 to 1/8 below the tuning, and
+    // [f + step / 2, f + 3/4 step) 1/8 to 3/8 above it
+    size_t quarter = fft_size / 4;
+    float *out = panorama + (t / 2) * fft_size + (t % 2) * quarter;
+    memcpy(out, line + 5 * fft_size / 8, quarter * sizeof(float));
+    memcpy(out + fft_size / 2, line + fft_size / 8, quarter * sizeof(float));
+}
+
+static void emit_panorama(uint64_t sweep) {
+    spectrum_line_t *out = queue_reserve(mag_line_queue);
+    if (out == NULL) {
+        atomic_fetch_add_explicit(&lines_dropped, 1, memory_order_relaxed);
+        return;
+    }
+    // a panorama has no single stream position, one generation per sweep
+    out->tag = (dsp_tag_t){0, (start + end) / 2, (uint32_t)sweep};
+    out->span = (float)(end - start);
+    out->rbw = (float)((double)step * fft->setup->enbw / (double)fft_size);
+    binning_reduce(panorama, n_bins, 0, 0.0, (double)n_bins,
+                   atomic_load_explicit(&reducer, memory_order_relaxed),
+                   out->bins, display_width);
+    out->n_bins = (uint32_t)display_width;
+    if (archive != NULL) {
+        archive_write(archive, out);
+    }
+    queue_commit(mag_line_queue, out);
+    atomic_fetch_add_explicit(&lines_emitted, 1, memory_order_relaxed);
+}
+
+// Panorama out, and how long the sweep took.
+static void finish_sweep(uint64_t *sweep, double *started) {
+    emit_panorama(*sweep);
+    uint64_t stale = 0;
+    for (uint32_t i = 0; i < n_tunings; i++) {
+        stale += refreshed[i] != *sweep;
+    }
+    double t = now();
+    atomic_store(&missing, stale);
+    // the clock may not have moved on a very short sweep, keep the last
+    if (t > *started) {
+        atomic_store(&rate,
+                     (uint64_t)((double)(end - start) / (t - *started)));
+    }
+    atomic_fetch_add(&sweeps, 1);
+    *started = t;
+    (*sweep)++;
+}
+
+static void *sweep_thread(void *arg) {
+    uint64_t sweep = 1;
+    uint32_t next = 0; // tuning expected next
+    double started = now();
+
+    while (atomic_load_explicit(&running, memory_order_relaxed)) {
+        sweep_block_t *block = queue_peek(&block_queue);
+        if (block == NULL) {
+            nanosleep(&idle, NULL);
+            continue;
+        }
+
+        bool hw = atomic_load_explicit(&hardware, memory_order_relaxed);
+        uint32_t t = next;
+        if (hw) {
+            uint64_t offset = block->frequency - start;
+            if (block->frequency < start || block->frequency >= end ||
+                (offset % step != 0 && offset % step != step / 4)) {
+                atomic_fetch_add_explicit(&blocks_ignored, 1,
+                                          memory_order_relaxed);
+                queue_release(&block_queue);
+                continue;
+            }
+            t = (uint32_t)(offset / step * 2 + (offset % step != 0));
+            if (t < next) {
+                // wrapped around without the end of the last sweep
+                finish_sweep(&sweep, &started);
+            }
+        } else if (block->sequence < atomic_load(&settle_until)) {
+            // copied before the receive thread saw the retune
+            queue_release(&block_queue);
+            continue;
+        }
+
+        stitch(t, block->samples, block->n_samples);
+        refreshed[t] = sweep;
+        queue_release(&block_queue);
+        next = t + 1;
+        if (next == n_tunings) {
+            finish_sweep(&sweep, &started);
+            next = 0;
+        }
+        if (!hw) {
+            retune(next);
+        }
+    }
+
+    return NULL;
+}
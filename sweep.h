@@ -0,0 +1,81 @@
+//
+// Created by dbrent on 3/22/21.
+//
+
+#ifndef DBSDR_SWEEP_H
+#define DBSDR_SWEEP_H
+
+#include "binning.h"
+#include "fft.h"
+#include "queue.h"
+#include "source.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define SWEEP_BLOCK_QUEUE_SIZE 64
+#define SWEEP_MAX_MHZ 7250
+// one 16 KiB hardware sweep block less its 10 byte header, the retune
+// fallback takes the same from the end of a transfer
+#define SWEEP_TUNING_SAMPLES 8187
+#define SWEEP_MAX_FFT_SIZE 4096 // whole FFTs in one tuning
+
+// Steps across [start, end) one sample_rate wide step at a time, rounding
+// end up to a whole step. Each step is covered by two tunings a quarter
+// step apart, the same interleaved plan as hackrf_sweep: a tuning to f +
+// 3/8 step keeps [f, f + step / 4) and [f + step / 2, f + 3/4 step), clear
+// of dc and the filter edges, so the pieces butt together without overlap.
+// One panorama line comes out per sweep, binned to display_width.
+typedef struct sweep_config {
+    uint64_t start; // Hz, whole MHz for the hardware sweep
+    uint64_t end;
+    double sample_rate;
+    size_t fft_size; // power of two up to SWEEP_MAX_FFT_SIZE
+    fft_window_t window;
+    int display_width;
+    binning_reducer_t reducer;
+} sweep_config_t;
+
+typedef struct sweep_stats {
+    bool hardware; // device sweeps on its own, or retune and dwell
+    uint32_t tunings; // per sweep
+    uint64_t sweeps;
+    uint64_t blocks_received;
+    uint64_t blocks_dropped; // block queue full
+    uint64_t blocks_ignored; // not on the plan
+    uint64_t missing; // tunings not refreshed in the last sweep
+    uint64_t lines_emitted;
+    uint64_t lines_dropped; // line queue full
+    double rate;      // Hz covered per second over the last sweep
+    double span;      // Hz per sweep
+} sweep_stats_t;
+
+// Full resolution width of the panorama for config.
+size_t sweep_panorama_bins(const sweep_config_t *config);
+
+bool sweep_init(const sweep_config_t *config, queue_t *line_queue);
+
+void sweep_destroy(void);
+
+// Starts src sweeping, in hardware when it can, otherwise streaming while
+// the sweep thread retunes it. Replaces source_start().
+bool sweep_start(source_t *src);
+
+void sweep_stop(void);
+
+bool sweep_set_reducer(binning_reducer_t reducer);
+
+// Archive every panorama line, see archive.h. Set before sweep_start().
+struct archive;
+void sweep_set_archive(struct archive *archive);
+
+// Source callbacks of the two modes.
+void sweep_receive(void *samples, size_t n_samples, size_t bytes_per_sample);
+
+void sweep_receive_tuning(uint64_t frequency, void *samples, size_t n_samples,
+                          size_t bytes_per_sample);
+
+void sweep_get_stats(sweep_stats_t *stats);
+
+#endif //DBSDR_SWEEP_H
@@ -0,0 +1,134 @@
+//
+// Created by dbrent on 3/12/21.
+//
+
+#include "uploader.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define FENCE_TIMEOUT_NS 1000000 // 1 ms per wait, looped
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static void wait_fence(uploader_t *u, int i) {
+    if (u->fences[i] == NULL) {
+        return;
+    }
+
+    GLenum status = glClientWaitSync(u->fences[i], 0, 0);
+    if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED) {
+        double start = now();
+        u->stalls++;
+        do {
+            status = glClientWaitSync(u->fences[i], GL_SYNC_FLUSH_COMMANDS_BIT,
+                                      FENCE_TIMEOUT_NS);
+        } while (status == GL_TIMEOUT_EXPIRED);
+        u->stall_time += now() - start;
+    }
+
+    glDeleteSync(u->fences[i]);
+    u->fences[i] = NULL;
+}
+
+uploader_t *uploader_create(size_t size) {
+    uploader_t *u = calloc(1, sizeof(uploader_t));
+    if (u == NULL) {
+        fprintf(stderr, "Could not create uploader\n");
+        return NULL;
+    }
+    u->size = size;
+    u->persistent = GLEW_ARB_buffer_storage || GLEW_VERSION_4_4;
+
+    glGenBuffers(UPLOADER_BUFFERS, u->buffers);
+    for (int i = 0; i < UPLOADER_BUFFERS; i++) {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, u->buffers[i]);
+        if (u->persistent) {
+            GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT |
+                               GL_MAP_COHERENT_BIT;
+            glBufferStorage(GL_PIXEL_UNPACK_BUFFER, size, NULL, flags);
+            u->mapped[i] =
+                    glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, flags);
+            if (u->mapped[i] == NULL) {
+                fprintf(stderr, "Could not map upload buffer\n");
+                glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+                uploader_destroy(u);
+                return NULL;
+            }
+        } else {
+            glBufferData(GL_PIXEL_UNPACK_BUFFER, size, NULL, GL_STREAM_DRAW);
+        }
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+    fprintf(stderr, "Texture uploads: %d %s buffers of %zu bytes\n",
+            UPLOADER_BUFFERS, u->persistent ? "persistent" : "mapped", size);
+    return u;
+}
+
+void uploader_destroy(uploader_t *u) {
+    if (u == NULL) {
+        return;
+    }
+    for (int i = 0; i < UPLOADER_BUFFERS; i++) {
+        if (u->fences[i] != NULL) {
+            glDeleteSync(u->fences[i]);
+        }
+        if (u->persistent && u->mapped[i] != NULL) {
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, u->buffers[i]);
+            glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+        }
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    glDeleteBuffers(UPLOADER_BUFFERS, u->buffers);
+    free(u);
+}
+
+void *uploader_begin(uploader_t *u) {
+    int i = u->index;
+    wait_fence(u, i);
+
+    if (u->persistent) {
+        return u->mapped[i];
+    }
+
+    // the fence already guarantees the GPU is done with this buffer
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, u->buffers[i]);
+    u->mapped[i] = glMapBufferRange(
+            GL_PIXEL_UNPACK_BUFFER, 0, u->size,
+            GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT |
+                    GL_MAP_UNSYNCHRONIZED_BIT);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    return u->mapped[i];
+}
+
+void uploader_end_texture_2d(uploader_t *u, GLuint texture, GLint x, GLint y,
+                             GLsizei width, GLsizei height, GLenum format,
+                             GLenum type) {
+    int i = u->index;
+
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, u->buffers[i]);
+    if (!u->persistent) {
+        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+        u->mapped[i] = NULL;
+    }
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, width, height, format, type, 0);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+    u->fences[i] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    u->index = (i + 1) % UPLOADER_BUFFERS;
+    u->uploads++;
+}
+
+void uploader_get_stats(const uploader_t *u, uploader_stats_t *stats) {
+    stats->uploads = u->uploads;
+    stats->stalls = u->stalls;
+    stats->stall_time = u->stall_time;
+    stats->persistent = u->persistent;
+}
@@ -0,0 +1,54 @@
+//
+// Created by dbrent on 3/12/21.
+//
+
+#ifndef DBSDR_UPLOADER_H
+#define DBSDR_UPLOADER_H
+
+#include <GL/glew.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define UPLOADER_BUFFERS 3
+
+// Round robin of pixel unpack buffers. The caller writes straight into
+// mapped buffer memory and the texture copy runs on the GPU while the next
+// frame is prepared. Buffers are persistently mapped when
+// GL_ARB_buffer_storage is available, otherwise mapped per upload.
+typedef struct uploader {
+    GLuint buffers[UPLOADER_BUFFERS];
+    GLsync fences[UPLOADER_BUFFERS];
+    void *mapped[UPLOADER_BUFFERS];
+    size_t size;
+    int index;
+    bool persistent;
+    uint64_t uploads;
+    uint64_t stalls;
+    double stall_time;
+} uploader_t;
+
+typedef struct uploader_stats {
+    uint64_t uploads;
+    uint64_t stalls;
+    double stall_time;
+    bool persistent;
+} uploader_stats_t;
+
+uploader_t *uploader_create(size_t size);
+
+void uploader_destroy(uploader_t *u);
+
+// Memory for the next upload, size bytes. Waits (and counts the stall) if
+// the GPU still reads from this buffer.
+void *uploader_begin(uploader_t *u);
+
+// Copy what was written since uploader_begin() into a region of texture.
+void uploader_end_texture_2d(uploader_t *u, GLuint texture, GLint x, GLint y,
+                             GLsizei width, GLsizei height, GLenum format,
+                             GLenum type);
+
+void uploader_get_stats(const uploader_t *u, uploader_stats_t *stats);
+
+#endif //DBSDR_UPLOADER_H
@@ -3,3 +3,84 @@
 //
 
 #include "waterfall.h"
+#include "binning.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+waterfall_t *waterfall_create(int width, int height) {
+    waterfall_t *wf = malloc(sizeof(waterfall_t));
+    if (wf == NULL) {
+        fprintf(stderr, "Could not create waterfall\n");
+        return NULL;
+    }
+    wf->width = width;
+    wf->height = height;
+    wf->row = 0;
+
+    GLint max_size = 0;
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_size);
+    if (width > max_size || height > max_size) {
+        fprintf(stderr, "Waterfall of %d x %d is over the %d texture limit\n",
+                width, height, max_size);
+        free(wf);
+        return NULL;
+    }
+    wf->uploader = uploader_create(width * sizeof(uint16_t));
+
+    // start at the bottom of the palette, this is the only full size upload
+    uint16_t *blank = malloc((size_t)width * height * sizeof(uint16_t));
+    if (wf->uploader == NULL || blank == NULL) {
+        fprintf(stderr, "Could not create waterfall pixels\n");
+        free(blank);
+        uploader_destroy(wf->uploader);
+        free(wf);
+        return NULL;
+    }
+    for (size_t i = 0; i < (size_t)width * height; i++) {
+        blank[i] = float_to_half(-1000.0f);
+    }
+
+    glGenTextures(1, &wf->texture);
+    glBindTexture(GL_TEXTURE_2D, wf->texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 2);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_R16F, width, height, 0, GL_RED,
+                 GL_HALF_FLOAT, blank);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    free(blank);
+
+    return wf;
+}
+
+void waterfall_destroy(waterfall_t *wf) {
+    if (wf == NULL) {
+        return;
+    }
+    glDeleteTextures(1, &wf->texture);
+    uploader_destroy(wf->uploader);
+    free(wf);
+}
+
+void waterfall_push_line(waterfall_t *wf, const float *line, size_t n_bins) {
+    // bin straight into the mapped upload buffer
+    uint16_t *pixels = uploader_begin(wf->uploader);
+    if (pixels == NULL) {
+        return;
+    }
+
+    binning_mean_half(line, n_bins, pixels, wf->width);
+
+    // newest line goes one row above the previous newest
+    wf->row = (wf->row + wf->height - 1) % wf->height;
+
+    uploader_end_texture_2d(wf->uploader, wf->texture, 0, wf->row, wf->width,
+                            1, GL_RED, GL_HALF_FLOAT);
+}
+
+float waterfall_row_offset(const waterfall_t *wf) {
+    return (float)wf->row / (float)wf->height;
+}
@@ -5,4 +5,33 @@
 #ifndef DBSDR_WATERFALL_H
 #define DBSDR_WATERFALL_H
 
+#include "uploader.h"
+
+#include <GL/glew.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Circular waterfall texture. Each new line overwrites one row, the oldest,
+// and the fragment shader scrolls by row_offset so nothing is ever moved.
+// Texels are single channel half floats in dB, one per FFT bin where they
+// fit. The shader picks the zoomed range out and reduces it to screen
+// pixels, colour comes from the palette.
+typedef struct waterfall {
+    GLuint texture;
+    int width;
+    int height;
+    int row; // row holding the newest line
+    uploader_t *uploader;
+} waterfall_t;
+
+waterfall_t *waterfall_create(int width, int height);
+
+void waterfall_destroy(waterfall_t *wf);
+
+void waterfall_push_line(waterfall_t *wf, const float *line, size_t n_bins);
+
+// Texture coordinate offset of the newest row, for the row_offset uniform.
+float waterfall_row_offset(const waterfall_t *wf);
+
 #endif //DBSDR_WATERFALL_H
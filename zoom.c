@@ -0,0 +1,248 @@
+//
+// Created by dbrent on 3/27/21.
+//
+
+#include "zoom.h"
+#include "binning.h"
+#include "source.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define ZOOM_IDLE_SLEEP_NS 500000
+
+static const struct timespec idle = {0, ZOOM_IDLE_SLEEP_NS};
+
+static double offset_load(zoom_t *zoom) {
+    uint64_t bits = atomic_load(&zoom->offset);
+    double offset;
+    memcpy(&offset, &bits, sizeof(offset));
+    return offset;
+}
+
+void zoom_set_offset(zoom_t *zoom, double offset) {
+    uint64_t bits;
+    memcpy(&bits, &offset, sizeof(bits));
+    atomic_store(&zoom->offset, bits);
+}
+
+static void *zoom_thread(void *arg);
+
+zoom_t *zoom_open(const zoom_config_t *config) {
+    // decimate as far as the DDC's alias free band still covers the span,
+    // the FFT size then sets the resolution
+    double most = config->sample_rate * DDC_DEFAULT_BANDWIDTH / config->span;
+    if (most < 1.0 || config->fft_size < FFT_MIN_SIZE ||
+        config->fft_size > ZOOM_MAX_FFT_SIZE ||
+        (config->fft_size & (config->fft_size - 1)) != 0) {
+        fprintf(stderr, "Can't zoom into %.0f Hz with %zu point FFTs\n",
+                config->span, config->fft_size);
+        return NULL;
+    }
+    zoom_t *zoom = calloc(1, sizeof(zoom_t));
+    if (zoom == NULL) {
+        return NULL;
+    }
+    zoom->sample_rate = config->sample_rate;
+    zoom->span = config->span;
+    zoom->decimation = most > DDC_MAX_DECIMATION ? DDC_MAX_DECIMATION
+                                                 : (uint32_t)most;
+    zoom->fft_size = config->fft_size;
+    zoom->hop = (size_t)((double)config->fft_size * (1.0 - ZOOM_OVERLAP));
+    double rate = config->sample_rate / zoom->decimation;
+    zoom->rbw = rate / (double)config->fft_size;
+    double fft_rate = rate / (double)zoom->hop;
+    zoom->average = config->line_rate > 0.0 && fft_rate > config->line_rate
+                            ? (uint32_t)lround(fft_rate / config->line_rate)
+                            : 1;
+    double bins = ceil(config->span / zoom->rbw);
+    zoom->width = bins < config->max_width ? (int)bins : config->max_width;
+    zoom->generation = UINT32_MAX;
+    zoom_set_offset(zoom, 0.0);
+
+    ddc_config_t ddc_config = {config->sample_rate, 0.0, zoom->decimation,
+                               0.0};
+    const fft_setup_t *setup = fft_setup_wait(config->fft_size,
+                                              config->window);
+    bool ok = queue_init(&zoom->blocks,
+                         sizeof(iq_block_t) +
+                                 config->max_block_samples * BYTES_PER_SAMPLE,
+                         ZOOM_BLOCK_QUEUE_SIZE, QUEUE_SPSC);
+    ok = queue_init(&zoom->lines, DSP_LINE_BYTES(zoom->width),
+                    ZOOM_LINE_QUEUE_SIZE, QUEUE_SPSC) && ok;
+    ok = ok && setup != NULL &&
+         (zoom->ddc = ddc_create(&ddc_config)) != NULL &&
+         (zoom->fft = fft_context_create(config->fft_size)) != NULL &&
+         fft_context_set(zoom->fft, setup);
+    if (ok) {
+        size_t max_out = ddc_max_output(zoom->ddc,
+                                        config->max_block_samples);
+        zoom->frames = malloc(2 * (config->fft_size + max_out) *
+                              sizeof(float));
+        zoom->sum = calloc(config->fft_size, sizeof(float));
+        zoom->line = malloc(config->fft_size * sizeof(float));
+        ok = zoom->frames != NULL && zoom->sum != NULL && zoom->line != NULL;
+    }
+    if (!ok) {
+        fprintf(stderr, "Could not set up the zoom FFT\n");
+        zoom_close(zoom);
+        return NULL;
+    }
+
+    atomic_store(&zoom->running, true);
+    if (pthread_create(&zoom->thread, NULL, zoom_thread, zoom) != 0) {
+        fprintf(stderr, "Could not create zoom thread\n");
+        zoom_close(zoom);
+        return NULL;
+    }
+    zoom->started = true;
+    fprintf(stderr,
+            "Zoom: %.0f Hz span, %ux decimation to %.0f Hz, %zu point FFTs, "
+            "%.3f Hz RBW, %u per line\n",
+            zoom->span, zoom->decimation, rate, zoom->fft_size, zoom->rbw,
+            zoom->average);
+    return zoom;
+}
+
+void zoom_close(zoom_t *zoom) {
+    if (zoom == NULL) {
+        return;
+    }
+    atomic_store(&zoom->running, false);
+    if (zoom->started) {
+        pthread_join(zoom->thread, NULL);
+    }
+    ddc_destroy(zoom->ddc);
+    fft_context_destroy(zoom->fft);
+    queue_destroy(&zoom->blocks);
+    queue_destroy(&zoom->lines);
+    free(zoom->frames);
+    free(zoom->sum);
+    free(zoom->line);
+    free(zoom);
+}
+
+void zoom_write(zoom_t *zoom, const iq_block_t *block) {
+    iq_block_t *slot = queue_reserve(&zoom->blocks);
+    if (slot == NULL) {
+        atomic_fetch_add_explicit(&zoom->blocks_dropped, 1,
+                                  memory_order_relaxed);
+        return;
+    }
+    memcpy(slot, block,
+           sizeof(iq_block_t) + block->n_samples * block->bytes_per_sample);
+    queue_commit(&zoom->blocks, slot);
+}
+
+void zoom_tap(void *ctx, const iq_block_t *block, uint64_t missing,
+              bool retuned) {
+    (void)missing;
+    (void)retuned;
+    zoom_write(ctx, block);
+}
+
+// Windowed FFT of the decimated samples at x, power added to the sum. The
+// window is scaled for int8 input and the DDC's output is already scaled
+// down to full scale 1.0, so the 128 comes back here.
+static void transform(zoom_t *zoom, const float *x) {
+    fft_context_t *ctx = zoom->fft;
+    const fft_real *window = ctx->setup->coefficients;
+    fft_complex *in = ctx->in;
+    const size_t n = zoom->fft_size;
+#pragma omp simd
+    for (size_t i = 0; i < n; i++) {
+        in[i][0] = (fft_real)(x[2 * i] * 128.0f) * window[i];
+        in[i][1] = (fft_real)(x[2 * i + 1] * 128.0f) * window[i];
+    }
+    fft_transform(ctx);
+    fft_accumulate_power(ctx, zoom->sum);
+}
+
+// The span around dc, which is in the middle after rotating by half.
+static void emit_line(zoom_t *zoom) {
+    spectrum_line_t *out = queue_reserve(&zoom->lines);
+    if (out == NULL) {
+        atomic_fetch_add_explicit(&zoom->lines_dropped, 1,
+                                  memory_order_relaxed);
+    } else {
+        size_t n = zoom->fft_size;
+        double half = zoom->span / zoom->rbw / 2.0;
+        fft_power_to_db(zoom->sum, n, zoom->count, zoom->line);
+        binning_reduce(zoom->line, n, n / 2, (double)(n / 2) - half,
+                       (double)(n / 2) + half, BINNING_MAX, out->bins,
+                       zoom->width);
+        out->tag = zoom->tag;
+        out->span = (float)zoom->span;
+        out->rbw = (float)(zoom->rbw * zoom->fft->setup->enbw);
+        out->n_bins = (uint32_t)zoom->width;
+        queue_commit(&zoom->lines, out);
+        atomic_fetch_add_explicit(&zoom->lines_emitted, 1,
+                                  memory_order_relaxed);
+    }
+    memset(zoom->sum, 0, zoom->fft_size * sizeof(float));
+    zoom->count = 0;
+}
+
+static void zoom_block(zoom_t *zoom, const iq_block_t *block) {
+    // no FFT or average spans a retune, a move of the sub-band or blocks
+    // dropped on the way in
+    double offset = offset_load(zoom);
+    bool missing = block->tag.first_sample != zoom->next_sample;
+    zoom->next_sample = block->tag.first_sample + block->n_samples;
+    if (block->tag.generation != zoom->generation ||
+        offset != zoom->tuned_offset || missing) {
+        zoom->generation = block->tag.generation;
+        zoom->tuned_offset = offset;
+        ddc_set_offset(zoom->ddc, offset);
+        memset(zoom->sum, 0, zoom->fft_size * sizeof(float));
+        zoom->count = 0;
+        zoom->fill = 0;
+    }
+
+    zoom->fill += ddc_process(zoom->ddc, block->samples, block->n_samples,
+                              zoom->frames + 2 * zoom->fill);
+    size_t at = 0;
+    for (; at + zoom->fft_size <= zoom->fill; at += zoom->hop) {
+        if (zoom->count == 0) {
+            // close enough, the block the first FFT of the line ends in
+            zoom->tag = block->tag;
+        }
+        transform(zoom, zoom->frames + 2 * at);
+        if (++zoom->count == zoom->average) {
+            emit_line(zoom);
+        }
+    }
+    zoom->fill -= at;
+    memmove(zoom->frames, zoom->frames + 2 * at,
+            2 * zoom->fill * sizeof(float));
+}
+
+static void *zoom_thread(void *arg) {
+    zoom_t *zoom = arg;
+    while (atomic_load_explicit(&zoom->running, memory_order_relaxed)) {
+        iq_block_t *block = queue_peek(&zoom->blocks);
+        if (block == NULL) {
+            nanosleep(&idle, NULL);
+            continue;
+        }
+        zoom_block(zoom, block);
+        queue_release(&zoom->blocks);
+        atomic_fetch_add_explicit(&zoom->blocks_done, 1,
+                                  memory_order_relaxed);
+    }
+    return NULL;
+}
+
+void zoom_get_stats(zoom_t *zoom, zoom_stats_t *stats) {
+    stats->blocks = atomic_load(&zoom->blocks_done);
+    stats->blocks_dropped = atomic_load(&zoom->blocks_dropped);
+    stats->lines_emitted = atomic_load(&zoom->lines_emitted);
+    stats->lines_dropped = atomic_load(&zoom->lines_dropped);
+    stats->offset = offset_load(zoom);
+    stats->rbw = zoom->rbw;
+    stats->average = zoom->average;
+    queue_get_stats(&zoom->blocks, &stats->queue);
+}
@@ -0,0 +1,109 @@
+//
+// Created by dbrent on 3/27/21.
+//
+
+#ifndef DBSDR_ZOOM_H
+#define DBSDR_ZOOM_H
+
+#include "ddc.h"
+#include "dsp.h"
+#include "fft.h"
+#include "queue.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define ZOOM_BLOCK_QUEUE_SIZE 8
+#define ZOOM_LINE_QUEUE_SIZE 64
+#define ZOOM_DEFAULT_FFT_SIZE 16384
+#define ZOOM_MAX_FFT_SIZE 65536
+#define ZOOM_DEFAULT_SPAN 10000.0 // Hz
+#define ZOOM_OVERLAP 0.75 // decimated streams are slow, lines come faster
+
+// Zoom FFT: a DDC shifts the sub-band to dc and decimates by as much as
+// still covers span (up to DDC_MAX_DECIMATION), then modest FFTs over the
+// slow stream give a resolution bandwidth of the decimated rate / fft_size.
+// Consecutive FFTs overlap by ZOOM_OVERLAP and are averaged down to about
+// line_rate lines per second, like the wideband ones. Only the span around
+// dc is kept, max reduced to at most max_width bins, and lines go to their
+// own queue. Blocks are handed over on the DSP thread and transformed on
+// the zoom thread.
+typedef struct zoom_config {
+    double sample_rate;
+    double span; // Hz shown around the centre of the sub-band
+    size_t fft_size;
+    fft_window_t window;
+    double line_rate; // 0 for a line per FFT
+    size_t max_block_samples;
+    int max_width;
+} zoom_config_t;
+
+typedef struct zoom_stats {
+    uint64_t blocks;
+    uint64_t blocks_dropped; // queue full, the zoom thread fell behind
+    uint64_t lines_emitted;
+    uint64_t lines_dropped;
+    double offset; // Hz from the tuning
+    double rbw;    // Hz per FFT bin
+    uint32_t average;
+    queue_stats_t queue;
+} zoom_stats_t;
+
+typedef struct zoom {
+    double sample_rate;
+    double span;
+    double rbw;
+    uint32_t decimation;
+    size_t fft_size;
+    size_t hop;
+    uint32_t average; // FFTs per line
+    int width;        // bins per line
+    atomic_uint_fast64_t offset; // double bits, Hz from the tuning
+
+    queue_t blocks; // dsp thread -> zoom thread, iq_block_t slots
+    queue_t lines;  // zoom thread -> render thread, spectrum_line_t slots
+    pthread_t thread;
+    bool started;
+    atomic_bool running;
+
+    // zoom thread side
+    ddc_t *ddc;
+    fft_context_t *fft;
+    float *frames; // decimated, interleaved complex, fill of them waiting
+    size_t fill;
+    float *sum;    // Welch power of count FFTs
+    float *line;
+    uint32_t count;
+    dsp_tag_t tag; // of the samples the FFT being averaged started on
+    uint32_t generation;
+    double tuned_offset;
+    uint64_t next_sample; // first sample of the next block, if contiguous
+
+    atomic_uint_fast64_t blocks_done;
+    atomic_uint_fast64_t blocks_dropped;
+    atomic_uint_fast64_t lines_emitted;
+    atomic_uint_fast64_t lines_dropped;
+} zoom_t;
+
+// Plans the FFT and starts the zoom thread, NULL if span can't be shown.
+zoom_t *zoom_open(const zoom_config_t *config);
+
+void zoom_close(zoom_t *zoom);
+
+// DSP thread: queue a block, dropped if the zoom thread is behind.
+void zoom_write(zoom_t *zoom, const iq_block_t *block);
+
+// The same as a dsp_tap.
+void zoom_tap(void *zoom, const iq_block_t *block, uint64_t missing,
+              bool retuned);
+
+// Any thread: centre the sub-band offset Hz from the tuned frequency, from
+// the next block on. Averaging starts over.
+void zoom_set_offset(zoom_t *zoom, double offset);
+
+void zoom_get_stats(zoom_t *zoom, zoom_stats_t *stats);
+
+#endif //DBSDR_ZOOM_H